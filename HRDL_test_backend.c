@@ -76,14 +76,37 @@ typedef struct _HrdlUnit
 static _HrdlUnit _g_units[MaxHandle];
 // NOTE(cmo): First one is never initialised since handle can't be 0/null.
 
+#ifdef HRDL_TEST_UNTHROTTLED
+// NOTE(cmo): With HRDL_TEST_UNTHROTTLED the simulated device runs on its own
+// virtual clock. Polling a unit that isn't ready jumps the clock straight to
+// the point where it will be, so blocks are produced as fast as the caller can
+// consume them (used by the benchmarks in bench/).
+static int64_t _g_virtual_millis = 0;
+#endif
+
 int64_t _current_epoch_millis()
 {
+#ifdef HRDL_TEST_UNTHROTTLED
+    if (_g_virtual_millis != 0)
+        return _g_virtual_millis;
+#endif
     struct timeval tv;
     gettimeofday(&tv, NULL);
     int64_t result = (int64_t)(tv.tv_sec) * 1000 + (int64_t)(tv.tv_usec) / 1000;
+#ifdef HRDL_TEST_UNTHROTTLED
+    _g_virtual_millis = result;
+#endif
     return result;
 }
 
+#ifdef HRDL_TEST_UNTHROTTLED
+void _advance_virtual_clock(int64_t to)
+{
+    if (to > _g_virtual_millis)
+        _g_virtual_millis = to;
+}
+#endif
+
 void _init_unit(_HrdlUnit* unit, bool async)
 {
     unit->is_open = true;
@@ -297,23 +320,18 @@ int16_t HRDLReady(int16_t handle)
     int64_t now = _current_epoch_millis();
 
     _HrdlUnit* unit = &_g_units[handle];
-    if (unit->samples_to_take > 0)
-    {
-        if (unit->samples_to_take * unit->sample_rate <= now - unit->prev_sample_time)
-        {
-            return 1;
-        }
-        else
-        {
-            return 0;
-        }
-    }
+    int32_t n_req_samples = unit->samples_to_take;
+    if (n_req_samples == 0)
+        n_req_samples = 1;
 
-    if (unit->sample_rate <= now - unit->prev_sample_time)
-    {
+    if (n_req_samples * unit->sample_rate <= now - unit->prev_sample_time)
         return 1;
-    }
 
+#ifdef HRDL_TEST_UNTHROTTLED
+    // NOTE(cmo): Report not ready once (so the caller still runs its wait
+    // loop), but the next poll will find the data waiting.
+    _advance_virtual_clock(unit->prev_sample_time + n_req_samples * unit->sample_rate);
+#endif
     return 0;
 }
 
@@ -13,6 +13,7 @@ import os
 import logging
 from logging.handlers import TimedRotatingFileHandler
 import sys
+from Pyramid import PyramidWriter
 
 # NOTE(cmo): Set this to False on deployment
 LocalFsTest = False
@@ -37,6 +38,9 @@ root_logger.addHandler(handler)
 
 Conf = ConfigParser()
 Conf.read(ConfigPath)
+# NOTE(cmo): Set daemon_writes_text = yes in the [magnetometer] section when mag
+# is writing the daily text files itself (ArchiveDir in magnetometer.c).
+DaemonWritesText = Conf.getboolean("magnetometer", "daemon_writes_text", fallback=False)
 
 
 # NOTE(cmo): Some code based on Sean Leavey's original magnetometer FTP/logging
@@ -98,6 +102,10 @@ class MagnetometerDataMiddleLayer:
         self.sync_files_from_server()
         self.prev_sync_time = time.time()
         self.influx_point_list = []
+        # NOTE(cmo): Downsampled copies of the archive for plotting long spans,
+        # see Pyramid.py. Run `python3 Pyramid.py build <local_dir>` once to
+        # backfill it from existing text files.
+        self.pyramid = PyramidWriter(os.path.join(Conf["magnetometer"]["local_dir"], "pyramid"))
 
     def bucket_name(self, data):
         bucket = self.influx_bucket
@@ -147,7 +155,10 @@ class MagnetometerDataMiddleLayer:
 
         self.influx_point_list.append(self.to_influx_bucket_point(data))
 
-        self.submit_reading_text(data)
+        if not DaemonWritesText:
+            self.submit_reading_text(data)
+        # NOTE(cmo): Whoever writes the text files, the pyramid is kept here.
+        self.pyramid.append_sample(data.timestamp, data.data)
 
         # NOTE(cmo): Messages come through in batches of 4.
         if len(self.influx_point_list) >= 4:
@@ -0,0 +1,288 @@
+import datetime
+import glob
+import logging
+import os
+import sys
+import numpy as np
+
+# NOTE(cmo): Min/max/mean summaries of the archive at a few fixed resolutions,
+# so a plot of months or years reads a few thousand records rather than
+# millions of samples. Kept in <local_dir>/pyramid next to the daily text
+# files, one file per level per period:
+#   1m:  YYYY-MM-DD.1m.pyr  (1440 bins)
+#   10m: YYYY-MM.10m.pyr    (up to 4464 bins)
+#   1h:  YYYY.1h.pyr        (up to 8784 bins)
+#   1d:  YYYY.1d.pyr        (up to 366 bins)
+# Each file is a time-ordered array of BinDtype records, one per bin that has
+# any samples in it (gaps are simply missing), aligned to UT. Bins are stored
+# with the sum rather than the mean so that they can be topped up as samples
+# arrive; the record for the bin currently filling is rewritten in place, so
+# what's on disk is never more than one sample behind.
+
+Levels = [
+    # name, bin width (ms), period a file covers
+    ("1m", 60_000, "day"),
+    ("10m", 600_000, "month"),
+    ("1h", 3_600_000, "year"),
+    ("1d", 86_400_000, "year"),
+]
+BinDtype = np.dtype([
+    ("start", "<i8"), # ms since epoch
+    ("count", "<i8"),
+    ("min", "<f8", (4,)),
+    ("max", "<f8", (4,)),
+    ("sum", "<f8", (4,)),
+])
+QueryDtype = np.dtype([
+    ("start", "<i8"),
+    ("count", "<i8"),
+    ("min", "<f8", (4,)),
+    ("max", "<f8", (4,)),
+    ("mean", "<f8", (4,)),
+])
+
+logger = logging.getLogger(__name__)
+
+
+def period_bounds(period, millis):
+    # NOTE(cmo): Name and end (ms) of the file period containing millis.
+    t = datetime.datetime.fromtimestamp(millis / 1000, tz=datetime.timezone.utc)
+    if period == "day":
+        start = t.replace(hour=0, minute=0, second=0, microsecond=0)
+        name = start.strftime("%Y-%m-%d")
+        end = start + datetime.timedelta(days=1)
+    elif period == "month":
+        start = t.replace(day=1, hour=0, minute=0, second=0, microsecond=0)
+        name = start.strftime("%Y-%m")
+        end = start.replace(year=start.year + start.month // 12, month=start.month % 12 + 1)
+    else:
+        start = t.replace(month=1, day=1, hour=0, minute=0, second=0, microsecond=0)
+        name = start.strftime("%Y")
+        end = start.replace(year=start.year + 1)
+    return name, int(end.timestamp() * 1000)
+
+
+def merge_bins(a, b):
+    # NOTE(cmo): Combines two records for the same bin. fmin/fmax so a NaN
+    # reading doesn't wipe out the bin's extremes.
+    out = a.copy()
+    out["count"] = a["count"] + b["count"]
+    out["min"] = np.fmin(a["min"], b["min"])
+    out["max"] = np.fmax(a["max"], b["max"])
+    out["sum"] = a["sum"] + b["sum"]
+    return out
+
+
+def aggregate(timestamps, data, bin_width):
+    # NOTE(cmo): Reduces time-ordered samples to one record per bin.
+    bins = timestamps // bin_width * bin_width
+    starts = np.concatenate(([0], np.flatnonzero(np.diff(bins)) + 1))
+    out = np.empty(starts.shape[0], BinDtype)
+    out["start"] = bins[starts]
+    out["count"] = np.diff(np.append(starts, bins.shape[0]))
+    out["min"] = np.fmin.reduceat(data, starts, axis=0)
+    out["max"] = np.fmax.reduceat(data, starts, axis=0)
+    out["sum"] = np.add.reduceat(data, starts, axis=0)
+    return out
+
+
+class LevelWriter:
+    def __init__(self, dir, name, bin_width, period):
+        self.dir = dir
+        self.name = name
+        self.bin_width = bin_width
+        self.period_kind = period
+        self.period = None
+        self.fd = -1
+        self.num_bins = 0
+        self.last = None
+
+    def path(self, period):
+        return os.path.join(self.dir, f"{period}.{self.name}.pyr")
+
+    def open_period(self, period):
+        self.close()
+        self.fd = os.open(self.path(period), os.O_RDWR | os.O_CREAT, 0o644)
+        size = os.fstat(self.fd).st_size
+        self.num_bins = size // BinDtype.itemsize
+        if size % BinDtype.itemsize != 0:
+            # NOTE(cmo): We died part way through adding a bin.
+            os.ftruncate(self.fd, self.num_bins * BinDtype.itemsize)
+        self.last = None
+        if self.num_bins > 0:
+            buf = os.pread(self.fd, BinDtype.itemsize, (self.num_bins - 1) * BinDtype.itemsize)
+            self.last = np.frombuffer(buf, BinDtype)[0].copy()
+        self.period = period
+
+    def write_bin(self, index, record):
+        os.pwrite(self.fd, record.tobytes(), index * BinDtype.itemsize)
+
+    def add_late(self, record):
+        # NOTE(cmo): Late sample (e.g. redelivered after a reconnect). Fine if
+        # its bin is already here, otherwise it would need inserting mid-file,
+        # which isn't worth it for this: rebuild to pick it up.
+        bins = np.fromfile(self.path(self.period), BinDtype, count=self.num_bins)
+        i = np.searchsorted(bins["start"], record["start"])
+        if i < self.num_bins and bins["start"][i] == record["start"]:
+            self.write_bin(i, merge_bins(bins[i], record))
+        else:
+            logger.warning(f"Late sample at {record['start']} has no {self.name} bin, skipping it")
+
+    def add(self, period, records):
+        # NOTE(cmo): Time-ordered records, all in the same period.
+        if period != self.period:
+            self.open_period(period)
+
+        if self.last is not None:
+            late = np.searchsorted(records["start"], self.last["start"])
+            for record in records[:late]:
+                self.add_late(record)
+            records = records[late:]
+            if records.shape[0] > 0 and records[0]["start"] == self.last["start"]:
+                self.last = merge_bins(self.last, records[0])
+                self.write_bin(self.num_bins - 1, self.last)
+                records = records[1:]
+
+        if records.shape[0] > 0:
+            os.pwrite(self.fd, records.tobytes(), self.num_bins * BinDtype.itemsize)
+            self.num_bins += records.shape[0]
+            self.last = records[-1].copy()
+
+    def append(self, timestamps, data):
+        records = aggregate(timestamps, data, self.bin_width)
+        while records.shape[0] > 0:
+            period, end = period_bounds(self.period_kind, records[0]["start"])
+            n = np.searchsorted(records["start"], end)
+            self.add(period, records[:n])
+            records = records[n:]
+
+    def close(self):
+        if self.fd != -1:
+            os.close(self.fd)
+        self.fd = -1
+        self.period = None
+
+
+class PyramidWriter:
+    def __init__(self, dir):
+        os.makedirs(dir, exist_ok=True)
+        self.levels = [LevelWriter(dir, *level) for level in Levels]
+
+    def append(self, timestamps, data):
+        # NOTE(cmo): timestamps (ms, ascending) and data (n x 4).
+        timestamps = np.asarray(timestamps, dtype=np.int64)
+        data = np.asarray(data, dtype=np.float64).reshape(-1, 4)
+        if timestamps.shape[0] == 0:
+            return
+        for level in self.levels:
+            level.append(timestamps, data)
+
+    def append_sample(self, timestamp, data):
+        self.append(np.array([timestamp], dtype=np.int64), data)
+
+    def close(self):
+        for level in self.levels:
+            level.close()
+
+
+class Pyramid:
+    def __init__(self, dir):
+        self.dir = dir
+
+    @staticmethod
+    def level_for(resolution):
+        # NOTE(cmo): The coarsest level whose bins are no wider than
+        # resolution (ms), or None if only the raw samples are fine enough.
+        best = None
+        for level in Levels:
+            if level[1] <= resolution:
+                best = level
+        return best
+
+    def read_level(self, level, start, end):
+        name, bin_width, period = level
+        first, _ = period_bounds(period, start)
+        last, _ = period_bounds(period, end - 1)
+        # NOTE(cmo): Period names sort in time order.
+        paths = []
+        for path in glob.glob(os.path.join(self.dir, f"*.{name}.pyr")):
+            period = os.path.basename(path)[:-len(f".{name}.pyr")]
+            if first <= period <= last:
+                paths.append((period, path))
+        paths.sort()
+
+        parts = []
+        for _, path in paths:
+            with open(path, "rb") as f:
+                buf = f.read()
+            # NOTE(cmo): Ignore a bin that's only half written.
+            n = len(buf) // BinDtype.itemsize
+            parts.append(np.frombuffer(buf, BinDtype, count=n))
+        if len(parts) == 0:
+            return np.empty(0, BinDtype)
+        bins = np.concatenate(parts)
+        mask = (bins["start"] + bin_width > start) & (bins["start"] < end)
+        return bins[mask]
+
+    def query(self, start, end, resolution):
+        # NOTE(cmo): Summary of [start, end) (ms since epoch) from the coarsest
+        # level at least as fine as resolution (ms). Returns the level name and
+        # an array of QueryDtype, one per non-empty bin. Raises ValueError if
+        # resolution is finer than the finest level; read the raw archive
+        # for that.
+        level = self.level_for(resolution)
+        if level is None:
+            raise ValueError(f"No pyramid level as fine as {resolution} ms (finest is {Levels[0][1]} ms)")
+
+        bins = self.read_level(level, start, end)
+        out = np.empty(bins.shape[0], QueryDtype)
+        out["start"] = bins["start"]
+        out["count"] = bins["count"]
+        out["min"] = bins["min"]
+        out["max"] = bins["max"]
+        out["mean"] = bins["sum"] / bins["count"][:, None]
+        return level[0], out
+
+    def query_points(self, start, end, max_points):
+        # NOTE(cmo): For plotting: no more than about max_points bins.
+        return self.query(start, end, max(1, (end - start) // max_points))
+
+
+def read_text_day(path):
+    # NOTE(cmo): One YYYY-MM-DD.txt from the text archive, as written by
+    # submit_reading_text or daily_archive.c. Lines that don't parse (e.g. cut
+    # short by a crash) are dropped.
+    day = datetime.datetime.strptime(os.path.basename(path)[:10], "%Y-%m-%d")
+    midnight = int(day.replace(tzinfo=datetime.timezone.utc).timestamp() * 1000)
+    rows = np.genfromtxt(path, dtype=np.float64, invalid_raise=False, ndmin=2)
+    if rows.shape[0] == 0 or rows.shape[1] != 5:
+        return np.empty(0, np.int64), np.empty((0, 4))
+    rows = rows[~np.isnan(rows[:, 0])]
+    timestamps = rows[:, 0].astype(np.int64) + midnight
+    order = np.argsort(timestamps, kind="stable")
+    return timestamps[order], rows[order, 1:]
+
+
+def build(local_dir):
+    # NOTE(cmo): (Re)builds the whole pyramid from the daily text files. Stop
+    # anything writing to it first.
+    dir = os.path.join(local_dir, "pyramid")
+    os.makedirs(dir, exist_ok=True)
+    for path in glob.glob(os.path.join(dir, "*.pyr")):
+        os.remove(path)
+
+    writer = PyramidWriter(dir)
+    days = sorted(glob.glob(os.path.join(local_dir, "[0-9][0-9][0-9][0-9]-[0-9][0-9]-[0-9][0-9].txt")))
+    for path in days:
+        timestamps, data = read_text_day(path)
+        writer.append(timestamps, data)
+    writer.close()
+    return len(days)
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 3 or sys.argv[1] != "build":
+        print(f"Usage: {sys.argv[0]} build LOCAL_DIR")
+        sys.exit(1)
+    n = build(sys.argv[2])
+    print(f"Built pyramid from {n} daily files")
@@ -0,0 +1,95 @@
+import mmap
+import struct
+import numpy as np
+
+# NOTE(cmo): Reader for the shared memory ring of recent samples written by the
+# magnetometer daemon, see sample_ring.h for the layout. Nothing here ever
+# writes to the ring, so any number of these can be open at once.
+
+RingPath = "/dev/shm/magnetometer-samples"
+RingMagic = b"MAGRING\0"
+RingVersion = 1
+HeaderFormat = "=8sIIIIqqq16xqq"
+CountersOffset = 64
+RecordDtype = np.dtype([("timestamp", "<i8"), ("data", "<f8", (4,))])
+
+
+class SampleRing:
+    def __init__(self, path=RingPath):
+        with open(path, "rb") as f:
+            self.mm = mmap.mmap(f.fileno(), 0, prot=mmap.PROT_READ)
+
+        (magic, version, self.header_size, record_size, num_channels,
+         self.capacity, self.sample_interval, self.created,
+         _, _) = struct.unpack_from(HeaderFormat, self.mm)
+        if magic != RingMagic or version != RingVersion:
+            raise ValueError(f"{path} is not a version {RingVersion} sample ring")
+        if record_size != RecordDtype.itemsize or num_channels != 4:
+            raise ValueError(f"Unexpected record layout in {path}")
+
+        # NOTE(cmo): Zero-copy views. Slot i % capacity holds record i. Anything
+        # read straight from `records` must be checked with still_valid after.
+        self.records = np.ndarray((self.capacity,), RecordDtype,
+                                  buffer=self.mm, offset=self.header_size)
+        self.counters = np.ndarray((2,), np.int64,
+                                   buffer=self.mm, offset=CountersOffset)
+
+    def close(self):
+        del self.records
+        del self.counters
+        self.mm.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def stale(self):
+        # NOTE(cmo): The daemon has recreated the ring (e.g. with a different
+        # size), reopen it.
+        created = struct.unpack_from("=q", self.mm, 40)[0]
+        return created != self.created
+
+    def head(self):
+        # NOTE(cmo): Index of the next record to be written.
+        return int(self.counters[1])
+
+    def oldest(self):
+        return max(int(self.counters[0]) - self.capacity, 0)
+
+    def still_valid(self, first):
+        return first >= int(self.counters[0]) - self.capacity
+
+    def read(self, cursor, max_records=None):
+        # NOTE(cmo): Returns a copy of the records from cursor onwards (or from
+        # the oldest still in the ring, if cursor has been overwritten) and the
+        # cursor to pass next time.
+        while True:
+            head = self.head()
+            start = max(cursor, head - self.capacity, 0)
+            n = head - start
+            if max_records is not None:
+                n = min(n, max_records)
+            if n <= 0:
+                return np.empty(0, RecordDtype), cursor
+
+            slots = np.arange(start, start + n) % self.capacity
+            out = self.records[slots]
+            if self.still_valid(start):
+                return out, start + n
+
+    def latest(self, n):
+        # NOTE(cmo): The most recent n (or fewer) records, oldest first.
+        out, _ = self.read(self.head() - n, n)
+        return out
+
+    def last_hours(self, hours):
+        return self.latest(int(hours * 3600 * 1000 // self.sample_interval))
+
+
+if __name__ == "__main__":
+    with SampleRing() as ring:
+        recent = ring.latest(10)
+        for r in recent:
+            print(r["timestamp"], r["data"])
@@ -0,0 +1,292 @@
+#define _POSIX_C_SOURCE 200809L
+#include "bench_broker.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "../mqtt.h"
+
+int64_t bench_now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int bench_broker_listen_tcp(BenchBroker* b)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+        return -1;
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(fd, 4) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (struct sockaddr*)&addr, &len);
+    b->listen_fd = fd;
+    return ntohs(addr.sin_port);
+}
+
+int bench_broker_listen_unix(BenchBroker* b, const char* path)
+{
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path) || strlen(path) >= sizeof(b->unix_path))
+        return -1;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+        return -1;
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(fd, 4) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+
+    strcpy(b->unix_path, path);
+    b->listen_fd = fd;
+    return 0;
+}
+
+static bool send_all(int fd, const uint8_t* buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t rv = send(fd, buf, len, 0);
+        if (rv <= 0)
+            return false;
+        buf += rv;
+        len -= rv;
+    }
+    return true;
+}
+
+static void record_latency(BenchBroker* b, int64_t latency)
+{
+    if (b->num_latencies == b->latencies_capacity)
+    {
+        b->latencies_capacity = b->latencies_capacity ? 2 * b->latencies_capacity : 4096;
+        b->latencies_us = realloc(b->latencies_us, b->latencies_capacity * sizeof(int64_t));
+    }
+    b->latencies_us[b->num_latencies++] = latency;
+}
+
+// NOTE(cmo): The block starts seen recently on a connection, most recent last.
+#define RecentBlockStarts 64
+typedef struct BlockStarts
+{
+    int64_t t0[RecentBlockStarts];
+    int32_t count;
+    int32_t next;
+} BlockStarts;
+
+// NOTE(cmo): Sample i of a block is stamped start_time + i * sample_interval,
+// so its block started at one of timestamp - i * sample_interval, i <
+// block_size. That's the one another sample of the block already established,
+// or failing that the latest one not after the sample's arrival, which is
+// right as long as the block arrives within a sample interval of starting
+// (the bench device fills blocks instantly). Only the sample's own timestamp
+// is used, so dropped, resent or reordered publishes don't shift the others.
+static int64_t block_start(const BenchBroker* b, BlockStarts* recent, int64_t timestamp, int64_t arrival_ms)
+{
+    for (int32_t i = 0; i < b->block_size; ++i)
+    {
+        int64_t t0 = timestamp - (int64_t)i * b->sample_interval;
+        for (int32_t j = 0; j < recent->count; ++j)
+        {
+            if (recent->t0[j] == t0)
+                return t0;
+        }
+    }
+
+    int64_t i = 0;
+    if (b->sample_interval > 0 && timestamp > arrival_ms)
+        i = (timestamp - arrival_ms + b->sample_interval - 1) / b->sample_interval;
+    if (i > b->block_size - 1)
+        i = b->block_size - 1;
+    int64_t t0 = timestamp - i * b->sample_interval;
+
+    recent->t0[recent->next] = t0;
+    recent->next = (recent->next + 1) % RecentBlockStarts;
+    if (recent->count < RecentBlockStarts)
+        recent->count += 1;
+    return t0;
+}
+
+static void handle_publish(BenchBroker* b, int fd, const struct mqtt_fixed_header* fh,
+                           const uint8_t* body, int64_t arrival, BlockStarts* recent)
+{
+    uint16_t topic_len = __mqtt_unpack_uint16(body);
+    const uint8_t* p = body + 2 + topic_len;
+    uint8_t qos = (fh->control_flags & MQTT_PUBLISH_QOS_MASK) >> 1;
+    uint16_t packet_id = 0;
+    if (qos > 0)
+    {
+        packet_id = __mqtt_unpack_uint16(p);
+        p += 2;
+    }
+    size_t payload_len = fh->remaining_length - (p - body);
+
+    if (b->num_publish == 0)
+        b->first_arrival_us = arrival;
+    b->last_arrival_us = arrival;
+
+    // NOTE(cmo): Latency is measured from the start of the sample's block to
+    // its arrival here.
+    if (payload_len >= sizeof(int64_t))
+    {
+        int64_t timestamp;
+        memcpy(&timestamp, p, sizeof(timestamp));
+        record_latency(b, arrival - block_start(b, recent, timestamp, arrival / 1000) * 1000);
+    }
+    b->num_publish += 1;
+
+    if (qos > 0)
+    {
+        uint8_t ack[4];
+        mqtt_pack_pubxxx_request(ack, sizeof(ack), qos == 1 ? MQTT_CONTROL_PUBACK : MQTT_CONTROL_PUBREC, packet_id);
+        send_all(fd, ack, sizeof(ack));
+    }
+}
+
+static void serve_connection(BenchBroker* b, int fd)
+{
+    size_t buf_size = 1 << 16;
+    uint8_t* buf = malloc(buf_size);
+    size_t filled = 0;
+    BlockStarts recent = {0};
+
+    while (!b->stop)
+    {
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        if (poll(&pfd, 1, 50) <= 0)
+            continue;
+
+        ssize_t rv = recv(fd, buf + filled, buf_size - filled, 0);
+        if (rv <= 0)
+            break;
+        int64_t arrival = bench_now_us();
+        b->num_bytes += rv;
+        filled += rv;
+
+        size_t consumed = 0;
+        while (true)
+        {
+            struct mqtt_response response;
+            ssize_t header_len = mqtt_unpack_fixed_header(&response, buf + consumed, filled - consumed);
+            if (header_len <= 0)
+                break;
+
+            const struct mqtt_fixed_header* fh = &response.fixed_header;
+            const uint8_t* body = buf + consumed + header_len;
+            switch (fh->control_type)
+            {
+                case MQTT_CONTROL_CONNECT:
+                {
+                    static const uint8_t connack[] = {0x20, 0x02, 0x00, 0x00};
+                    send_all(fd, connack, sizeof(connack));
+                } break;
+
+                case MQTT_CONTROL_PUBLISH:
+                {
+                    handle_publish(b, fd, fh, body, arrival, &recent);
+                } break;
+
+                case MQTT_CONTROL_PUBREL:
+                {
+                    uint8_t ack[4];
+                    mqtt_pack_pubxxx_request(ack, sizeof(ack), MQTT_CONTROL_PUBCOMP, __mqtt_unpack_uint16(body));
+                    send_all(fd, ack, sizeof(ack));
+                } break;
+
+                case MQTT_CONTROL_PINGREQ:
+                {
+                    static const uint8_t pingresp[] = {0xD0, 0x00};
+                    send_all(fd, pingresp, sizeof(pingresp));
+                } break;
+
+                default:
+                    break;
+            }
+            consumed += header_len + fh->remaining_length;
+        }
+
+        memmove(buf, buf + consumed, filled - consumed);
+        filled -= consumed;
+        if (filled == buf_size)
+        {
+            buf_size *= 2;
+            buf = realloc(buf, buf_size);
+        }
+    }
+
+    free(buf);
+    close(fd);
+}
+
+static void* broker_thread(void* arg)
+{
+    BenchBroker* b = (BenchBroker*)arg;
+    while (!b->stop)
+    {
+        struct pollfd pfd = {.fd = b->listen_fd, .events = POLLIN};
+        if (poll(&pfd, 1, 50) <= 0)
+            continue;
+
+        int fd = accept(b->listen_fd, NULL, NULL);
+        if (fd == -1)
+            continue;
+        b->num_connections += 1;
+        serve_connection(b, fd);
+    }
+    return NULL;
+}
+
+void bench_broker_start(BenchBroker* b)
+{
+    if (b->block_size <= 0)
+        b->block_size = 1;
+    b->stop = false;
+    pthread_create(&b->thread, NULL, broker_thread, b);
+}
+
+void bench_broker_stop(BenchBroker* b)
+{
+    b->stop = true;
+    pthread_join(b->thread, NULL);
+    close(b->listen_fd);
+    b->listen_fd = -1;
+    if (b->unix_path[0])
+    {
+        unlink(b->unix_path);
+        b->unix_path[0] = 0;
+    }
+}
+
+void bench_broker_free(BenchBroker* b)
+{
+    free(b->latencies_us);
+    b->latencies_us = NULL;
+    b->num_latencies = 0;
+    b->latencies_capacity = 0;
+}
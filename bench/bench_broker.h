@@ -0,0 +1,42 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// NOTE(cmo): A minimal stand-in for the MQTT broker, used by the benchmarks.
+// It accepts a connection at a time, answers CONNECT/PINGREQ and acknowledges
+// QoS 1/2 publishes, and records when each Magnetometer message arrives. It
+// does not route anything anywhere.
+
+typedef struct BenchBroker
+{
+    // NOTE(cmo): Configuration, set before bench_broker_start.
+    int32_t block_size;
+    int32_t sample_interval;
+
+    int listen_fd;
+    char unix_path[108];
+    pthread_t thread;
+    volatile bool stop;
+
+    // NOTE(cmo): Statistics, only read these after bench_broker_stop.
+    int64_t num_connections;
+    int64_t num_publish;
+    int64_t num_bytes;
+    int64_t first_arrival_us;
+    int64_t last_arrival_us;
+    int64_t* latencies_us;
+    int64_t num_latencies;
+    int64_t latencies_capacity;
+} BenchBroker;
+
+int64_t bench_now_us();
+
+// NOTE(cmo): Listen on an ephemeral loopback TCP port, returns the port (or -1).
+int bench_broker_listen_tcp(BenchBroker* b);
+// NOTE(cmo): Listen on a unix domain socket at path (removed again by
+// bench_broker_stop), returns 0 (or -1).
+int bench_broker_listen_unix(BenchBroker* b, const char* path);
+void bench_broker_start(BenchBroker* b);
+void bench_broker_stop(BenchBroker* b);
+void bench_broker_free(BenchBroker* b);
@@ -0,0 +1,148 @@
+#define _DEFAULT_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "bench_broker.h"
+
+// NOTE(cmo): End-to-end throughput benchmark. Runs a benchmark build of `mag`
+// (simulated device, unthrottled clock, see build.sh) against the broker
+// stand-in in bench_broker.c and reports the sustained sample rate, publish
+// latency, and the CPU time and peak memory of the `mag` process as JSON.
+// --transport unix connects `mag` to the broker over a unix domain socket
+// instead of loopback TCP.
+//
+// Usage: bench_e2e [--mag PATH] [--blocks N] [--transport tcp|unix]
+
+// NOTE(cmo): Keep these in step with magnetometer.c
+static const int32_t BlockSize = 4;
+static const int32_t SampleInterval = 3000;
+
+static int compare_int64(const void* a, const void* b)
+{
+    int64_t x = *(const int64_t*)a;
+    int64_t y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static int64_t percentile(const int64_t* sorted, int64_t n, double p)
+{
+    if (n == 0)
+        return 0;
+    int64_t idx = (int64_t)(p * (double)(n - 1) + 0.5);
+    return sorted[idx];
+}
+
+int main(int argc, const char* argv[])
+{
+    const char* mag_path = "./mag_bench";
+    int64_t blocks = 20000;
+    const char* transport = "tcp";
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--mag") == 0 && i + 1 < argc)
+            mag_path = argv[++i];
+        else if (strcmp(argv[i], "--blocks") == 0 && i + 1 < argc)
+            blocks = atoll(argv[++i]);
+        else if (strcmp(argv[i], "--transport") == 0 && i + 1 < argc
+                 && (strcmp(argv[i + 1], "tcp") == 0 || strcmp(argv[i + 1], "unix") == 0))
+            transport = argv[++i];
+        else
+        {
+            fprintf(stderr, "Usage: %s [--mag PATH] [--blocks N] [--transport tcp|unix]\n", argv[0]);
+            return 1;
+        }
+    }
+    bool use_unix = strcmp(transport, "unix") == 0;
+
+    BenchBroker broker = {
+        .block_size = BlockSize,
+        .sample_interval = SampleInterval,
+    };
+    char port_str[16] = "1883";
+    char endpoint[128] = "localhost";
+    int port = 0;
+    if (use_unix)
+    {
+        char path[96];
+        snprintf(path, sizeof(path), "/tmp/mag-bench-%d.sock", (int)getpid());
+        snprintf(endpoint, sizeof(endpoint), "unix://%s", path);
+        if (bench_broker_listen_unix(&broker, path) != 0)
+            port = -1;
+    }
+    else
+    {
+        port = bench_broker_listen_tcp(&broker);
+        snprintf(port_str, sizeof(port_str), "%d", port);
+    }
+    if (port < 0)
+    {
+        fprintf(stderr, "Failed to open broker stand-in socket\n");
+        return 1;
+    }
+    bench_broker_start(&broker);
+
+    char blocks_str[32];
+    snprintf(blocks_str, sizeof(blocks_str), "%lld", (long long)blocks);
+
+    int64_t start = bench_now_us();
+    pid_t child = fork();
+    if (child == 0)
+    {
+        setenv("MAG_BENCH_PORT", port_str, 1);
+        setenv("MAG_BENCH_ENDPOINT", endpoint, 1);
+        setenv("MAG_BENCH_BLOCKS", blocks_str, 1);
+        // NOTE(cmo): The device info dump isn't interesting here.
+        freopen("/dev/null", "w", stderr);
+        execl(mag_path, mag_path, (char*)NULL);
+        _exit(127);
+    }
+
+    int status = 0;
+    struct rusage usage = {0};
+    wait4(child, &status, 0, &usage);
+    int64_t end = bench_now_us();
+    bench_broker_stop(&broker);
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        fprintf(stderr, "%s did not exit cleanly (status %d)\n", mag_path, status);
+        return 1;
+    }
+
+    int64_t expected = blocks * BlockSize;
+    int64_t samples = broker.num_publish;
+    double stream_s = (double)(broker.last_arrival_us - broker.first_arrival_us) * 1e-6;
+    double cpu_us = (double)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e6
+                    + (double)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+
+    qsort(broker.latencies_us, broker.num_latencies, sizeof(int64_t), compare_int64);
+    const int64_t* lat = broker.latencies_us;
+    int64_t n_lat = broker.num_latencies;
+
+    printf("{\n");
+    printf("  \"benchmark\": \"e2e\",\n");
+    printf("  \"transport\": \"%s\",\n", transport);
+    printf("  \"blocks\": %lld,\n", (long long)blocks);
+    printf("  \"samples_expected\": %lld,\n", (long long)expected);
+    printf("  \"samples_received\": %lld,\n", (long long)samples);
+    printf("  \"bytes_received\": %lld,\n", (long long)broker.num_bytes);
+    printf("  \"wall_s\": %.6f,\n", (double)(end - start) * 1e-6);
+    printf("  \"samples_per_s\": %.1f,\n", stream_s > 0.0 ? (double)samples / stream_s : 0.0);
+    // NOTE(cmo): Sample timestamps are in ms, so latencies carry up to 1 ms of truncation.
+    printf("  \"latency_us\": {\"p50\": %lld, \"p90\": %lld, \"p99\": %lld, \"p999\": %lld, \"max\": %lld},\n",
+           (long long)percentile(lat, n_lat, 0.5), (long long)percentile(lat, n_lat, 0.9),
+           (long long)percentile(lat, n_lat, 0.99), (long long)percentile(lat, n_lat, 0.999),
+           (long long)(n_lat ? lat[n_lat - 1] : 0));
+    printf("  \"cpu_us_per_sample\": %.3f,\n", samples ? cpu_us / (double)samples : 0.0);
+    printf("  \"max_rss_kb\": %ld\n", usage.ru_maxrss);
+    printf("}\n");
+
+    bench_broker_free(&broker);
+    return samples == expected ? 0 : 2;
+}
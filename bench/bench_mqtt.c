@@ -0,0 +1,1192 @@
+#define _DEFAULT_SOURCE
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdarg.h>
+#if defined(MQTT_USE_IO_URING)
+#include <errno.h>
+#include <stddef.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#endif
+#include "../mqtt.h"
+
+// NOTE(cmo): Microbenchmarks for the parts of MQTT-C that sit on the
+// publishing path: packing and parsing, the message queue, and __mqtt_send /
+// __mqtt_recv driven through a unix domain socket pair (or loopback TCP, to
+// compare the two transports). Results are printed as
+// JSON (ns, wire bytes and client socket syscalls per operation) so runs can
+// be diffed against a baseline whenever the vendored client changes.
+//
+// Built with -DMQTT_USE_IO_URING (bench_mqtt_uring) the client's sockets are
+// wrapped in io_uring handles; --uring-fallback makes io_uring_setup fail so
+// the same runs cover the fallback to the plain socket calls.
+//
+// Usage: bench_mqtt [--scale F]   (F multiplies the iteration counts)
+//        bench_mqtt_uring [--scale F] [--uring-fallback]
+
+static const char* Topic = "Magnetometer";
+static double g_scale = 1.0;
+static int g_num_results = 0;
+#if defined(MQTT_USE_IO_URING)
+static bool g_uring_fallback = false;
+#endif
+
+// NOTE(cmo): The syscalls made on the client's socket are counted by wrapping
+// the libc calls MQTT-C's PAL makes at link time (-Wl,--wrap, see build.sh).
+// The peer's end of the socket isn't counted. syscall() is only used by the
+// io_uring backend, and every one of those is counted.
+static int g_counted_fd = -1;
+static int64_t g_syscalls = 0;
+
+ssize_t __real_send(int fd, const void* buf, size_t len, int flags);
+ssize_t __real_sendmsg(int fd, const struct msghdr* msg, int flags);
+ssize_t __real_recv(int fd, void* buf, size_t len, int flags);
+long __real_syscall(long number, ...);
+
+ssize_t __wrap_send(int fd, const void* buf, size_t len, int flags)
+{
+    g_syscalls += fd == g_counted_fd;
+    return __real_send(fd, buf, len, flags);
+}
+
+ssize_t __wrap_sendmsg(int fd, const struct msghdr* msg, int flags)
+{
+    g_syscalls += fd == g_counted_fd;
+    return __real_sendmsg(fd, msg, flags);
+}
+
+ssize_t __wrap_recv(int fd, void* buf, size_t len, int flags)
+{
+    g_syscalls += fd == g_counted_fd;
+    return __real_recv(fd, buf, len, flags);
+}
+
+long __wrap_syscall(long number, ...)
+{
+    long args[6];
+    va_list ap;
+    va_start(ap, number);
+    for (int i = 0; i < 6; ++i)
+        args[i] = va_arg(ap, long);
+    va_end(ap);
+    g_syscalls += 1;
+    return __real_syscall(number, args[0], args[1], args[2], args[3], args[4], args[5]);
+}
+
+static int64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int64_t iterations(int64_t n)
+{
+    int64_t result = (int64_t)((double)n * g_scale);
+    return result > 0 ? result : 1;
+}
+
+static void report(const char* name, int64_t ops, int64_t elapsed_ns, int64_t bytes, int64_t syscalls)
+{
+    printf("%s    {\"name\": \"%s\", \"ops\": %lld, \"ns_per_op\": %.2f, \"bytes_per_op\": %.2f, \"syscalls_per_op\": %.2f}",
+           g_num_results ? ",\n" : "", name, (long long)ops,
+           (double)elapsed_ns / (double)ops, (double)bytes / (double)ops, (double)syscalls / (double)ops);
+    g_num_results += 1;
+    fflush(stdout);
+}
+
+static void publish_callback(void** state, struct mqtt_response_publish* publish)
+{}
+
+// NOTE(cmo): The far end of the socket pair, playing the part of the broker.
+// Acks are held for ack_delay_ns after the packet is read, to stand in for the
+// round trip to a real broker.
+typedef struct Peer
+{
+    int fd;
+    uint8_t* buf;
+    size_t buf_size;
+    size_t filled;
+    uint8_t* acks;
+    int64_t* ack_due;
+    size_t acks_head;
+    size_t acks_len;
+    size_t acks_capacity;
+    int64_t ack_delay_ns;
+} Peer;
+
+static void peer_init(Peer* p, int fd)
+{
+    memset(p, 0, sizeof(*p));
+    p->fd = fd;
+    p->buf_size = 1 << 20;
+    p->buf = malloc(p->buf_size);
+    p->acks_capacity = 1 << 16;
+    p->acks = malloc(p->acks_capacity);
+    p->ack_due = malloc(p->acks_capacity / 4 * sizeof(int64_t));
+}
+
+static void peer_free(Peer* p)
+{
+    close(p->fd);
+    free(p->buf);
+    free(p->acks);
+    free(p->ack_due);
+}
+
+// NOTE(cmo): Read everything that's been sent, staging a PUBACK for each QoS 1
+// PUBLISH, a PUBREC for each QoS 2 PUBLISH and a PUBCOMP for each PUBREL.
+// Returns the number of bytes read.
+static int64_t peer_drain(Peer* p)
+{
+    int64_t total = 0;
+    int64_t due = p->ack_delay_ns ? now_ns() + p->ack_delay_ns : 0;
+    while (true)
+    {
+        ssize_t rv = recv(p->fd, p->buf + p->filled, p->buf_size - p->filled, MSG_DONTWAIT);
+        if (rv <= 0)
+            break;
+        total += rv;
+        p->filled += rv;
+
+        size_t consumed = 0;
+        while (true)
+        {
+            struct mqtt_response response;
+            ssize_t header_len = mqtt_unpack_fixed_header(&response, p->buf + consumed, p->filled - consumed);
+            if (header_len <= 0)
+                break;
+
+            const struct mqtt_fixed_header* fh = &response.fixed_header;
+            const uint8_t* body = p->buf + consumed + header_len;
+            enum MQTTControlPacketType ack_type = 0;
+            uint16_t packet_id = 0;
+            if (fh->control_type == MQTT_CONTROL_PUBLISH && (fh->control_flags & MQTT_PUBLISH_QOS_MASK))
+            {
+                packet_id = __mqtt_unpack_uint16(body + 2 + __mqtt_unpack_uint16(body));
+                ack_type = (fh->control_flags & MQTT_PUBLISH_QOS_2) ? MQTT_CONTROL_PUBREC : MQTT_CONTROL_PUBACK;
+            }
+            else if (fh->control_type == MQTT_CONTROL_PUBREL)
+            {
+                packet_id = __mqtt_unpack_uint16(body);
+                ack_type = MQTT_CONTROL_PUBCOMP;
+            }
+            if (ack_type)
+            {
+                if (p->acks_len + 4 > p->acks_capacity)
+                {
+                    p->acks_capacity *= 2;
+                    p->acks = realloc(p->acks, p->acks_capacity);
+                    p->ack_due = realloc(p->ack_due, p->acks_capacity / 4 * sizeof(int64_t));
+                }
+                p->ack_due[p->acks_len / 4] = due;
+                p->acks_len += mqtt_pack_pubxxx_request(p->acks + p->acks_len, 4, ack_type, packet_id);
+            }
+            consumed += header_len + fh->remaining_length;
+        }
+        memmove(p->buf, p->buf + consumed, p->filled - consumed);
+        p->filled -= consumed;
+    }
+    return total;
+}
+
+// NOTE(cmo): Send the PUBACKs that are due.
+static void peer_send_acks(Peer* p)
+{
+    size_t end = p->acks_len;
+    if (p->ack_delay_ns)
+    {
+        int64_t now = now_ns();
+        end = p->acks_head;
+        while (end < p->acks_len && p->ack_due[end / 4] <= now)
+            end += 4;
+    }
+
+    while (p->acks_head < end)
+    {
+        ssize_t rv = send(p->fd, p->acks + p->acks_head, end - p->acks_head, 0);
+        if (rv <= 0)
+            break;
+        p->acks_head += rv;
+    }
+    if (p->acks_head == p->acks_len)
+    {
+        p->acks_head = 0;
+        p->acks_len = 0;
+    }
+}
+
+typedef struct BenchClient
+{
+    struct mqtt_client client;
+    uint8_t* sendbuf;
+    uint8_t* recvbuf;
+    Peer peer;
+} BenchClient;
+
+// NOTE(cmo): A connected pair of loopback TCP sockets, with Nagle off as in
+// magnetometer.c.
+static int tcp_socket_pair(int fds[2])
+{
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (listen_fd == -1
+        || bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1
+        || listen(listen_fd, 1) == -1
+        || getsockname(listen_fd, (struct sockaddr*)&addr, &len) == -1)
+        return -1;
+
+    fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+    if (fds[0] == -1 || connect(fds[0], (struct sockaddr*)&addr, sizeof(addr)) == -1)
+        return -1;
+    fds[1] = accept(listen_fd, NULL, NULL);
+    close(listen_fd);
+    if (fds[1] == -1)
+        return -1;
+
+    int one = 1;
+    setsockopt(fds[0], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(fds[1], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return 0;
+}
+
+// NOTE(cmo): Connects a socket pair, handing one end to the peer. Returns the
+// client's end, as the socket handle the client is built with.
+static mqtt_pal_socket_handle bench_socket(Peer* peer, bool tcp)
+{
+    int fds[2];
+    if (tcp ? tcp_socket_pair(fds) == -1 : socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+    {
+        perror(tcp ? "tcp_socket_pair" : "socketpair");
+        exit(1);
+    }
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    peer_init(peer, fds[1]);
+    g_counted_fd = fds[0];
+#if defined(MQTT_USE_IO_URING)
+    mqtt_pal_socket_handle handle = mqtt_pal_uring_open(fds[0]);
+    if (!handle)
+    {
+        fprintf(stderr, "mqtt_pal_uring_open failed\n");
+        exit(1);
+    }
+    if (g_uring_fallback && mqtt_pal_uring_active(handle))
+    {
+        fprintf(stderr, "Bench client is using io_uring with --uring-fallback\n");
+        exit(1);
+    }
+    return handle;
+#else
+    return fds[0];
+#endif
+}
+
+static void bench_client_open_version(BenchClient* bc, size_t sendbuf_size, size_t recvbuf_size, bool tcp,
+                                      uint8_t protocol_level)
+{
+    mqtt_pal_socket_handle handle = bench_socket(&bc->peer, tcp);
+    bc->sendbuf = malloc(sendbuf_size);
+    bc->recvbuf = malloc(recvbuf_size);
+    mqtt_init(&bc->client, handle, bc->sendbuf, sendbuf_size, bc->recvbuf, recvbuf_size, publish_callback);
+    mqtt_set_protocol_version(&bc->client, protocol_level, NULL);
+    mqtt_connect(&bc->client, "bench", NULL, NULL, 0, NULL, NULL, MQTT_CONNECT_CLEAN_SESSION, 400);
+    __mqtt_send(&bc->client);
+    peer_drain(&bc->peer);
+
+    static const uint8_t connack[] = {0x20, 0x02, 0x00, 0x00};
+    static const uint8_t connack_v5[] = {0x20, 0x03, 0x00, 0x00, 0x00};
+    if (protocol_level >= MQTT_PROTOCOL_LEVEL_5)
+        send(bc->peer.fd, connack_v5, sizeof(connack_v5), 0);
+    else
+        send(bc->peer.fd, connack, sizeof(connack), 0);
+    __mqtt_recv(&bc->client);
+    if (bc->client.error != MQTT_OK)
+    {
+        fprintf(stderr, "Bench client failed to connect: %s\n", mqtt_error_str(bc->client.error));
+        exit(1);
+    }
+}
+
+static void bench_client_open(BenchClient* bc, size_t sendbuf_size, size_t recvbuf_size, bool tcp)
+{
+    bench_client_open_version(bc, sendbuf_size, recvbuf_size, tcp, MQTT_PROTOCOL_LEVEL);
+}
+
+static int client_fd(BenchClient* bc)
+{
+#if defined(MQTT_USE_IO_URING)
+    return mqtt_pal_uring_fd(bc->client.socketfd);
+#else
+    return bc->client.socketfd;
+#endif
+}
+
+static void bench_client_close_socket(BenchClient* bc)
+{
+    close(client_fd(bc));
+#if defined(MQTT_USE_IO_URING)
+    mqtt_pal_uring_close(bc->client.socketfd);
+#endif
+    g_counted_fd = -1;
+    peer_free(&bc->peer);
+}
+
+static void bench_client_close(BenchClient* bc)
+{
+    bench_client_close_socket(bc);
+    mqtt_free_buffers(&bc->client);
+    free(bc->sendbuf);
+    free(bc->recvbuf);
+}
+
+static void bench_pack_publish(const char* name, size_t payload_size, uint8_t flags, int64_t n)
+{
+    uint8_t* payload = calloc(payload_size, 1);
+    size_t buf_size = payload_size + 64;
+    uint8_t* buf = malloc(buf_size);
+    int64_t bytes = 0;
+
+    int64_t start = now_ns();
+    for (int64_t i = 0; i < n; ++i)
+        bytes += mqtt_pack_publish_request(buf, buf_size, Topic, (uint16_t)i, payload, payload_size, flags);
+    report(name, n, now_ns() - start, bytes, 0);
+
+    free(buf);
+    free(payload);
+}
+
+static void bench_unpack(const char* name, const uint8_t* packet, size_t packet_size, int64_t n)
+{
+    struct mqtt_response response;
+    int64_t bytes = 0;
+
+    int64_t start = now_ns();
+    for (int64_t i = 0; i < n; ++i)
+        bytes += mqtt_unpack_response(&response, packet, packet_size);
+    report(name, n, now_ns() - start, bytes, 0);
+}
+
+static struct mqtt_queued_message* push_publish(struct mqtt_message_queue* mq, uint16_t packet_id)
+{
+    static const uint8_t payload[40] = {0};
+    ssize_t rv = mqtt_pack_publish_request(mq->curr, mq->curr_sz, Topic, packet_id,
+                                           payload, sizeof(payload), MQTT_PUBLISH_QOS_1);
+    if (rv <= 0)
+    {
+        fprintf(stderr, "Message queue too small for benchmark\n");
+        exit(1);
+    }
+    struct mqtt_queued_message* msg = mqtt_mq_register(mq, (size_t)rv);
+    msg->control_type = MQTT_CONTROL_PUBLISH;
+    msg->packet_id = packet_id;
+    mqtt_mq_index(mq, msg);
+    return msg;
+}
+
+// NOTE(cmo): A sliding window of `depth` outstanding messages: each operation
+// registers a new message, completes the oldest and cleans the queue. This is
+// the queue's steady state when it's behind (e.g. after a reconnect).
+static void bench_mq_fifo(int64_t depth, int64_t n)
+{
+    size_t buf_size = 1 << 22;
+    void* buf = malloc(buf_size);
+    struct mqtt_message_queue mq;
+    mqtt_mq_init(&mq, buf, buf_size);
+
+    uint16_t packet_id = 1;
+    for (int64_t i = 0; i < depth; ++i)
+        push_publish(&mq, packet_id++);
+
+    int64_t start = now_ns();
+    for (int64_t i = 0; i < n; ++i)
+    {
+        push_publish(&mq, packet_id++);
+        mqtt_mq_get(&mq, 0)->state = MQTT_QUEUED_COMPLETE;
+        mqtt_mq_clean(&mq);
+    }
+    int64_t elapsed = now_ns() - start;
+
+    char name[64];
+    snprintf(name, sizeof(name), "mq_fifo_depth_%lld", (long long)depth);
+    report(name, n, elapsed, 0, 0);
+    free(buf);
+}
+
+static void bench_mq_find(int64_t depth, int64_t n)
+{
+    size_t buf_size = 1 << 22;
+    void* buf = malloc(buf_size);
+    struct mqtt_message_queue mq;
+    mqtt_mq_init(&mq, buf, buf_size);
+
+    for (int64_t i = 0; i < depth; ++i)
+        push_publish(&mq, (uint16_t)(i + 1));
+
+    int64_t found = 0;
+    int64_t start = now_ns();
+    for (int64_t i = 0; i < n; ++i)
+    {
+        uint16_t packet_id = (uint16_t)((i % depth) + 1);
+        found += mqtt_mq_find(&mq, MQTT_CONTROL_PUBLISH, &packet_id) != NULL;
+    }
+    int64_t elapsed = now_ns() - start;
+    if (found != n)
+        fprintf(stderr, "mq_find missed %lld lookups\n", (long long)(n - found));
+
+    char name[64];
+    snprintf(name, sizeof(name), "mq_find_depth_%lld", (long long)depth);
+    report(name, n, elapsed, 0, 0);
+    free(buf);
+}
+
+// NOTE(cmo): Publish bursts through the client and push them out with
+// __mqtt_send, with the peer draining (and, for QoS 1, acknowledging)
+// after every burst. Reported per message.
+typedef enum PublishMode
+{
+    PublishCopy,  // mqtt_publish per message
+    PublishRef,   // mqtt_publish_ref per message, payload not copied
+    PublishBatch, // one mqtt_publish_batch per burst
+} PublishMode;
+
+static void bench_send(const char* name, size_t sendbuf_size, size_t payload_size,
+                       uint8_t flags, PublishMode mode, int64_t burst, int64_t n_bursts)
+{
+    BenchClient bc;
+    bench_client_open(&bc, sendbuf_size, 1 << 16, false);
+    uint8_t* payload = calloc(payload_size, 1);
+    bool acks = (flags & MQTT_PUBLISH_QOS_MASK) != 0;
+    int64_t bytes = 0;
+    struct mqtt_payload_ref payload_ref;
+    mqtt_payload_ref_init(&payload_ref, NULL);
+    struct mqtt_publish_entry* entries = calloc(burst, sizeof(struct mqtt_publish_entry));
+    for (int64_t i = 0; i < burst; ++i)
+    {
+        entries[i].application_message = payload;
+        entries[i].application_message_size = payload_size;
+        entries[i].publish_flags = flags;
+    }
+
+    int64_t start_syscalls = g_syscalls;
+    int64_t start = now_ns();
+    for (int64_t b = 0; b < n_bursts; ++b)
+    {
+        if (mode == PublishBatch)
+            mqtt_publish_batch(&bc.client, Topic, entries, burst);
+        for (int64_t i = 0; mode != PublishBatch && i < burst; ++i)
+        {
+            if (mode == PublishRef)
+                mqtt_publish_ref(&bc.client, Topic, payload, payload_size, flags, &payload_ref);
+            else
+                mqtt_publish(&bc.client, Topic, payload, payload_size, flags);
+        }
+        __mqtt_send(&bc.client);
+        bytes += peer_drain(&bc.peer);
+        if (acks)
+        {
+            peer_send_acks(&bc.peer);
+            __mqtt_recv(&bc.client);
+        }
+    }
+    int64_t elapsed = now_ns() - start;
+
+    if (bc.client.error != MQTT_OK)
+        fprintf(stderr, "%s: client error %s\n", name, mqtt_error_str(bc.client.error));
+    report(name, burst * n_bursts, elapsed, bytes, g_syscalls - start_syscalls);
+
+    free(entries);
+    free(payload);
+    bench_client_close(&bc);
+}
+
+// NOTE(cmo): Steady-state QoS 1 or 2 throughput through an in-flight window
+// of `window` messages against a broker `rtt_us` away (QoS 0 ignores the
+// window). The producer publishes batches of 16 whenever fewer than window +
+// 16 messages are queued, and the run ends when all n are acknowledged.
+// Reported per message, so ns_per_op is the inverse of throughput (bounded
+// below by rtt / window for QoS 1, twice that for QoS 2).
+static void bench_window(int qos, int window, int64_t rtt_us, int64_t n)
+{
+    const int64_t burst = 16;
+    static const uint8_t qos_flags[] = {MQTT_PUBLISH_QOS_0, MQTT_PUBLISH_QOS_1, MQTT_PUBLISH_QOS_2};
+    uint8_t flags = qos_flags[qos];
+    BenchClient bc;
+    bench_client_open(&bc, 1 << 22, 1 << 16, false);
+    bc.client.max_inflight_qos1 = window;
+    bc.client.max_inflight_qos2 = window;
+    bc.peer.ack_delay_ns = rtt_us * 1000;
+
+    uint8_t payload[40] = {0};
+    struct mqtt_publish_entry entries[16];
+    for (int64_t i = 0; i < burst; ++i)
+    {
+        entries[i].topic_name = NULL;
+        entries[i].application_message = payload;
+        entries[i].application_message_size = sizeof(payload);
+        entries[i].publish_flags = flags;
+    }
+
+    int64_t published = 0;
+    int64_t bytes = 0;
+    int64_t start_syscalls = g_syscalls;
+    int64_t start = now_ns();
+    while (published < n || mqtt_mq_length(&bc.client.mq) > 0)
+    {
+        if (published < n && mqtt_mq_length(&bc.client.mq) < window + burst)
+        {
+            int64_t count = (n - published) < burst ? (n - published) : burst;
+            mqtt_publish_batch(&bc.client, Topic, entries, count);
+            published += count;
+        }
+        __mqtt_send(&bc.client);
+        bytes += peer_drain(&bc.peer);
+        peer_send_acks(&bc.peer);
+        __mqtt_recv(&bc.client);
+        mqtt_mq_clean(&bc.client.mq);
+        if (bc.client.error != MQTT_OK)
+            break;
+    }
+    int64_t elapsed = now_ns() - start;
+
+    char name[64];
+    if (qos)
+        snprintf(name, sizeof(name), "qos%d_window%d_rtt%lldus", qos, window, (long long)rtt_us);
+    else
+        snprintf(name, sizeof(name), "qos0_rtt%lldus", (long long)rtt_us);
+    if (bc.client.error != MQTT_OK)
+        fprintf(stderr, "%s: client error %s\n", name, mqtt_error_str(bc.client.error));
+    report(name, n, elapsed, bytes, g_syscalls - start_syscalls);
+    bench_client_close(&bc);
+}
+
+// NOTE(cmo): One QoS 1 sample at a time: publish, send, the peer reads it and
+// acks, the client reads the PUBACK. Both ends run on this thread, so
+// ns_per_op is the CPU cost of a message round trip through the transport
+// (both sides of the kernel stack included) as well as its latency.
+static void bench_transport(bool tcp, int64_t n)
+{
+    BenchClient bc;
+    bench_client_open(&bc, 1 << 16, 1 << 16, tcp);
+    uint8_t payload[40] = {0};
+    int64_t bytes = 0;
+
+    int64_t start_syscalls = g_syscalls;
+    int64_t start = now_ns();
+    for (int64_t i = 0; i < n; ++i)
+    {
+        mqtt_publish(&bc.client, Topic, payload, sizeof(payload), MQTT_PUBLISH_QOS_1);
+        __mqtt_send(&bc.client);
+        int64_t drained = 0;
+        while (drained == 0)
+            drained = peer_drain(&bc.peer);
+        bytes += drained;
+        peer_send_acks(&bc.peer);
+        while (mqtt_mq_length(&bc.client.mq) > 0 && bc.client.error == MQTT_OK)
+        {
+            __mqtt_recv(&bc.client);
+            mqtt_mq_clean(&bc.client.mq);
+        }
+    }
+    int64_t elapsed = now_ns() - start;
+
+    const char* name = tcp ? "roundtrip_qos1_40B_tcp" : "roundtrip_qos1_40B_unix";
+    if (bc.client.error != MQTT_OK)
+        fprintf(stderr, "%s: client error %s\n", name, mqtt_error_str(bc.client.error));
+    report(name, n, elapsed, bytes, g_syscalls - start_syscalls);
+    bench_client_close(&bc);
+}
+
+// NOTE(cmo): Byte i of the payload of message `seed`, so every payload the
+// peer reads can be checked.
+static uint8_t pattern_byte(int seed, size_t i)
+{
+    return (uint8_t)((i * 7 + (size_t)seed * 13) % 251);
+}
+
+static void fill_pattern(uint8_t* buf, size_t len, int seed)
+{
+    for (size_t i = 0; i < len; ++i)
+        buf[i] = pattern_byte(seed, i);
+}
+
+// NOTE(cmo): A payload that is scribbled over as soon as MQTT-C lets go of it.
+typedef struct ScribbledPayload
+{
+    struct mqtt_payload_ref ref;
+    uint8_t* buf;
+    size_t size;
+    int releases;
+} ScribbledPayload;
+
+static void scribble_payload(struct mqtt_payload_ref* ref)
+{
+    ScribbledPayload* payload = (ScribbledPayload*)ref;
+    memset(payload->buf, 0xEE, payload->size);
+    payload->releases += 1;
+}
+
+// NOTE(cmo): Read whatever is waiting on the peer's end without parsing it.
+static void peer_read_raw(Peer* p)
+{
+    while (true)
+    {
+        if (p->filled == p->buf_size)
+        {
+            p->buf_size *= 2;
+            p->buf = realloc(p->buf, p->buf_size);
+        }
+        ssize_t rv = recv(p->fd, p->buf + p->filled, p->buf_size - p->filled, MSG_DONTWAIT);
+        if (rv <= 0)
+            break;
+        p->filled += rv;
+    }
+}
+
+static void check_failed(const char* name, const char* what)
+{
+    fprintf(stderr, "%s: FAILED: %s\n", name, what);
+    exit(1);
+}
+
+// NOTE(cmo): Not a benchmark, a check of the partial-send bookkeeping. A large
+// QoS 1 PUBLISH is sent, then retransmitted into a socket that only takes part
+// of it, and the PUBACK for the first copy arrives while the rest is still
+// waiting to be written. The acked message must stay queued (and, published
+// by reference, keep its payload) until the write finishes, even though a
+// flush runs and enough is published after it to reuse its space if it had
+// been freed (or, with `grow`, to make a buffer policy grow the send buffer
+// under it). Everything the peer then reads has to parse, with every payload
+// intact.
+static void check_retransmit_short_write(bool by_ref, bool grow)
+{
+    const char* name = grow ? (by_ref ? "retransmit_short_write_grow_ref" : "retransmit_short_write_grow")
+                            : (by_ref ? "retransmit_short_write_ref" : "retransmit_short_write");
+    const size_t big_size = 1 << 18;
+    const size_t small_size = 4096;
+    const int num_small = grow ? 256 : 64;
+    BenchClient bc;
+    bench_client_open(&bc, grow ? 1 << 20 : 1 << 21, 1 << 16, false);
+    if (grow)
+    {
+        struct mqtt_buffer_policy policy = {
+            .send_initial_size = 1 << 20,
+            .send_max_size = 1 << 23,
+            .recv_initial_size = 1 << 16,
+            .recv_max_size = 1 << 16,
+            .shrink_after = 1000,
+        };
+        mqtt_set_buffer_policy(&bc.client, &policy);
+    }
+    int sndbuf = 16384;
+    setsockopt(client_fd(&bc), SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+    uint8_t* big = malloc(big_size);
+    uint8_t* small = malloc(small_size);
+    fill_pattern(big, big_size, 0);
+    ScribbledPayload payload = {.buf = big, .size = big_size};
+    mqtt_payload_ref_init(&payload.ref, scribble_payload);
+
+    int64_t start_syscalls = g_syscalls;
+    int64_t start = now_ns();
+    if (by_ref)
+    {
+        mqtt_publish_ref(&bc.client, Topic, big, big_size, MQTT_PUBLISH_QOS_1, &payload.ref);
+        mqtt_payload_ref_release(&payload.ref);
+    }
+    else
+    {
+        mqtt_publish(&bc.client, Topic, big, big_size, MQTT_PUBLISH_QOS_1);
+    }
+    struct mqtt_queued_message* msg = mqtt_mq_get(&bc.client.mq, mqtt_mq_length(&bc.client.mq) - 1);
+    uint16_t packet_id = msg->packet_id;
+
+    // NOTE(cmo): Get the first copy across.
+    while (msg->state != MQTT_QUEUED_AWAITING_ACK && bc.client.error == MQTT_OK)
+    {
+        __mqtt_send(&bc.client);
+        peer_read_raw(&bc.peer);
+    }
+
+    // NOTE(cmo): Time it out, and retransmit into a socket nobody is reading.
+    msg->time_sent = MQTT_PAL_TIME() - bc.client.response_timeout - 1;
+    __mqtt_send(&bc.client);
+    if (bc.client.send_partial != msg)
+        check_failed(name, "the retransmission wasn't a short write");
+
+    // NOTE(cmo): Ack the first copy, flush (making no progress) and publish
+    // enough to reuse the retransmission's space.
+    uint8_t ack[4];
+    mqtt_pack_pubxxx_request(ack, sizeof(ack), MQTT_CONTROL_PUBACK, packet_id);
+    send(bc.peer.fd, ack, sizeof(ack), 0);
+    __mqtt_recv(&bc.client);
+    __mqtt_send(&bc.client);
+    if (payload.releases != 0)
+        check_failed(name, "payload released while still being written");
+    for (int i = 0; i < num_small; ++i)
+    {
+        fill_pattern(small, small_size, i + 1);
+        if (mqtt_publish(&bc.client, Topic, small, small_size, MQTT_PUBLISH_QOS_0) != MQTT_OK)
+            check_failed(name, "couldn't queue the messages after it");
+    }
+
+    // NOTE(cmo): Let the rest through.
+    int64_t give_up = now_ns() + 2000000000;
+    while ((mqtt_mq_length(&bc.client.mq) > 0 || bc.client.send_partial) && bc.client.error == MQTT_OK)
+    {
+        __mqtt_send(&bc.client);
+        peer_read_raw(&bc.peer);
+        mqtt_mq_clean(&bc.client.mq);
+        if (now_ns() > give_up || bc.peer.filled > 8 * big_size)
+            check_failed(name, "the queue never drained");
+    }
+    peer_read_raw(&bc.peer);
+    int64_t elapsed = now_ns() - start;
+    if (bc.client.error != MQTT_OK)
+        check_failed(name, mqtt_error_str(bc.client.error));
+    if (by_ref && payload.releases != 1)
+        check_failed(name, "payload not released once sent and acked");
+
+    // NOTE(cmo): Two copies of the big message, then the small ones, in order.
+    size_t consumed = 0;
+    int num_packets = 0;
+    while (consumed < bc.peer.filled)
+    {
+        struct mqtt_response response;
+        ssize_t rv = mqtt_unpack_response(&response, bc.peer.buf + consumed, bc.peer.filled - consumed);
+        if (rv <= 0 || response.fixed_header.control_type != MQTT_CONTROL_PUBLISH)
+            check_failed(name, "the stream doesn't parse");
+        const struct mqtt_response_publish* publish = &response.decoded.publish;
+        int seed = num_packets < 2 ? 0 : num_packets - 1;
+        size_t size = num_packets < 2 ? big_size : small_size;
+        if (publish->application_message_size != size)
+            check_failed(name, "wrong message size");
+        for (size_t i = 0; i < size; ++i)
+        {
+            if (((const uint8_t*)publish->application_message)[i] != pattern_byte(seed, i))
+                check_failed(name, "corrupted payload");
+        }
+        num_packets += 1;
+        consumed += rv;
+    }
+    if (num_packets != 2 + num_small)
+        check_failed(name, "wrong number of packets");
+    if (grow && bc.client.owned_send_buffer == NULL)
+        check_failed(name, "the send buffer never grew");
+    report(name, 1, elapsed, (int64_t)bc.peer.filled, g_syscalls - start_syscalls);
+
+    free(big);
+    free(small);
+    bench_client_close(&bc);
+}
+
+// NOTE(cmo): The slots and index take part of the send buffer, leaving room
+// for packets of up to mqtt_mq_max_packet_size. A publish of exactly that
+// fits; one byte more is refused with MQTT_ERROR_SEND_BUFFER_TOO_SMALL, which
+// leaves the client usable, and in a batch only that entry is skipped.
+static void check_packet_too_large()
+{
+    const char* name = "publish_too_large";
+    const size_t sendbuf_size = 1 << 14;
+    BenchClient bc;
+    bench_client_open(&bc, sendbuf_size, 1 << 16, false);
+    size_t max_size = (size_t)(bc.client.mq.data_end - bc.client.mq.data_start);
+    if (max_size != mqtt_mq_max_packet_size(sendbuf_size))
+        check_failed(name, "mqtt_mq_max_packet_size doesn't match the queue");
+
+    // NOTE(cmo): A QoS 0 PUBLISH is 3 bytes of fixed header at this size, then
+    // the topic and the payload.
+    size_t payload_size = max_size - 3 - 2 - strlen(Topic);
+    uint8_t* payload = calloc(payload_size + 1, 1);
+    int64_t bytes = 0;
+    int64_t start_syscalls = g_syscalls;
+    int64_t start = now_ns();
+    if (mqtt_publish(&bc.client, Topic, payload, payload_size + 1, MQTT_PUBLISH_QOS_0) != MQTT_ERROR_SEND_BUFFER_TOO_SMALL)
+        check_failed(name, "a packet larger than the data ring wasn't refused");
+    if (mqtt_publish(&bc.client, Topic, payload, payload_size, MQTT_PUBLISH_QOS_0) != MQTT_OK)
+        check_failed(name, "a packet the size of the data ring didn't fit");
+    __mqtt_send(&bc.client);
+    bytes += peer_drain(&bc.peer);
+
+    struct mqtt_publish_entry entries[3] = {
+        {.application_message = payload, .application_message_size = 40, .publish_flags = MQTT_PUBLISH_QOS_0},
+        {.application_message = payload, .application_message_size = payload_size + 1, .publish_flags = MQTT_PUBLISH_QOS_0},
+        {.application_message = payload, .application_message_size = 40, .publish_flags = MQTT_PUBLISH_QOS_0},
+    };
+    if (mqtt_publish_batch(&bc.client, Topic, entries, 3) != MQTT_ERROR_SEND_BUFFER_TOO_SMALL
+        || entries[0].status != MQTT_OK
+        || entries[1].status != MQTT_ERROR_SEND_BUFFER_TOO_SMALL
+        || entries[2].status != MQTT_OK)
+        check_failed(name, "the batch didn't skip just the oversized entry");
+    __mqtt_send(&bc.client);
+    bytes += peer_drain(&bc.peer);
+    int64_t elapsed = now_ns() - start;
+    if (bc.client.error != MQTT_OK)
+        check_failed(name, mqtt_error_str(bc.client.error));
+    if (bytes != (int64_t)(max_size + 2 * (2 + 2 + strlen(Topic) + 40)))
+        check_failed(name, "wrong number of bytes sent");
+    report(name, 1, elapsed, bytes, g_syscalls - start_syscalls);
+
+    free(payload);
+    bench_client_close(&bc);
+}
+
+// NOTE(cmo): A broker stall long enough to time a message out gets it
+// retransmitted, and the broker acks both copies. The second ack arrives after
+// the first has completed the exchange and the queue has been cleaned, and has
+// to be ignored rather than put the client in an error state. QoS 2 does this
+// for the PUBLISH (two PUBRECs) and then the PUBREL (two PUBCOMPs).
+static void check_duplicate_acks(int qos)
+{
+    const char* name = qos == 2 ? "duplicate_acks_qos2" : "duplicate_acks_qos1";
+    BenchClient bc;
+    bench_client_open(&bc, 1 << 16, 1 << 16, false);
+    uint8_t payload[40] = {0};
+    int64_t bytes = 0;
+    int64_t start_syscalls = g_syscalls;
+    int64_t start = now_ns();
+    mqtt_publish(&bc.client, Topic, payload, sizeof(payload), qos == 2 ? MQTT_PUBLISH_QOS_2 : MQTT_PUBLISH_QOS_1);
+    for (int round = 0; round < qos; ++round)
+    {
+        __mqtt_send(&bc.client);
+        bytes += peer_drain(&bc.peer);
+
+        // NOTE(cmo): Time out whatever is waiting for its ack, and retransmit.
+        for (ssize_t i = 0; i < mqtt_mq_length(&bc.client.mq); ++i)
+        {
+            struct mqtt_queued_message* msg = mqtt_mq_get(&bc.client.mq, i);
+            if (msg->state == MQTT_QUEUED_AWAITING_ACK)
+                msg->time_sent = MQTT_PAL_TIME() - bc.client.response_timeout - 1;
+        }
+        __mqtt_send(&bc.client);
+        bytes += peer_drain(&bc.peer);
+        if (bc.peer.acks_len != 8)
+            check_failed(name, "the message wasn't retransmitted");
+
+        // NOTE(cmo): One ack at a time, flushing (and cleaning) in between.
+        for (size_t a = 0; a < bc.peer.acks_len; a += 4)
+        {
+            send(bc.peer.fd, bc.peer.acks + a, 4, 0);
+            __mqtt_recv(&bc.client);
+            __mqtt_send(&bc.client);
+            if (bc.client.error != MQTT_OK)
+                check_failed(name, mqtt_error_str(bc.client.error));
+        }
+        bc.peer.acks_head = 0;
+        bc.peer.acks_len = 0;
+    }
+    mqtt_mq_clean(&bc.client.mq);
+    int64_t elapsed = now_ns() - start;
+    if (mqtt_mq_length(&bc.client.mq) != 0)
+        check_failed(name, "the exchange didn't complete");
+    report(name, 1, elapsed, bytes, g_syscalls - start_syscalls);
+    bench_client_close(&bc);
+}
+
+// NOTE(cmo): MQTT 5 doesn't allow a PUBLISH or PUBREL to be resent on the
+// connection it went out on [MQTT-4.4.0-1]. Timed out, they wait for the next
+// connection, and go out again right after its CONNECT.
+static void check_v5_resend_on_reconnect()
+{
+    const char* name = "v5_resend_on_reconnect";
+    BenchClient bc;
+    bench_client_open_version(&bc, 1 << 16, 1 << 16, false, MQTT_PROTOCOL_LEVEL_5);
+    struct mqtt_buffer_policy policy = {
+        .send_initial_size = 1 << 16,
+        .send_max_size = 1 << 16,
+        .recv_initial_size = 1 << 16,
+        .recv_max_size = 1 << 16,
+        .shrink_after = 1000,
+    };
+    mqtt_set_buffer_policy(&bc.client, &policy);
+    uint8_t payload[40] = {0};
+    int64_t bytes = 0;
+    int64_t start_syscalls = g_syscalls;
+    int64_t start = now_ns();
+
+    // NOTE(cmo): A QoS 1 PUBLISH waiting for its PUBACK, and the PUBREL of a
+    // QoS 2 one waiting for its PUBCOMP.
+    mqtt_publish(&bc.client, Topic, payload, sizeof(payload), MQTT_PUBLISH_QOS_1);
+    mqtt_publish(&bc.client, Topic, payload, sizeof(payload), MQTT_PUBLISH_QOS_2);
+    uint16_t qos1_id = mqtt_mq_get(&bc.client.mq, 1)->packet_id;
+    uint16_t qos2_id = mqtt_mq_get(&bc.client.mq, 2)->packet_id;
+    __mqtt_send(&bc.client);
+    bytes += peer_drain(&bc.peer);
+    uint8_t ack[4];
+    mqtt_pack_pubxxx_request(ack, sizeof(ack), MQTT_CONTROL_PUBREC, qos2_id);
+    send(bc.peer.fd, ack, sizeof(ack), 0);
+    __mqtt_recv(&bc.client);
+    __mqtt_send(&bc.client);
+    bytes += peer_drain(&bc.peer);
+
+    for (ssize_t i = 0; i < mqtt_mq_length(&bc.client.mq); ++i)
+    {
+        struct mqtt_queued_message* msg = mqtt_mq_get(&bc.client.mq, i);
+        if (msg->state == MQTT_QUEUED_AWAITING_ACK)
+            msg->time_sent = MQTT_PAL_TIME() - bc.client.response_timeout - 1;
+    }
+    __mqtt_send(&bc.client);
+    if (peer_drain(&bc.peer) != 0 || bc.client.number_of_timeouts != 0)
+        check_failed(name, "resent on the same connection");
+
+    // NOTE(cmo): Reconnect, keeping the queue.
+    bench_client_close_socket(&bc);
+    mqtt_reinit(&bc.client, bench_socket(&bc.peer, false), NULL, 0, NULL, 0);
+    mqtt_connect(&bc.client, "bench", NULL, NULL, 0, NULL, NULL, 0, 400);
+    __mqtt_send(&bc.client);
+    static const uint8_t connack_v5[] = {0x20, 0x03, 0x00, 0x00, 0x00};
+    send(bc.peer.fd, connack_v5, sizeof(connack_v5), 0);
+    __mqtt_recv(&bc.client);
+    __mqtt_send(&bc.client);
+    peer_read_raw(&bc.peer);
+    bytes += (int64_t)bc.peer.filled;
+
+    static const enum MQTTControlPacketType expected[] = {MQTT_CONTROL_CONNECT, MQTT_CONTROL_PUBLISH, MQTT_CONTROL_PUBREL};
+    size_t consumed = 0;
+    int num_packets = 0;
+    while (consumed < bc.peer.filled)
+    {
+        struct mqtt_response response;
+        ssize_t header_len = mqtt_unpack_fixed_header(&response, bc.peer.buf + consumed, bc.peer.filled - consumed);
+        if (header_len <= 0 || num_packets == 3 || response.fixed_header.control_type != expected[num_packets])
+            check_failed(name, "not resent after the CONNECT");
+        num_packets += 1;
+        consumed += header_len + response.fixed_header.remaining_length;
+    }
+    if (num_packets != 3)
+        check_failed(name, "not resent after the CONNECT");
+
+    mqtt_pack_pubxxx_request(ack, sizeof(ack), MQTT_CONTROL_PUBACK, qos1_id);
+    send(bc.peer.fd, ack, sizeof(ack), 0);
+    mqtt_pack_pubxxx_request(ack, sizeof(ack), MQTT_CONTROL_PUBCOMP, qos2_id);
+    send(bc.peer.fd, ack, sizeof(ack), 0);
+    __mqtt_recv(&bc.client);
+    mqtt_mq_clean(&bc.client.mq);
+    int64_t elapsed = now_ns() - start;
+    if (bc.client.error != MQTT_OK)
+        check_failed(name, mqtt_error_str(bc.client.error));
+    if (mqtt_mq_length(&bc.client.mq) != 0)
+        check_failed(name, "the exchanges didn't complete");
+    report(name, 1, elapsed, bytes, g_syscalls - start_syscalls);
+    bench_client_close(&bc);
+}
+
+// NOTE(cmo): Read what the client sent and list the QoS of each PUBLISH in it,
+// in order. Returns the number of PUBLISHes.
+static int peer_read_publish_qos(Peer* p, int* qos, int max_publishes)
+{
+    p->filled = 0;
+    peer_read_raw(p);
+    size_t consumed = 0;
+    int num_publishes = 0;
+    while (consumed < p->filled)
+    {
+        struct mqtt_response response;
+        ssize_t header_len = mqtt_unpack_fixed_header(&response, p->buf + consumed, p->filled - consumed);
+        if (header_len <= 0)
+            break;
+        if (response.fixed_header.control_type == MQTT_CONTROL_PUBLISH && num_publishes < max_publishes)
+            qos[num_publishes++] = (response.fixed_header.control_flags >> 1) & 0x3;
+        consumed += header_len + response.fixed_header.remaining_length;
+    }
+    p->filled = 0;
+    return num_publishes;
+}
+
+// NOTE(cmo): A PUBLISH held back by a full in-flight window holds back every
+// PUBLISH queued behind it, so a QoS 0 message can't overtake a QoS 1 one.
+static void check_window_order()
+{
+    const char* name = "window_holds_later_qos0";
+    BenchClient bc;
+    bench_client_open(&bc, 1 << 16, 1 << 16, false);
+    bc.client.max_inflight_qos1 = 1;
+    uint8_t payload[40] = {0};
+    int64_t start_syscalls = g_syscalls;
+    int64_t start = now_ns();
+
+    mqtt_publish(&bc.client, Topic, payload, sizeof(payload), MQTT_PUBLISH_QOS_1);
+    mqtt_publish(&bc.client, Topic, payload, sizeof(payload), MQTT_PUBLISH_QOS_1);
+    mqtt_publish(&bc.client, Topic, payload, sizeof(payload), MQTT_PUBLISH_QOS_0);
+    uint16_t first_id = mqtt_mq_get(&bc.client.mq, 1)->packet_id;
+    uint16_t second_id = mqtt_mq_get(&bc.client.mq, 2)->packet_id;
+    __mqtt_send(&bc.client);
+    int qos[4];
+    if (peer_read_publish_qos(&bc.peer, qos, 4) != 1 || qos[0] != 1)
+        check_failed(name, "a PUBLISH went out past one held by the window");
+
+    uint8_t ack[4];
+    mqtt_pack_pubxxx_request(ack, sizeof(ack), MQTT_CONTROL_PUBACK, first_id);
+    send(bc.peer.fd, ack, sizeof(ack), 0);
+    __mqtt_recv(&bc.client);
+    __mqtt_send(&bc.client);
+    if (peer_read_publish_qos(&bc.peer, qos, 4) != 2 || qos[0] != 1 || qos[1] != 0)
+        check_failed(name, "the held PUBLISHes didn't go out in order");
+
+    mqtt_pack_pubxxx_request(ack, sizeof(ack), MQTT_CONTROL_PUBACK, second_id);
+    send(bc.peer.fd, ack, sizeof(ack), 0);
+    __mqtt_recv(&bc.client);
+    mqtt_mq_clean(&bc.client.mq);
+    int64_t elapsed = now_ns() - start;
+    if (bc.client.error != MQTT_OK)
+        check_failed(name, mqtt_error_str(bc.client.error));
+    if (mqtt_mq_length(&bc.client.mq) != 0)
+        check_failed(name, "the exchanges didn't complete");
+    report(name, 1, elapsed, 0, g_syscalls - start_syscalls);
+    bench_client_close(&bc);
+}
+
+#if defined(MQTT_USE_IO_URING)
+// NOTE(cmo): For --uring-fallback: from here on io_uring_setup fails with
+// ENOSYS, as on a kernel without io_uring, so every handle opened takes the
+// plain socket calls.
+static void disable_io_uring()
+{
+    struct sock_filter filter[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_io_uring_setup, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | ENOSYS),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+    };
+    struct sock_fprog program = {
+        .len = sizeof(filter) / sizeof(filter[0]),
+        .filter = filter,
+    };
+    if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == -1
+        || prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &program) == -1)
+    {
+        perror("disable_io_uring");
+        exit(1);
+    }
+}
+#endif
+
+// NOTE(cmo): What the client's socket calls go through: the plain socket
+// calls, or an io_uring handle, which is probed here as it may fall back
+// (io_uring missing or disabled) without being asked to.
+static const char* socket_backend()
+{
+#if defined(MQTT_USE_IO_URING)
+    if (g_uring_fallback)
+    {
+        disable_io_uring();
+        return "io_uring_fallback";
+    }
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+    {
+        perror("socketpair");
+        exit(1);
+    }
+    struct mqtt_pal_uring* probe = mqtt_pal_uring_open(fds[0]);
+    int active = probe && mqtt_pal_uring_active(probe);
+    if (probe)
+        mqtt_pal_uring_close(probe);
+    close(fds[0]);
+    close(fds[1]);
+    if (!active)
+        fprintf(stderr, "io_uring isn't available here, the handles fell back to the plain socket calls\n");
+    return active ? "io_uring" : "io_uring_fallback";
+#else
+    return "sockets";
+#endif
+}
+
+int main(int argc, const char* argv[])
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc)
+            g_scale = atof(argv[++i]);
+#if defined(MQTT_USE_IO_URING)
+        else if (strcmp(argv[i], "--uring-fallback") == 0)
+            g_uring_fallback = true;
+#endif
+        else
+        {
+#if defined(MQTT_USE_IO_URING)
+            fprintf(stderr, "Usage: %s [--scale F] [--uring-fallback]\n", argv[0]);
+#else
+            fprintf(stderr, "Usage: %s [--scale F]\n", argv[0]);
+#endif
+            return 1;
+        }
+    }
+
+    const char* backend = socket_backend();
+    printf("{\n  \"benchmark\": \"mqtt\",\n  \"backend\": \"%s\",\n  \"results\": [\n", backend);
+
+    bench_pack_publish("pack_publish_qos0_40B", 40, MQTT_PUBLISH_QOS_0, iterations(5000000));
+    bench_pack_publish("pack_publish_qos1_16KiB", 16384, MQTT_PUBLISH_QOS_1, iterations(200000));
+
+    {
+        uint8_t packet[128];
+        uint8_t payload[40] = {0};
+        ssize_t len = mqtt_pack_publish_request(packet, sizeof(packet), Topic, 1234, payload, sizeof(payload), MQTT_PUBLISH_QOS_1);
+        bench_unpack("unpack_publish_qos1_40B", packet, (size_t)len, iterations(5000000));
+        len = mqtt_pack_pubxxx_request(packet, sizeof(packet), MQTT_CONTROL_PUBACK, 1234);
+        bench_unpack("unpack_puback", packet, (size_t)len, iterations(5000000));
+    }
+
+    static const int64_t depths[] = {1, 16, 256, 4096};
+    for (int i = 0; i < (int)(sizeof(depths) / sizeof(depths[0])); ++i)
+        bench_mq_fifo(depths[i], iterations(4000000 / depths[i] + 20000));
+    for (int i = 0; i < (int)(sizeof(depths) / sizeof(depths[0])); ++i)
+        bench_mq_find(depths[i], iterations(4000000 / depths[i] + 20000));
+
+    bench_send("send_qos0_burst4_40B", 4096, 40, MQTT_PUBLISH_QOS_0, PublishCopy, 4, iterations(250000));
+    bench_send("send_qos0_burst64_40B", 1 << 16, 40, MQTT_PUBLISH_QOS_0, PublishCopy, 64, iterations(20000));
+    bench_send("send_qos0_batch4_40B", 4096, 40, MQTT_PUBLISH_QOS_0, PublishBatch, 4, iterations(250000));
+    bench_send("send_qos0_batch64_40B", 1 << 16, 40, MQTT_PUBLISH_QOS_0, PublishBatch, 64, iterations(20000));
+    bench_send("send_qos1_acked64_40B", 1 << 16, 40, MQTT_PUBLISH_QOS_1, PublishCopy, 64, iterations(10000));
+    bench_send("send_qos0_64KiB", 1 << 20, 1 << 16, MQTT_PUBLISH_QOS_0, PublishCopy, 1, iterations(20000));
+    bench_send("send_qos0_64KiB_ref", 4096, 1 << 16, MQTT_PUBLISH_QOS_0, PublishRef, 1, iterations(20000));
+    bench_send("send_qos1_acked4_16KiB_ref", 4096, 1 << 14, MQTT_PUBLISH_QOS_1, PublishRef, 4, iterations(20000));
+
+    check_retransmit_short_write(false, false);
+    check_retransmit_short_write(true, false);
+    check_retransmit_short_write(false, true);
+    check_retransmit_short_write(true, true);
+    check_packet_too_large();
+    check_duplicate_acks(1);
+    check_duplicate_acks(2);
+    check_v5_resend_on_reconnect();
+    check_window_order();
+
+    bench_transport(false, iterations(100000));
+    bench_transport(true, iterations(100000));
+
+    // NOTE(cmo): Each run is sized to take roughly 0.2 s at the window's
+    // theoretical throughput (window / rtt, half that for QoS 2).
+    static const int64_t rtts_us[] = {0, 200, 1000};
+    static const int windows[] = {1, 16, 64, 256};
+    for (int r = 0; r < (int)(sizeof(rtts_us) / sizeof(rtts_us[0])); ++r)
+    {
+        bench_window(0, 0, rtts_us[r], iterations(200000));
+        for (int qos = 1; qos <= 2; ++qos)
+        {
+            for (int w = 0; w < (int)(sizeof(windows) / sizeof(windows[0])); ++w)
+            {
+                int64_t n = 200000;
+                if (rtts_us[r] && (int64_t)windows[w] * 200000 / (qos * rtts_us[r]) < n)
+                    n = (int64_t)windows[w] * 200000 / (qos * rtts_us[r]);
+                bench_window(qos, windows[w], rtts_us[r], iterations(n));
+            }
+        }
+    }
+
+    printf("\n  ]\n}\n");
+    return 0;
+}
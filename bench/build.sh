@@ -0,0 +1,15 @@
+#!/bin/bash
+
+# NOTE(cmo): Builds the benchmarks. Run from the bench directory.
+# bench_mqtt and bench_mqtt_uring (the client on the io_uring backend) count
+# the client's socket syscalls by wrapping the libc calls the PAL makes.
+
+BENCH_MQTT_WRAP="-Wl,--wrap=send,--wrap=sendmsg,--wrap=recv,--wrap=syscall"
+
+gcc -c -O2 -DMQTT_SINGLE_THREADED ../mqtt_pal.c ../mqtt.c
+gcc -c -O2 -DMQTT_SINGLE_THREADED -DMQTT_USE_IO_URING ../mqtt_pal.c -o mqtt_pal_uring.o
+gcc -c -O2 -DMQTT_SINGLE_THREADED -DMQTT_USE_IO_URING ../mqtt.c -o mqtt_uring.o
+gcc -O2 -Wall -std=c99 -DMQTT_SINGLE_THREADED ../magnetometer.c ../sample_ring.c ../sink.c ../daily_archive.c ../mag_archive.c ../mag_time.c ../calibrate.c mqtt_pal.o mqtt.o -DHRDL_TEST -DHRDL_TEST_UNTHROTTLED -DMAG_BENCH -g -o mag_bench -lrt -lpthread -lm
+gcc -O2 -Wall -std=c99 bench_e2e.c bench_broker.c mqtt_pal.o mqtt.o -g -o bench_e2e -lpthread
+gcc -O2 -Wall -std=c99 bench_mqtt.c mqtt_pal.o mqtt.o $BENCH_MQTT_WRAP -g -o bench_mqtt -lpthread
+gcc -O2 -Wall -std=c99 -DMQTT_USE_IO_URING bench_mqtt.c mqtt_pal_uring.o mqtt_uring.o $BENCH_MQTT_WRAP -g -o bench_mqtt_uring -lpthread
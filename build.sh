@@ -1,4 +1,9 @@
 #!/bin/bash
 
-gcc -c -O2 mqtt_pal.c mqtt.c
-gcc -O2 -Wall -std=c99 magnetometer.c mqtt_pal.o mqtt.o -g -o mag -lpicohrdl -L/opt/picoscope/lib
\ No newline at end of file
+gcc -c -O2 -DMQTT_SINGLE_THREADED mqtt_pal.c mqtt.c
+gcc -O2 -Wall -std=c99 -DMQTT_SINGLE_THREADED magnetometer.c sample_ring.c sink.c daily_archive.c mag_archive.c mag_time.c calibrate.c mqtt_pal.o mqtt.o -g -o mag -lpicohrdl -L/opt/picoscope/lib -lrt -lpthread -lm
+gcc -O2 -Wall -std=c99 multicast_recv.c -g -o mag_mcast_recv
+gcc -O2 -Wall -std=c99 magarc.c mag_archive.c daily_archive.c mag_time.c -g -o magarc -lm
+gcc -O2 -Wall -std=c99 mag_convert.c text_parse.c mag_archive.c mag_time.c -g -o mag_convert -lpthread
+gcc -O2 -Wall -std=c99 magscan.c text_parse.c daily_archive.c mag_time.c -g -o magscan -lpthread -lm
+gcc -O2 -Wall -std=c99 mag_recal.c calibrate.c mag_archive.c daily_archive.c mag_time.c -g -o mag_recal -lpthread -lm
\ No newline at end of file
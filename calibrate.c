@@ -0,0 +1,237 @@
+#define _POSIX_C_SOURCE 200809L
+#include "calibrate.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char* CalibrationLogName = "calibrations.txt";
+
+// NOTE(cmo): Based on Sean Leavey's code, based on Hugh Potts' code.
+const Calibration CurrentCalibration = {
+    .version = 1,
+    .r_wires = 2.48,
+    .r_in = 10000.0,
+    .pot_divider = 3.01 / (6.98 + 3.01),
+    .b_scale = 1e6 / 143.0,
+    // NOTE(cmo): LM35, 10 mV / deg C
+    .temp_scale = 100.0,
+};
+
+void calibrate_one_reading(const int32_t* data, int32_t n_channels, const Calibration* cal, double* result)
+{
+    assert(n_channels == 4 &&  "Calibration assumed 4 channels");
+
+    // Scale counts to Voltage
+    for (int i = 0; i < n_channels; ++i)
+        result[i] = (double)data[i] * cal->counts_to_volts[i];
+
+    // Scale the voltages to nanotesla.
+    // Need to take into account the voltage drop in the wires and crosstalk between the channels
+    // v_true = v_measured * (1 + r_wires / r_in) + sum(v_measured) * r_wires / r_in
+
+    // scale z-channel to its correct value.
+    result[2] /= cal->pot_divider;
+
+    double total_voltage = 0.0;
+    for (int i = 0; i < n_channels; ++i)
+        total_voltage += result[i];
+
+    double total_voltage_corr = total_voltage * cal->r_wires / cal->r_in;
+    for (int i = 0; i < n_channels; ++i)
+    {
+        result[i] *= (1.0 + cal->r_wires / cal->r_in);
+        result[i] += total_voltage_corr;
+    }
+
+    // unit conversion
+    for (int i = 0; i < 3; ++i)
+        result[i] *= cal->b_scale;
+    result[3] *= cal->temp_scale;
+}
+
+void calibrate_data(const int32_t* data, int32_t n_samples, int32_t n_channels, const Calibration* cal, double* result)
+{
+    // NOTE(cmo): Same TU as calibrate_one_reading so it's inlined, and the
+    // loop over samples is left to the compiler to vectorise.
+    for (int i = 0; i < n_samples; ++i)
+        calibrate_one_reading(&data[i * n_channels], n_channels, cal, &result[i * n_channels]);
+}
+
+typedef struct CalibrationField
+{
+    const char* name;
+    size_t offset;
+} CalibrationField;
+
+static const CalibrationField DoubleFields[] = {
+    { "r_wires", offsetof(Calibration, r_wires) },
+    { "r_in", offsetof(Calibration, r_in) },
+    { "pot_divider", offsetof(Calibration, pot_divider) },
+    { "b_scale", offsetof(Calibration, b_scale) },
+    { "temp_scale", offsetof(Calibration, temp_scale) },
+};
+static const int NumDoubleFields = sizeof(DoubleFields) / sizeof(DoubleFields[0]);
+
+int calibration_format(char* buf, size_t len, int64_t from, const Calibration* cal)
+{
+    int n = snprintf(buf, len, "from=%lld version=%lld counts_to_volts=%.17g,%.17g,%.17g,%.17g",
+                     (long long)from, (long long)cal->version,
+                     cal->counts_to_volts[0], cal->counts_to_volts[1],
+                     cal->counts_to_volts[2], cal->counts_to_volts[3]);
+    for (int i = 0; i < NumDoubleFields && n >= 0 && (size_t)n < len; ++i)
+    {
+        double value;
+        memcpy(&value, (const char*)cal + DoubleFields[i].offset, sizeof(value));
+        n += snprintf(buf + n, len - n, " %s=%.17g", DoubleFields[i].name, value);
+    }
+    return n;
+}
+
+bool calibration_parse(const char* line, int64_t* from, Calibration* cal)
+{
+    const char* p = line;
+    while (true)
+    {
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == '\0' || *p == '\n' || *p == '#')
+            return true;
+
+        const char* eq = strchr(p, '=');
+        if (!eq)
+            return false;
+        size_t key_len = eq - p;
+        const char* value = eq + 1;
+        char* end;
+        bool known = false;
+        if (key_len == 4 && strncmp(p, "from", 4) == 0)
+        {
+            *from = strtoll(value, &end, 10);
+            known = true;
+        }
+        else if (key_len == 7 && strncmp(p, "version", 7) == 0)
+        {
+            cal->version = strtoll(value, &end, 10);
+            known = true;
+        }
+        else if (key_len == 15 && strncmp(p, "counts_to_volts", 15) == 0)
+        {
+            end = (char*)value;
+            for (int i = 0; i < 4; ++i)
+            {
+                const char* start = end + (i > 0);
+                if (i > 0 && *end != ',')
+                    return false;
+                cal->counts_to_volts[i] = strtod(start, &end);
+                if (end == start)
+                    return false;
+            }
+            known = true;
+        }
+        else
+        {
+            for (int i = 0; i < NumDoubleFields; ++i)
+            {
+                if (strlen(DoubleFields[i].name) == key_len && strncmp(p, DoubleFields[i].name, key_len) == 0)
+                {
+                    double x = strtod(value, &end);
+                    memcpy((char*)cal + DoubleFields[i].offset, &x, sizeof(x));
+                    known = true;
+                }
+            }
+        }
+        if (!known || end == value || (*end != ' ' && *end != '\t' && *end != '\n' && *end != '\0'))
+            return false;
+        p = end;
+    }
+}
+
+bool calibration_equal(const Calibration* a, const Calibration* b)
+{
+    if (a->version != b->version)
+        return false;
+    for (int i = 0; i < 4; ++i)
+    {
+        if (a->counts_to_volts[i] != b->counts_to_volts[i])
+            return false;
+    }
+    for (int i = 0; i < NumDoubleFields; ++i)
+    {
+        double x;
+        double y;
+        memcpy(&x, (const char*)a + DoubleFields[i].offset, sizeof(x));
+        memcpy(&y, (const char*)b + DoubleFields[i].offset, sizeof(y));
+        if (x != y)
+            return false;
+    }
+    return true;
+}
+
+int32_t calibration_log_read(const char* dir, CalibrationRecord** records)
+{
+    *records = NULL;
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, CalibrationLogName);
+    FILE* f = fopen(path, "r");
+    if (!f)
+        return 0;
+
+    int32_t count = 0;
+    int32_t capacity = 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), f))
+    {
+        CalibrationRecord record = { .from = INT64_MIN };
+        if (line[strspn(line, " \t\n")] == '\0' || line[strspn(line, " \t")] == '#')
+            continue;
+        if (!calibration_parse(line, &record.from, &record.calibration) || record.from == INT64_MIN)
+        {
+            fprintf(stderr, "%s: can't parse record %d: %s", path, count + 1, line);
+            count = -1;
+            break;
+        }
+        if (count == capacity)
+        {
+            capacity = capacity ? 2 * capacity : 16;
+            *records = realloc(*records, capacity * sizeof(CalibrationRecord));
+        }
+        (*records)[count++] = record;
+    }
+    fclose(f);
+    if (count < 0)
+    {
+        free(*records);
+        *records = NULL;
+    }
+    return count;
+}
+
+bool calibration_log_append(const char* dir, int64_t from, const Calibration* cal)
+{
+    CalibrationRecord* records;
+    int32_t count = calibration_log_read(dir, &records);
+    bool unchanged = count > 0 && calibration_equal(&records[count - 1].calibration, cal);
+    free(records);
+    if (unchanged)
+        return true;
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, CalibrationLogName);
+    char line[1024];
+    int len = calibration_format(line, sizeof(line) - 1, from, cal);
+    line[len++] = '\n';
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        perror(path);
+        return false;
+    }
+    bool ok = write(fd, line, len) == len && fsync(fd) == 0;
+    if (!ok)
+        perror(path);
+    close(fd);
+    return ok;
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// NOTE(cmo): Turning the datalogger's ADC counts into nanotesla and degrees,
+// shared by the daemon and mag_recal so that reprocessed history goes through
+// exactly the same arithmetic as the live data.
+//
+// Everything the result depends on is in a Calibration, and the daemon logs
+// the one it's using to <raw archive dir>/calibrations.txt whenever it
+// changes, one record per line:
+//   from=<ms since epoch> version=<n> counts_to_volts=<a>,<b>,<c>,<d>
+//   r_wires=<ohm> r_in=<ohm> pot_divider=<ratio> b_scale=<nT/V>
+//   temp_scale=<degC/V>
+// (all on one line, values printed so they read back exactly). A record
+// applies to raw samples from its `from` until the next record's.
+//
+// Bump CurrentCalibration's version whenever its constants change.
+
+typedef struct Calibration
+{
+    int64_t version;
+    // NOTE(cmo): Volts per count, from the device's range.
+    double counts_to_volts[4];
+    // NOTE(cmo): Resistance of the wires.
+    double r_wires;
+    // NOTE(cmo): Input resistance.
+    double r_in;
+    // NOTE(cmo): Potential divider on the up-down field.
+    double pot_divider;
+    // NOTE(cmo): Nanotesla per volt.
+    double b_scale;
+    // NOTE(cmo): Temperature sensor degrees per volt.
+    double temp_scale;
+} Calibration;
+
+typedef struct CalibrationRecord
+{
+    int64_t from;
+    Calibration calibration;
+} CalibrationRecord;
+
+// NOTE(cmo): The constants in use, with counts_to_volts still to be filled in
+// from the device.
+extern const Calibration CurrentCalibration;
+
+void calibrate_one_reading(const int32_t* data, int32_t n_channels, const Calibration* cal, double* result);
+void calibrate_data(const int32_t* data, int32_t n_samples, int32_t n_channels, const Calibration* cal, double* result);
+
+// NOTE(cmo): One line of calibrations.txt (without the newline) into buf, or
+// back. Parsing starts from *cal, so a partial line (e.g. "r_wires=2.5")
+// just overrides those fields; from is left alone if absent.
+int calibration_format(char* buf, size_t len, int64_t from, const Calibration* cal);
+bool calibration_parse(const char* line, int64_t* from, Calibration* cal);
+bool calibration_equal(const Calibration* a, const Calibration* b);
+
+// NOTE(cmo): Reads every record in <dir>/calibrations.txt, in order. Returns
+// the count (0 if there's no file) or -1 if a line doesn't parse; *records
+// is malloced.
+int32_t calibration_log_read(const char* dir, CalibrationRecord** records);
+// NOTE(cmo): Appends a record starting at from, unless cal is what the last
+// record already says.
+bool calibration_log_append(const char* dir, int64_t from, const Calibration* cal);
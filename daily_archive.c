@@ -0,0 +1,270 @@
+#define _POSIX_C_SOURCE 200809L
+#include "daily_archive.h"
+#include "mag_time.h"
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// NOTE(cmo): Longest possible line: 8 digits of ms, 4 values of at most 24
+// characters, separators and newline.
+static const size_t ArchiveLineMax = 128;
+
+int format_python_float(char* buf, double x)
+{
+    if (isnan(x))
+        return sprintf(buf, "nan");
+    if (isinf(x))
+        return sprintf(buf, x < 0 ? "-inf" : "inf");
+
+    // NOTE(cmo): Find the fewest significant digits that read back as x (17
+    // always do). Having enough digits is monotonic, so count down until it
+    // stops working; nearly all of our readings need 16 or 17. The correctly
+    // rounded string with that many digits is the one Python picks.
+    char sci[32];
+    char attempt[32];
+    snprintf(sci, sizeof(sci), "%.16e", x);
+    for (int precision = 15; precision >= 0; --precision)
+    {
+        snprintf(attempt, sizeof(attempt), "%.*e", precision, x);
+        if (strtod(attempt, NULL) != x)
+            break;
+        memcpy(sci, attempt, sizeof(sci));
+    }
+
+    const char* p = sci;
+    char* out = buf;
+    if (*p == '-')
+    {
+        *out++ = '-';
+        p++;
+    }
+    char digits[20];
+    int n_digits = 0;
+    for (; *p != 'e'; ++p)
+    {
+        if (*p != '.')
+            digits[n_digits++] = *p;
+    }
+    while (n_digits > 1 && digits[n_digits - 1] == '0')
+        n_digits--;
+    // NOTE(cmo): Position of the decimal point relative to the digits, as in
+    // Python's format_float_short.
+    int decpt = atoi(p + 1) + 1;
+
+    if (decpt > -4 && decpt <= 16)
+    {
+        if (decpt <= 0)
+        {
+            *out++ = '0';
+            *out++ = '.';
+            for (int i = 0; i < -decpt; ++i)
+                *out++ = '0';
+            memcpy(out, digits, n_digits);
+            out += n_digits;
+        }
+        else if (decpt < n_digits)
+        {
+            memcpy(out, digits, decpt);
+            out += decpt;
+            *out++ = '.';
+            memcpy(out, digits + decpt, n_digits - decpt);
+            out += n_digits - decpt;
+        }
+        else
+        {
+            memcpy(out, digits, n_digits);
+            out += n_digits;
+            for (int i = n_digits; i < decpt; ++i)
+                *out++ = '0';
+            *out++ = '.';
+            *out++ = '0';
+        }
+        *out = '\0';
+    }
+    else
+    {
+        *out++ = digits[0];
+        if (n_digits > 1)
+        {
+            *out++ = '.';
+            memcpy(out, digits + 1, n_digits - 1);
+            out += n_digits - 1;
+        }
+        int exponent = decpt - 1;
+        out += sprintf(out, "e%c%02d", exponent < 0 ? '-' : '+', abs(exponent));
+    }
+    return (int)(out - buf);
+}
+
+static void daily_archive_sync(DailyArchive* archive)
+{
+    if (archive->fd != -1 && archive->dirty)
+        fdatasync(archive->fd);
+    archive->dirty = false;
+    archive->last_fsync = monotonic_millis();
+}
+
+static void daily_archive_close_day(DailyArchive* archive)
+{
+    if (archive->fd == -1)
+        return;
+    if (archive->fsync_policy != ARCHIVE_FSYNC_NEVER)
+        daily_archive_sync(archive);
+    close(archive->fd);
+    archive->fd = -1;
+    archive->day = INT64_MIN;
+}
+
+static bool daily_archive_open_day(DailyArchive* archive, int64_t day)
+{
+    time_t midnight = (time_t)(day * (MillisPerDay / 1000));
+    struct tm date;
+    gmtime_r(&midnight, &date);
+    char name[32];
+    strftime(name, sizeof(name), "%Y-%m-%d.txt", &date);
+
+    int fd = openat(archive->dir_fd, name, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        perror(name);
+        return false;
+    }
+
+    // NOTE(cmo): If we died part way through a write, drop the partial line
+    // rather than gluing the next one onto it.
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size > 0)
+    {
+        char tail[ArchiveLineMax * 2];
+        off_t start = size > (off_t)sizeof(tail) ? size - (off_t)sizeof(tail) : 0;
+        ssize_t n = pread(fd, tail, size - start, start);
+        if (n > 0 && tail[n - 1] != '\n')
+        {
+            off_t keep = start;
+            for (ssize_t i = n - 1; i >= 0; --i)
+            {
+                if (tail[i] == '\n')
+                {
+                    keep = start + i + 1;
+                    break;
+                }
+            }
+            fprintf(stderr, "Trimming partial line from end of %s\n", name);
+            if (ftruncate(fd, keep) == -1)
+                perror(name);
+        }
+    }
+
+    // NOTE(cmo): Make sure the new file's directory entry is on disk too.
+    if (archive->fsync_policy != ARCHIVE_FSYNC_NEVER)
+        fsync(archive->dir_fd);
+
+    archive->fd = fd;
+    archive->day = day;
+    return true;
+}
+
+bool daily_archive_open(DailyArchive* archive, const char* dir, ArchiveFsyncPolicy fsync_policy, int64_t fsync_interval)
+{
+    memset(archive, 0, sizeof(*archive));
+    archive->fd = -1;
+    archive->day = INT64_MIN;
+    archive->fsync_policy = fsync_policy;
+    archive->fsync_interval = fsync_interval;
+    archive->last_fsync = monotonic_millis();
+    archive->dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (archive->dir_fd == -1)
+    {
+        perror(dir);
+        return false;
+    }
+    return true;
+}
+
+int32_t daily_archive_append(DailyArchive* archive, const MagnetometerMessage* samples, int32_t n_samples)
+{
+    size_t needed = n_samples * ArchiveLineMax;
+    if (archive->buf_cap < needed)
+    {
+        char* buf = realloc(archive->buf, needed);
+        if (!buf)
+            return n_samples;
+        archive->buf = buf;
+        archive->buf_cap = needed;
+    }
+
+    int32_t failed = 0;
+    int32_t start = 0;
+    while (start < n_samples)
+    {
+        // NOTE(cmo): The run of samples from the same UT day.
+        int64_t day = floor_div(samples[start].timestamp, MillisPerDay);
+        int32_t end = start + 1;
+        while (end < n_samples && floor_div(samples[end].timestamp, MillisPerDay) == day)
+            end += 1;
+
+        if (day != archive->day)
+        {
+            daily_archive_close_day(archive);
+            if (!daily_archive_open_day(archive, day))
+            {
+                failed += end - start;
+                start = end;
+                continue;
+            }
+        }
+
+        int64_t midnight = day * MillisPerDay;
+        char* out = archive->buf;
+        for (int32_t i = start; i < end; ++i)
+        {
+            out += sprintf(out, "%lld", (long long)(samples[i].timestamp - midnight));
+            for (int j = 0; j < 4; ++j)
+            {
+                *out++ = ' ';
+                out += format_python_float(out, samples[i].data[j]);
+            }
+            *out++ = '\n';
+        }
+
+        size_t len = out - archive->buf;
+        archive->dirty = true;
+        if (write(archive->fd, archive->buf, len) != (ssize_t)len)
+        {
+            // NOTE(cmo): Reopening trims whatever part of this made it out.
+            perror("daily archive write");
+            failed += end - start;
+            daily_archive_close_day(archive);
+        }
+        start = end;
+    }
+
+    if (archive->fsync_policy == ARCHIVE_FSYNC_ALWAYS
+        || (archive->fsync_policy == ARCHIVE_FSYNC_INTERVAL
+            && monotonic_millis() - archive->last_fsync >= archive->fsync_interval))
+    {
+        daily_archive_sync(archive);
+    }
+    return failed;
+}
+
+void daily_archive_flush(DailyArchive* archive)
+{
+    if (archive->fsync_policy != ARCHIVE_FSYNC_NEVER)
+        daily_archive_sync(archive);
+}
+
+void daily_archive_close(DailyArchive* archive)
+{
+    daily_archive_close_day(archive);
+    if (archive->dir_fd != -1)
+        close(archive->dir_fd);
+    archive->dir_fd = -1;
+    free(archive->buf);
+    archive->buf = NULL;
+    archive->buf_cap = 0;
+}
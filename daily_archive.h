@@ -0,0 +1,54 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "sink.h"
+
+// NOTE(cmo): Writes the canonical daily text archive, <dir>/YYYY-MM-DD.txt,
+// one line per sample:
+//   <ms since UT midnight> <east-west> <north-south> <up-down> <temperature>
+// with the values printed as Python's repr would print them, i.e. byte for
+// byte what MagSample.text_repr in PrintMessagesInflux.py produces.
+//
+// Each sample goes in the file for the UT day of its own timestamp, so a
+// block straddling midnight is split between the two files. Each call
+// appends whole lines with one write to an O_APPEND descriptor that stays
+// open for the day. A line cut short by a crash is trimmed off when the file
+// is next opened.
+
+typedef enum ArchiveFsyncPolicy
+{
+    // NOTE(cmo): Leave it to the kernel.
+    ARCHIVE_FSYNC_NEVER,
+    // NOTE(cmo): When a day's file is finished, and on flush.
+    ARCHIVE_FSYNC_DAILY,
+    // NOTE(cmo): At most every fsync_interval ms, plus DAILY.
+    ARCHIVE_FSYNC_INTERVAL,
+    // NOTE(cmo): After every append.
+    ARCHIVE_FSYNC_ALWAYS,
+} ArchiveFsyncPolicy;
+
+typedef struct DailyArchive
+{
+    int dir_fd;
+    int fd;
+    int64_t day; // days since unix epoch of the open file
+    ArchiveFsyncPolicy fsync_policy;
+    int64_t fsync_interval;
+    int64_t last_fsync;
+    bool dirty;
+    char* buf;
+    size_t buf_cap;
+} DailyArchive;
+
+bool daily_archive_open(DailyArchive* archive, const char* dir, ArchiveFsyncPolicy fsync_policy, int64_t fsync_interval);
+// NOTE(cmo): Returns the number of samples that couldn't be written.
+int32_t daily_archive_append(DailyArchive* archive, const MagnetometerMessage* samples, int32_t n_samples);
+// NOTE(cmo): Gets everything appended so far onto disk (unless the policy is
+// ARCHIVE_FSYNC_NEVER).
+void daily_archive_flush(DailyArchive* archive);
+void daily_archive_close(DailyArchive* archive);
+
+// NOTE(cmo): Formats x the way Python's repr(float) does (the shortest string
+// that reads back as x), into buf, which needs 32 bytes. Returns the length.
+int format_python_float(char* buf, double x);
@@ -4,6 +4,7 @@
 
 cp mag /usr/local/bin/.
 cp PrintMessagesInflux.py /usr/local/bin/.
+cp Pyramid.py /usr/local/bin/.
 
 cp magnetometer.service /etc/systemd/system/.
 cp magnetometer_message_server.service /etc/systemd/system/.
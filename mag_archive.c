@@ -0,0 +1,653 @@
+#define _POSIX_C_SOURCE 200809L
+#include "mag_archive.h"
+#include "mag_time.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// NOTE(cmo): Worst case compressed size of a sample: a 68 bit timestamp and
+// 4 x 78 bit values, rounded up.
+static const size_t MaxBytesPerSample = 48;
+
+uint32_t mag_archive_crc32(const uint8_t* data, size_t len)
+{
+    // NOTE(cmo): CRC-32 (as zlib), a nibble at a time.
+    static const uint32_t Table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+        0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+        0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+    };
+    uint32_t crc = 0xffffffffu;
+    for (size_t i = 0; i < len; ++i)
+    {
+        crc ^= data[i];
+        crc = (crc >> 4) ^ Table[crc & 0xf];
+        crc = (crc >> 4) ^ Table[crc & 0xf];
+    }
+    return crc ^ 0xffffffffu;
+}
+
+void mag_archive_file_name(char* buf, size_t len, int64_t day)
+{
+    time_t midnight = (time_t)(day * (MillisPerDay / 1000));
+    struct tm date;
+    gmtime_r(&midnight, &date);
+    strftime(buf, len, "%Y-%m-%d.mag", &date);
+}
+
+// NOTE(cmo): Bit streams, most significant bit first.
+typedef struct BitWriter
+{
+    uint8_t* out;
+    size_t len;
+    uint64_t acc;
+    int n_acc;
+} BitWriter;
+
+static void bits_put(BitWriter* w, uint64_t value, int n)
+{
+    if (n > 32)
+    {
+        bits_put(w, value >> 32, n - 32);
+        n = 32;
+    }
+    w->acc = (w->acc << n) | (value & ((1ull << n) - 1));
+    w->n_acc += n;
+    while (w->n_acc >= 8)
+    {
+        w->n_acc -= 8;
+        w->out[w->len++] = (uint8_t)(w->acc >> w->n_acc);
+    }
+}
+
+static void bits_finish(BitWriter* w)
+{
+    if (w->n_acc > 0)
+        w->out[w->len++] = (uint8_t)(w->acc << (8 - w->n_acc));
+    w->n_acc = 0;
+}
+
+typedef struct BitReader
+{
+    const uint8_t* in;
+    size_t len;
+    size_t pos;
+    uint64_t acc;
+    int n_acc;
+    bool overrun;
+} BitReader;
+
+static uint64_t bits_get(BitReader* r, int n)
+{
+    if (n > 32)
+    {
+        uint64_t high = bits_get(r, n - 32);
+        return (high << 32) | bits_get(r, 32);
+    }
+    while (r->n_acc < n)
+    {
+        uint8_t byte = 0;
+        if (r->pos < r->len)
+            byte = r->in[r->pos++];
+        else
+            r->overrun = true;
+        r->acc = (r->acc << 8) | byte;
+        r->n_acc += 8;
+    }
+    r->n_acc -= n;
+    return (r->acc >> r->n_acc) & ((1ull << n) - 1);
+}
+
+static uint64_t double_bits(double x)
+{
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    return bits;
+}
+
+static double bits_double(uint64_t bits)
+{
+    double x;
+    memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+static size_t encode_block(uint8_t* out, const MagnetometerMessage* samples, uint32_t n)
+{
+    BitWriter w = { .out = out };
+
+    // NOTE(cmo): Timestamps, as the zigzagged change in the gap between
+    // samples. The first is in the block header.
+    int64_t prev_delta = 0;
+    for (uint32_t i = 1; i < n; ++i)
+    {
+        int64_t delta = samples[i].timestamp - samples[i - 1].timestamp;
+        int64_t dd = delta - prev_delta;
+        uint64_t z = ((uint64_t)dd << 1) ^ (uint64_t)(dd >> 63);
+        prev_delta = delta;
+        if (z == 0)
+            bits_put(&w, 0x0, 1);
+        else if (z < (1u << 7))
+            bits_put(&w, (0x2ull << 7) | z, 2 + 7);
+        else if (z < (1u << 9))
+            bits_put(&w, (0x6ull << 9) | z, 3 + 9);
+        else if (z < (1u << 12))
+            bits_put(&w, (0xeull << 12) | z, 4 + 12);
+        else
+        {
+            bits_put(&w, 0xf, 4);
+            bits_put(&w, z, 64);
+        }
+    }
+
+    // NOTE(cmo): Each channel, as the XOR with the previous value: '0' if
+    // it's unchanged, '10' and the meaningful bits if they fit in the
+    // previous window of leading/trailing zeros, else '11', 5 bits of
+    // leading zeros, 6 bits of length - 1, and the meaningful bits.
+    for (int c = 0; c < MAG_ARCHIVE_NUM_CHANNELS; ++c)
+    {
+        uint64_t prev = double_bits(samples[0].data[c]);
+        bits_put(&w, prev, 64);
+        int prev_lead = -1;
+        int prev_trail = 0;
+        for (uint32_t i = 1; i < n; ++i)
+        {
+            uint64_t value = double_bits(samples[i].data[c]);
+            uint64_t x = value ^ prev;
+            prev = value;
+            if (x == 0)
+            {
+                bits_put(&w, 0x0, 1);
+                continue;
+            }
+
+            int lead = __builtin_clzll(x);
+            int trail = __builtin_ctzll(x);
+            if (lead > 31)
+                lead = 31;
+            if (prev_lead >= 0 && lead >= prev_lead && trail >= prev_trail)
+            {
+                bits_put(&w, 0x2, 2);
+                bits_put(&w, x >> prev_trail, 64 - prev_lead - prev_trail);
+            }
+            else
+            {
+                int significant = 64 - lead - trail;
+                bits_put(&w, 0x3, 2);
+                bits_put(&w, lead, 5);
+                bits_put(&w, significant - 1, 6);
+                bits_put(&w, x >> trail, significant);
+                prev_lead = lead;
+                prev_trail = trail;
+            }
+        }
+    }
+    bits_finish(&w);
+    return w.len;
+}
+
+static bool decode_block(const MagArchiveBlockHeader* header, const uint8_t* payload, MagnetometerMessage* out)
+{
+    uint32_t n = header->num_samples;
+    BitReader r = { .in = payload, .len = header->payload_size };
+
+    out[0].timestamp = header->first_timestamp;
+    int64_t prev_delta = 0;
+    for (uint32_t i = 1; i < n; ++i)
+    {
+        uint64_t z;
+        if (bits_get(&r, 1) == 0)
+            z = 0;
+        else if (bits_get(&r, 1) == 0)
+            z = bits_get(&r, 7);
+        else if (bits_get(&r, 1) == 0)
+            z = bits_get(&r, 9);
+        else if (bits_get(&r, 1) == 0)
+            z = bits_get(&r, 12);
+        else
+            z = bits_get(&r, 64);
+        int64_t dd = (int64_t)(z >> 1) ^ -(int64_t)(z & 1);
+        prev_delta += dd;
+        out[i].timestamp = out[i - 1].timestamp + prev_delta;
+    }
+
+    for (int c = 0; c < MAG_ARCHIVE_NUM_CHANNELS; ++c)
+    {
+        uint64_t prev = bits_get(&r, 64);
+        out[0].data[c] = bits_double(prev);
+        int prev_lead = 0;
+        int prev_trail = 0;
+        for (uint32_t i = 1; i < n; ++i)
+        {
+            if (bits_get(&r, 1) == 1)
+            {
+                if (bits_get(&r, 1) == 1)
+                {
+                    prev_lead = (int)bits_get(&r, 5);
+                    int significant = (int)bits_get(&r, 6) + 1;
+                    prev_trail = 64 - prev_lead - significant;
+                    if (prev_trail < 0)
+                        return false;
+                }
+                prev ^= bits_get(&r, 64 - prev_lead - prev_trail) << prev_trail;
+            }
+            out[i].data[c] = bits_double(prev);
+        }
+    }
+    return !r.overrun && out[n - 1].timestamp == header->last_timestamp;
+}
+
+static bool index_push(MagArchiveIndex* index, const MagArchiveIndexEntry* entry)
+{
+    if (index->num_blocks == index->capacity)
+    {
+        uint64_t capacity = index->capacity ? 2 * index->capacity : 64;
+        MagArchiveIndexEntry* entries = realloc(index->entries, capacity * sizeof(MagArchiveIndexEntry));
+        if (!entries)
+            return false;
+        index->entries = entries;
+        index->capacity = capacity;
+    }
+    index->entries[index->num_blocks++] = *entry;
+    return true;
+}
+
+static bool read_exact(int fd, void* buf, size_t len, uint64_t offset)
+{
+    return pread(fd, buf, len, (off_t)offset) == (ssize_t)len;
+}
+
+// NOTE(cmo): Fills index from the footer if it's intact, else by scanning the
+// blocks.
+static void load_index(int fd, uint64_t file_size, MagArchiveIndex* index)
+{
+    memset(index, 0, sizeof(*index));
+    index->data_end = sizeof(MagArchiveFileHeader);
+
+    MagArchiveFooter footer;
+    if (file_size >= sizeof(MagArchiveFileHeader) + sizeof(footer)
+        && read_exact(fd, &footer, sizeof(footer), file_size - sizeof(footer))
+        && memcmp(footer.magic, MAG_ARCHIVE_FOOTER_MAGIC, sizeof(footer.magic)) == 0
+        && footer.index_offset >= sizeof(MagArchiveFileHeader)
+        && footer.num_blocks <= file_size / sizeof(MagArchiveIndexEntry)
+        && footer.index_offset + footer.num_blocks * sizeof(MagArchiveIndexEntry) + sizeof(footer) == file_size)
+    {
+        size_t len = footer.num_blocks * sizeof(MagArchiveIndexEntry);
+        MagArchiveIndexEntry* entries = malloc(len ? len : 1);
+        if (entries && read_exact(fd, entries, len, footer.index_offset)
+            && mag_archive_crc32((const uint8_t*)entries, len) == footer.crc)
+        {
+            index->entries = entries;
+            index->num_blocks = footer.num_blocks;
+            index->capacity = footer.num_blocks;
+            index->data_end = footer.index_offset;
+            return;
+        }
+        free(entries);
+    }
+
+    index->recovered = true;
+    uint64_t offset = sizeof(MagArchiveFileHeader);
+    uint8_t* payload = NULL;
+    size_t payload_cap = 0;
+    while (offset + sizeof(MagArchiveBlockHeader) <= file_size)
+    {
+        MagArchiveBlockHeader header;
+        if (!read_exact(fd, &header, sizeof(header), offset)
+            || header.magic != MAG_ARCHIVE_BLOCK_MAGIC
+            || header.num_samples == 0
+            || offset + sizeof(header) + header.payload_size > file_size)
+            break;
+        if (payload_cap < header.payload_size)
+        {
+            uint8_t* grown = realloc(payload, header.payload_size);
+            if (!grown)
+                break;
+            payload = grown;
+            payload_cap = header.payload_size;
+        }
+        if (!read_exact(fd, payload, header.payload_size, offset + sizeof(header))
+            || mag_archive_crc32(payload, header.payload_size) != header.crc)
+            break;
+
+        MagArchiveIndexEntry entry = {
+            .first_timestamp = header.first_timestamp,
+            .last_timestamp = header.last_timestamp,
+            .offset = offset,
+            .num_samples = header.num_samples,
+        };
+        if (!index_push(index, &entry))
+            break;
+        offset += sizeof(header) + header.payload_size;
+        index->data_end = offset;
+    }
+    free(payload);
+}
+
+static bool header_ok(const MagArchiveFileHeader* header)
+{
+    return memcmp(header->magic, MAG_ARCHIVE_MAGIC, sizeof(header->magic)) == 0
+        && header->version == MAG_ARCHIVE_VERSION
+        && header->num_channels == MAG_ARCHIVE_NUM_CHANNELS
+        && header->block_samples > 0;
+}
+
+static bool writer_write_block(MagArchiveWriter* writer)
+{
+    uint32_t n = writer->num_pending;
+    if (n == 0)
+        return true;
+    writer->num_pending = 0;
+    writer->last_flush = monotonic_millis();
+
+    MagArchiveBlockHeader* header = (MagArchiveBlockHeader*)writer->scratch;
+    uint8_t* payload = writer->scratch + sizeof(MagArchiveBlockHeader);
+    size_t payload_size = encode_block(payload, writer->pending, n);
+    header->magic = MAG_ARCHIVE_BLOCK_MAGIC;
+    header->payload_size = (uint32_t)payload_size;
+    header->num_samples = n;
+    header->crc = mag_archive_crc32(payload, payload_size);
+    header->first_timestamp = writer->pending[0].timestamp;
+    header->last_timestamp = writer->pending[n - 1].timestamp;
+
+    size_t len = sizeof(MagArchiveBlockHeader) + payload_size;
+    uint64_t offset = writer->index.data_end;
+    if (pwrite(writer->fd, writer->scratch, len, (off_t)offset) != (ssize_t)len)
+    {
+        perror("binary archive write");
+        return false;
+    }
+    MagArchiveIndexEntry entry = {
+        .first_timestamp = header->first_timestamp,
+        .last_timestamp = header->last_timestamp,
+        .offset = offset,
+        .num_samples = n,
+    };
+    index_push(&writer->index, &entry);
+    writer->index.data_end = offset + len;
+    return true;
+}
+
+static void writer_close_day(MagArchiveWriter* writer)
+{
+    if (writer->fd == -1)
+        return;
+    writer_write_block(writer);
+
+    MagArchiveIndex* index = &writer->index;
+    size_t len = index->num_blocks * sizeof(MagArchiveIndexEntry);
+    MagArchiveFooter footer = {
+        .index_offset = index->data_end,
+        .num_blocks = index->num_blocks,
+        .crc = mag_archive_crc32((const uint8_t*)index->entries, len),
+    };
+    memcpy(footer.magic, MAG_ARCHIVE_FOOTER_MAGIC, sizeof(footer.magic));
+    if (pwrite(writer->fd, index->entries, len, (off_t)index->data_end) != (ssize_t)len
+        || pwrite(writer->fd, &footer, sizeof(footer), (off_t)(index->data_end + len)) != (ssize_t)sizeof(footer))
+        perror("binary archive footer");
+    fdatasync(writer->fd);
+    close(writer->fd);
+
+    free(index->entries);
+    memset(index, 0, sizeof(*index));
+    writer->fd = -1;
+    writer->day = INT64_MIN;
+}
+
+static bool writer_open_day(MagArchiveWriter* writer, int64_t day)
+{
+    char name[32];
+    mag_archive_file_name(name, sizeof(name), day);
+    int fd = openat(writer->dir_fd, name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        perror(name);
+        if (fd != -1)
+            close(fd);
+        return false;
+    }
+
+    MagArchiveFileHeader header;
+    if (st.st_size > 0
+        && (!read_exact(fd, &header, sizeof(header), 0) || !header_ok(&header) || header.day != day))
+    {
+        // NOTE(cmo): Not ours, or mangled beyond use. Keep it out of the way
+        // rather than appending to (or over) it.
+        char aside[48];
+        snprintf(aside, sizeof(aside), "%s.corrupt", name);
+        fprintf(stderr, "Unreadable binary archive %s, moving it to %s\n", name, aside);
+        close(fd);
+        if (renameat(writer->dir_fd, name, writer->dir_fd, aside) == -1)
+        {
+            perror(aside);
+            return false;
+        }
+        return writer_open_day(writer, day);
+    }
+
+    if (st.st_size == 0)
+    {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, MAG_ARCHIVE_MAGIC, sizeof(header.magic));
+        header.version = MAG_ARCHIVE_VERSION;
+        header.num_channels = MAG_ARCHIVE_NUM_CHANNELS;
+        header.block_samples = writer->block_samples;
+        header.day = day;
+        if (pwrite(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header))
+        {
+            perror(name);
+            close(fd);
+            return false;
+        }
+        memset(&writer->index, 0, sizeof(writer->index));
+        writer->index.data_end = sizeof(header);
+        fsync(writer->dir_fd);
+    }
+    else
+    {
+        // NOTE(cmo): Carry on after the last good block, dropping the footer
+        // (rewritten when we close) and anything torn off the end.
+        load_index(fd, st.st_size, &writer->index);
+        if (writer->index.recovered && writer->index.data_end != (uint64_t)st.st_size)
+            fprintf(stderr, "Recovered %s, dropping %lld bytes after the last good block\n",
+                    name, (long long)(st.st_size - writer->index.data_end));
+        if (ftruncate(fd, (off_t)writer->index.data_end) == -1)
+            perror(name);
+    }
+
+    writer->fd = fd;
+    writer->day = day;
+    return true;
+}
+
+bool mag_archive_writer_open(MagArchiveWriter* writer, const char* dir, uint32_t block_samples, int64_t flush_interval)
+{
+    memset(writer, 0, sizeof(*writer));
+    writer->fd = -1;
+    writer->day = INT64_MIN;
+    writer->block_samples = block_samples;
+    writer->flush_interval = flush_interval;
+    writer->last_flush = monotonic_millis();
+    writer->pending = calloc(block_samples, sizeof(MagnetometerMessage));
+    writer->scratch_size = sizeof(MagArchiveBlockHeader) + block_samples * MaxBytesPerSample + 64;
+    writer->scratch = malloc(writer->scratch_size);
+    writer->dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (!writer->pending || !writer->scratch || writer->dir_fd == -1)
+    {
+        perror(dir);
+        mag_archive_writer_close(writer);
+        return false;
+    }
+    return true;
+}
+
+int32_t mag_archive_writer_append(MagArchiveWriter* writer, const MagnetometerMessage* samples, int32_t n_samples)
+{
+    int32_t failed = 0;
+    for (int32_t i = 0; i < n_samples; ++i)
+    {
+        int64_t day = floor_div(samples[i].timestamp, MillisPerDay);
+        if (day != writer->day)
+        {
+            writer_close_day(writer);
+            if (!writer_open_day(writer, day))
+            {
+                failed += 1;
+                continue;
+            }
+        }
+
+        writer->pending[writer->num_pending++] = samples[i];
+        if (writer->num_pending == writer->block_samples)
+        {
+            uint32_t n = writer->num_pending;
+            if (!writer_write_block(writer))
+                failed += n;
+        }
+    }
+
+    if (writer->flush_interval > 0 && writer->num_pending > 0
+        && monotonic_millis() - writer->last_flush >= writer->flush_interval)
+    {
+        uint32_t n = writer->num_pending;
+        if (!writer_write_block(writer))
+            failed += n;
+        fdatasync(writer->fd);
+    }
+    return failed;
+}
+
+void mag_archive_writer_flush(MagArchiveWriter* writer)
+{
+    if (writer->fd == -1)
+        return;
+    writer_write_block(writer);
+    fdatasync(writer->fd);
+}
+
+void mag_archive_writer_close(MagArchiveWriter* writer)
+{
+    writer_close_day(writer);
+    if (writer->dir_fd != -1)
+        close(writer->dir_fd);
+    writer->dir_fd = -1;
+    free(writer->pending);
+    free(writer->scratch);
+    writer->pending = NULL;
+    writer->scratch = NULL;
+}
+
+bool mag_archive_reader_open(MagArchiveReader* reader, const char* path)
+{
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (reader->fd == -1)
+        return false;
+
+    struct stat st;
+    if (fstat(reader->fd, &st) == -1 || (size_t)st.st_size < sizeof(MagArchiveFileHeader))
+    {
+        mag_archive_reader_close(reader);
+        return false;
+    }
+    reader->size = st.st_size;
+    void* map = mmap(NULL, reader->size, PROT_READ, MAP_SHARED, reader->fd, 0);
+    if (map == MAP_FAILED)
+    {
+        reader->size = 0;
+        mag_archive_reader_close(reader);
+        return false;
+    }
+    reader->map = map;
+    memcpy(&reader->header, reader->map, sizeof(reader->header));
+    if (!header_ok(&reader->header))
+    {
+        mag_archive_reader_close(reader);
+        return false;
+    }
+    load_index(reader->fd, reader->size, &reader->index);
+    return true;
+}
+
+int64_t mag_archive_read_range(MagArchiveReader* reader,
+                               int64_t start,
+                               int64_t end,
+                               MagnetometerMessage** out,
+                               size_t* count,
+                               size_t* capacity)
+{
+    const MagArchiveIndex* index = &reader->index;
+
+    // NOTE(cmo): First block that ends at or after start.
+    uint64_t lo = 0;
+    uint64_t hi = index->num_blocks;
+    while (lo < hi)
+    {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (index->entries[mid].last_timestamp < start)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    int64_t appended = 0;
+    for (uint64_t b = lo; b < index->num_blocks && index->entries[b].first_timestamp < end; ++b)
+    {
+        const MagArchiveIndexEntry* entry = &index->entries[b];
+        if (entry->offset + sizeof(MagArchiveBlockHeader) > reader->size)
+            return -1;
+        MagArchiveBlockHeader header;
+        memcpy(&header, reader->map + entry->offset, sizeof(header));
+        const uint8_t* payload = reader->map + entry->offset + sizeof(header);
+        if (header.magic != MAG_ARCHIVE_BLOCK_MAGIC
+            || header.num_samples != entry->num_samples
+            || entry->offset + sizeof(header) + header.payload_size > reader->size
+            || mag_archive_crc32(payload, header.payload_size) != header.crc)
+            return -1;
+
+        if (*capacity < *count + header.num_samples)
+        {
+            size_t grown_capacity = 2 * (*count + header.num_samples);
+            MagnetometerMessage* grown = realloc(*out, grown_capacity * sizeof(MagnetometerMessage));
+            if (!grown)
+                return -1;
+            *out = grown;
+            *capacity = grown_capacity;
+        }
+
+        MagnetometerMessage* samples = *out + *count;
+        if (!decode_block(&header, payload, samples))
+            return -1;
+
+        // NOTE(cmo): Only the ends of the range cut into blocks.
+        uint32_t first = 0;
+        uint32_t last = header.num_samples;
+        while (first < last && samples[first].timestamp < start)
+            first += 1;
+        while (last > first && samples[last - 1].timestamp >= end)
+            last -= 1;
+        if (first > 0)
+            memmove(samples, samples + first, (last - first) * sizeof(MagnetometerMessage));
+        *count += last - first;
+        appended += last - first;
+    }
+    return appended;
+}
+
+void mag_archive_reader_close(MagArchiveReader* reader)
+{
+    if (reader->map)
+        munmap((void*)reader->map, reader->size);
+    if (reader->fd != -1)
+        close(reader->fd);
+    free(reader->index.entries);
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = -1;
+}
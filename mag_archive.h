@@ -0,0 +1,139 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "sink.h"
+
+// NOTE(cmo): Compressed binary archive, one file per UT day,
+// <dir>/YYYY-MM-DD.mag. Native (little) endian throughout.
+//
+//   MagArchiveFileHeader
+//   block 0: MagArchiveBlockHeader, payload
+//   block 1: ...
+//   footer (only once the file has been closed cleanly):
+//     n_blocks x MagArchiveIndexEntry
+//     MagArchiveFooter
+//
+// A block holds up to block_samples samples (a fixed count, set when the
+// file is created), compressed as one bit stream:
+//   timestamps: delta-of-delta against the previous sample, where 0 (the
+//     usual 3 s cadence) costs 1 bit
+//   then each channel in turn: the value XORed with the channel's previous
+//     value, storing only the meaningful bits (as in Facebook's Gorilla)
+// The first sample of the block is stored raw (64 bits each).
+//
+// The footer's index (first/last timestamp and offset of every block) lets
+// a reader binary search straight to the blocks covering a time range. A
+// file without a valid footer (still being written, or the writer died) is
+// recovered by hopping from block header to block header, stopping at the
+// first one whose magic, length or CRC doesn't check out.
+
+#define MAG_ARCHIVE_MAGIC "MAGARC1"
+#define MAG_ARCHIVE_FOOTER_MAGIC "MAGIDX1"
+#define MAG_ARCHIVE_BLOCK_MAGIC 0x4b4c424du // "MBLK"
+#define MAG_ARCHIVE_VERSION 1
+#define MAG_ARCHIVE_NUM_CHANNELS 4
+
+typedef struct MagArchiveFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t num_channels;
+    uint32_t block_samples; // most samples in a block, when the file was created
+    uint32_t reserved;
+    int64_t day; // days since unix epoch
+} MagArchiveFileHeader;
+
+typedef struct MagArchiveBlockHeader
+{
+    uint32_t magic;
+    uint32_t payload_size;
+    uint32_t num_samples;
+    uint32_t crc; // CRC-32 of the payload
+    int64_t first_timestamp;
+    int64_t last_timestamp;
+} MagArchiveBlockHeader;
+
+typedef struct MagArchiveIndexEntry
+{
+    int64_t first_timestamp;
+    int64_t last_timestamp;
+    uint64_t offset; // of the block header
+    uint32_t num_samples;
+    uint32_t reserved;
+} MagArchiveIndexEntry;
+
+typedef struct MagArchiveFooter
+{
+    uint64_t index_offset;
+    uint64_t num_blocks;
+    uint32_t crc; // CRC-32 of the index entries
+    uint32_t reserved;
+    char magic[8];
+} MagArchiveFooter;
+
+typedef struct MagArchiveIndex
+{
+    MagArchiveIndexEntry* entries;
+    uint64_t num_blocks;
+    uint64_t capacity;
+    // NOTE(cmo): Offset just past the last good block.
+    uint64_t data_end;
+    // NOTE(cmo): The footer was missing or bad and the blocks were scanned.
+    bool recovered;
+} MagArchiveIndex;
+
+typedef struct MagArchiveWriter
+{
+    int dir_fd;
+    int fd;
+    int64_t day;
+    uint32_t block_samples;
+    MagArchiveIndex index;
+    MagnetometerMessage* pending;
+    uint32_t num_pending;
+    uint8_t* scratch;
+    size_t scratch_size;
+    int64_t flush_interval; // ms
+    int64_t last_flush; // monotonic ms
+} MagArchiveWriter;
+
+typedef struct MagArchiveReader
+{
+    int fd;
+    const uint8_t* map;
+    size_t size;
+    MagArchiveFileHeader header;
+    MagArchiveIndex index;
+} MagArchiveReader;
+
+// NOTE(cmo): Writer. Samples are buffered until a block is full, or until
+// flush_interval ms (0 for never) have passed since a block was last written,
+// when append writes out the partial block, so a crash loses at most the
+// samples of that interval. Partial blocks compress less well, so keep the
+// interval long compared to the sample cadence. flush also writes out a
+// partial block. Appending to a day that already has a file carries on after
+// its last good block. Samples must be appended in time order.
+bool mag_archive_writer_open(MagArchiveWriter* writer, const char* dir, uint32_t block_samples, int64_t flush_interval);
+// NOTE(cmo): Returns the number of samples that couldn't be written.
+int32_t mag_archive_writer_append(MagArchiveWriter* writer, const MagnetometerMessage* samples, int32_t n_samples);
+void mag_archive_writer_flush(MagArchiveWriter* writer);
+// NOTE(cmo): Flushes, and finishes the open file with its footer.
+void mag_archive_writer_close(MagArchiveWriter* writer);
+
+// NOTE(cmo): Reader, for one day's file.
+bool mag_archive_reader_open(MagArchiveReader* reader, const char* path);
+// NOTE(cmo): Decodes the samples with start <= timestamp < end, appending
+// them to *out (grown with realloc as needed, *capacity in samples). Returns
+// the number appended, or -1 if a block is corrupt.
+int64_t mag_archive_read_range(MagArchiveReader* reader,
+                               int64_t start,
+                               int64_t end,
+                               MagnetometerMessage** out,
+                               size_t* count,
+                               size_t* capacity);
+void mag_archive_reader_close(MagArchiveReader* reader);
+
+// NOTE(cmo): Name of the file for a day, into buf (at least 16 bytes).
+void mag_archive_file_name(char* buf, size_t len, int64_t day);
+uint32_t mag_archive_crc32(const uint8_t* data, size_t len);
@@ -0,0 +1,435 @@
+#define _DEFAULT_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "mag_archive.h"
+#include "mag_time.h"
+#include "text_parse.h"
+
+// NOTE(cmo): Converts daily text archive files (YYYY-MM-DD.txt, ms since UT
+// midnight and 4 values per line, as ImportOldData.py reads) into the binary
+// archive (see mag_archive.h).
+//
+//   mag_convert [-j threads] [-f] [-v] TEXT_DIR OUT_DIR
+//
+// Each worker thread takes the next day file, parses it (text_parse.h),
+// writes it into a private staging directory under OUT_DIR, reads it back and
+// checks the CRC-32 of the decoded samples against that of the parsed ones,
+// and only then renames it into place. So OUT_DIR only ever holds complete,
+// verified days, and an interrupted run can simply be started again. A day
+// is skipped if its .mag is newer than its .txt (i.e. the text hasn't changed
+// since it was converted), unless -f is given. Lines that don't parse (e.g.
+// cut short by a crash) are dropped and counted.
+//
+// -j defaults to the number of CPUs, -v prints a line per file.
+
+// NOTE(cmo): Same as the daemon's BinaryArchiveBlockSamples.
+static const uint32_t ConvertBlockSamples = 1024;
+
+typedef struct ConvertStats
+{
+    int64_t converted;
+    int64_t skipped;
+    int64_t failed;
+    int64_t samples;
+    int64_t bad_lines;
+    int64_t bytes_in;
+    int64_t bytes_out;
+} ConvertStats;
+
+typedef struct ConvertJob
+{
+    const char* text_dir;
+    const char* out_dir;
+    char** names;
+    int32_t num_files;
+    int32_t next_file;
+    bool force;
+    bool verbose;
+} ConvertJob;
+
+typedef struct ConvertWorker
+{
+    ConvertJob* job;
+    int id;
+    pthread_t thread;
+    char staging[4096];
+    ConvertStats stats;
+    MagnetometerMessage* samples;
+    size_t capacity;
+} ConvertWorker;
+
+double monotonic_seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+bool day_from_name(const char* name, int64_t* day)
+{
+    struct tm date = {0};
+    int n = 0;
+    if (strlen(name) != 14
+        || sscanf(name, "%4d-%2d-%2d.txt%n", &date.tm_year, &date.tm_mon, &date.tm_mday, &n) != 3
+        || n != 14)
+        return false;
+    date.tm_year -= 1900;
+    date.tm_mon -= 1;
+    *day = (int64_t)timegm(&date) / (MillisPerDay / 1000);
+    return true;
+}
+
+bool newer_or_same(const struct stat* a, const struct stat* b)
+{
+    if (a->st_mtim.tv_sec != b->st_mtim.tv_sec)
+        return a->st_mtim.tv_sec > b->st_mtim.tv_sec;
+    return a->st_mtim.tv_nsec >= b->st_mtim.tv_nsec;
+}
+
+char* read_whole_file(const char* path, size_t* size)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        if (fd != -1)
+            close(fd);
+        return NULL;
+    }
+    char* buf = malloc(st.st_size + 1);
+    size_t len = 0;
+    while (buf && len < (size_t)st.st_size)
+    {
+        ssize_t n = read(fd, buf + len, st.st_size - len);
+        if (n <= 0)
+            break;
+        len += n;
+    }
+    close(fd);
+    *size = len;
+    return buf;
+}
+
+int compare_timestamps(const void* a, const void* b)
+{
+    int64_t ta = ((const MagnetometerMessage*)a)->timestamp;
+    int64_t tb = ((const MagnetometerMessage*)b)->timestamp;
+    return (ta > tb) - (ta < tb);
+}
+
+// NOTE(cmo): Parses a day's text into worker->samples, returning how many.
+int64_t parse_day(ConvertWorker* worker, const char* text, size_t len, int64_t day, int64_t* bad_lines)
+{
+    int64_t midnight = day * MillisPerDay;
+    int64_t count = 0;
+    bool sorted = true;
+    const char* p = text;
+    const char* end = text + len;
+    while (p < end)
+    {
+        if (worker->capacity == (size_t)count)
+        {
+            size_t capacity = worker->capacity ? 2 * worker->capacity : 32768;
+            MagnetometerMessage* grown = realloc(worker->samples, capacity * sizeof(MagnetometerMessage));
+            if (!grown)
+                return -1;
+            worker->samples = grown;
+            worker->capacity = capacity;
+        }
+
+        double values[5];
+        bool ok;
+        p = text_parse_line(p, end, values, &ok);
+        // NOTE(cmo): Samples belong in their own UT day's file.
+        if (!ok || !(values[0] >= 0.0 && values[0] < (double)MillisPerDay))
+        {
+            *bad_lines += 1;
+            continue;
+        }
+        MagnetometerMessage* sample = &worker->samples[count];
+        sample->timestamp = midnight + (int64_t)(values[0] + 0.5);
+        memcpy(sample->data, values + 1, sizeof(sample->data));
+        if (count > 0 && sample->timestamp < worker->samples[count - 1].timestamp)
+            sorted = false;
+        count += 1;
+    }
+    if (!sorted)
+        qsort(worker->samples, count, sizeof(MagnetometerMessage), compare_timestamps);
+    return count;
+}
+
+// NOTE(cmo): Writes the samples into the staging directory and checks that
+// they read back exactly.
+bool write_and_verify(ConvertWorker* worker, const char* mag_name, int64_t count)
+{
+    MagArchiveWriter writer;
+    if (!mag_archive_writer_open(&writer, worker->staging, ConvertBlockSamples, 0))
+        return false;
+    int32_t failed = 0;
+    for (int64_t start = 0; start < count; start += ConvertBlockSamples)
+    {
+        int32_t n = (int32_t)(count - start < ConvertBlockSamples ? count - start : ConvertBlockSamples);
+        failed += mag_archive_writer_append(&writer, worker->samples + start, n);
+    }
+    mag_archive_writer_close(&writer);
+    if (failed != 0)
+        return false;
+
+    char path[4096 + 32];
+    snprintf(path, sizeof(path), "%s/%s", worker->staging, mag_name);
+    MagArchiveReader reader;
+    if (!mag_archive_reader_open(&reader, path))
+        return false;
+    MagnetometerMessage* decoded = NULL;
+    size_t decoded_count = 0;
+    size_t capacity = 0;
+    bool ok = mag_archive_read_range(&reader, INT64_MIN, INT64_MAX, &decoded, &decoded_count, &capacity) == count
+        && !reader.index.recovered
+        && mag_archive_crc32((const uint8_t*)decoded, decoded_count * sizeof(MagnetometerMessage))
+           == mag_archive_crc32((const uint8_t*)worker->samples, count * sizeof(MagnetometerMessage));
+    free(decoded);
+    mag_archive_reader_close(&reader);
+    return ok;
+}
+
+void convert_file(ConvertWorker* worker, const char* name)
+{
+    ConvertJob* job = worker->job;
+    ConvertStats* stats = &worker->stats;
+    int64_t day;
+    if (!day_from_name(name, &day))
+        return;
+
+    char mag_name[32];
+    mag_archive_file_name(mag_name, sizeof(mag_name), day);
+    char text_path[4096 + 32];
+    char out_path[4096 + 32];
+    snprintf(text_path, sizeof(text_path), "%s/%s", job->text_dir, name);
+    snprintf(out_path, sizeof(out_path), "%s/%s", job->out_dir, mag_name);
+
+    struct stat text_st;
+    struct stat out_st;
+    if (stat(text_path, &text_st) == -1)
+    {
+        perror(text_path);
+        stats->failed += 1;
+        return;
+    }
+    if (!job->force && stat(out_path, &out_st) == 0 && newer_or_same(&out_st, &text_st))
+    {
+        stats->skipped += 1;
+        return;
+    }
+
+    size_t len;
+    char* text = read_whole_file(text_path, &len);
+    if (!text)
+    {
+        perror(text_path);
+        stats->failed += 1;
+        return;
+    }
+    int64_t bad_lines = 0;
+    int64_t count = parse_day(worker, text, len, day, &bad_lines);
+    free(text);
+    if (count <= 0)
+    {
+        if (count < 0 || job->verbose)
+            fprintf(stderr, "%s: no samples\n", text_path);
+        stats->failed += count < 0;
+        stats->skipped += count == 0;
+        return;
+    }
+
+    char staged_path[4096 + 32];
+    snprintf(staged_path, sizeof(staged_path), "%s/%s", worker->staging, mag_name);
+    unlink(staged_path);
+    if (!write_and_verify(worker, mag_name, count))
+    {
+        fprintf(stderr, "%s: conversion did not verify, leaving %s alone\n", text_path, out_path);
+        unlink(staged_path);
+        stats->failed += 1;
+        return;
+    }
+    if (rename(staged_path, out_path) == -1)
+    {
+        perror(out_path);
+        unlink(staged_path);
+        stats->failed += 1;
+        return;
+    }
+
+    struct stat done_st;
+    stat(out_path, &done_st);
+    stats->converted += 1;
+    stats->samples += count;
+    stats->bad_lines += bad_lines;
+    stats->bytes_in += text_st.st_size;
+    stats->bytes_out += done_st.st_size;
+    if (job->verbose)
+        printf("%s -> %s: %lld samples, %lld bad lines, %lld -> %lld bytes\n", text_path, out_path,
+               (long long)count, (long long)bad_lines, (long long)text_st.st_size, (long long)done_st.st_size);
+}
+
+void* convert_worker(void* arg)
+{
+    ConvertWorker* worker = (ConvertWorker*)arg;
+    ConvertJob* job = worker->job;
+    while (true)
+    {
+        int32_t i = __atomic_fetch_add(&job->next_file, 1, __ATOMIC_RELAXED);
+        if (i >= job->num_files)
+            break;
+        convert_file(worker, job->names[i]);
+    }
+    return NULL;
+}
+
+int compare_names(const void* a, const void* b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+bool list_day_files(ConvertJob* job)
+{
+    DIR* dir = opendir(job->text_dir);
+    if (!dir)
+    {
+        perror(job->text_dir);
+        return false;
+    }
+    int32_t capacity = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)))
+    {
+        int64_t day;
+        if (!day_from_name(entry->d_name, &day))
+            continue;
+        if (job->num_files == capacity)
+        {
+            capacity = capacity ? 2 * capacity : 1024;
+            job->names = realloc(job->names, capacity * sizeof(char*));
+        }
+        job->names[job->num_files++] = strdup(entry->d_name);
+    }
+    closedir(dir);
+    qsort(job->names, job->num_files, sizeof(char*), compare_names);
+    return true;
+}
+
+void usage(const char* name)
+{
+    fprintf(stderr, "Usage: %s [-j threads] [-f] [-v] TEXT_DIR OUT_DIR\n", name);
+}
+
+int main(int argc, char* argv[])
+{
+    ConvertJob job = {0};
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    while ((opt = getopt(argc, argv, "j:fv")) != -1)
+    {
+        switch (opt)
+        {
+            case 'j':
+                num_threads = atol(optarg);
+                break;
+            case 'f':
+                job.force = true;
+                break;
+            case 'v':
+                job.verbose = true;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind != 2 || num_threads < 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    job.text_dir = argv[optind];
+    job.out_dir = argv[optind + 1];
+    if (mkdir(job.out_dir, 0755) == -1 && errno != EEXIST)
+    {
+        perror(job.out_dir);
+        return 1;
+    }
+    if (!list_day_files(&job))
+        return 1;
+    if (num_threads > job.num_files)
+        num_threads = job.num_files > 0 ? job.num_files : 1;
+
+    double start = monotonic_seconds();
+    ConvertWorker* workers = calloc(num_threads, sizeof(ConvertWorker));
+    int status = 0;
+    int started = 0;
+    for (int i = 0; i < num_threads; ++i)
+    {
+        ConvertWorker* worker = &workers[i];
+        worker->job = &job;
+        worker->id = i;
+        snprintf(worker->staging, sizeof(worker->staging), "%s/.mag_convert-%ld-%d",
+                 job.out_dir, (long)getpid(), i);
+        if (mkdir(worker->staging, 0755) == -1)
+        {
+            perror(worker->staging);
+            status = 1;
+            break;
+        }
+        if (pthread_create(&worker->thread, NULL, convert_worker, worker) != 0)
+        {
+            rmdir(worker->staging);
+            status = 1;
+            break;
+        }
+        started += 1;
+    }
+
+    ConvertStats total = {0};
+    for (int i = 0; i < started; ++i)
+    {
+        ConvertWorker* worker = &workers[i];
+        pthread_join(worker->thread, NULL);
+        rmdir(worker->staging);
+        free(worker->samples);
+        total.converted += worker->stats.converted;
+        total.skipped += worker->stats.skipped;
+        total.failed += worker->stats.failed;
+        total.samples += worker->stats.samples;
+        total.bad_lines += worker->stats.bad_lines;
+        total.bytes_in += worker->stats.bytes_in;
+        total.bytes_out += worker->stats.bytes_out;
+    }
+    // NOTE(cmo): Make the renames stick.
+    int dir_fd = open(job.out_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd != -1)
+    {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    double elapsed = monotonic_seconds() - start;
+
+    printf("%lld converted, %lld skipped, %lld failed; %lld samples (%lld bad lines), "
+           "%.1f MB -> %.1f MB in %.2f s with %d threads (%.1f MB/s of text)\n",
+           (long long)total.converted, (long long)total.skipped, (long long)total.failed,
+           (long long)total.samples, (long long)total.bad_lines,
+           total.bytes_in / 1e6, total.bytes_out / 1e6, elapsed, started,
+           elapsed > 0 ? total.bytes_in / 1e6 / elapsed : 0.0);
+
+    for (int32_t i = 0; i < job.num_files; ++i)
+        free(job.names[i]);
+    free(job.names);
+    free(workers);
+    return (status || total.failed) ? 1 : 0;
+}
@@ -0,0 +1,404 @@
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "calibrate.h"
+#include "daily_archive.h"
+#include "mag_archive.h"
+#include "mag_time.h"
+
+// NOTE(cmo): Recalibrates history from the daemon's raw archive (RawArchiveDir
+// in magnetometer.c: ADC counts in the binary archive format, and
+// calibrations.txt, see calibrate.h).
+//
+//   mag_recal [-j threads] [-o mag|text] [-s FIELD=VALUE]... RAW_DIR OUT_DIR START END
+//
+// START and END are ms since unix epoch or a UT date/time as YYYY-MM-DD,
+// YYYY-MM-DDTHH:MM or YYYY-MM-DDTHH:MM:SS; END is exclusive. Each raw sample
+// is calibrated with the record that was in force when it was taken, with
+// any -s overrides applied on top (e.g. -s r_wires=2.51 -s version=2; the
+// field names are those of calibrations.txt, and a new version is required
+// when overriding anything). With no overrides the output is bit for bit what
+// the daemon produced. The calibration goes through calibrate_data, the same
+// code the daemon runs.
+//
+// OUT_DIR gets a YYYY-MM-DD.mag (binary archive) or YYYY-MM-DD.txt (daily
+// text archive) per day, holding that day's samples from the range, replacing
+// any file already there, and calibrations.txt logging the calibrations
+// applied. Days are spread over worker threads (-j, default the number of
+// CPUs); each is written to a staging directory and renamed into place once
+// complete.
+
+static const uint32_t RecalBlockSamples = 1024;
+
+typedef enum OutputFormat
+{
+    OUTPUT_MAG,
+    OUTPUT_TEXT,
+} OutputFormat;
+
+typedef struct RecalJob
+{
+    const char* raw_dir;
+    const char* out_dir;
+    int64_t start;
+    int64_t end;
+    int64_t first_day;
+    int32_t num_days;
+    int32_t next_day;
+    OutputFormat format;
+    // NOTE(cmo): The raw archive's records with the overrides applied.
+    CalibrationRecord* records;
+    int32_t num_records;
+} RecalJob;
+
+typedef struct RecalWorker
+{
+    RecalJob* job;
+    pthread_t thread;
+    char staging[4096];
+    int64_t days;
+    int64_t samples;
+    int64_t failed_days;
+    int64_t bad_samples;
+} RecalWorker;
+
+double monotonic_seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// NOTE(cmo): Index of the record in force at t, or -1 if t is before them all.
+int32_t record_for(const RecalJob* job, int64_t t)
+{
+    int32_t lo = 0;
+    int32_t hi = job->num_records;
+    while (lo < hi)
+    {
+        int32_t mid = lo + (hi - lo) / 2;
+        if (job->records[mid].from <= t)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo - 1;
+}
+
+// NOTE(cmo): Calibrates samples in place (raw counts in, calibrated values
+// out), a run at a time for each calibration record. Returns the number of
+// samples that had to be dropped, compacting the rest.
+int64_t recalibrate(const RecalJob* job, MagnetometerMessage* samples, int64_t* count)
+{
+    int64_t n = *count;
+    int32_t* counts = malloc(n * 4 * sizeof(int32_t));
+    double* calibrated = malloc(n * 4 * sizeof(double));
+    if (!counts || !calibrated)
+    {
+        free(counts);
+        free(calibrated);
+        *count = 0;
+        return n;
+    }
+
+    int64_t kept = 0;
+    int64_t dropped = 0;
+    for (int64_t i = 0; i < n; ++i)
+    {
+        bool integral = true;
+        for (int c = 0; c < 4; ++c)
+        {
+            double x = samples[i].data[c];
+            integral = integral && x == floor(x) && fabs(x) <= 2147483647.0;
+        }
+        if (!integral || record_for(job, samples[i].timestamp) < 0)
+        {
+            dropped += 1;
+            continue;
+        }
+        samples[kept].timestamp = samples[i].timestamp;
+        for (int c = 0; c < 4; ++c)
+            counts[kept * 4 + c] = (int32_t)samples[i].data[c];
+        kept += 1;
+    }
+
+    int64_t start = 0;
+    while (start < kept)
+    {
+        int32_t r = record_for(job, samples[start].timestamp);
+        int64_t run_end = start + 1;
+        int64_t next_from = r + 1 < job->num_records ? job->records[r + 1].from : INT64_MAX;
+        while (run_end < kept && samples[run_end].timestamp >= job->records[r].from
+               && samples[run_end].timestamp < next_from)
+            run_end += 1;
+        calibrate_data(counts + start * 4, (int32_t)(run_end - start), 4,
+                       &job->records[r].calibration, calibrated + start * 4);
+        start = run_end;
+    }
+    for (int64_t i = 0; i < kept; ++i)
+        memcpy(samples[i].data, calibrated + i * 4, sizeof(samples[i].data));
+
+    free(counts);
+    free(calibrated);
+    *count = kept;
+    return dropped;
+}
+
+bool write_day(RecalWorker* worker, int64_t day, const MagnetometerMessage* samples, int64_t count)
+{
+    RecalJob* job = worker->job;
+    time_t midnight = (time_t)(day * (MillisPerDay / 1000));
+    struct tm date;
+    gmtime_r(&midnight, &date);
+    char name[32];
+    strftime(name, sizeof(name), job->format == OUTPUT_MAG ? "%Y-%m-%d.mag" : "%Y-%m-%d.txt", &date);
+    char staged_path[4096 + 32];
+    char out_path[4096 + 32];
+    snprintf(staged_path, sizeof(staged_path), "%s/%s", worker->staging, name);
+    snprintf(out_path, sizeof(out_path), "%s/%s", job->out_dir, name);
+    unlink(staged_path);
+
+    int64_t failed = 0;
+    if (job->format == OUTPUT_MAG)
+    {
+        MagArchiveWriter writer;
+        if (!mag_archive_writer_open(&writer, worker->staging, RecalBlockSamples, 0))
+            return false;
+        for (int64_t i = 0; i < count; i += RecalBlockSamples)
+        {
+            int32_t n = (int32_t)(count - i < RecalBlockSamples ? count - i : RecalBlockSamples);
+            failed += mag_archive_writer_append(&writer, samples + i, n);
+        }
+        mag_archive_writer_close(&writer);
+    }
+    else
+    {
+        DailyArchive archive;
+        if (!daily_archive_open(&archive, worker->staging, ARCHIVE_FSYNC_DAILY, 0))
+            return false;
+        for (int64_t i = 0; i < count; i += RecalBlockSamples)
+        {
+            int32_t n = (int32_t)(count - i < RecalBlockSamples ? count - i : RecalBlockSamples);
+            failed += daily_archive_append(&archive, samples + i, n);
+        }
+        daily_archive_close(&archive);
+    }
+
+    if (failed != 0 || rename(staged_path, out_path) == -1)
+    {
+        if (failed == 0)
+            perror(out_path);
+        unlink(staged_path);
+        return false;
+    }
+    return true;
+}
+
+void recal_day(RecalWorker* worker, int64_t day)
+{
+    RecalJob* job = worker->job;
+    char name[32];
+    char path[4096 + 32];
+    mag_archive_file_name(name, sizeof(name), day);
+    snprintf(path, sizeof(path), "%s/%s", job->raw_dir, name);
+    MagArchiveReader reader;
+    if (!mag_archive_reader_open(&reader, path))
+        return;
+
+    MagnetometerMessage* samples = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    bool ok = mag_archive_read_range(&reader, job->start, job->end, &samples, &count, &capacity) >= 0;
+    mag_archive_reader_close(&reader);
+    if (!ok)
+        fprintf(stderr, "%s: corrupt block, recalibrating what could be read\n", path);
+
+    // NOTE(cmo): read_range only trims the ends of blocks, relying on the
+    // daemon's timestamps increasing; make sure of the range regardless.
+    int64_t n = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (samples[i].timestamp >= job->start && samples[i].timestamp < job->end)
+            samples[n++] = samples[i];
+    }
+    worker->bad_samples += recalibrate(job, samples, &n);
+    if (n > 0)
+    {
+        if (write_day(worker, day, samples, n))
+        {
+            worker->days += 1;
+            worker->samples += n;
+        }
+        else
+        {
+            fprintf(stderr, "%s: couldn't write the recalibrated day\n", path);
+            worker->failed_days += 1;
+        }
+    }
+    free(samples);
+}
+
+void* recal_worker(void* arg)
+{
+    RecalWorker* worker = (RecalWorker*)arg;
+    RecalJob* job = worker->job;
+    while (true)
+    {
+        int32_t i = __atomic_fetch_add(&job->next_day, 1, __ATOMIC_RELAXED);
+        if (i >= job->num_days)
+            break;
+        recal_day(worker, job->first_day + i);
+    }
+    return NULL;
+}
+
+void usage(const char* name)
+{
+    fprintf(stderr, "Usage: %s [-j threads] [-o mag|text] [-s FIELD=VALUE]... RAW_DIR OUT_DIR START END\n", name);
+}
+
+int main(int argc, char* argv[])
+{
+    RecalJob job = {0};
+    job.format = OUTPUT_MAG;
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    char overrides[1024] = "";
+    int opt;
+    while ((opt = getopt(argc, argv, "j:o:s:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'j':
+                num_threads = atol(optarg);
+                break;
+            case 'o':
+                if (strcmp(optarg, "mag") == 0)
+                    job.format = OUTPUT_MAG;
+                else if (strcmp(optarg, "text") == 0)
+                    job.format = OUTPUT_TEXT;
+                else
+                {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 's':
+                if (strlen(overrides) + strlen(optarg) + 2 > sizeof(overrides))
+                {
+                    usage(argv[0]);
+                    return 1;
+                }
+                strcat(overrides, " ");
+                strcat(overrides, optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind != 4 || num_threads < 1
+        || !parse_time(argv[optind + 2], &job.start) || !parse_time(argv[optind + 3], &job.end)
+        || job.end <= job.start)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    job.raw_dir = argv[optind];
+    job.out_dir = argv[optind + 1];
+
+    job.num_records = calibration_log_read(job.raw_dir, &job.records);
+    if (job.num_records <= 0)
+    {
+        fprintf(stderr, "No usable calibrations.txt in %s\n", job.raw_dir);
+        return 1;
+    }
+    if (overrides[0] != '\0')
+    {
+        for (int32_t i = 0; i < job.num_records; ++i)
+        {
+            int64_t from = job.records[i].from;
+            int64_t old_version = job.records[i].calibration.version;
+            if (!calibration_parse(overrides, &from, &job.records[i].calibration) || from != job.records[i].from)
+            {
+                fprintf(stderr, "Bad override:%s\n", overrides);
+                return 1;
+            }
+            if (job.records[i].calibration.version == old_version)
+            {
+                fprintf(stderr, "Give the new calibration its own version (-s version=N)\n");
+                return 1;
+            }
+        }
+    }
+
+    if (mkdir(job.out_dir, 0755) == -1 && errno != EEXIST)
+    {
+        perror(job.out_dir);
+        return 1;
+    }
+    for (int32_t i = 0; i < job.num_records; ++i)
+    {
+        if (!calibration_log_append(job.out_dir, job.records[i].from, &job.records[i].calibration))
+            return 1;
+    }
+
+    job.first_day = floor_div(job.start, MillisPerDay);
+    job.num_days = (int32_t)(floor_div(job.end - 1, MillisPerDay) - job.first_day + 1);
+    if (num_threads > job.num_days)
+        num_threads = job.num_days;
+
+    double start = monotonic_seconds();
+    RecalWorker* workers = calloc(num_threads, sizeof(RecalWorker));
+    int started = 0;
+    int status = 0;
+    for (int i = 0; i < num_threads; ++i)
+    {
+        RecalWorker* worker = &workers[i];
+        worker->job = &job;
+        snprintf(worker->staging, sizeof(worker->staging), "%s/.mag_recal-%ld-%d",
+                 job.out_dir, (long)getpid(), i);
+        if (mkdir(worker->staging, 0755) == -1)
+        {
+            perror(worker->staging);
+            status = 1;
+            break;
+        }
+        if (pthread_create(&worker->thread, NULL, recal_worker, worker) != 0)
+        {
+            rmdir(worker->staging);
+            status = 1;
+            break;
+        }
+        started += 1;
+    }
+
+    int64_t days = 0;
+    int64_t samples = 0;
+    int64_t failed_days = 0;
+    int64_t bad_samples = 0;
+    for (int i = 0; i < started; ++i)
+    {
+        pthread_join(workers[i].thread, NULL);
+        rmdir(workers[i].staging);
+        days += workers[i].days;
+        samples += workers[i].samples;
+        failed_days += workers[i].failed_days;
+        bad_samples += workers[i].bad_samples;
+    }
+    double elapsed = monotonic_seconds() - start;
+    printf("%lld days, %lld samples recalibrated (%lld dropped: not counts, or before the first calibration), "
+           "%lld days failed, in %.2f s with %d threads (%.0f samples/s)\n",
+           (long long)days, (long long)samples, (long long)bad_samples, (long long)failed_days,
+           elapsed, started, elapsed > 0 ? samples / elapsed : 0.0);
+
+    free(workers);
+    free(job.records);
+    return (status || failed_days) ? 1 : 0;
+}
@@ -0,0 +1,37 @@
+#define _DEFAULT_SOURCE
+#include "mag_time.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+int64_t monotonic_millis()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+bool parse_time(const char* str, int64_t* millis)
+{
+    struct tm date = {0};
+    int n = 0;
+    char* end;
+    long long raw = strtoll(str, &end, 10);
+    if (*end == '\0')
+    {
+        *millis = raw;
+        return true;
+    }
+
+    if (sscanf(str, "%d-%d-%d%n", &date.tm_year, &date.tm_mon, &date.tm_mday, &n) != 3)
+        return false;
+    const char* time = str + n;
+    if (*time == 'T'
+        && sscanf(time, "T%d:%d%n", &date.tm_hour, &date.tm_min, &n) == 2
+        && time[n] == ':')
+        sscanf(time + n, ":%d", &date.tm_sec);
+    date.tm_year -= 1900;
+    date.tm_mon -= 1;
+    *millis = (int64_t)timegm(&date) * 1000;
+    return true;
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+// NOTE(cmo): Time handling shared by the daemon's archives and the tools that
+// read them. Times are ms since unix epoch, days are UT days since then.
+
+static const int64_t MillisPerDay = 86400000;
+
+// NOTE(cmo): Rounds towards -infinity, so times before the epoch (or the
+// start of an interval) still land in the right day (or interval).
+static inline int64_t floor_div(int64_t a, int64_t b)
+{
+    int64_t q = a / b;
+    return (a % b != 0 && (a < 0) != (b < 0)) ? q - 1 : q;
+}
+
+// NOTE(cmo): For measuring intervals (between syncs, flushes, ...), unmoved
+// by the wall clock being stepped.
+int64_t monotonic_millis();
+
+// NOTE(cmo): Parses ms since unix epoch, or a UT date/time as YYYY-MM-DD,
+// YYYY-MM-DDTHH:MM or YYYY-MM-DDTHH:MM:SS, into *millis.
+bool parse_time(const char* str, int64_t* millis);
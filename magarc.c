@@ -0,0 +1,154 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mag_archive.h"
+#include "daily_archive.h"
+#include "mag_time.h"
+
+// NOTE(cmo): Command line access to the binary archive (see mag_archive.h).
+//
+//   magarc info FILE...
+//   magarc extract [-f text|csv|bin] DIR START END
+//
+// START and END are ms since unix epoch, or a UT date/time as YYYY-MM-DD,
+// YYYY-MM-DDTHH:MM or YYYY-MM-DDTHH:MM:SS; END is exclusive. text prints a
+// line per sample like the daily text archive but with ms since epoch, csv
+// adds a header row, and bin writes the raw 40 byte samples (read them with
+// np.fromfile(f, dtype=[("timestamp", "<i8"), ("data", "<f8", (4,))])).
+
+
+typedef enum OutputFormat
+{
+    OUTPUT_TEXT,
+    OUTPUT_CSV,
+    OUTPUT_BINARY,
+} OutputFormat;
+
+int info(int argc, const char* argv[])
+{
+    int status = 0;
+    for (int i = 0; i < argc; ++i)
+    {
+        MagArchiveReader reader;
+        if (!mag_archive_reader_open(&reader, argv[i]))
+        {
+            fprintf(stderr, "%s: not a binary archive\n", argv[i]);
+            status = 1;
+            continue;
+        }
+
+        MagArchiveIndex* index = &reader.index;
+        uint64_t samples = 0;
+        for (uint64_t b = 0; b < index->num_blocks; ++b)
+            samples += index->entries[b].num_samples;
+        MagnetometerMessage* out = NULL;
+        size_t count = 0;
+        size_t capacity = 0;
+        bool ok = mag_archive_read_range(&reader, INT64_MIN, INT64_MAX, &out, &count, &capacity) >= 0;
+        free(out);
+
+        printf("%s: %llu blocks, %llu samples, %zu bytes (%.1f bytes/sample, %.1fx smaller than raw)%s%s\n",
+               argv[i], (unsigned long long)index->num_blocks, (unsigned long long)samples, reader.size,
+               samples ? (double)reader.size / samples : 0.0,
+               reader.size ? (double)(samples * sizeof(MagnetometerMessage)) / reader.size : 0.0,
+               index->recovered ? ", no footer (recovered by scanning)" : "",
+               ok ? "" : ", CORRUPT BLOCK");
+        if (!ok)
+            status = 1;
+        mag_archive_reader_close(&reader);
+    }
+    return status;
+}
+
+int extract(OutputFormat format, const char* dir, int64_t start, int64_t end)
+{
+    if (format == OUTPUT_CSV)
+        printf("timestamp,east-west,north-south,up-down,temperature\n");
+
+    MagnetometerMessage* out = NULL;
+    size_t capacity = 0;
+    int status = 0;
+    for (int64_t day = floor_div(start, MillisPerDay); day <= floor_div(end - 1, MillisPerDay); ++day)
+    {
+        char name[32];
+        char path[4096];
+        mag_archive_file_name(name, sizeof(name), day);
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+        MagArchiveReader reader;
+        if (!mag_archive_reader_open(&reader, path))
+            continue;
+
+        size_t count = 0;
+        if (mag_archive_read_range(&reader, start, end, &out, &count, &capacity) < 0)
+        {
+            fprintf(stderr, "%s: corrupt block, output from this day is incomplete\n", path);
+            status = 1;
+        }
+        mag_archive_reader_close(&reader);
+
+        if (format == OUTPUT_BINARY)
+        {
+            fwrite(out, sizeof(MagnetometerMessage), count, stdout);
+            continue;
+        }
+        char sep = format == OUTPUT_CSV ? ',' : ' ';
+        for (size_t i = 0; i < count; ++i)
+        {
+            char values[4][32];
+            for (int c = 0; c < 4; ++c)
+                format_python_float(values[c], out[i].data[c]);
+            printf("%lld%c%s%c%s%c%s%c%s\n", (long long)out[i].timestamp,
+                   sep, values[0], sep, values[1], sep, values[2], sep, values[3]);
+        }
+    }
+    free(out);
+    return status;
+}
+
+void usage(const char* name)
+{
+    fprintf(stderr, "Usage: %s info FILE...\n"
+                    "       %s extract [-f text|csv|bin] DIR START END\n", name, name);
+}
+
+int main(int argc, const char* argv[])
+{
+    if (argc >= 3 && strcmp(argv[1], "info") == 0)
+        return info(argc - 2, argv + 2);
+
+    if (argc >= 2 && strcmp(argv[1], "extract") == 0)
+    {
+        OutputFormat format = OUTPUT_TEXT;
+        int arg = 2;
+        if (arg + 1 < argc && strcmp(argv[arg], "-f") == 0)
+        {
+            const char* f = argv[arg + 1];
+            if (strcmp(f, "text") == 0)
+                format = OUTPUT_TEXT;
+            else if (strcmp(f, "csv") == 0)
+                format = OUTPUT_CSV;
+            else if (strcmp(f, "bin") == 0)
+                format = OUTPUT_BINARY;
+            else
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            arg += 2;
+        }
+
+        int64_t start;
+        int64_t end;
+        if (argc - arg != 3 || !parse_time(argv[arg + 1], &start) || !parse_time(argv[arg + 2], &end))
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        return extract(format, argv[arg], start, end);
+    }
+
+    usage(argv[0]);
+    return 1;
+}
@@ -3,19 +3,33 @@
 #include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
 #include <fcntl.h>
+#include <poll.h>
 #include "HRDL.h"
 #ifdef HRDL_TEST
     #include "HRDL_test_backend.c"
 #endif
 #include "mqtt.h"
-
+#include "sample_ring.h"
+#include "multicast_feed.h"
+#include "sink.h"
+#include "daily_archive.h"
+#include "mag_archive.h"
+#include "calibrate.h"
+
+// NOTE(cmo): A host name (with MqttPort), or "unix:///path/to/socket" for a
+// broker on this machine listening on a unix domain socket, which skips the
+// loopback TCP stack entirely.
 const char* MqttEndpoint = "localhost";
 const char* MqttPort = "1883";
 const char* MqttClient = "Magnetometer";
@@ -25,8 +39,7 @@ typedef struct MqttPublisher
 {
     struct mqtt_client client;
     int sockfd;
-    uint8_t sendbuf[4096];
-    uint8_t recvbuf[4096];
+    int64_t last_connect_attempt;
 } MqttPublisher;
 static MqttPublisher g_mqtt;
 
@@ -35,6 +48,72 @@ static const bool RejectMains = true;
 static const int32_t SampleInterval = 3000;
 static const int32_t BufferSize = 1024;
 static const int32_t BlockSize = 4; // 12 s
+// NOTE(cmo): The MQTT send buffer grows to hold whatever is queued while the
+// broker is unreachable (~200 B per sample, so 8 MiB is a good few hours of
+// data) and is given back after it has been idle for 10 mins.
+static const size_t MqttSendBufferInitial = 4096;
+static const size_t MqttSendBufferMax = 8 * 1024 * 1024;
+static const size_t MqttRecvBufferInitial = 4096;
+static const size_t MqttRecvBufferMax = 64 * 1024;
+static const int64_t MqttBufferShrinkAfter = 600000; // ms
+static const int64_t MqttReconnectInterval = 1000; // ms
+// NOTE(cmo): Samples go out at QoS 1 so anything in flight when the connection
+// drops is sent again. At most this many can be awaiting a PUBACK, the rest
+// wait in the send buffer.
+static const int MqttInflightWindow = 64;
+// NOTE(cmo): The last day of samples is also kept in shared memory for local
+// readers (see sample_ring.h and SampleRing.py). Set to NULL to turn it off.
+const char* SampleRingName = "/magnetometer-samples";
+static const int64_t SampleRingHours = 24;
+// NOTE(cmo): Optional UDP multicast feed of each block (see multicast_feed.h),
+// e.g. MULTICAST_DEFAULT_GROUP. NULL turns it off. The TTL keeps it on the
+// lab subnet.
+const char* MulticastGroup = NULL;
+const char* MulticastPort = MULTICAST_DEFAULT_PORT;
+static const int MulticastTtl = 1;
+typedef struct MulticastSink
+{
+    int sockfd;
+    uint64_t sequence;
+    int64_t session;
+} MulticastSink;
+// NOTE(cmo): Optional local copy of every sample, appended as raw 40 byte
+// messages. NULL turns it off.
+const char* SampleFile = NULL;
+typedef struct FileSink
+{
+    int fd;
+} FileSink;
+// NOTE(cmo): Directory for the daily YYYY-MM-DD.txt archive (see
+// daily_archive.h). Writing it here means it doesn't depend on the broker or
+// the ingest script being up. NULL turns it off; when it's on, set
+// daemon_writes_text in server.conf so PrintMessagesInflux.py doesn't write
+// the same files too.
+const char* ArchiveDir = NULL;
+static const ArchiveFsyncPolicy ArchiveFsync = ARCHIVE_FSYNC_INTERVAL;
+static const int64_t ArchiveFsyncInterval = 60000; // ms
+// NOTE(cmo): Directory for the compressed, indexed YYYY-MM-DD.mag archive
+// (see mag_archive.h, and magarc for reading it back). Written alongside the
+// text archive, not instead of it. NULL turns it off. Blocks hold up to 1024
+// samples (~50 mins), but a partial one is written out every
+// ArchiveFsyncInterval, so a crash loses at most that much.
+const char* BinaryArchiveDir = NULL;
+static const uint32_t BinaryArchiveBlockSamples = 1024;
+// NOTE(cmo): Directory for the raw ADC counts behind every sample, in the
+// same format as the binary archive but with the counts (exact as doubles) in
+// place of calibrated values, plus calibrations.txt logging the Calibration
+// in force (see calibrate.h). mag_recal uses them to redo the calibration of
+// any stretch of history. NULL turns it off.
+const char* RawArchiveDir = NULL;
+typedef struct RawArchiveSink
+{
+    MagArchiveWriter writer;
+    Calibration calibration;
+} RawArchiveSink;
+// NOTE(cmo): Blocks each output can fall behind by before it starts dropping
+// them (~50 mins). The MQTT client has its own, much larger, buffer behind
+// this.
+static const int64_t SinkQueueBlocks = 256;
 
 typedef struct DataLogger
 {
@@ -46,14 +125,6 @@ typedef struct DataLogger
 } DataLogger;
 static DataLogger g_logger;
 
-#pragma(pack, 1)
-typedef struct MagnetometerMessage
-{
-    int64_t timestamp;
-    double data[4];
-} __attribute__((packed)) MagnetometerMessage;
-#pragma(pop)
-
 /* noreturn */ void exit_with_message(const char* message, int code)
 {
     fprintf(stderr, "%s", message);
@@ -72,9 +143,35 @@ int64_t current_epoch_millis()
 void published_response(void** state, struct mqtt_response_publish* publish)
 {}
 
+int open_nb_unix_socket(const char* path)
+{
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Unix socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd == -1)
+        return -1;
+    if (connect(sockfd, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+    {
+        close(sockfd);
+        return -1;
+    }
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+    return sockfd;
+}
+
 int open_nb_socket(const char* addr, const char* port) {
     // NOTE(cmo): From MQTT-C repo.
     // Open a non-blocking socket.
+    if (strncmp(addr, "unix://", 7) == 0)
+        return open_nb_unix_socket(addr + 7);
+
     struct addrinfo hints = {0};
 
     hints.ai_family = AF_UNSPEC; /* IPv4 or IPv6 */
@@ -111,6 +208,14 @@ int open_nb_socket(const char* addr, const char* port) {
     /* make non-blocking */
     if (sockfd != -1) fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
 
+    /* each mqtt_sync hands the whole batch to the kernel in one write, so don't let
+     * Nagle hold back the tail of it waiting for an ACK */
+    if (sockfd != -1)
+    {
+        int one = 1;
+        setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
     /* return the new socket fd */
     return sockfd;
 }
@@ -120,36 +225,118 @@ void reconnect_publisher(struct mqtt_client* c, void** reconnect_state_ptr)
     MqttPublisher* pub = *(MqttPublisher**)reconnect_state_ptr;
     assert(&pub->client == c);
 
-    if (c->error != MQTT_ERROR_INITIAL_RECONNECT)
+    // NOTE(cmo): This is called from every mqtt_sync while the client is in
+    // an error state, so only actually try the broker again once a second.
+    // Leaving the error set means we'll be called again.
+    int64_t now = current_epoch_millis();
+    if (now - pub->last_connect_attempt < MqttReconnectInterval)
+        return;
+    pub->last_connect_attempt = now;
+
+    if (pub->sockfd != -1)
     {
         close(pub->sockfd);
+        pub->sockfd = -1;
         fprintf(stderr, "Reconnecting MQTT publisher. Client was in error state \"%s\"\n", 
                mqtt_error_str(c->error));
     }
 
     int sockfd = open_nb_socket(MqttEndpoint, MqttPort);
     if (sockfd == -1)
-        exit_with_message("Failed to open socket for MQTT\n", 1);
+    {
+        fprintf(stderr, "Failed to open socket for MQTT, %zu bytes queued\n", c->mq.bytes_queued);
+        return;
+    }
     pub->sockfd = sockfd;
 
-    mqtt_reinit(c, 
-                sockfd,
-                pub->sendbuf, sizeof(pub->sendbuf),
-                pub->recvbuf, sizeof(pub->recvbuf));
+    // NOTE(cmo): NULL buffers keep the policy-owned buffers, and with them
+    // any samples queued while we were disconnected.
+    mqtt_reinit(c, sockfd, NULL, 0, NULL, 0);
 
     uint8_t conn_flags = MQTT_CONNECT_CLEAN_SESSION;
     mqtt_connect(c, MqttClient, NULL, NULL, 0, NULL, NULL, conn_flags, 300);
     if (c->error != MQTT_OK)
     {
-        char buf[2048];
-        snprintf(buf, sizeof(buf), "Failed to connect to MQTT broker (error: \"%s\")\n", mqtt_error_str(c->error));
-        exit_with_message(buf, 1);
+        fprintf(stderr, "Failed to connect to MQTT broker (error: \"%s\")\n", mqtt_error_str(c->error));
     }
 }
 
 void configure_mqtt_publisher(MqttPublisher* pub)
 {
+    pub->sockfd = -1;
+    pub->last_connect_attempt = INT64_MIN / 2;
     mqtt_init_reconnect(&pub->client, reconnect_publisher, pub, published_response);
+    pub->client.max_inflight_qos1 = MqttInflightWindow;
+
+    struct mqtt_buffer_policy policy = {
+        .send_initial_size = MqttSendBufferInitial,
+        .send_max_size = MqttSendBufferMax,
+        .recv_initial_size = MqttRecvBufferInitial,
+        .recv_max_size = MqttRecvBufferMax,
+        .shrink_after = MqttBufferShrinkAfter,
+    };
+    mqtt_set_buffer_policy(&pub->client, &policy);
+}
+
+void pump_mqtt_publisher(MqttPublisher* pub, int wake_fd, int64_t max_wait)
+{
+    // NOTE(cmo): Sleep in poll until the broker socket needs servicing, the
+    // client's next retransmit/keep-alive deadline comes up, wake_fd is
+    // readable (if not -1), or max_wait ms pass, then do just the work that's
+    // due.
+    struct mqtt_client* c = &pub->client;
+    struct mqtt_readiness ready;
+    if (mqtt_get_readiness(c, &ready) != MQTT_OK)
+    {
+        // NOTE(cmo): mqtt_sync recovers from errors by calling
+        // reconnect_publisher. If that's still waiting out the reconnect
+        // interval, sleep until it's due.
+        mqtt_sync(c);
+        if (mqtt_get_readiness(c, &ready) != MQTT_OK)
+        {
+            int64_t wait = pub->last_connect_attempt + MqttReconnectInterval - current_epoch_millis();
+            if (wait > max_wait)
+                wait = max_wait;
+            struct pollfd wake = { .fd = wake_fd, .events = POLLIN };
+            if (wait > 0)
+                poll(&wake, 1, (int)wait);
+            return;
+        }
+    }
+
+    int64_t wait = max_wait;
+    if (ready.next_deadline != MQTT_DEADLINE_NONE && ready.next_deadline - MQTT_PAL_TIME() < wait)
+        wait = ready.next_deadline - MQTT_PAL_TIME();
+    if (wait < 0)
+        wait = 0;
+
+    struct pollfd pfd[2] = {
+        {
+            .fd = ready.socketfd,
+            .events = (ready.want_read ? POLLIN : 0) | (ready.want_write ? POLLOUT : 0),
+        },
+        { .fd = wake_fd, .events = POLLIN },
+    };
+    int n = poll(pfd, 2, (int)wait);
+    if (n > 0 && (pfd[0].revents & (POLLIN | POLLERR | POLLHUP)))
+        mqtt_sync_read(c);
+    if (n == 0 || (n > 0 && (pfd[0].revents & POLLOUT)))
+        mqtt_sync_write(c);
+}
+
+void flush_mqtt_publisher(MqttPublisher* pub)
+{
+    // NOTE(cmo): Queue a DISCONNECT behind everything else and pump the client
+    // until the whole queue has gone out (or we give up after ~1 s).
+    mqtt_disconnect(&pub->client);
+    int64_t give_up = current_epoch_millis() + 1000;
+    for (int64_t now = current_epoch_millis(); now < give_up; now = current_epoch_millis())
+    {
+        pump_mqtt_publisher(pub, -1, give_up - now);
+        mqtt_mq_clean(&pub->client.mq);
+        if (mqtt_mq_length(&pub->client.mq) == 0)
+            break;
+    }
 }
 
 void close_global_mqtt_atexit()
@@ -159,41 +346,373 @@ void close_global_mqtt_atexit()
 }
 
 
-void send_mqtt_messages(MqttPublisher* pub, 
-                        double* data, 
-                        int32_t n_samples, 
-                        int32_t n_channels, 
-                        int64_t start_time)
+void encode_block(SinkBlock* block,
+                  double* data,
+                  int32_t n_channels,
+                  int64_t start_time)
 {
     // NOTE(cmo): We're just going to encode the data as binary, no padding, 8
     // bytes of milliseconds since unix epoch, 4 x 8 bytes of doubles
-    // representing the calibrated data.
+    // representing the calibrated data. Every output uses this.
     assert(sizeof(MagnetometerMessage) == (5 * 8) && 
           "Magnetometer Message struct has been padded by the compiler (or otherwise modified).");
 
     assert(n_channels == 4 && "Only expecting 4 channels of data");
 
+    block->start_time = start_time;
+    for (int i = 0; i < block->n_samples; ++i)
+    {
+        block->samples[i].timestamp = start_time + i * SampleInterval;
+        for (int j = 0; j < n_channels; ++j)
+        {
+            block->samples[i].data[j] = data[i * n_channels + j];
+        }
+    }
+}
+
+bool mqtt_sink_init(void* state)
+{
+    configure_mqtt_publisher((MqttPublisher*)state);
+    return true;
+}
+
+int32_t mqtt_sink_write_block(void* state, const SinkBlock* block)
+{
+    MqttPublisher* pub = (MqttPublisher*)state;
+    int32_t n_samples = block->n_samples;
 
-    MagnetometerMessage msg = {};
+    // NOTE(cmo): Queue the whole block with one call, the client only locks
+    // and checks for buffer space once.
+    struct mqtt_publish_entry entries[n_samples];
     for (int i = 0; i < n_samples; ++i)
     {
-        msg.timestamp = start_time + i * SampleInterval;
-        for (int j = 0; j < n_channels; ++j)
+        entries[i] = (struct mqtt_publish_entry){
+            .application_message = &block->samples[i],
+            .application_message_size = sizeof(block->samples[i]),
+            .publish_flags = MQTT_PUBLISH_QOS_1,
+        };
+    }
+    // NOTE(cmo): Connection errors are handled by the reconnect callback on the
+    // next sync, the samples stay queued until then. The only thing that
+    // loses data is the send buffer hitting its ceiling.
+    int32_t dropped = 0;
+    if (mqtt_publish_batch(&pub->client, MqttTopic, entries, n_samples) != MQTT_OK)
+    {
+        for (int i = 0; i < n_samples; ++i)
         {
-            msg.data[j] = data[i * n_channels + j];
+            if (entries[i].status != MQTT_OK)
+                dropped += 1;
         }
+        fprintf(stderr, "Dropped %d MQTT samples (error: \"%s\", %zu bytes queued)\n", 
+                dropped, mqtt_error_str(entries[n_samples - 1].status), pub->client.mq.bytes_queued);
+    }
+    // NOTE(cmo): Get the block on the wire (and take in any PUBACKs) now,
+    // rather than after the rest of the queue has been packed.
+    mqtt_sync(&pub->client);
+    return dropped;
+}
+
+void mqtt_sink_wait(void* state, int wake_fd)
+{
+    // NOTE(cmo): The client's own deadlines wake us as needed, this is just
+    // an upper bound.
+    pump_mqtt_publisher((MqttPublisher*)state, wake_fd, 60000);
+}
+
+void mqtt_sink_flush(void* state)
+{
+    flush_mqtt_publisher((MqttPublisher*)state);
+}
+
+void mqtt_sink_close(void* state)
+{
+    MqttPublisher* pub = (MqttPublisher*)state;
+    if (pub->sockfd != -1)
+        close(pub->sockfd);
+    pub->sockfd = -1;
+    mqtt_free_buffers(&pub->client);
+}
+
+void mqtt_sink_stats(void* state, SinkStats* stats)
+{
+    MqttPublisher* pub = (MqttPublisher*)state;
+    stats->backlog = pub->client.mq.bytes_queued;
+    stats->backlog_high_water = pub->client.send_high_water;
+}
+
+static const SinkOps MqttSinkOps = {
+    .name = "MQTT",
+    .init = mqtt_sink_init,
+    .write_block = mqtt_sink_write_block,
+    .flush = mqtt_sink_flush,
+    .close = mqtt_sink_close,
+    .stats = mqtt_sink_stats,
+    .wait = mqtt_sink_wait,
+};
+
+bool ring_sink_init(void* state)
+{
+    return sample_ring_create((SampleRing*)state,
+                              SampleRingName,
+                              SampleRingHours * 3600 * 1000 / SampleInterval,
+                              SampleInterval);
+}
+
+int32_t ring_sink_write_block(void* state, const SinkBlock* block)
+{
+    assert(sizeof(SampleRingRecord) == sizeof(MagnetometerMessage) && "Ring records are messages");
+    sample_ring_write((SampleRing*)state, (const SampleRingRecord*)block->samples, block->n_samples);
+    return 0;
+}
+
+void ring_sink_flush(void* state)
+{}
+
+void ring_sink_close(void* state)
+{
+    sample_ring_close((SampleRing*)state);
+}
+
+static const SinkOps RingSinkOps = {
+    .name = "shared memory ring",
+    .init = ring_sink_init,
+    .write_block = ring_sink_write_block,
+    .flush = ring_sink_flush,
+    .close = ring_sink_close,
+};
+
+bool open_multicast_sink(MulticastSink* sink, const char* group, const char* port)
+{
+    sink->sockfd = -1;
+    sink->sequence = 0;
+    sink->session = current_epoch_millis();
+
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    struct addrinfo* info;
+    int rv = getaddrinfo(group, port, &hints, &info);
+    if (rv != 0)
+    {
+        fprintf(stderr, "Failed to resolve multicast group (getaddrinfo): %s\n", gai_strerror(rv));
+        return false;
+    }
+
+    // NOTE(cmo): Connected, so each block is a single send() with no address,
+    // and looped back so receivers on this machine see it too.
+    int sockfd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+    int ttl = MulticastTtl;
+    int loop = 1;
+    if (sockfd == -1
+        || setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) == -1
+        || setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) == -1
+        || connect(sockfd, info->ai_addr, info->ai_addrlen) == -1)
+    {
+        perror("multicast socket");
+        if (sockfd != -1)
+            close(sockfd);
+        freeaddrinfo(info);
+        return false;
+    }
+    freeaddrinfo(info);
+
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+    sink->sockfd = sockfd;
+    return true;
+}
+
+bool multicast_sink_init(void* state)
+{
+    return open_multicast_sink((MulticastSink*)state, MulticastGroup, MulticastPort);
+}
 
-        mqtt_publish(&pub->client, MqttTopic, (void*)&msg, sizeof(msg), MQTT_PUBLISH_QOS_0);
+int32_t multicast_sink_write_block(void* state, const SinkBlock* block)
+{
+    MulticastSink* sink = (MulticastSink*)state;
+    int32_t n_samples = block->n_samples;
+    assert(sizeof(MulticastSample) == sizeof(MagnetometerMessage) && "Multicast samples are messages");
+    uint8_t buf[sizeof(MulticastBlockHeader) + n_samples * sizeof(MulticastSample)];
+    MulticastBlockHeader* header = (MulticastBlockHeader*)buf;
+    memcpy(buf + sizeof(MulticastBlockHeader), block->samples, n_samples * sizeof(MulticastSample));
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    memcpy(header->magic, MULTICAST_MAGIC, sizeof(header->magic));
+    header->version = MULTICAST_VERSION;
+    header->num_samples = n_samples;
+    header->sequence = sink->sequence++;
+    header->session = sink->session;
+    header->timestamp = block->start_time;
+    header->sent = (int64_t)now.tv_sec * 1000000 + now.tv_usec;
+
+    // NOTE(cmo): Fire and forget. The sequence number still advances if this
+    // fails, so receivers count it as lost.
+    if (send(sink->sockfd, buf, sizeof(buf), 0) == -1)
+    {
+        if (LogLevel > 1)
+            perror("multicast send");
+        return n_samples;
     }
+    return 0;
+}
+
+void multicast_sink_flush(void* state)
+{}
+
+void multicast_sink_close(void* state)
+{
+    MulticastSink* sink = (MulticastSink*)state;
+    if (sink->sockfd != -1)
+        close(sink->sockfd);
+    sink->sockfd = -1;
+}
+
+static const SinkOps MulticastSinkOps = {
+    .name = "multicast",
+    .init = multicast_sink_init,
+    .write_block = multicast_sink_write_block,
+    .flush = multicast_sink_flush,
+    .close = multicast_sink_close,
+};
+
+bool file_sink_init(void* state)
+{
+    FileSink* sink = (FileSink*)state;
+    sink->fd = open(SampleFile, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (sink->fd == -1)
+        perror(SampleFile);
+    return sink->fd != -1;
+}
+
+int32_t file_sink_write_block(void* state, const SinkBlock* block)
+{
+    FileSink* sink = (FileSink*)state;
+    size_t len = block->n_samples * sizeof(MagnetometerMessage);
+    if (write(sink->fd, block->samples, len) != (ssize_t)len)
+    {
+        if (LogLevel > 1)
+            perror(SampleFile);
+        return block->n_samples;
+    }
+    return 0;
+}
+
+void file_sink_flush(void* state)
+{
+    fsync(((FileSink*)state)->fd);
+}
+
+void file_sink_close(void* state)
+{
+    FileSink* sink = (FileSink*)state;
+    if (sink->fd != -1)
+        close(sink->fd);
+    sink->fd = -1;
+}
+
+static const SinkOps FileSinkOps = {
+    .name = "sample file",
+    .init = file_sink_init,
+    .write_block = file_sink_write_block,
+    .flush = file_sink_flush,
+    .close = file_sink_close,
+};
+
+bool archive_sink_init(void* state)
+{
+    return daily_archive_open((DailyArchive*)state, ArchiveDir, ArchiveFsync, ArchiveFsyncInterval);
+}
+
+int32_t archive_sink_write_block(void* state, const SinkBlock* block)
+{
+    return daily_archive_append((DailyArchive*)state, block->samples, block->n_samples);
+}
+
+void archive_sink_flush(void* state)
+{
+    daily_archive_flush((DailyArchive*)state);
+}
+
+void archive_sink_close(void* state)
+{
+    daily_archive_close((DailyArchive*)state);
+}
+
+static const SinkOps ArchiveSinkOps = {
+    .name = "daily archive",
+    .init = archive_sink_init,
+    .write_block = archive_sink_write_block,
+    .flush = archive_sink_flush,
+    .close = archive_sink_close,
+};
+
+bool binary_archive_sink_init(void* state)
+{
+    return mag_archive_writer_open((MagArchiveWriter*)state, BinaryArchiveDir, BinaryArchiveBlockSamples, ArchiveFsyncInterval);
+}
+
+int32_t binary_archive_sink_write_block(void* state, const SinkBlock* block)
+{
+    return mag_archive_writer_append((MagArchiveWriter*)state, block->samples, block->n_samples);
+}
+
+void binary_archive_sink_flush(void* state)
+{
+    mag_archive_writer_flush((MagArchiveWriter*)state);
+}
+
+void binary_archive_sink_close(void* state)
+{
+    mag_archive_writer_close((MagArchiveWriter*)state);
+}
 
-    if (pub->client.error != MQTT_OK)
+static const SinkOps BinaryArchiveSinkOps = {
+    .name = "binary archive",
+    .init = binary_archive_sink_init,
+    .write_block = binary_archive_sink_write_block,
+    .flush = binary_archive_sink_flush,
+    .close = binary_archive_sink_close,
+};
+
+bool raw_archive_sink_init(void* state)
+{
+    RawArchiveSink* sink = (RawArchiveSink*)state;
+    // NOTE(cmo): Counts are no use without knowing how they were calibrated.
+    return calibration_log_append(RawArchiveDir, current_epoch_millis(), &sink->calibration)
+        && mag_archive_writer_open(&sink->writer, RawArchiveDir, BinaryArchiveBlockSamples, ArchiveFsyncInterval);
+}
+
+int32_t raw_archive_sink_write_block(void* state, const SinkBlock* block)
+{
+    RawArchiveSink* sink = (RawArchiveSink*)state;
+    MagnetometerMessage raw[block->n_samples];
+    for (int i = 0; i < block->n_samples; ++i)
     {
-        char buf[2048];
-        snprintf(buf, sizeof(buf), "Failed to send to MQTT message (error: \"%s\")\n", mqtt_error_str(pub->client.error));
-        exit_with_message(buf, 1);
+        raw[i].timestamp = block->samples[i].timestamp;
+        for (int j = 0; j < 4; ++j)
+            raw[i].data[j] = (double)block->counts[i * 4 + j];
     }
+    return mag_archive_writer_append(&sink->writer, raw, block->n_samples);
 }
 
+void raw_archive_sink_flush(void* state)
+{
+    mag_archive_writer_flush(&((RawArchiveSink*)state)->writer);
+}
+
+void raw_archive_sink_close(void* state)
+{
+    mag_archive_writer_close(&((RawArchiveSink*)state)->writer);
+}
+
+static const SinkOps RawArchiveSinkOps = {
+    .name = "raw archive",
+    .init = raw_archive_sink_init,
+    .write_block = raw_archive_sink_write_block,
+    .flush = raw_archive_sink_flush,
+    .close = raw_archive_sink_close,
+};
+
 
 DataLogger open_device()
 {
@@ -290,11 +809,13 @@ void close_global_logger_atexit()
     close_device(&g_logger);
 }
 
+static volatile sig_atomic_t g_stop = 0;
+
 void handle_sigint(int signum)
 {
-    // NOTE(cmo): This is to ensure HRDLClose is called on ^C.
-    if (signum == SIGINT)
-        exit(0);
+    // NOTE(cmo): Stop at the end of the block in hand, so the outputs are
+    // drained and flushed, and HRDLClose is called, on ^C or SIGTERM.
+    g_stop = 1;
 }
 
 void configure_channels(DataLogger* d)
@@ -376,67 +897,6 @@ void configure_datalogger(DataLogger* d)
     }
 }
 
-void calibrate_one_reading(int32_t* data,  
-                           int32_t n_channels, 
-                           double* counts_conversion_factor, 
-                           double* result)
-{
-    // NOTE(cmo): Based on Sean Leavey's code, based on Hugh Potts' code.
-    assert(n_channels == 4 &&  "Calibration assumed 4 channels");
-
-    // Scale counts to Voltage
-    for (int i = 0; i < n_channels; ++i)
-        result[i] = (double)data[i] * counts_conversion_factor[i];
-
-    // resistance in the wires
-    const double r_wires = 2.48;
-    // input resistance
-    const double r_in = 10000.0;
-    // potential divider for up-down field
-    const double pot_divider = 3.01 / (6.98 + 3.01);
-    // nanoTesla per Volt
-    const double b_scale = 1e6 / 143.0;
-    // temperature sensor degrees per Volt, from LM35 10mV / deg C
-    const double temp_scale = 100.0;
-
-    // Scale the voltages to nanotesla.
-    // Need to take into account the voltage drop in the wires and crosstalk between the channels
-    // v_true = v_measured * (1 + r_wires / r_in) + sum(v_measured) * r_wires / r_in
-
-    // scale z-channel to its correct value.
-    result[2] /= pot_divider;
-
-    double total_voltage = 0.0;
-    for (int i = 0; i < n_channels; ++i)
-        total_voltage += result[i];
-
-    double total_voltage_corr = total_voltage * r_wires / r_in;
-    for (int i = 0; i < n_channels; ++i)
-    {
-        result[i] *= (1.0 + r_wires / r_in);
-        result[i] += total_voltage_corr;
-    }
-
-    // unit conversion
-    for (int i = 0; i < 3; ++i)
-        result[i] *= b_scale;
-    result[3] *= temp_scale;
-}
-
-void calibrate_data(int32_t* data, 
-                    int32_t n_samples, 
-                    int32_t n_channels, 
-                    double* counts_conversion_factor, 
-                    double* result)
-{
-    for (int i = 0; i < n_samples; ++i)
-        calibrate_one_reading(&data[i * n_channels], 
-                              n_channels, 
-                              counts_conversion_factor, 
-                              &result[i * n_channels]
-        );
-}
-
 void compute_scaling_factors(DataLogger* d)
 {
     d->voltage_scaling_factors = calloc(d->num_active_channels, sizeof(double));
@@ -465,7 +925,7 @@ void prepare_data_block(DataLogger* d)
     }
 }
 
-int64_t log_heartbeat(FILE* log_file, int64_t prev_time)
+int64_t log_heartbeat(FILE* log_file, int64_t prev_time, SinkFanout* outputs)
 {
     int64_t now = current_epoch_millis();
 
@@ -474,6 +934,17 @@ int64_t log_heartbeat(FILE* log_file, int64_t prev_time)
         return prev_time;
 
     fprintf(log_file, "Process alive at millis: %lld\n", now);
+    for (int i = 0; i < outputs->num_sinks; ++i)
+    {
+        SinkStats stats;
+        sink_fanout_stats(outputs, i, &stats);
+        fprintf(log_file, "Output %s: %lld blocks written, %lld dropped (queue full), %lld samples failed, "
+                          "queue high water %lld blocks, backlog %lld (high water %lld)\n",
+                outputs->sinks[i].ops.name,
+                (long long)stats.blocks_written, (long long)stats.blocks_dropped,
+                (long long)stats.samples_failed, (long long)stats.queue_high_water,
+                (long long)stats.backlog, (long long)stats.backlog_high_water);
+    }
     fflush(log_file);
 
     return now;
@@ -481,17 +952,67 @@ int64_t log_heartbeat(FILE* log_file, int64_t prev_time)
 
 int main(int argc, const char* argv[])
 {
+#ifdef MAG_BENCH
+    // NOTE(cmo): Benchmark builds (see bench/) talk to the broker stand-in on
+    // MAG_BENCH_PORT and stop after MAG_BENCH_BLOCKS blocks.
+    if (getenv("MAG_BENCH_PORT"))
+        MqttPort = getenv("MAG_BENCH_PORT");
+    if (getenv("MAG_BENCH_ENDPOINT"))
+        MqttEndpoint = getenv("MAG_BENCH_ENDPOINT");
+    // NOTE(cmo): Leave /dev/shm alone unless asked.
+    SampleRingName = getenv("MAG_BENCH_RING");
+    MulticastGroup = getenv("MAG_BENCH_MULTICAST");
+    SampleFile = getenv("MAG_BENCH_FILE");
+    ArchiveDir = getenv("MAG_BENCH_ARCHIVE");
+    BinaryArchiveDir = getenv("MAG_BENCH_BINARY_ARCHIVE");
+    RawArchiveDir = getenv("MAG_BENCH_RAW_ARCHIVE");
+    int64_t bench_blocks = 0;
+    if (getenv("MAG_BENCH_BLOCKS"))
+        bench_blocks = atoll(getenv("MAG_BENCH_BLOCKS"));
+    LogFile = "/dev/null";
+#endif
+
     DataLogger d = open_device();
     g_logger = d;
     atexit(close_global_logger_atexit);
-    signal(SIGINT, handle_sigint);
-
-    MqttPublisher* pub = &g_mqtt;
-    configure_mqtt_publisher(pub);
-    atexit(close_global_mqtt_atexit);
+    // NOTE(cmo): No SA_RESTART, so the wait for the device returns on Ctrl-C.
+    struct sigaction sa = {0};
+    sa.sa_handler = handle_sigint;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
 
     configure_datalogger(&d);
     compute_scaling_factors(&d);
+    Calibration calibration = CurrentCalibration;
+    for (int i = 0; i < d.num_active_channels; ++i)
+        calibration.counts_to_volts[i] = d.voltage_scaling_factors[i];
+
+    // NOTE(cmo): Each output gets its own thread. Any of them failing to start
+    // is no reason to stop logging.
+    SinkFanout outputs = {0};
+#ifdef MAG_BENCH
+    outputs.wait_when_full = true;
+#endif
+    sink_fanout_add(&outputs, &MqttSinkOps, &g_mqtt, SinkQueueBlocks);
+    atexit(close_global_mqtt_atexit);
+    SampleRing ring = {.fd = -1};
+    if (SampleRingName)
+        sink_fanout_add(&outputs, &RingSinkOps, &ring, SinkQueueBlocks);
+    MulticastSink multicast = {.sockfd = -1};
+    if (MulticastGroup)
+        sink_fanout_add(&outputs, &MulticastSinkOps, &multicast, SinkQueueBlocks);
+    FileSink sample_file = {.fd = -1};
+    if (SampleFile)
+        sink_fanout_add(&outputs, &FileSinkOps, &sample_file, SinkQueueBlocks);
+    DailyArchive archive = {.dir_fd = -1, .fd = -1};
+    if (ArchiveDir)
+        sink_fanout_add(&outputs, &ArchiveSinkOps, &archive, SinkQueueBlocks);
+    MagArchiveWriter binary_archive = {.dir_fd = -1, .fd = -1};
+    if (BinaryArchiveDir)
+        sink_fanout_add(&outputs, &BinaryArchiveSinkOps, &binary_archive, SinkQueueBlocks);
+    RawArchiveSink raw_archive = {.writer = {.dir_fd = -1, .fd = -1}, .calibration = calibration};
+    if (RawArchiveDir)
+        sink_fanout_add(&outputs, &RawArchiveSinkOps, &raw_archive, SinkQueueBlocks);
 
     int32_t data_len = BlockSize * d.num_active_channels;
     int32_t* data_block = calloc(data_len, sizeof(int32_t));
@@ -500,21 +1021,37 @@ int main(int argc, const char* argv[])
 
     FILE* log_file = fopen(LogFile, "w");
     int64_t log_file_open = current_epoch_millis();
-    while (true)
+    while (!g_stop)
     {
         // NOTE(cmo): Start receiving a block of data.
         prepare_data_block(&d);
         int64_t block_start_timestamp = current_epoch_millis();
 
-        // NOTE(cmo): Wait for block to fill (12s).  Do other stuff like MQTT
-        // message loop in here.
+        // NOTE(cmo): Wait for block to fill (12s). The outputs run on their
+        // own threads, so just sleep until the block is due, then check the
+        // device every 10 ms.
+        int64_t block_due = block_start_timestamp + BlockSize * SampleInterval;
+        bool ready = true;
         while (!HRDLReady(d.handle))
         {
-            // NOTE(cmo): Sleep for only 100 ms to also pump mqtt messages.
-            struct timespec sleep_time = {.tv_sec=0, .tv_nsec=100000};
-            nanosleep(&sleep_time, NULL);
-            mqtt_sync(&pub->client);
+            // NOTE(cmo): When stopping, give up on a device that's stalled
+            // rather than waiting forever.
+            if (g_stop && current_epoch_millis() > block_due + SampleInterval)
+            {
+                ready = false;
+                break;
+            }
+            int64_t wait = block_due - current_epoch_millis();
+            if (wait < 10)
+                wait = 10;
+#ifdef MAG_BENCH
+            // NOTE(cmo): The bench device fills blocks instantly.
+            wait = 0;
+#endif
+            poll(NULL, 0, (int)wait);
         }
+        if (!ready)
+            break;
 
         // NOTE(cmo): Get data from device
         int16_t overflow = 0;
@@ -528,11 +1065,17 @@ int main(int argc, const char* argv[])
         calibrate_data(data_block, 
                        BlockSize, 
                        d.num_active_channels, 
-                       d.voltage_scaling_factors, 
+                       &calibration, 
                        calibrated_block
         );
-        send_mqtt_messages(pub, calibrated_block, BlockSize, d.num_active_channels, block_start_timestamp);
-        prev_heartbeat_time = log_heartbeat(log_file, prev_heartbeat_time);
+        SinkBlock* block = sink_block_alloc(BlockSize);
+        if (block)
+        {
+            encode_block(block, calibrated_block, d.num_active_channels, block_start_timestamp);
+            memcpy(block->counts, data_block, data_len * sizeof(int32_t));
+            sink_fanout_submit(&outputs, block);
+        }
+        prev_heartbeat_time = log_heartbeat(log_file, prev_heartbeat_time, &outputs);
         if (prev_heartbeat_time - log_file_open > 259200000L)
         {
             // NOTE(cmo): Recycle log file every 3 days.
@@ -540,10 +1083,19 @@ int main(int argc, const char* argv[])
             log_file = fopen(LogFile, "w");
             log_file_open = current_epoch_millis();
         }
+
+#ifdef MAG_BENCH
+        if (--bench_blocks == 0)
+            break;
+#endif
     }
 
+    sink_fanout_close(&outputs);
     free(data_block);
     free(calibrated_block);
+    if (log_file)
+        fclose(log_file);
+    return 0;
 }
 
 // http://ariel.astro.gla.ac.uk/w/bin/view/Instruments/Magnetometer
@@ -0,0 +1,697 @@
+#define _DEFAULT_SOURCE
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "daily_archive.h"
+#include "mag_time.h"
+#include "text_parse.h"
+
+// NOTE(cmo): Scans the daily text archive (YYYY-MM-DD.txt, see
+// daily_archive.h) for a time range, filtering and aggregating as it goes.
+//
+//   magscan [-j threads] [-o csv|text|bin|summary] [-i SECONDS] [-v]
+//           [-l CH=MIN] [-u CH=MAX] [-d CH=RATE] DIR START END
+//
+// START and END are ms since unix epoch or a UT date/time as YYYY-MM-DD,
+// YYYY-MM-DDTHH:MM or YYYY-MM-DDTHH:MM:SS; END is exclusive. CH is one of ew,
+// ns, ud, temp (or 0-3). A sample is kept if it passes every filter:
+//   -l: channel >= MIN
+//   -u: channel <= MAX
+//   -d: |dB/dt| >= RATE (per second, against the previous sample in the
+//       archive, even across midnight)
+// The kept samples are written as csv (with a header), text (one line each
+// in the archive's format but with ms since epoch) or bin (raw 40 byte
+// samples); or -o summary prints their count, min, max, mean and standard
+// deviation, and steepest dB/dt, per channel. -i instead prints, as csv, the
+// count, min, max and mean of each channel over each SECONDS long interval
+// (aligned to the epoch) that has any.
+//
+// Each day's file is mmapped and parsed and filtered in one pass by a worker
+// thread (-j, default the number of CPUs), and the results are written out in
+// time order. -v reports how much was scanned, and how fast, on stderr.
+
+static const int MaxFilters = 32;
+static const int NumChannels = 4;
+static const char* ChannelNames[] = { "east-west", "north-south", "up-down", "temperature" };
+// NOTE(cmo): How many days workers may get ahead of the output.
+static const int32_t DaysInFlightPerThread = 4;
+
+typedef enum OutputFormat
+{
+    OUTPUT_CSV,
+    OUTPUT_TEXT,
+    OUTPUT_BINARY,
+    OUTPUT_SUMMARY,
+    OUTPUT_INTERVALS,
+} OutputFormat;
+
+typedef enum FilterKind
+{
+    FILTER_MIN,
+    FILTER_MAX,
+    FILTER_RATE,
+} FilterKind;
+
+typedef struct ScanFilter
+{
+    FilterKind kind;
+    int channel;
+    double value;
+} ScanFilter;
+
+typedef struct ChannelSummary
+{
+    int64_t count;
+    double min;
+    double max;
+    // NOTE(cmo): Running mean and sum of squared deviations from it (Welford),
+    // rather than sums of x and x^2, whose difference loses most of its
+    // precision to cancellation for a small field on a large offset.
+    double mean;
+    double m2;
+    int64_t min_time;
+    int64_t max_time;
+    double steepest_rate;
+    int64_t steepest_rate_time;
+} ChannelSummary;
+
+typedef struct IntervalBin
+{
+    int64_t start;
+    int64_t count;
+    double min[4];
+    double max[4];
+    double sum[4];
+} IntervalBin;
+
+typedef struct DayResult
+{
+    bool done;
+    MagnetometerMessage* samples;
+    int64_t num_samples;
+    IntervalBin* bins;
+    int64_t num_bins;
+    ChannelSummary summary[4];
+    int64_t lines;
+    int64_t bad_lines;
+    int64_t bytes;
+} DayResult;
+
+typedef struct ScanJob
+{
+    const char* dir;
+    int64_t start;
+    int64_t end;
+    int64_t first_day;
+    int32_t num_days;
+    ScanFilter filters[32];
+    int num_filters;
+    bool need_rate;
+    OutputFormat format;
+    int64_t interval;
+    bool verbose;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int32_t next_day;
+    int32_t days_written;
+    int32_t max_in_flight;
+    DayResult* results;
+} ScanJob;
+
+double monotonic_seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+bool parse_filter(FilterKind kind, const char* arg, ScanFilter* filter)
+{
+    static const char* Short[] = { "ew", "ns", "ud", "temp" };
+    const char* eq = strchr(arg, '=');
+    if (!eq)
+        return false;
+    size_t len = eq - arg;
+    filter->channel = -1;
+    for (int c = 0; c < NumChannels; ++c)
+    {
+        if ((strlen(Short[c]) == len && strncmp(arg, Short[c], len) == 0)
+            || (strlen(ChannelNames[c]) == len && strncmp(arg, ChannelNames[c], len) == 0)
+            || (len == 1 && arg[0] == '0' + c))
+            filter->channel = c;
+    }
+    char* end;
+    filter->kind = kind;
+    filter->value = strtod(eq + 1, &end);
+    return filter->channel >= 0 && end != eq + 1 && *end == '\0';
+}
+
+void day_file_path(const ScanJob* job, int64_t day, char* path, size_t len)
+{
+    time_t midnight = (time_t)(day * (MillisPerDay / 1000));
+    struct tm date;
+    gmtime_r(&midnight, &date);
+    char name[32];
+    strftime(name, sizeof(name), "%Y-%m-%d.txt", &date);
+    snprintf(path, len, "%s/%s", job->dir, name);
+}
+
+typedef struct DayFile
+{
+    int fd;
+    const char* text;
+    size_t size;
+} DayFile;
+
+bool day_file_open(DayFile* file, const char* path)
+{
+    file->text = NULL;
+    file->size = 0;
+    file->fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (file->fd == -1 || fstat(file->fd, &st) == -1 || st.st_size == 0)
+        return false;
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, file->fd, 0);
+    if (map == MAP_FAILED)
+        return false;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    file->text = map;
+    file->size = st.st_size;
+    return true;
+}
+
+void day_file_close(DayFile* file)
+{
+    if (file->text)
+        munmap((void*)file->text, file->size);
+    if (file->fd != -1)
+        close(file->fd);
+    file->text = NULL;
+    file->fd = -1;
+}
+
+// NOTE(cmo): The last complete sample of the day before, for dB/dt at the
+// start of this one.
+bool previous_day_last_sample(const ScanJob* job, int64_t day, MagnetometerMessage* sample)
+{
+    char path[4096];
+    day_file_path(job, day - 1, path, sizeof(path));
+    DayFile file;
+    bool found = false;
+    if (day_file_open(&file, path))
+    {
+        // NOTE(cmo): Walk back over whole lines until one parses.
+        const char* end = file.text + file.size;
+        while (end > file.text && !found)
+        {
+            const char* line = end - 1;
+            while (line > file.text && line[-1] != '\n')
+                line--;
+            double values[5];
+            bool ok;
+            text_parse_line(line, end, values, &ok);
+            if (ok)
+            {
+                sample->timestamp = (day - 1) * MillisPerDay + (int64_t)(values[0] + 0.5);
+                memcpy(sample->data, values + 1, sizeof(sample->data));
+                found = true;
+            }
+            end = line;
+        }
+    }
+    day_file_close(&file);
+    return found;
+}
+
+void summary_init(ChannelSummary summary[4])
+{
+    for (int c = 0; c < NumChannels; ++c)
+    {
+        memset(&summary[c], 0, sizeof(summary[c]));
+        summary[c].min = INFINITY;
+        summary[c].max = -INFINITY;
+    }
+}
+
+void summary_merge(ChannelSummary* into, const ChannelSummary* from)
+{
+    if (from->count == 0)
+        return;
+    if (from->min < into->min)
+    {
+        into->min = from->min;
+        into->min_time = from->min_time;
+    }
+    if (from->max > into->max)
+    {
+        into->max = from->max;
+        into->max_time = from->max_time;
+    }
+    if (fabs(from->steepest_rate) > fabs(into->steepest_rate))
+    {
+        into->steepest_rate = from->steepest_rate;
+        into->steepest_rate_time = from->steepest_rate_time;
+    }
+    // NOTE(cmo): Chan et al.'s pairwise combination of the two means and m2s.
+    int64_t count = into->count + from->count;
+    double delta = from->mean - into->mean;
+    double weight = (double)from->count / (double)count;
+    into->mean += delta * weight;
+    into->m2 += from->m2 + delta * delta * (double)into->count * weight;
+    into->count = count;
+}
+
+bool push_sample(DayResult* result, const MagnetometerMessage* sample, size_t* capacity)
+{
+    if ((size_t)result->num_samples == *capacity)
+    {
+        size_t grown_capacity = *capacity ? 2 * *capacity : 4096;
+        MagnetometerMessage* grown = realloc(result->samples, grown_capacity * sizeof(MagnetometerMessage));
+        if (!grown)
+            return false;
+        result->samples = grown;
+        *capacity = grown_capacity;
+    }
+    result->samples[result->num_samples++] = *sample;
+    return true;
+}
+
+bool add_to_bin(DayResult* result, const MagnetometerMessage* sample, int64_t interval, size_t* capacity)
+{
+    int64_t start = floor_div(sample->timestamp, interval) * interval;
+    IntervalBin* bin = result->num_bins ? &result->bins[result->num_bins - 1] : NULL;
+    if (!bin || bin->start != start)
+    {
+        if ((size_t)result->num_bins == *capacity)
+        {
+            size_t grown_capacity = *capacity ? 2 * *capacity : 256;
+            IntervalBin* grown = realloc(result->bins, grown_capacity * sizeof(IntervalBin));
+            if (!grown)
+                return false;
+            result->bins = grown;
+            *capacity = grown_capacity;
+        }
+        bin = &result->bins[result->num_bins++];
+        bin->start = start;
+        bin->count = 0;
+        for (int c = 0; c < NumChannels; ++c)
+        {
+            bin->min[c] = INFINITY;
+            bin->max[c] = -INFINITY;
+            bin->sum[c] = 0.0;
+        }
+    }
+    bin->count += 1;
+    for (int c = 0; c < NumChannels; ++c)
+    {
+        bin->min[c] = fmin(bin->min[c], sample->data[c]);
+        bin->max[c] = fmax(bin->max[c], sample->data[c]);
+        bin->sum[c] += sample->data[c];
+    }
+    return true;
+}
+
+// NOTE(cmo): Parse, filter and aggregate one day, in one pass.
+void scan_day(ScanJob* job, int64_t day, DayResult* result)
+{
+    summary_init(result->summary);
+    char path[4096];
+    day_file_path(job, day, path, sizeof(path));
+    DayFile file;
+    if (!day_file_open(&file, path))
+    {
+        day_file_close(&file);
+        return;
+    }
+    result->bytes = file.size;
+
+    MagnetometerMessage prev;
+    bool have_prev = job->need_rate && previous_day_last_sample(job, day, &prev);
+    int64_t midnight = day * MillisPerDay;
+    size_t sample_capacity = 0;
+    size_t bin_capacity = 0;
+    const char* p = file.text;
+    const char* end = file.text + file.size;
+    while (p < end)
+    {
+        double values[5];
+        bool ok;
+        p = text_parse_line(p, end, values, &ok);
+        result->lines += 1;
+        if (!ok)
+        {
+            result->bad_lines += 1;
+            continue;
+        }
+        MagnetometerMessage sample;
+        sample.timestamp = midnight + (int64_t)(values[0] + 0.5);
+        memcpy(sample.data, values + 1, sizeof(sample.data));
+
+        double rates[4] = { NAN, NAN, NAN, NAN };
+        if (have_prev && sample.timestamp > prev.timestamp)
+        {
+            double dt = (sample.timestamp - prev.timestamp) * 1e-3;
+            for (int c = 0; c < NumChannels; ++c)
+                rates[c] = (sample.data[c] - prev.data[c]) / dt;
+        }
+        prev = sample;
+        have_prev = job->need_rate;
+
+        if (sample.timestamp < job->start || sample.timestamp >= job->end)
+            continue;
+        bool keep = true;
+        for (int f = 0; f < job->num_filters && keep; ++f)
+        {
+            const ScanFilter* filter = &job->filters[f];
+            double x = sample.data[filter->channel];
+            switch (filter->kind)
+            {
+                case FILTER_MIN:
+                    keep = x >= filter->value;
+                    break;
+                case FILTER_MAX:
+                    keep = x <= filter->value;
+                    break;
+                case FILTER_RATE:
+                    keep = fabs(rates[filter->channel]) >= filter->value;
+                    break;
+            }
+        }
+        if (!keep)
+            continue;
+
+        switch (job->format)
+        {
+            case OUTPUT_SUMMARY:
+                for (int c = 0; c < NumChannels; ++c)
+                {
+                    ChannelSummary* s = &result->summary[c];
+                    double x = sample.data[c];
+                    s->count += 1;
+                    double delta = x - s->mean;
+                    s->mean += delta / s->count;
+                    s->m2 += delta * (x - s->mean);
+                    if (x < s->min)
+                    {
+                        s->min = x;
+                        s->min_time = sample.timestamp;
+                    }
+                    if (x > s->max)
+                    {
+                        s->max = x;
+                        s->max_time = sample.timestamp;
+                    }
+                    if (fabs(rates[c]) > fabs(s->steepest_rate))
+                    {
+                        s->steepest_rate = rates[c];
+                        s->steepest_rate_time = sample.timestamp;
+                    }
+                }
+                break;
+            case OUTPUT_INTERVALS:
+                if (!add_to_bin(result, &sample, job->interval, &bin_capacity))
+                    result->bad_lines += 1;
+                break;
+            default:
+                if (!push_sample(result, &sample, &sample_capacity))
+                    result->bad_lines += 1;
+                break;
+        }
+    }
+    day_file_close(&file);
+}
+
+void* scan_worker(void* arg)
+{
+    ScanJob* job = (ScanJob*)arg;
+    pthread_mutex_lock(&job->lock);
+    while (true)
+    {
+        while (job->next_day < job->num_days && job->next_day >= job->days_written + job->max_in_flight)
+            pthread_cond_wait(&job->cond, &job->lock);
+        if (job->next_day >= job->num_days)
+            break;
+        int32_t i = job->next_day++;
+        pthread_mutex_unlock(&job->lock);
+
+        DayResult result = {0};
+        scan_day(job, job->first_day + i, &result);
+
+        pthread_mutex_lock(&job->lock);
+        result.done = true;
+        job->results[i % job->max_in_flight] = result;
+        pthread_cond_broadcast(&job->cond);
+    }
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+void write_samples(OutputFormat format, const DayResult* result)
+{
+    if (format == OUTPUT_BINARY)
+    {
+        fwrite(result->samples, sizeof(MagnetometerMessage), result->num_samples, stdout);
+        return;
+    }
+    char sep = format == OUTPUT_CSV ? ',' : ' ';
+    for (int64_t i = 0; i < result->num_samples; ++i)
+    {
+        const MagnetometerMessage* s = &result->samples[i];
+        char values[4][32];
+        for (int c = 0; c < NumChannels; ++c)
+            format_python_float(values[c], s->data[c]);
+        printf("%lld%c%s%c%s%c%s%c%s\n", (long long)s->timestamp,
+               sep, values[0], sep, values[1], sep, values[2], sep, values[3]);
+    }
+}
+
+void write_bin(const IntervalBin* bin)
+{
+    printf("%lld,%lld", (long long)bin->start, (long long)bin->count);
+    for (int c = 0; c < NumChannels; ++c)
+    {
+        char values[3][32];
+        format_python_float(values[0], bin->min[c]);
+        format_python_float(values[1], bin->max[c]);
+        format_python_float(values[2], bin->sum[c] / bin->count);
+        printf(",%s,%s,%s", values[0], values[1], values[2]);
+    }
+    printf("\n");
+}
+
+void write_summary(const ChannelSummary summary[4], int64_t total_lines, int64_t bad_lines, int64_t bytes,
+                   int32_t num_days, int num_threads, double elapsed)
+{
+    printf("%lld samples kept, from %lld lines (%lld bad) in %d days, %.1f MB in %.2f s with %d threads (%.1f MB/s)\n",
+           (long long)summary[0].count, (long long)total_lines, (long long)bad_lines, num_days,
+           bytes / 1e6, elapsed, num_threads, elapsed > 0 ? bytes / 1e6 / elapsed : 0.0);
+    if (summary[0].count == 0)
+        return;
+    for (int c = 0; c < NumChannels; ++c)
+    {
+        const ChannelSummary* s = &summary[c];
+        printf("%-12s min %.6g at %lld, max %.6g at %lld, mean %.6g, std %.6g",
+               ChannelNames[c], s->min, (long long)s->min_time, s->max, (long long)s->max_time,
+               s->mean, sqrt(s->m2 / s->count));
+        if (s->steepest_rate != 0.0)
+            printf(", steepest dB/dt %.6g /s at %lld", s->steepest_rate, (long long)s->steepest_rate_time);
+        printf("\n");
+    }
+}
+
+void usage(const char* name)
+{
+    fprintf(stderr, "Usage: %s [-j threads] [-o csv|text|bin|summary] [-i SECONDS] [-v]\n"
+                    "       %*s [-l CH=MIN] [-u CH=MAX] [-d CH=RATE] DIR START END\n",
+            name, (int)strlen(name), "");
+}
+
+int main(int argc, char* argv[])
+{
+    static ScanJob job;
+    job.format = OUTPUT_CSV;
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    while ((opt = getopt(argc, argv, "j:o:i:l:u:d:v")) != -1)
+    {
+        switch (opt)
+        {
+            case 'j':
+                num_threads = atol(optarg);
+                break;
+            case 'o':
+                if (strcmp(optarg, "csv") == 0)
+                    job.format = OUTPUT_CSV;
+                else if (strcmp(optarg, "text") == 0)
+                    job.format = OUTPUT_TEXT;
+                else if (strcmp(optarg, "bin") == 0)
+                    job.format = OUTPUT_BINARY;
+                else if (strcmp(optarg, "summary") == 0)
+                    job.format = OUTPUT_SUMMARY;
+                else
+                {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'i':
+                job.interval = (int64_t)(atof(optarg) * 1000.0);
+                if (job.interval <= 0)
+                {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'v':
+                job.verbose = true;
+                break;
+            case 'l':
+            case 'u':
+            case 'd':
+            {
+                FilterKind kind = opt == 'l' ? FILTER_MIN : (opt == 'u' ? FILTER_MAX : FILTER_RATE);
+                if (job.num_filters == MaxFilters || !parse_filter(kind, optarg, &job.filters[job.num_filters]))
+                {
+                    usage(argv[0]);
+                    return 1;
+                }
+                job.need_rate |= kind == FILTER_RATE;
+                job.num_filters += 1;
+            } break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind != 3 || num_threads < 1
+        || !parse_time(argv[optind + 1], &job.start) || !parse_time(argv[optind + 2], &job.end)
+        || job.end <= job.start)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    if (job.interval > 0)
+        job.format = OUTPUT_INTERVALS;
+    if (job.format == OUTPUT_SUMMARY)
+        job.need_rate = true;
+    job.dir = argv[optind];
+    job.first_day = floor_div(job.start, MillisPerDay);
+    job.num_days = (int32_t)(floor_div(job.end - 1, MillisPerDay) - job.first_day + 1);
+    if (num_threads > job.num_days)
+        num_threads = job.num_days;
+    job.max_in_flight = (int32_t)num_threads * DaysInFlightPerThread;
+    job.results = calloc(job.max_in_flight, sizeof(DayResult));
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+
+    double start = monotonic_seconds();
+    pthread_t* threads = calloc(num_threads, sizeof(pthread_t));
+    int started = 0;
+    for (int i = 0; i < num_threads; ++i)
+    {
+        if (pthread_create(&threads[i], NULL, scan_worker, &job) != 0)
+            break;
+        started += 1;
+    }
+    if (started == 0)
+    {
+        fprintf(stderr, "Couldn't start any threads\n");
+        return 1;
+    }
+
+    if (job.format == OUTPUT_CSV)
+        printf("timestamp,east-west,north-south,up-down,temperature\n");
+    if (job.format == OUTPUT_INTERVALS)
+    {
+        printf("start,count");
+        for (int c = 0; c < NumChannels; ++c)
+            printf(",%s_min,%s_max,%s_mean", ChannelNames[c], ChannelNames[c], ChannelNames[c]);
+        printf("\n");
+    }
+
+    ChannelSummary summary[4];
+    summary_init(summary);
+    IntervalBin pending_bin = {0};
+    bool have_pending_bin = false;
+    int64_t total_lines = 0;
+    int64_t bad_lines = 0;
+    int64_t bytes = 0;
+    for (int32_t i = 0; i < job.num_days; ++i)
+    {
+        DayResult* slot = &job.results[i % job.max_in_flight];
+        pthread_mutex_lock(&job.lock);
+        while (!slot->done)
+            pthread_cond_wait(&job.cond, &job.lock);
+        DayResult result = *slot;
+        memset(slot, 0, sizeof(*slot));
+        pthread_mutex_unlock(&job.lock);
+
+        total_lines += result.lines;
+        bad_lines += result.bad_lines;
+        bytes += result.bytes;
+        switch (job.format)
+        {
+            case OUTPUT_SUMMARY:
+                for (int c = 0; c < NumChannels; ++c)
+                    summary_merge(&summary[c], &result.summary[c]);
+                break;
+            case OUTPUT_INTERVALS:
+                // NOTE(cmo): An interval can span midnight, so hold on to the
+                // last one in case the next day carries on with it.
+                for (int64_t b = 0; b < result.num_bins; ++b)
+                {
+                    const IntervalBin* bin = &result.bins[b];
+                    if (have_pending_bin && pending_bin.start == bin->start)
+                    {
+                        pending_bin.count += bin->count;
+                        for (int c = 0; c < NumChannels; ++c)
+                        {
+                            pending_bin.min[c] = fmin(pending_bin.min[c], bin->min[c]);
+                            pending_bin.max[c] = fmax(pending_bin.max[c], bin->max[c]);
+                            pending_bin.sum[c] += bin->sum[c];
+                        }
+                        continue;
+                    }
+                    if (have_pending_bin)
+                        write_bin(&pending_bin);
+                    pending_bin = *bin;
+                    have_pending_bin = true;
+                }
+                break;
+            default:
+                write_samples(job.format, &result);
+                break;
+        }
+        free(result.samples);
+        free(result.bins);
+
+        pthread_mutex_lock(&job.lock);
+        job.days_written = i + 1;
+        pthread_cond_broadcast(&job.cond);
+        pthread_mutex_unlock(&job.lock);
+    }
+    if (have_pending_bin)
+        write_bin(&pending_bin);
+
+    for (int i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+    double elapsed = monotonic_seconds() - start;
+    if (job.format == OUTPUT_SUMMARY)
+        write_summary(summary, total_lines, bad_lines, bytes, job.num_days, started, elapsed);
+    else if (job.verbose)
+        fprintf(stderr, "%lld lines (%lld bad) in %d days, %.1f MB in %.2f s (%.1f MB/s)\n",
+                (long long)total_lines, (long long)bad_lines, job.num_days,
+                bytes / 1e6, elapsed, elapsed > 0 ? bytes / 1e6 / elapsed : 0.0);
+
+    free(threads);
+    free(job.results);
+    return 0;
+}
@@ -32,7 +32,11 @@ SOFTWARE.
  * @cond Doxygen_Suppress
  */
 
-enum MQTTErrors mqtt_sync(struct mqtt_client *client) {
+/**
+ * mqtt_sync, mqtt_sync_read and mqtt_sync_write: recovers from errors, then receives
+ * and/or sends.
+ */
+static enum MQTTErrors __mqtt_sync(struct mqtt_client *client, int do_recv, int do_send) {
     /* Recover from any errors */
     enum MQTTErrors err;
     int reconnecting = 0;
@@ -67,11 +71,17 @@ enum MQTTErrors mqtt_sync(struct mqtt_client *client) {
     }
 
     /* Call receive */
-    err = (enum MQTTErrors)__mqtt_recv(client);
-    if (err != MQTT_OK) return err;
+    if (do_recv) {
+        err = (enum MQTTErrors)__mqtt_recv(client);
+        if (err != MQTT_OK) return err;
+    }
 
-    /* Call send */
-    err = (enum MQTTErrors)__mqtt_send(client);
+    /* Call send. The DISCONNECT queued by mqtt_reconnect has to go out before reconnecting */
+    if (do_send || reconnecting) {
+        err = (enum MQTTErrors)__mqtt_send(client);
+    } else {
+        err = MQTT_OK;
+    }
 
     /* mqtt_reconnect will essentially be a disconnect if there is no callback */
     if (reconnecting && client->reconnect_callback != NULL) {
@@ -82,6 +92,18 @@ enum MQTTErrors mqtt_sync(struct mqtt_client *client) {
     return err;
 }
 
+enum MQTTErrors mqtt_sync(struct mqtt_client *client) {
+    return __mqtt_sync(client, 1, 1);
+}
+
+enum MQTTErrors mqtt_sync_read(struct mqtt_client *client) {
+    return __mqtt_sync(client, 1, 0);
+}
+
+enum MQTTErrors mqtt_sync_write(struct mqtt_client *client) {
+    return __mqtt_sync(client, 0, 1);
+}
+
 uint16_t __mqtt_next_pid(struct mqtt_client *client) {
     int pid_exists = 0;
     if (client->pid_lfsr == 0) {
@@ -90,7 +112,6 @@ uint16_t __mqtt_next_pid(struct mqtt_client *client) {
     /* LFSR taps taken from: https://en.wikipedia.org/wiki/Linear-feedback_shift_register */
     
     do {
-        struct mqtt_queued_message *curr;
         unsigned lsb = client->pid_lfsr & 1;
         (client->pid_lfsr) >>= 1;
         if (lsb) {
@@ -98,13 +119,7 @@ uint16_t __mqtt_next_pid(struct mqtt_client *client) {
         }
 
         /* check that the PID is unique */
-        pid_exists = 0;
-        for(curr = mqtt_mq_get(&(client->mq), 0); curr >= client->mq.queue_tail; --curr) {
-            if (curr->packet_id == client->pid_lfsr) {
-                pid_exists = 1;
-                break;
-            }
-        }
+        pid_exists = __mqtt_mq_pid_in_use(&client->mq, client->pid_lfsr);
 
     } while(pid_exists);
     return client->pid_lfsr;
@@ -134,13 +149,36 @@ enum MQTTErrors mqtt_init(struct mqtt_client *client,
     client->recv_buffer.curr_sz = client->recv_buffer.mem_size;
 
     client->error = MQTT_ERROR_CONNECT_NOT_CALLED;
-    client->response_timeout = 30;
+    client->response_timeout = 30000;
+    client->min_response_timeout = 1000;
+    client->max_inflight_qos1 = 0;
+    client->max_inflight_qos2 = 1;
+    client->srtt = -1.0f;
+    client->rttvar = 0.0f;
+    client->rto = 0;
     client->number_of_timeouts = 0;
     client->number_of_keep_alives = 0;
     client->typical_response_time = -1.0f;
     client->publish_response_callback = publish_response_callback;
     client->pid_lfsr = 0;
     client->send_offset = 0;
+    client->send_partial = NULL;
+    client->send_first = NULL;
+
+    client->has_buffer_policy = 0;
+    client->owned_send_buffer = NULL;
+    client->owned_recv_buffer = NULL;
+    client->time_of_last_grow = 0;
+    client->send_high_water = 0;
+
+    client->protocol_level = MQTT_PROTOCOL_LEVEL;
+    memset(&client->connect_properties, 0, sizeof(client->connect_properties));
+    client->server_receive_maximum = 0;
+    client->server_topic_alias_maximum = 0;
+    client->server_maximum_qos = 2;
+    client->server_maximum_packet_size = 0;
+    client->last_reason_code = 0;
+    client->num_topic_aliases = 0;
 
     client->inspector_callback = NULL;
     client->reconnect_callback = NULL;
@@ -167,18 +205,379 @@ void mqtt_init_reconnect(struct mqtt_client *client,
     client->recv_buffer.curr_sz = 0;
 
     client->error = MQTT_ERROR_INITIAL_RECONNECT;
-    client->response_timeout = 30;
+    client->response_timeout = 30000;
+    client->min_response_timeout = 1000;
+    client->max_inflight_qos1 = 0;
+    client->max_inflight_qos2 = 1;
+    client->srtt = -1.0f;
+    client->rttvar = 0.0f;
+    client->rto = 0;
     client->number_of_timeouts = 0;
     client->number_of_keep_alives = 0;
     client->typical_response_time = -1.0f;
     client->publish_response_callback = publish_response_callback;
     client->send_offset = 0;
+    client->send_partial = NULL;
+    client->send_first = NULL;
+
+    client->has_buffer_policy = 0;
+    client->owned_send_buffer = NULL;
+    client->owned_recv_buffer = NULL;
+    client->time_of_last_grow = 0;
+    client->send_high_water = 0;
+
+    client->protocol_level = MQTT_PROTOCOL_LEVEL;
+    memset(&client->connect_properties, 0, sizeof(client->connect_properties));
+    client->server_receive_maximum = 0;
+    client->server_topic_alias_maximum = 0;
+    client->server_maximum_qos = 2;
+    client->server_maximum_packet_size = 0;
+    client->last_reason_code = 0;
+    client->num_topic_aliases = 0;
 
     client->inspector_callback = NULL;
     client->reconnect_callback = reconnect;
     client->reconnect_state = reconnect_state;
 }
 
+/* packers shared by the 3.1.1 and MQTT 5 code paths, defined with the others below */
+static ssize_t __mqtt_pack_connection_request(uint8_t* buf, size_t bufsz,
+                                              const char* client_id,
+                                              const char* will_topic,
+                                              const void* will_message,
+                                              size_t will_message_size,
+                                              const char* user_name,
+                                              const char* password,
+                                              uint8_t connect_flags,
+                                              uint16_t keep_alive,
+                                              uint8_t protocol_level,
+                                              const struct mqtt_connect_properties *properties);
+static ssize_t __mqtt_pack_publish_header(uint8_t *buf, size_t bufsz,
+                                          const char* topic_name,
+                                          uint16_t packet_id,
+                                          size_t application_message_size,
+                                          uint8_t publish_flags,
+                                          uint8_t protocol_level,
+                                          uint16_t topic_alias,
+                                          int alias_known);
+static ssize_t __mqtt_pack_publish(uint8_t *buf, size_t bufsz,
+                                   const char* topic_name,
+                                   uint16_t packet_id,
+                                   const void* application_message,
+                                   size_t application_message_size,
+                                   uint8_t publish_flags,
+                                   uint8_t protocol_level,
+                                   uint16_t topic_alias,
+                                   int alias_known);
+static ssize_t __mqtt_pack_subscribe(uint8_t *buf, size_t bufsz, unsigned int packet_id,
+                                     const char **topic, const uint8_t *max_qos, unsigned int num_subs,
+                                     uint8_t protocol_level);
+static ssize_t __mqtt_pack_unsubscribe(uint8_t *buf, size_t bufsz, unsigned int packet_id,
+                                       const char **topic, unsigned int num_subs,
+                                       uint8_t protocol_level);
+
+/*
+ * Buffer policy helpers. These all expect the client's mutex to be held.
+ */
+static void* __mqtt_policy_alloc(struct mqtt_client *client, size_t size)
+{
+    if (client->buffer_policy.alloc != NULL) {
+        return client->buffer_policy.alloc(client->buffer_policy.state, size);
+    }
+    return MQTT_PAL_MALLOC(size);
+}
+
+static void __mqtt_policy_free(struct mqtt_client *client, void *buf, size_t size)
+{
+    if (buf == NULL) {
+        return;
+    }
+    if (client->buffer_policy.free != NULL) {
+        client->buffer_policy.free(client->buffer_policy.state, buf, size);
+    } else {
+        MQTT_PAL_FREE(buf);
+    }
+}
+
+/**
+ * Packs a copy of the queued PUBLISH msg with its topic alias replaced by the full topic.
+ */
+static ssize_t __mqtt_unalias_publish(struct mqtt_client *client, uint8_t *buf, size_t bufsz,
+                                      const struct mqtt_queued_message *msg)
+{
+    const uint8_t *p = msg->start + 1;
+    uint8_t publish_flags = msg->start[0] & 0x0F;
+    uint16_t packet_id = 0;
+    size_t inline_size;
+    ssize_t rv;
+
+    /* skip the fixed header, the (possibly empty) topic and the packet id */
+    while (*p++ & 0x80) {
+    }
+    p += 2 + __mqtt_unpack_uint16(p);
+    if (publish_flags & MQTT_PUBLISH_QOS_MASK) {
+        packet_id = __mqtt_unpack_uint16(p);
+        p += 2;
+    }
+    /* the properties we pack always fit a one byte length */
+    p += 1 + *p;
+    inline_size = (size_t) (msg->start + msg->size - p);
+
+    rv = __mqtt_pack_publish_header(buf, bufsz, client->topic_aliases[msg->topic_alias - 1], packet_id,
+                                    inline_size + msg->payload_size, publish_flags, 
+                                    MQTT_PROTOCOL_LEVEL_5, 0, 0);
+    if (rv <= 0) {
+        return rv;
+    }
+    if (bufsz - (size_t)rv < inline_size) {
+        return 0;
+    }
+    buf[0] |= msg->start[0] & MQTT_PUBLISH_DUP;
+    memcpy(buf + rv, p, inline_size);
+    return rv + (ssize_t)inline_size;
+}
+
+/**
+ * Moves the queued messages into a new send buffer of new_size bytes, dropping completed
+ * ones, and repacking PUBLISHes that use a topic alias if strip_topic_aliases is set (only
+ * done between connections, when nothing is partially sent). A partially sent message is 
+ * always moved, byte for byte, since the rest of it still has to be written. 
+ * Returns 1 on success, or 0 (leaving the queue untouched) if the buffer couldn't be
+ * allocated or is too small for what is queued.
+ */
+static int __mqtt_resize_send_buffer(struct mqtt_client *client, size_t new_size, int strip_topic_aliases)
+{
+    struct mqtt_message_queue mq;
+    void *buf = __mqtt_policy_alloc(client, new_size);
+    struct mqtt_queued_message *send_partial = NULL;
+    struct mqtt_queued_message *send_first = NULL;
+    size_t i;
+
+    if (buf == NULL) {
+        return 0;
+    }
+    mqtt_mq_init(&mq, buf, new_size);
+
+    /* copy everything that is still outstanding, in order */
+    for(i = 0; i < client->mq.queue_length; ++i) {
+        struct mqtt_queued_message *src = mqtt_mq_get(&client->mq, i);
+        struct mqtt_queued_message *dst;
+        ssize_t size = (ssize_t) src->size;
+        if (src->state == MQTT_QUEUED_COMPLETE && src != client->send_partial) {
+            continue;
+        }
+        if (strip_topic_aliases && src->topic_alias != 0) {
+            size = __mqtt_unalias_publish(client, mq.curr, mq.curr_sz, src);
+        } else if (mq.curr_sz >= src->size) {
+            memcpy(mq.curr, src->start, src->size);
+        } else {
+            size = 0;
+        }
+        if (size <= 0) {
+            __mqtt_policy_free(client, buf, new_size);
+            return 0;
+        }
+        dst = mqtt_mq_register(&mq, (size_t) size);
+        dst->state = src->state;
+        dst->time_sent = src->time_sent;
+        dst->control_type = src->control_type;
+        dst->packet_id = src->packet_id;
+        dst->resend_count = src->resend_count;
+        dst->topic_alias = strip_topic_aliases ? 0 : src->topic_alias;
+        dst->payload = src->payload;
+        dst->payload_size = src->payload_size;
+        dst->payload_ref = src->payload_ref;
+        mqtt_mq_index(&mq, dst);
+        if (src == client->send_partial) {
+            send_partial = dst;
+        }
+        if (src == client->send_first) {
+            send_first = dst;
+        }
+    }
+
+    /* completed messages that were left behind give their payloads back */
+    for(i = 0; i < client->mq.queue_length; ++i) {
+        struct mqtt_queued_message *src = mqtt_mq_get(&client->mq, i);
+        if (src->state == MQTT_QUEUED_COMPLETE && src != client->send_partial && src->payload_ref != NULL) {
+            mqtt_payload_ref_release(src->payload_ref);
+        }
+    }
+
+    if (client->owned_send_buffer != NULL) {
+        __mqtt_policy_free(client, client->owned_send_buffer, 
+                           (size_t) ((uint8_t *)client->mq.mem_end - (uint8_t *)client->mq.mem_start));
+    }
+    client->owned_send_buffer = buf;
+    client->mq = mq;
+    client->mq.pinned = send_partial;
+    client->send_partial = send_partial;
+    client->send_first = send_first;
+    return 1;
+}
+
+/**
+ * Grows the send buffer (doubling) so that at least needed more bytes can be packed.
+ * Returns 1 if the buffer grew, 0 if there is no policy or it is at its ceiling.
+ */
+static int __mqtt_grow_send_buffer(struct mqtt_client *client, size_t needed)
+{
+    size_t size = (size_t) ((uint8_t *)client->mq.mem_end - (uint8_t *)client->mq.mem_start);
+    size_t new_size = size > 0 ? 2 * size : client->buffer_policy.send_initial_size;
+
+    if (!client->has_buffer_policy || size >= client->buffer_policy.send_max_size || new_size == 0) {
+        return 0;
+    }
+    while (new_size < size + 2 * needed) {
+        new_size *= 2;
+    }
+    if (new_size > client->buffer_policy.send_max_size) {
+        new_size = client->buffer_policy.send_max_size;
+    }
+
+    if (!__mqtt_resize_send_buffer(client, new_size, 0)) {
+        return 0;
+    }
+    client->time_of_last_grow = MQTT_PAL_TIME();
+    return 1;
+}
+
+/**
+ * Gives back an oversized send buffer once the queue is empty and it hasn't grown for a while.
+ */
+static void __mqtt_shrink_send_buffer(struct mqtt_client *client)
+{
+    size_t size = (size_t) ((uint8_t *)client->mq.mem_end - (uint8_t *)client->mq.mem_start);
+    if (client->has_buffer_policy
+        && client->mq.queue_length == 0
+        && size > client->buffer_policy.send_initial_size
+        && MQTT_PAL_TIME() - client->time_of_last_grow >= client->buffer_policy.shrink_after)
+    {
+        __mqtt_resize_send_buffer(client, client->buffer_policy.send_initial_size, 0);
+    }
+}
+
+/**
+ * Doubles the receive buffer, keeping the bytes received so far. Returns 1 if it grew.
+ */
+static int __mqtt_grow_recv_buffer(struct mqtt_client *client)
+{
+    size_t size = client->recv_buffer.mem_size;
+    size_t used = (size_t) (client->recv_buffer.curr - client->recv_buffer.mem_start);
+    size_t new_size = size > 0 ? 2 * size : client->buffer_policy.recv_initial_size;
+    uint8_t *buf;
+
+    if (!client->has_buffer_policy || size >= client->buffer_policy.recv_max_size) {
+        return 0;
+    }
+    if (new_size > client->buffer_policy.recv_max_size) {
+        new_size = client->buffer_policy.recv_max_size;
+    }
+    buf = (uint8_t *) __mqtt_policy_alloc(client, new_size);
+    if (buf == NULL) {
+        return 0;
+    }
+    if (used > 0) {
+        memcpy(buf, client->recv_buffer.mem_start, used);
+    }
+    __mqtt_policy_free(client, client->owned_recv_buffer, size);
+
+    client->owned_recv_buffer = buf;
+    client->recv_buffer.mem_start = buf;
+    client->recv_buffer.mem_size = new_size;
+    client->recv_buffer.curr = buf + used;
+    client->recv_buffer.curr_sz = new_size - used;
+    return 1;
+}
+
+/**
+ * Keeps the messages that should be sent again on a new connection, completing the rest.
+ */
+static void __mqtt_retain_for_reconnect(struct mqtt_client *client)
+{
+    size_t extra = 0;
+    size_t i;
+    for(i = 0; i < client->mq.queue_length; ++i) {
+        struct mqtt_queued_message *msg = mqtt_mq_get(&client->mq, i);
+        switch (msg->control_type) {
+        case MQTT_CONTROL_PUBLISH:
+        case MQTT_CONTROL_PUBREL:
+        case MQTT_CONTROL_SUBSCRIBE:
+        case MQTT_CONTROL_UNSUBSCRIBE:
+            if (msg->state != MQTT_QUEUED_COMPLETE) {
+                msg->state = MQTT_QUEUED_UNSENT;
+                if (msg->topic_alias != 0) {
+                    extra += strlen(client->topic_aliases[msg->topic_alias - 1]) + 1;
+                }
+            }
+            break;
+        default:
+            /* CONNECT, PINGREQ and DISCONNECT belong to the old connection, as do our acks */
+            msg->state = MQTT_QUEUED_COMPLETE;
+            break;
+        }
+    }
+    mqtt_mq_clean(&client->mq);
+
+    /* topic aliases belong to the old connection too, so put the topics back. Only about 
+       half of the new block is packet data, hence the headroom */
+    if (extra > 0) {
+        size_t size = (size_t) ((uint8_t *)client->mq.mem_end - (uint8_t *)client->mq.mem_start);
+        if (!__mqtt_resize_send_buffer(client, size + 4 * extra, 1)) {
+            /* without room for their topics these messages can't be sent again */
+            for(i = 0; i < client->mq.queue_length; ++i) {
+                struct mqtt_queued_message *msg = mqtt_mq_get(&client->mq, i);
+                if (msg->topic_alias != 0) {
+                    msg->state = MQTT_QUEUED_COMPLETE;
+                }
+            }
+            mqtt_mq_clean(&client->mq);
+        }
+    }
+}
+
+void mqtt_set_buffer_policy(struct mqtt_client *client, const struct mqtt_buffer_policy *policy)
+{
+    client->buffer_policy = *policy;
+    client->has_buffer_policy = 1;
+}
+
+enum MQTTErrors mqtt_set_protocol_version(struct mqtt_client *client, uint8_t protocol_level,
+                                          const struct mqtt_connect_properties *properties)
+{
+    if (protocol_level != MQTT_PROTOCOL_LEVEL && protocol_level != MQTT_PROTOCOL_LEVEL_5) {
+        return MQTT_ERROR_NOT_IMPLEMENTED;
+    }
+    client->protocol_level = protocol_level;
+    if (properties != NULL) {
+        client->connect_properties = *properties;
+    } else {
+        memset(&client->connect_properties, 0, sizeof(client->connect_properties));
+    }
+    return MQTT_OK;
+}
+
+void mqtt_free_buffers(struct mqtt_client *client)
+{
+    mqtt_mq_release_payloads(&client->mq);
+    if (client->owned_send_buffer != NULL) {
+        __mqtt_policy_free(client, client->owned_send_buffer,
+                           (size_t) ((uint8_t *)client->mq.mem_end - (uint8_t *)client->mq.mem_start));
+        client->owned_send_buffer = NULL;
+    }
+    mqtt_mq_init(&client->mq, NULL, 0);
+    client->send_partial = NULL;
+    client->send_first = NULL;
+    client->send_offset = 0;
+
+    __mqtt_policy_free(client, client->owned_recv_buffer, client->recv_buffer.mem_size);
+    client->owned_recv_buffer = NULL;
+    client->recv_buffer.mem_start = NULL;
+    client->recv_buffer.mem_size = 0;
+    client->recv_buffer.curr = NULL;
+    client->recv_buffer.curr_sz = 0;
+}
+
 void mqtt_reinit(struct mqtt_client* client,
                  mqtt_pal_socket_handle socketfd,
                  uint8_t *sendbuf, size_t sendbufsz,
@@ -186,11 +585,46 @@ void mqtt_reinit(struct mqtt_client* client,
 {
     client->error = MQTT_ERROR_CONNECT_NOT_CALLED;
     client->socketfd = socketfd;
+    client->send_offset = 0;
+    client->send_partial = NULL;
+    client->send_first = NULL;
+    client->mq.pinned = NULL;
+
+    if (sendbuf == NULL && client->has_buffer_policy) {
+        /* keep our own buffer, and what's queued in it for the new connection */
+        if (client->mq.mem_start != NULL) {
+            __mqtt_retain_for_reconnect(client);
+        } else {
+            __mqtt_grow_send_buffer(client, 0);
+        }
+    } else {
+        /* anything still queued is dropped with the old session */
+        mqtt_mq_release_payloads(&client->mq);
+        if (client->owned_send_buffer != NULL) {
+            __mqtt_policy_free(client, client->owned_send_buffer,
+                               (size_t) ((uint8_t *)client->mq.mem_end - (uint8_t *)client->mq.mem_start));
+            client->owned_send_buffer = NULL;
+        }
+        mqtt_mq_init(&client->mq, sendbuf, sendbufsz);
+    }
 
-    mqtt_mq_init(&client->mq, sendbuf, sendbufsz);
+    /* the broker's limits and our topic aliases are set up again by the next CONNACK */
+    client->server_receive_maximum = 0;
+    client->server_topic_alias_maximum = 0;
+    client->server_maximum_qos = 2;
+    client->server_maximum_packet_size = 0;
+    client->num_topic_aliases = 0;
 
-    client->recv_buffer.mem_start = recvbuf;
-    client->recv_buffer.mem_size = recvbufsz;
+    if (recvbuf == NULL && client->has_buffer_policy) {
+        if (client->recv_buffer.mem_start == NULL) {
+            __mqtt_grow_recv_buffer(client);
+        }
+    } else {
+        __mqtt_policy_free(client, client->owned_recv_buffer, client->recv_buffer.mem_size);
+        client->owned_recv_buffer = NULL;
+        client->recv_buffer.mem_start = recvbuf;
+        client->recv_buffer.mem_size = recvbufsz;
+    }
     client->recv_buffer.curr = client->recv_buffer.mem_start;
     client->recv_buffer.curr_sz = client->recv_buffer.mem_size;
 }
@@ -201,6 +635,7 @@ void mqtt_reinit(struct mqtt_client* client,
  *      2) Attempts to pack to client's message queue.
  *          a) handles errors
  *          b) if mq buffer is too small, cleans it and tries again
+ *          c) if it's still too small, grows it (with a buffer policy) and tries again
  *      3) Upon successful pack, registers the new message.
  */
 #define MQTT_CLIENT_TRY_PACK(tmp, msg, client, pack_call, release)  \
@@ -216,6 +651,9 @@ void mqtt_reinit(struct mqtt_client* client,
     } else if (tmp == 0) {                                          \
         mqtt_mq_clean(&client->mq);                                 \
         tmp = pack_call;                                            \
+        while (tmp == 0 && __mqtt_grow_send_buffer(client, 0)) {    \
+            tmp = pack_call;                                        \
+        }                                                           \
         if (tmp < 0) {                                              \
             client->error = (enum MQTTErrors)tmp;                                    \
             if (release) MQTT_PAL_MUTEX_UNLOCK(&client->mutex);     \
@@ -252,21 +690,110 @@ enum MQTTErrors mqtt_connect(struct mqtt_client *client,
     
     /* try to pack the message */
     MQTT_CLIENT_TRY_PACK(rv, msg, client, 
-        mqtt_pack_connection_request(
+        __mqtt_pack_connection_request(
             client->mq.curr, client->mq.curr_sz,
             client_id, will_topic, will_message, 
             will_message_size,user_name, password, 
-            connect_flags, keep_alive
+            connect_flags, keep_alive,
+            client->protocol_level, &client->connect_properties
         ), 
         1
     );
     /* save the control type of the message */
     msg->control_type = MQTT_CONTROL_CONNECT;
 
+    /* messages kept from the last connection have to wait for the CONNECT */
+    if (mqtt_mq_length(&client->mq) > 1) {
+        client->send_first = msg;
+    }
+
     MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
     return MQTT_OK;
 }
 
+/**
+ * Picks the topic alias for a PUBLISH to topic_name on this connection, or 0 for none, and
+ * sets *known if the broker already has it (so the topic can be left out). A new alias is
+ * only recorded by __mqtt_topic_alias_commit, once the PUBLISH has been queued.
+ */
+static uint16_t __mqtt_topic_alias(struct mqtt_client *client, const char *topic_name, int *known)
+{
+    uint16_t i;
+    size_t length;
+
+    *known = 0;
+    if (client->server_topic_alias_maximum == 0 || topic_name == NULL) {
+        return 0;
+    }
+    for(i = 0; i < client->num_topic_aliases; ++i) {
+        if (strcmp(client->topic_aliases[i], topic_name) == 0) {
+            *known = 1;
+            return (uint16_t) (i + 1);
+        }
+    }
+    length = strlen(topic_name);
+    if (length == 0 || length >= MQTT_TOPIC_ALIAS_TOPIC_MAX
+        || i >= client->server_topic_alias_maximum || i >= MQTT_TOPIC_ALIAS_MAX)
+    {
+        return 0;
+    }
+    return (uint16_t) (i + 1);
+}
+
+static void __mqtt_topic_alias_commit(struct mqtt_client *client, const char *topic_name, uint16_t topic_alias, int known)
+{
+    if (topic_alias != 0 && !known) {
+        strcpy(client->topic_aliases[topic_alias - 1], topic_name);
+        client->num_topic_aliases = topic_alias;
+    }
+}
+
+/**
+ * Lowers the QoS in publish_flags to the most the broker supports.
+ */
+static uint8_t __mqtt_publish_flags(struct mqtt_client *client, uint8_t publish_flags)
+{
+    uint8_t qos = (publish_flags & MQTT_PUBLISH_QOS_MASK) >> 1;
+    if (qos != 3 && qos > client->server_maximum_qos) {
+        publish_flags = (uint8_t) ((publish_flags & ~MQTT_PUBLISH_QOS_MASK) | (client->server_maximum_qos << 1));
+    }
+    return publish_flags;
+}
+
+/**
+ * The most bytes __mqtt_pack_publish will produce for a message.
+ */
+static size_t __mqtt_packed_publish_size(const char* topic_name, size_t application_message_size, uint8_t publish_flags,
+                                         uint8_t protocol_level)
+{
+    size_t remaining_length = __mqtt_packed_cstrlen(topic_name) + application_message_size;
+    size_t header_length = 2;
+    if (publish_flags & MQTT_PUBLISH_QOS_MASK) {
+        remaining_length += 2;
+    }
+    if (protocol_level >= MQTT_PROTOCOL_LEVEL_5) {
+        /* the property length and a topic alias */
+        remaining_length += 4;
+    }
+    while (remaining_length >= ((size_t)1 << (7 * (header_length - 1)))) {
+        ++header_length;
+    }
+    return header_length + remaining_length;
+}
+
+/**
+ * The largest packet that can ever be queued: the send buffer's data ring, or with a buffer
+ * policy, that of the largest send buffer it can grow to.
+ */
+static size_t __mqtt_max_packet_size(const struct mqtt_client *client)
+{
+    size_t max_size = (size_t) (client->mq.data_end - client->mq.data_start);
+    if (client->has_buffer_policy && mqtt_mq_max_packet_size(client->buffer_policy.send_max_size) > max_size) {
+        max_size = mqtt_mq_max_packet_size(client->buffer_policy.send_max_size);
+    }
+    return max_size;
+}
+
 enum MQTTErrors mqtt_publish(struct mqtt_client *client,
                      const char* topic_name,
                      const void* application_message,
@@ -276,31 +803,239 @@ enum MQTTErrors mqtt_publish(struct mqtt_client *client,
     struct mqtt_queued_message *msg;
     ssize_t rv;
     uint16_t packet_id;
+    uint16_t topic_alias;
+    int alias_known;
     MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    if (topic_name != NULL
+        && __mqtt_packed_publish_size(topic_name, application_message_size, publish_flags, client->protocol_level)
+           > __mqtt_max_packet_size(client))
+    {
+        /* no amount of cleaning or growing would make room for it */
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return MQTT_ERROR_SEND_BUFFER_TOO_SMALL;
+    }
     packet_id = __mqtt_next_pid(client);
+    publish_flags = __mqtt_publish_flags(client, publish_flags);
+    topic_alias = __mqtt_topic_alias(client, topic_name, &alias_known);
 
 
     /* try to pack the message */
     MQTT_CLIENT_TRY_PACK(
         rv, msg, client, 
-        mqtt_pack_publish_request(
+        __mqtt_pack_publish(
             client->mq.curr, client->mq.curr_sz,
             topic_name,
             packet_id,
             application_message,
             application_message_size,
-            publish_flags
+            publish_flags,
+            client->protocol_level,
+            topic_alias,
+            alias_known
+        ), 
+        1
+    );
+    /* save the control type and packet id of the message */
+    msg->control_type = MQTT_CONTROL_PUBLISH;
+    msg->packet_id = packet_id;
+    msg->topic_alias = topic_alias;
+    mqtt_mq_index(&client->mq, msg);
+    __mqtt_topic_alias_commit(client, topic_name, topic_alias, alias_known);
+
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    return MQTT_OK;
+}
+
+enum MQTTErrors mqtt_publish_ref(struct mqtt_client *client,
+                                 const char* topic_name,
+                                 const void* application_message,
+                                 size_t application_message_size,
+                                 uint8_t publish_flags,
+                                 struct mqtt_payload_ref *payload_ref)
+{
+    struct mqtt_queued_message *msg;
+    ssize_t rv;
+    uint16_t packet_id;
+    uint16_t topic_alias;
+    int alias_known;
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    if (topic_name != NULL
+        && __mqtt_packed_publish_size(topic_name, application_message_size, publish_flags, client->protocol_level)
+           - application_message_size > __mqtt_max_packet_size(client))
+    {
+        /* no amount of cleaning or growing would make room for the header */
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return MQTT_ERROR_SEND_BUFFER_TOO_SMALL;
+    }
+    packet_id = __mqtt_next_pid(client);
+    publish_flags = __mqtt_publish_flags(client, publish_flags);
+    topic_alias = __mqtt_topic_alias(client, topic_name, &alias_known);
+
+
+    /* try to pack the header, the payload stays where it is */
+    MQTT_CLIENT_TRY_PACK(
+        rv, msg, client, 
+        __mqtt_pack_publish_header(
+            client->mq.curr, client->mq.curr_sz,
+            topic_name,
+            packet_id,
+            application_message_size,
+            publish_flags,
+            client->protocol_level,
+            topic_alias,
+            alias_known
         ), 
         1
     );
     /* save the control type and packet id of the message */
     msg->control_type = MQTT_CONTROL_PUBLISH;
     msg->packet_id = packet_id;
+    msg->topic_alias = topic_alias;
+    mqtt_mq_index(&client->mq, msg);
+    __mqtt_topic_alias_commit(client, topic_name, topic_alias, alias_known);
+
+    /* point the message at the caller's payload, holding a reference until it is cleaned */
+    msg->payload = (const uint8_t *)application_message;
+    msg->payload_size = application_message_size;
+    msg->payload_ref = payload_ref;
+    if (payload_ref != NULL) {
+        mqtt_payload_ref_retain(payload_ref);
+    }
 
     MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
     return MQTT_OK;
 }
 
+enum MQTTErrors mqtt_publish_batch(struct mqtt_client *client,
+                                   const char* topic_name,
+                                   struct mqtt_publish_entry *entries,
+                                   size_t count)
+{
+    enum MQTTErrors result = MQTT_OK;
+    size_t needed = 0;
+    size_t max_size;
+    size_t fits;
+    size_t queued = 0;
+    int full = 0;
+    size_t i;
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+
+    /* with a buffer policy the queue survives reconnects, so keep queueing through errors */
+    if (client->error < 0 && !client->has_buffer_policy) {
+        for(i = 0; i < count; ++i) {
+            entries[i].status = client->error;
+        }
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return count > 0 ? client->error : MQTT_OK;
+    }
+
+    /* check the space for the whole batch once, cleaning the queue if it's short */
+    max_size = __mqtt_max_packet_size(client);
+    for(i = 0; i < count; ++i) {
+        const char *topic = entries[i].topic_name != NULL ? entries[i].topic_name : topic_name;
+        size_t size;
+        if (topic != NULL) {
+            size = __mqtt_packed_publish_size(topic, entries[i].application_message_size, entries[i].publish_flags,
+                                              client->protocol_level);
+            if (size <= max_size) {
+                needed += size;
+            }
+        }
+    }
+    if (client->mq.curr_sz < needed 
+        || client->mq.queue_capacity - client->mq.queue_length < count) 
+    {
+        mqtt_mq_clean(&client->mq);
+        while ((client->mq.curr_sz < needed 
+                || client->mq.queue_capacity - client->mq.queue_length < count)
+               && __mqtt_grow_send_buffer(client, needed))
+        {
+        }
+    }
+    fits = client->mq.queue_capacity - client->mq.queue_length;
+
+    /* pack everything back to back */
+    for(i = 0; i < count; ++i) {
+        struct mqtt_publish_entry *entry = &entries[i];
+        const char *topic = entry->topic_name != NULL ? entry->topic_name : topic_name;
+        struct mqtt_queued_message *msg;
+        uint16_t packet_id;
+        uint16_t topic_alias;
+        int alias_known;
+        ssize_t rv = 0;
+
+        if (topic != NULL
+            && __mqtt_packed_publish_size(topic, entry->application_message_size, entry->publish_flags,
+                                          client->protocol_level) > max_size)
+        {
+            /* it would never fit, skip it */
+            entry->status = MQTT_ERROR_SEND_BUFFER_TOO_SMALL;
+        } else if (full || queued >= fits) {
+            entry->status = MQTT_ERROR_SEND_BUFFER_IS_FULL;
+        } else {
+            packet_id = __mqtt_next_pid(client);
+            topic_alias = __mqtt_topic_alias(client, topic, &alias_known);
+            rv = __mqtt_pack_publish(
+                client->mq.curr, client->mq.curr_sz,
+                topic,
+                packet_id,
+                entry->application_message,
+                entry->application_message_size,
+                __mqtt_publish_flags(client, entry->publish_flags),
+                client->protocol_level,
+                topic_alias,
+                alias_known
+            );
+            if (rv > 0) {
+                msg = mqtt_mq_register(&client->mq, (size_t)rv);
+                /* save the control type and packet id of the message */
+                msg->control_type = MQTT_CONTROL_PUBLISH;
+                msg->packet_id = packet_id;
+                msg->topic_alias = topic_alias;
+                mqtt_mq_index(&client->mq, msg);
+                __mqtt_topic_alias_commit(client, topic, topic_alias, alias_known);
+                entry->status = MQTT_OK;
+                ++queued;
+            } else {
+                entry->status = (rv == 0) ? MQTT_ERROR_SEND_BUFFER_IS_FULL : (enum MQTTErrors)rv;
+            }
+        }
+
+        if (entry->status == MQTT_ERROR_SEND_BUFFER_IS_FULL) {
+            /* keep the order: nothing after a message that didn't fit is queued */
+            full = 1;
+        }
+        if (entry->status != MQTT_OK && result == MQTT_OK) {
+            /* a full or too small buffer is reported per message, anything else is a client error */
+            result = entry->status;
+            if (result != MQTT_ERROR_SEND_BUFFER_IS_FULL && result != MQTT_ERROR_SEND_BUFFER_TOO_SMALL) {
+                client->error = result;
+            }
+        }
+    }
+
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    return result;
+}
+
+void mqtt_payload_ref_init(struct mqtt_payload_ref *ref, void (*release)(struct mqtt_payload_ref *ref))
+{
+    ref->refcount = 1;
+    ref->release = release;
+}
+
+void mqtt_payload_ref_retain(struct mqtt_payload_ref *ref)
+{
+    MQTT_PAL_REFCOUNT_INC(&ref->refcount);
+}
+
+void mqtt_payload_ref_release(struct mqtt_payload_ref *ref)
+{
+    if (MQTT_PAL_REFCOUNT_DEC(&ref->refcount) == 0 && ref->release != NULL) {
+        ref->release(ref);
+    }
+}
+
 ssize_t __mqtt_puback(struct mqtt_client *client, uint16_t packet_id) {
     ssize_t rv;
     struct mqtt_queued_message *msg;
@@ -318,6 +1053,7 @@ ssize_t __mqtt_puback(struct mqtt_client *client, uint16_t packet_id) {
     /* save the control type and packet id of the message */
     msg->control_type = MQTT_CONTROL_PUBACK;
     msg->packet_id = packet_id;
+    mqtt_mq_index(&client->mq, msg);
 
     return MQTT_OK;
 }
@@ -339,6 +1075,7 @@ ssize_t __mqtt_pubrec(struct mqtt_client *client, uint16_t packet_id) {
     /* save the control type and packet id of the message */
     msg->control_type = MQTT_CONTROL_PUBREC;
     msg->packet_id = packet_id;
+    mqtt_mq_index(&client->mq, msg);
 
     return MQTT_OK;
 }
@@ -360,6 +1097,7 @@ ssize_t __mqtt_pubrel(struct mqtt_client *client, uint16_t packet_id) {
     /* save the control type and packet id of the message */
     msg->control_type = MQTT_CONTROL_PUBREL;
     msg->packet_id = packet_id;
+    mqtt_mq_index(&client->mq, msg);
 
     return MQTT_OK;
 }
@@ -381,6 +1119,7 @@ ssize_t __mqtt_pubcomp(struct mqtt_client *client, uint16_t packet_id) {
     /* save the control type and packet id of the message */
     msg->control_type = MQTT_CONTROL_PUBCOMP;
     msg->packet_id = packet_id;
+    mqtt_mq_index(&client->mq, msg);
 
     return MQTT_OK;
 }
@@ -391,6 +1130,7 @@ enum MQTTErrors mqtt_subscribe(struct mqtt_client *client,
 {
     ssize_t rv;
     uint16_t packet_id;
+    uint8_t max_qos = (uint8_t) max_qos_level;
     struct mqtt_queued_message *msg;
     MQTT_PAL_MUTEX_LOCK(&client->mutex);
     packet_id = __mqtt_next_pid(client);
@@ -398,18 +1138,20 @@ enum MQTTErrors mqtt_subscribe(struct mqtt_client *client,
     /* try to pack the message */
     MQTT_CLIENT_TRY_PACK(
         rv, msg, client, 
-        mqtt_pack_subscribe_request(
+        __mqtt_pack_subscribe(
             client->mq.curr, client->mq.curr_sz,
             packet_id,
-            topic_name,
-            max_qos_level,
-            (const char*)NULL
+            &topic_name,
+            &max_qos,
+            1,
+            client->protocol_level
         ), 
         1
     );
     /* save the control type and packet id of the message */
     msg->control_type = MQTT_CONTROL_SUBSCRIBE;
     msg->packet_id = packet_id;
+    mqtt_mq_index(&client->mq, msg);
 
     MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
     return MQTT_OK;
@@ -426,17 +1168,19 @@ enum MQTTErrors mqtt_unsubscribe(struct mqtt_client *client,
     /* try to pack the message */
     MQTT_CLIENT_TRY_PACK(
         rv, msg, client, 
-        mqtt_pack_unsubscribe_request(
+        __mqtt_pack_unsubscribe(
             client->mq.curr, client->mq.curr_sz,
             packet_id,
-            topic_name,
-            (const char*)NULL
+            &topic_name,
+            1,
+            client->protocol_level
         ), 
         1
     );
     /* save the control type and packet id of the message */
     msg->control_type = MQTT_CONTROL_UNSUBSCRIBE;
     msg->packet_id = packet_id;
+    mqtt_mq_index(&client->mq, msg);
 
     MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
     return MQTT_OK;
@@ -470,167 +1214,473 @@ enum MQTTErrors __mqtt_ping(struct mqtt_client *client)
     return MQTT_OK;
 }
 
-enum MQTTErrors mqtt_reconnect(struct mqtt_client *client)
+enum MQTTErrors mqtt_reconnect(struct mqtt_client *client)
+{
+    enum MQTTErrors err = mqtt_disconnect(client);
+
+    if (err == MQTT_OK) {
+        MQTT_PAL_MUTEX_LOCK(&client->mutex);
+        client->error = MQTT_ERROR_RECONNECTING;
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    }
+    return err;
+}
+
+enum MQTTErrors mqtt_disconnect(struct mqtt_client *client) 
+{
+    ssize_t rv;
+    struct mqtt_queued_message *msg;
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+
+    /* try to pack the message */
+    MQTT_CLIENT_TRY_PACK(
+        rv, msg, client, 
+        mqtt_pack_disconnect(
+            client->mq.curr, client->mq.curr_sz
+        ), 
+        1
+    );
+    /* save the control type and packet id of the message */
+    msg->control_type = MQTT_CONTROL_DISCONNECT;
+
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    return MQTT_OK;
+}
+
+/**
+ * How long to wait for the ACK of a message before sending it again.
+ */
+static mqtt_pal_time_t __mqtt_retransmit_timeout(struct mqtt_client *client, struct mqtt_queued_message *msg)
+{
+    mqtt_pal_time_t timeout = (client->srtt < 0) ? client->response_timeout : client->rto;
+    uint8_t backoff = msg->resend_count;
+
+    if (timeout < client->min_response_timeout) {
+        timeout = client->min_response_timeout;
+    }
+    /* exponential backoff per message, so a slow broker isn't flooded with duplicates */
+    while (backoff-- > 0 && timeout < client->response_timeout) {
+        timeout *= 2;
+    }
+    if (timeout > client->response_timeout) {
+        timeout = client->response_timeout;
+    }
+    return timeout;
+}
+
+/**
+ * Whether a message waiting for its ACK is sent again when it times out. MQTT 5 doesn't 
+ * allow PUBLISH or PUBREL to be resent on the same connection [MQTT-4.4.0-1], only on 
+ * the next one (see __mqtt_retain_for_reconnect).
+ */
+static int __mqtt_retransmits(const struct mqtt_client *client, const struct mqtt_queued_message *msg)
+{
+    return client->protocol_level < MQTT_PROTOCOL_LEVEL_5
+        || (msg->control_type != MQTT_CONTROL_PUBLISH && msg->control_type != MQTT_CONTROL_PUBREL);
+}
+
+/**
+ * Updates the RTT estimate and retransmission timeout from the ACK of a message (RFC 6298).
+ */
+static void __mqtt_sample_rtt(struct mqtt_client *client, struct mqtt_queued_message *msg, mqtt_pal_time_t now)
+{
+    float rtt, err;
+
+    /* the ACK of a retransmitted message could be for either copy (Karn's algorithm) */
+    if (msg->resend_count > 0) {
+        return;
+    }
+
+    rtt = (float) (now - msg->time_sent);
+    if (client->srtt < 0) {
+        client->srtt = rtt;
+        client->rttvar = rtt / 2;
+    } else {
+        err = client->srtt - rtt;
+        client->rttvar = 0.75f * client->rttvar + 0.25f * (err < 0 ? -err : err);
+        client->srtt = 0.875f * client->srtt + 0.125f * rtt;
+    }
+    /* the clock granularity is 1 ms */
+    client->rto = (mqtt_pal_time_t) (client->srtt + (4 * client->rttvar > 1.0f ? 4 * client->rttvar : 1.0f) + 0.5f);
+}
+
+/**
+ * Counts the QoS 1 and QoS 2 messages in flight among messages [first, len) of the queue:
+ * PUBLISHes awaiting their ack, and QoS 2 exchanges in their PUBREL/PUBCOMP phase.
+ */
+static void __mqtt_count_inflight(struct mqtt_client *client, ssize_t first, ssize_t len, int *qos1, int *qos2)
+{
+    for(; first < len; ++first) {
+        struct mqtt_queued_message *msg = mqtt_mq_get(&client->mq, first);
+        if (msg == client->send_partial) {
+            continue;
+        }
+        if (msg->control_type == MQTT_CONTROL_PUBREL && msg->state != MQTT_QUEUED_COMPLETE) {
+            *qos2 += 1;
+        } else if (msg->control_type == MQTT_CONTROL_PUBLISH && msg->state == MQTT_QUEUED_AWAITING_ACK) {
+            uint8_t qos = (MQTT_PUBLISH_QOS_MASK & msg->start[0]) >> 1;
+            if (qos == 1) {
+                *qos1 += 1;
+            } else if (qos == 2) {
+                *qos2 += 1;
+            }
+        }
+    }
+}
+
+/**
+ * The in-flight accounting done while walking the queue to decide what may be sent.
+ */
+struct __mqtt_send_window {
+    int inflight_qos1;
+    int inflight_qos2;
+    int inflight_counted;
+    int publish_held;
+};
+
+/**
+ * Counts a partially sent message, which goes out before anything else, into the window.
+ */
+static void __mqtt_window_partial(struct __mqtt_send_window *window, struct mqtt_queued_message *msg)
+{
+    uint8_t inspected;
+    if (msg->state == MQTT_QUEUED_COMPLETE) {
+        /* acknowledged while being written, it's no longer in flight */
+        return;
+    }
+    if (msg->control_type == MQTT_CONTROL_PUBLISH) {
+        inspected = (MQTT_PUBLISH_QOS_MASK & msg->start[0]) >> 1;
+        if (inspected == 1) {
+            window->inflight_qos1 = 1;
+        } else if (inspected == 2) {
+            window->inflight_qos2 = 1;
+        }
+    } else if (msg->control_type == MQTT_CONTROL_PUBREL) {
+        window->inflight_qos2 = 1;
+    }
+}
+
+/**
+ * Accounts message i of the queue (of len) to the window. Returns 0 if it is unsent and
+ * has to be held back, 1 otherwise.
+ */
+static int __mqtt_window_admits(struct mqtt_client *client, struct __mqtt_send_window *window,
+                                struct mqtt_queued_message *msg, ssize_t i, ssize_t len)
+{
+    uint8_t inspected;
+
+    /* only send a new QoS 1 or QoS 2 message if its in-flight window, and the broker's
+       receive maximum, have room. A QoS 2 exchange is in flight until its PUBCOMP, so 
+       PUBRELs count too */
+    if (msg->control_type == MQTT_CONTROL_PUBREL
+        && (msg->state == MQTT_QUEUED_UNSENT || msg->state == MQTT_QUEUED_AWAITING_ACK)
+        && !window->inflight_counted)
+    {
+        window->inflight_qos2 += 1;
+    }
+    if (msg->control_type != MQTT_CONTROL_PUBLISH
+        || (msg->state != MQTT_QUEUED_UNSENT && msg->state != MQTT_QUEUED_AWAITING_ACK))
+    {
+        return 1;
+    }
+
+    inspected = 0x03 & ((msg->start[0]) >> 1); /* qos */
+    if (msg->state == MQTT_QUEUED_AWAITING_ACK) {
+        /* retransmissions of messages already in flight aren't held back */
+        if (!window->inflight_counted) {
+            window->inflight_qos1 += (inspected == 1);
+            window->inflight_qos2 += (inspected == 2);
+        }
+    } else if (window->publish_held) {
+        /* PUBLISHes go out in the order they were queued, whatever their QoS, 
+           and a later one may use the topic alias an earlier one sets up */
+        return 0;
+    } else if (inspected > 0) {
+        int receive_maximum = client->server_receive_maximum;
+        if (!window->inflight_counted 
+            && (receive_maximum > 0 
+                || (inspected == 1 ? client->max_inflight_qos1 : client->max_inflight_qos2) > 0)) 
+        {
+            /* messages queued behind this one can be in flight too */
+            __mqtt_count_inflight(client, i + 1, len, &window->inflight_qos1, &window->inflight_qos2);
+            window->inflight_counted = 1;
+        }
+        if ((inspected == 1 && client->max_inflight_qos1 > 0 && window->inflight_qos1 >= client->max_inflight_qos1)
+            || (inspected == 2 && client->max_inflight_qos2 > 0 && window->inflight_qos2 >= client->max_inflight_qos2)
+            || (receive_maximum > 0 && window->inflight_qos1 + window->inflight_qos2 >= receive_maximum))
+        {
+            window->publish_held = 1;
+            return 0;
+        } else if (inspected == 1) {
+            window->inflight_qos1 += 1;
+        } else {
+            window->inflight_qos2 += 1;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Moves a message that has been completely written to the socket into its next state.
+ */
+static enum MQTTErrors __mqtt_mark_sent(struct mqtt_client *client, struct mqtt_queued_message *msg, mqtt_pal_time_t now)
+{
+    uint8_t inspected;
+
+    /* update timeout watcher */
+    client->time_of_last_send = now;
+    msg->time_sent = now;
+
+    /* a retransmission can be acknowledged (by the ack of an earlier copy) while it is
+       still being written, it's done with once the write finishes */
+    if (msg->state == MQTT_QUEUED_COMPLETE) {
+        return MQTT_OK;
+    }
+
+    /*
+    Determine the state to put the message in.
+    Control Types:
+    MQTT_CONTROL_CONNECT     -> awaiting
+    MQTT_CONTROL_CONNACK     -> n/a
+    MQTT_CONTROL_PUBLISH     -> qos == 0 ? complete : awaiting
+    MQTT_CONTROL_PUBACK      -> complete
+    MQTT_CONTROL_PUBREC      -> awaiting
+    MQTT_CONTROL_PUBREL      -> awaiting
+    MQTT_CONTROL_PUBCOMP     -> complete
+    MQTT_CONTROL_SUBSCRIBE   -> awaiting
+    MQTT_CONTROL_SUBACK      -> n/a
+    MQTT_CONTROL_UNSUBSCRIBE -> awaiting
+    MQTT_CONTROL_UNSUBACK    -> n/a
+    MQTT_CONTROL_PINGREQ     -> awaiting
+    MQTT_CONTROL_PINGRESP    -> n/a
+    MQTT_CONTROL_DISCONNECT  -> complete
+    */
+    switch (msg->control_type) {
+    case MQTT_CONTROL_PUBACK:
+    case MQTT_CONTROL_PUBCOMP:
+    case MQTT_CONTROL_DISCONNECT:
+        msg->state = MQTT_QUEUED_COMPLETE;
+        break;
+    case MQTT_CONTROL_PUBLISH:
+        inspected = ( MQTT_PUBLISH_QOS_MASK & (msg->start[0]) ) >> 1; /* qos */
+        if (inspected == 0) {
+            msg->state = MQTT_QUEUED_COMPLETE;
+        } else if (inspected == 1) {
+            msg->state = MQTT_QUEUED_AWAITING_ACK;
+            /*set DUP flag for subsequent sends [Spec MQTT-3.3.1-1] */
+            msg->start[0] |= MQTT_PUBLISH_DUP;
+        } else {
+            msg->state = MQTT_QUEUED_AWAITING_ACK;
+        }
+        break;
+    case MQTT_CONTROL_CONNECT:
+    case MQTT_CONTROL_PUBREC:
+    case MQTT_CONTROL_PUBREL:
+    case MQTT_CONTROL_SUBSCRIBE:
+    case MQTT_CONTROL_UNSUBSCRIBE:
+    case MQTT_CONTROL_PINGREQ:
+        msg->state = MQTT_QUEUED_AWAITING_ACK;
+        break;
+    default:
+        return MQTT_ERROR_MALFORMED_REQUEST;
+    }
+    return MQTT_OK;
+}
+
+/**
+ * Appends the iovec entries for the bytes of msg from offset onwards: the packet in the
+ * queue, then the caller's payload if it was published with mqtt_publish_ref.
+ */
+static int __mqtt_gather(mqtt_pal_iovec *iov, const struct mqtt_queued_message *msg, size_t offset)
 {
-    enum MQTTErrors err = mqtt_disconnect(client);
-
-    if (err == MQTT_OK) {
-        MQTT_PAL_MUTEX_LOCK(&client->mutex);
-        client->error = MQTT_ERROR_RECONNECTING;
-        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    int n = 0;
+    if (offset < msg->size) {
+        iov[n].iov_base = msg->start + offset;
+        iov[n].iov_len = msg->size - offset;
+        ++n;
+        offset = 0;
+    } else {
+        offset -= msg->size;
     }
-    return err;
+    if (msg->payload_size > 0) {
+        iov[n].iov_base = (void *)(msg->payload + offset);
+        iov[n].iov_len = msg->payload_size - offset;
+        ++n;
+    }
+    return n;
 }
 
-enum MQTTErrors mqtt_disconnect(struct mqtt_client *client) 
+/**
+ * Records the message whose bytes up to offset have been written, pinning it in the queue 
+ * until the rest is. NULL when no message is partially sent.
+ */
+static void __mqtt_set_send_partial(struct mqtt_client *client, struct mqtt_queued_message *msg, size_t offset)
 {
-    ssize_t rv;
-    struct mqtt_queued_message *msg;
-    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    client->send_partial = msg;
+    client->send_offset = offset;
+    client->mq.pinned = msg;
+}
 
-    /* try to pack the message */
-    MQTT_CLIENT_TRY_PACK(
-        rv, msg, client, 
-        mqtt_pack_disconnect(
-            client->mq.curr, client->mq.curr_sz
-        ), 
-        1
-    );
-    /* save the control type and packet id of the message */
-    msg->control_type = MQTT_CONTROL_DISCONNECT;
+/**
+ * Writes a batch of messages to the socket with one gathering send.
+ *
+ * The first message in the batch may already be partially sent, in which case its
+ * iovec entries start at client->send_offset. Returns 1 if the whole batch was sent,
+ * 0 if the socket stopped accepting bytes part way through, or an MQTTErrors.
+ */
+static ssize_t __mqtt_send_batch(struct mqtt_client *client, mqtt_pal_iovec *iov, int iovcnt,
+                                 struct mqtt_queued_message **batch, int count)
+{
+    size_t first_offset = client->send_offset;
+    ssize_t sent;
+    mqtt_pal_time_t now;
+    int i;
+
+#if defined(MQTT_PAL_HAVE_SENDALLV)
+    sent = mqtt_pal_sendallv(client->socketfd, iov, iovcnt, 0);
+#else
+    sent = 0;
+    for(i = 0; i < iovcnt; ++i) {
+        ssize_t tmp = mqtt_pal_sendall(client->socketfd, iov[i].iov_base, iov[i].iov_len, 0);
+        if (tmp < 0) {
+            if (sent == 0) {
+                sent = tmp;
+            }
+            break;
+        }
+        sent += tmp;
+        if ((size_t) tmp < iov[i].iov_len) {
+            break;
+        }
+    }
+#endif
+    if (sent < 0) {
+        return sent;
+    }
+    now = MQTT_PAL_TIME();
 
-    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-    return MQTT_OK;
+    /* account the sent bytes to the messages, in order */
+    for(i = 0; i < count; ++i) {
+        struct mqtt_queued_message *msg = batch[i];
+        size_t offset = (i == 0) ? first_offset : 0;
+        size_t remaining = msg->size + msg->payload_size - offset;
+        enum MQTTErrors err;
+
+        if ((size_t) sent < remaining) {
+            /* partial sent. Await additional calls */
+            offset += (size_t) sent;
+            __mqtt_set_send_partial(client, (offset > 0) ? msg : NULL, offset);
+            return 0;
+        }
+
+        /* whole message has been sent */
+        sent -= (ssize_t) remaining;
+        __mqtt_set_send_partial(client, NULL, 0);
+        err = __mqtt_mark_sent(client, msg, now);
+        if (err != MQTT_OK) {
+            return err;
+        }
+    }
+    return 1;
 }
 
-ssize_t __mqtt_send(struct mqtt_client *client) 
+ssize_t __mqtt_send(struct mqtt_client *client)
 {
-    uint8_t inspected;
     ssize_t len;
-    int inflight_qos2 = 0;
+    struct __mqtt_send_window window = {0, 0, 0, 0};
     int i = 0;
-    
+    mqtt_pal_iovec iov[2 * MQTT_SEND_BATCH_MAX];
+    struct mqtt_queued_message *batch[MQTT_SEND_BATCH_MAX];
+    int count = 0;
+    int iovcnt = 0;
+    ssize_t rv = 1;
+    mqtt_pal_time_t now = MQTT_PAL_TIME();
+
     MQTT_PAL_MUTEX_LOCK(&client->mutex);
-    
+
     if (client->error < 0 && client->error != MQTT_ERROR_SEND_BUFFER_IS_FULL) {
         MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
         return client->error;
     }
 
-    /* loop through all messages in the queue */
+    if (client->mq.bytes_queued > client->send_high_water) {
+        client->send_high_water = client->mq.bytes_queued;
+    }
+
+    /* a partially sent message has to be finished before anything else is written */
+    if (client->send_partial == NULL && client->send_first != NULL) {
+        /* a CONNECT queued behind messages kept from the last connection goes out first */
+        __mqtt_set_send_partial(client, client->send_first, 0);
+        client->send_first = NULL;
+    }
+    if (client->send_partial != NULL) {
+        struct mqtt_queued_message *msg = client->send_partial;
+        iovcnt = __mqtt_gather(iov, msg, client->send_offset);
+        batch[0] = msg;
+        count = 1;
+        __mqtt_window_partial(&window, msg);
+    }
+
+    /* loop through all messages in the queue, gathering the ones that need sending */
     len = mqtt_mq_length(&client->mq);
     for(; i < len; ++i) {
         struct mqtt_queued_message *msg = mqtt_mq_get(&client->mq, i);
         int resend = 0;
+        if (msg == client->send_partial) {
+            continue;
+        }
         if (msg->state == MQTT_QUEUED_UNSENT) {
             /* message has not been sent to lets send it */
             resend = 1;
-        } else if (msg->state == MQTT_QUEUED_AWAITING_ACK) {
+        } else if (msg->state == MQTT_QUEUED_AWAITING_ACK && __mqtt_retransmits(client, msg)) {
             /* check for timeout */
-            if (MQTT_PAL_TIME() > msg->time_sent + client->response_timeout) {
+            if (now >= msg->time_sent + __mqtt_retransmit_timeout(client, msg)) {
                 resend = 1;
-                client->number_of_timeouts += 1;
-                client->send_offset = 0;
             }
         }
 
-        /* only send QoS 2 message if there are no inflight QoS 2 PUBLISH messages */
-        if (msg->control_type == MQTT_CONTROL_PUBLISH
-            && (msg->state == MQTT_QUEUED_UNSENT || msg->state == MQTT_QUEUED_AWAITING_ACK)) 
-        {
-            inspected = 0x03 & ((msg->start[0]) >> 1); /* qos */
-            if (inspected == 2) {
-                if (inflight_qos2) {
-                    resend = 0;
-                }
-                inflight_qos2 = 1;
-            }
+        if (!__mqtt_window_admits(client, &window, msg, i, len)) {
+            resend = 0;
         }
 
         /* goto next message if we don't need to send */
         if (!resend) {
             continue;
         }
-
-        /* we're sending the message */
-        {
-          ssize_t tmp = mqtt_pal_sendall(client->socketfd, msg->start + client->send_offset, msg->size - client->send_offset, 0);
-          if (tmp < 0) {
-            client->error = (enum MQTTErrors)tmp;
-            MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-            return tmp;
-          } else {
-            client->send_offset += (unsigned long)tmp;
-            if(client->send_offset < msg->size) {
-              /* partial sent. Await additional calls */
-              break;
-            } else {
-              /* whole message has been sent */
-              client->send_offset = 0;
+        if (msg->state == MQTT_QUEUED_AWAITING_ACK) {
+            client->number_of_timeouts += 1;
+            if (msg->resend_count < UINT8_MAX) {
+                msg->resend_count += 1;
             }
-
-          }
-
         }
 
-        /* update timeout watcher */
-        client->time_of_last_send = MQTT_PAL_TIME();
-        msg->time_sent = client->time_of_last_send;
-
-        /* 
-        Determine the state to put the message in.
-        Control Types:
-        MQTT_CONTROL_CONNECT     -> awaiting
-        MQTT_CONTROL_CONNACK     -> n/a
-        MQTT_CONTROL_PUBLISH     -> qos == 0 ? complete : awaiting
-        MQTT_CONTROL_PUBACK      -> complete
-        MQTT_CONTROL_PUBREC      -> awaiting
-        MQTT_CONTROL_PUBREL      -> awaiting
-        MQTT_CONTROL_PUBCOMP     -> complete
-        MQTT_CONTROL_SUBSCRIBE   -> awaiting
-        MQTT_CONTROL_SUBACK      -> n/a
-        MQTT_CONTROL_UNSUBSCRIBE -> awaiting
-        MQTT_CONTROL_UNSUBACK    -> n/a
-        MQTT_CONTROL_PINGREQ     -> awaiting
-        MQTT_CONTROL_PINGRESP    -> n/a
-        MQTT_CONTROL_DISCONNECT  -> complete
-        */
-        switch (msg->control_type) {
-        case MQTT_CONTROL_PUBACK:
-        case MQTT_CONTROL_PUBCOMP:
-        case MQTT_CONTROL_DISCONNECT:
-            msg->state = MQTT_QUEUED_COMPLETE;
-            break;
-        case MQTT_CONTROL_PUBLISH:
-            inspected = ( MQTT_PUBLISH_QOS_MASK & (msg->start[0]) ) >> 1; /* qos */
-            if (inspected == 0) {
-                msg->state = MQTT_QUEUED_COMPLETE;
-            } else if (inspected == 1) {
-                msg->state = MQTT_QUEUED_AWAITING_ACK;
-                /*set DUP flag for subsequent sends [Spec MQTT-3.3.1-1] */ 
-                msg->start[0] |= MQTT_PUBLISH_DUP;
-            } else {
-                msg->state = MQTT_QUEUED_AWAITING_ACK;
+        /* gather the message, writing the batch out once it is full */
+        iovcnt += __mqtt_gather(iov + iovcnt, msg, 0);
+        batch[count] = msg;
+        if (++count == MQTT_SEND_BATCH_MAX) {
+            rv = __mqtt_send_batch(client, iov, iovcnt, batch, count);
+            count = 0;
+            iovcnt = 0;
+            if (rv <= 0) {
+                break;
             }
-            break;
-        case MQTT_CONTROL_CONNECT:
-        case MQTT_CONTROL_PUBREC:
-        case MQTT_CONTROL_PUBREL:
-        case MQTT_CONTROL_SUBSCRIBE:
-        case MQTT_CONTROL_UNSUBSCRIBE:
-        case MQTT_CONTROL_PINGREQ:
-            msg->state = MQTT_QUEUED_AWAITING_ACK;
-            break;
-        default:
-            client->error = MQTT_ERROR_MALFORMED_REQUEST;
-            MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-            return MQTT_ERROR_MALFORMED_REQUEST;
         }
     }
 
+    /* write out the rest */
+    if (count > 0) {
+        rv = __mqtt_send_batch(client, iov, iovcnt, batch, count);
+    }
+    if (rv < 0) {
+        client->error = (enum MQTTErrors)rv;
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return rv;
+    }
+
     /* check for keep-alive */
     {
-        mqtt_pal_time_t keep_alive_timeout = client->time_of_last_send + (mqtt_pal_time_t)((float)(client->keep_alive));
+        /* keep_alive is in seconds (as sent to the broker), MQTT_PAL_TIME() in milliseconds */
+        mqtt_pal_time_t keep_alive_timeout = client->time_of_last_send + (mqtt_pal_time_t)client->keep_alive * 1000;
         if (MQTT_PAL_TIME() > keep_alive_timeout) {
           ssize_t rv = __mqtt_ping(client);
           if (rv != MQTT_OK) {
@@ -641,6 +1691,86 @@ ssize_t __mqtt_send(struct mqtt_client *client)
         }
     }
 
+    /* pop what has been sent so payloads published by reference are released promptly. A
+       message still part way through being written is pinned, so it (and the payload the
+       iovecs point at) is kept until a later call finishes it, acknowledged or not */
+    mqtt_mq_clean(&client->mq);
+    __mqtt_shrink_send_buffer(client);
+
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    return MQTT_OK;
+}
+
+enum MQTTErrors mqtt_get_readiness(struct mqtt_client *client, struct mqtt_readiness *readiness)
+{
+    struct __mqtt_send_window window = {0, 0, 0, 0};
+    mqtt_pal_time_t now = MQTT_PAL_TIME();
+    mqtt_pal_time_t deadline = MQTT_DEADLINE_NONE;
+    ssize_t len;
+    ssize_t i;
+
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+
+    readiness->socketfd = client->socketfd;
+    readiness->want_read = 0;
+    readiness->want_write = 0;
+    readiness->next_deadline = now;
+
+    /* errors are recovered from (and reconnects made) by mqtt_sync */
+    if (client->error != MQTT_OK && client->error != MQTT_ERROR_SEND_BUFFER_IS_FULL) {
+        enum MQTTErrors err = client->error;
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return err;
+    }
+    readiness->want_read = 1;
+
+    /* mirror the decisions of __mqtt_send, so a message held back by a window doesn't
+       keep the caller polling for a writable socket */
+    if (client->send_partial != NULL || client->send_first != NULL) {
+        readiness->want_write = 1;
+        if (client->send_partial != NULL) {
+            __mqtt_window_partial(&window, client->send_partial);
+        }
+    }
+    len = mqtt_mq_length(&client->mq);
+    for(i = 0; i < len; ++i) {
+        struct mqtt_queued_message *msg = mqtt_mq_get(&client->mq, i);
+        if (msg == client->send_partial || msg == client->send_first) {
+            continue;
+        }
+        if (!__mqtt_window_admits(client, &window, msg, i, len)) {
+            continue;
+        }
+        if (msg->state == MQTT_QUEUED_UNSENT) {
+            readiness->want_write = 1;
+        } else if (msg->state == MQTT_QUEUED_AWAITING_ACK && __mqtt_retransmits(client, msg)) {
+            mqtt_pal_time_t timeout = msg->time_sent + __mqtt_retransmit_timeout(client, msg);
+            if (deadline == MQTT_DEADLINE_NONE || timeout < deadline) {
+                deadline = timeout;
+            }
+        }
+    }
+
+    /* a PINGREQ is sent once keep_alive seconds have passed without sending anything */
+    if (client->keep_alive > 0) {
+        mqtt_pal_time_t keep_alive_timeout = client->time_of_last_send + (mqtt_pal_time_t)client->keep_alive * 1000 + 1;
+        if (deadline == MQTT_DEADLINE_NONE || keep_alive_timeout < deadline) {
+            deadline = keep_alive_timeout;
+        }
+    }
+
+    /* an oversized, idle send buffer is given back */
+    if (client->has_buffer_policy
+        && client->mq.queue_length == 0
+        && (size_t) ((uint8_t *)client->mq.mem_end - (uint8_t *)client->mq.mem_start) > client->buffer_policy.send_initial_size)
+    {
+        mqtt_pal_time_t shrink = client->time_of_last_grow + client->buffer_policy.shrink_after;
+        if (deadline == MQTT_DEADLINE_NONE || shrink < deadline) {
+            deadline = shrink;
+        }
+    }
+
+    readiness->next_deadline = deadline;
     MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
     return MQTT_OK;
 }
@@ -656,6 +1786,7 @@ ssize_t __mqtt_recv(struct mqtt_client *client)
         /* read in as many bytes as possible */
         ssize_t rv, consumed;
         struct mqtt_queued_message *msg = NULL;
+        mqtt_pal_time_t now;
 
         rv = mqtt_pal_recvall(client->socketfd, client->recv_buffer.curr, client->recv_buffer.curr_sz, 0);
         if (rv < 0) {
@@ -669,7 +1800,10 @@ ssize_t __mqtt_recv(struct mqtt_client *client)
         }
 
         /* attempt to parse */
-        consumed = mqtt_unpack_response(&response, client->recv_buffer.mem_start, (size_t) (client->recv_buffer.curr - client->recv_buffer.mem_start));
+        now = MQTT_PAL_TIME();
+        consumed = mqtt_unpack_response_version(&response, client->recv_buffer.mem_start, 
+                                                (size_t) (client->recv_buffer.curr - client->recv_buffer.mem_start),
+                                                client->protocol_level);
 
         if (consumed < 0) {
             client->error = (enum MQTTErrors)consumed;
@@ -677,6 +1811,9 @@ ssize_t __mqtt_recv(struct mqtt_client *client)
             return consumed;
         } else if (consumed == 0) {
             /* if curr_sz is 0 then the buffer is too small to ever fit the message */
+            if (client->recv_buffer.curr_sz == 0 && __mqtt_grow_recv_buffer(client)) {
+                continue;
+            }
             if (client->recv_buffer.curr_sz == 0) {
                 client->error = MQTT_ERROR_RECV_BUFFER_TOO_SMALL;
                 MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
@@ -717,6 +1854,8 @@ ssize_t __mqtt_recv(struct mqtt_client *client)
             -> release UNSUBSCRIBE
         MQTT_CONTROL_PINGRESP:
             -> release PINGREQ
+        MQTT_CONTROL_DISCONNECT (MQTT 5):
+            -> handle response
         */
         switch (response.fixed_header.control_type) {
             case MQTT_CONTROL_CONNACK:
@@ -729,9 +1868,11 @@ ssize_t __mqtt_recv(struct mqtt_client *client)
                 }
                 msg->state = MQTT_QUEUED_COMPLETE;
                 /* initialize typical response time */
-                client->typical_response_time = (float) (MQTT_PAL_TIME() - msg->time_sent);
+                client->typical_response_time = (float) (now - msg->time_sent);
+                __mqtt_sample_rtt(client, msg, now);
                 /* check that connection was successful */
                 if (response.decoded.connack.return_code != MQTT_CONNACK_ACCEPTED) {
+                    client->last_reason_code = response.decoded.connack.reason_code;
                     if (response.decoded.connack.return_code == MQTT_CONNACK_REFUSED_IDENTIFIER_REJECTED) {
                         client->error = MQTT_ERROR_CONNECT_CLIENT_ID_REFUSED;
                         mqtt_recv_ret = MQTT_ERROR_CONNECT_CLIENT_ID_REFUSED;
@@ -741,6 +1882,16 @@ ssize_t __mqtt_recv(struct mqtt_client *client)
                     }
                     break;
                 }
+                /* the broker's limits for this connection */
+                if (client->protocol_level >= MQTT_PROTOCOL_LEVEL_5) {
+                    client->server_receive_maximum = response.decoded.connack.receive_maximum;
+                    client->server_topic_alias_maximum = response.decoded.connack.topic_alias_maximum;
+                    client->server_maximum_qos = response.decoded.connack.maximum_qos;
+                    client->server_maximum_packet_size = response.decoded.connack.maximum_packet_size;
+                    if (response.decoded.connack.server_keep_alive >= 0) {
+                        client->keep_alive = (uint16_t) response.decoded.connack.server_keep_alive;
+                    }
+                }
                 break;
             case MQTT_CONTROL_PUBLISH:
                 /* stage response, none if qos==0, PUBACK if qos==1, PUBREC if qos==2 */
@@ -770,14 +1921,17 @@ ssize_t __mqtt_recv(struct mqtt_client *client)
             case MQTT_CONTROL_PUBACK:
                 /* release associated PUBLISH */
                 msg = mqtt_mq_find(&client->mq, MQTT_CONTROL_PUBLISH, &response.decoded.puback.packet_id);
-                if (msg == NULL) {
-                    client->error = MQTT_ERROR_ACK_OF_UNKNOWN;
-                    mqtt_recv_ret = MQTT_ERROR_ACK_OF_UNKNOWN;
+                if (msg == NULL || msg->state == MQTT_QUEUED_COMPLETE) {
+                    /* the ack of a copy that was retransmitted after the first ack went out */
                     break;
                 }
                 msg->state = MQTT_QUEUED_COMPLETE;
                 /* update response time */
-                client->typical_response_time = 0.875f * (client->typical_response_time) + 0.125f * (float) (MQTT_PAL_TIME() - msg->time_sent);
+                client->typical_response_time = 0.875f * (client->typical_response_time) + 0.125f * (float) (now - msg->time_sent);
+                __mqtt_sample_rtt(client, msg, now);
+                if (response.decoded.puback.reason_code >= 0x80) {
+                    client->last_reason_code = response.decoded.puback.reason_code;
+                }
                 break;
             case MQTT_CONTROL_PUBREC:
                 /* check if this is a duplicate */
@@ -786,14 +1940,19 @@ ssize_t __mqtt_recv(struct mqtt_client *client)
                 }
                 /* release associated PUBLISH */
                 msg = mqtt_mq_find(&client->mq, MQTT_CONTROL_PUBLISH, &response.decoded.pubrec.packet_id);
-                if (msg == NULL) {
-                    client->error = MQTT_ERROR_ACK_OF_UNKNOWN;
-                    mqtt_recv_ret = MQTT_ERROR_ACK_OF_UNKNOWN;
+                if (msg == NULL || msg->state == MQTT_QUEUED_COMPLETE) {
+                    /* the ack of a retransmitted copy, after the exchange moved on (or finished) */
                     break;
                 }
                 msg->state = MQTT_QUEUED_COMPLETE;
                 /* update response time */
-                client->typical_response_time = 0.875f * (client->typical_response_time) + 0.125f * (float) (MQTT_PAL_TIME() - msg->time_sent);
+                client->typical_response_time = 0.875f * (client->typical_response_time) + 0.125f * (float) (now - msg->time_sent);
+                __mqtt_sample_rtt(client, msg, now);
+                if (response.decoded.pubrec.reason_code >= 0x80) {
+                    /* the broker refused the message, which ends the exchange */
+                    client->last_reason_code = response.decoded.pubrec.reason_code;
+                    break;
+                }
                 /* stage PUBREL */
                 rv = __mqtt_pubrel(client, response.decoded.pubrec.packet_id);
                 if (rv != MQTT_OK) {
@@ -812,7 +1971,8 @@ ssize_t __mqtt_recv(struct mqtt_client *client)
                 }
                 msg->state = MQTT_QUEUED_COMPLETE;
                 /* update response time */
-                client->typical_response_time = 0.875f * (client->typical_response_time) + 0.125f * (float) (MQTT_PAL_TIME() - msg->time_sent);
+                client->typical_response_time = 0.875f * (client->typical_response_time) + 0.125f * (float) (now - msg->time_sent);
+                __mqtt_sample_rtt(client, msg, now);
                 /* stage PUBCOMP */
                 rv = __mqtt_pubcomp(client, response.decoded.pubrec.packet_id);
                 if (rv != MQTT_OK) {
@@ -824,14 +1984,14 @@ ssize_t __mqtt_recv(struct mqtt_client *client)
             case MQTT_CONTROL_PUBCOMP:
                 /* release associated PUBREL */
                 msg = mqtt_mq_find(&client->mq, MQTT_CONTROL_PUBREL, &response.decoded.pubcomp.packet_id);
-                if (msg == NULL) {
-                    client->error = MQTT_ERROR_ACK_OF_UNKNOWN;
-                    mqtt_recv_ret = MQTT_ERROR_ACK_OF_UNKNOWN;
+                if (msg == NULL || msg->state == MQTT_QUEUED_COMPLETE) {
+                    /* the ack of a retransmitted PUBREL */
                     break;
                 }
                 msg->state = MQTT_QUEUED_COMPLETE;
                 /* update response time */
-                client->typical_response_time = 0.875f * (client->typical_response_time) + 0.125f * (float) (MQTT_PAL_TIME() - msg->time_sent);
+                client->typical_response_time = 0.875f * (client->typical_response_time) + 0.125f * (float) (now - msg->time_sent);
+                __mqtt_sample_rtt(client, msg, now);
                 break;
             case MQTT_CONTROL_SUBACK:
                 /* release associated SUBSCRIBE */
@@ -843,9 +2003,10 @@ ssize_t __mqtt_recv(struct mqtt_client *client)
                 }
                 msg->state = MQTT_QUEUED_COMPLETE;
                 /* update response time */
-                client->typical_response_time = 0.875f * (client->typical_response_time) + 0.125f * (float) (MQTT_PAL_TIME() - msg->time_sent);
+                client->typical_response_time = 0.875f * (client->typical_response_time) + 0.125f * (float) (now - msg->time_sent);
+                __mqtt_sample_rtt(client, msg, now);
                 /* check that subscription was successful (not currently only one subscribe at a time) */
-                if (response.decoded.suback.return_codes[0] == MQTT_SUBACK_FAILURE) {
+                if (response.decoded.suback.return_codes[0] >= MQTT_SUBACK_FAILURE) {
                     client->error = MQTT_ERROR_SUBSCRIBE_FAILED;
                     mqtt_recv_ret = MQTT_ERROR_SUBSCRIBE_FAILED;
                     break;
@@ -861,7 +2022,8 @@ ssize_t __mqtt_recv(struct mqtt_client *client)
                 }
                 msg->state = MQTT_QUEUED_COMPLETE;
                 /* update response time */
-                client->typical_response_time = 0.875f * (client->typical_response_time) + 0.125f * (float) (MQTT_PAL_TIME() - msg->time_sent);
+                client->typical_response_time = 0.875f * (client->typical_response_time) + 0.125f * (float) (now - msg->time_sent);
+                __mqtt_sample_rtt(client, msg, now);
                 break;
             case MQTT_CONTROL_PINGRESP:
                 /* release associated PINGREQ */
@@ -873,7 +2035,14 @@ ssize_t __mqtt_recv(struct mqtt_client *client)
                 }
                 msg->state = MQTT_QUEUED_COMPLETE;
                 /* update response time */
-                client->typical_response_time = 0.875f * (client->typical_response_time) + 0.125f * (float) (MQTT_PAL_TIME() - msg->time_sent);
+                client->typical_response_time = 0.875f * (client->typical_response_time) + 0.125f * (float) (now - msg->time_sent);
+                __mqtt_sample_rtt(client, msg, now);
+                break;
+            case MQTT_CONTROL_DISCONNECT:
+                /* the broker is closing the connection */
+                client->last_reason_code = response.decoded.disconnect.reason_code;
+                client->error = MQTT_ERROR_SERVER_DISCONNECTED;
+                mqtt_recv_ret = MQTT_ERROR_SERVER_DISCONNECTED;
                 break;
             default:
                 client->error = MQTT_ERROR_MALFORMED_RESPONSE;
@@ -1046,7 +2215,10 @@ ssize_t mqtt_unpack_fixed_header(struct mqtt_response *response, const uint8_t *
     return buf - start;
 }
 
-ssize_t mqtt_pack_fixed_header(uint8_t *buf, size_t bufsz, const struct mqtt_fixed_header *fixed_header) {
+/**
+ * Packs the fixed header without checking that the rest of the packet fits in buf as well.
+ */
+static ssize_t __mqtt_pack_fixed_header_only(uint8_t *buf, size_t bufsz, const struct mqtt_fixed_header *fixed_header) {
     const uint8_t *start = buf;
     ssize_t errcode;
     uint32_t remaining_length;
@@ -1091,13 +2263,180 @@ ssize_t mqtt_pack_fixed_header(uint8_t *buf, size_t bufsz, const struct mqtt_fix
     --bufsz;
     ++buf;
 
+    /* return how many bytes were consumed */
+    return buf - start;
+}
+
+ssize_t mqtt_pack_fixed_header(uint8_t *buf, size_t bufsz, const struct mqtt_fixed_header *fixed_header) {
+    ssize_t rv = __mqtt_pack_fixed_header_only(buf, bufsz, fixed_header);
+
     /* check that there's still enough space in buffer for packet */
-    if (bufsz < fixed_header->remaining_length) {
+    if (rv > 0 && bufsz - (size_t)rv < fixed_header->remaining_length) {
         return 0;
     }
+    return rv;
+}
+
+/* MQTT 5 PROPERTIES */
+
+/* the property identifiers MQTT-C reads or writes */
+enum {
+    MQTT_PROPERTY_SESSION_EXPIRY_INTERVAL = 0x11,
+    MQTT_PROPERTY_SERVER_KEEP_ALIVE = 0x13,
+    MQTT_PROPERTY_RECEIVE_MAXIMUM = 0x21,
+    MQTT_PROPERTY_TOPIC_ALIAS_MAXIMUM = 0x22,
+    MQTT_PROPERTY_TOPIC_ALIAS = 0x23,
+    MQTT_PROPERTY_MAXIMUM_QOS = 0x24,
+    MQTT_PROPERTY_MAXIMUM_PACKET_SIZE = 0x27
+};
+
+static size_t __mqtt_varint_size(uint32_t value)
+{
+    size_t n = 1;
+    while (value > 127) {
+        value >>= 7;
+        ++n;
+    }
+    return n;
+}
 
-    /* return how many bytes were consumed */
-    return buf - start;
+static size_t __mqtt_pack_varint(uint8_t *buf, uint32_t value)
+{
+    size_t n = 0;
+    do {
+        buf[n] = (uint8_t) (value & 0x7F);
+        value >>= 7;
+        if (value > 0) {
+            buf[n] |= 0x80;
+        }
+        ++n;
+    } while (value > 0);
+    return n;
+}
+
+/**
+ * Unpacks the variable byte integer at buf (before end). Returns the number of bytes it
+ * took, or MQTT_ERROR_MALFORMED_RESPONSE.
+ */
+static ssize_t __mqtt_unpack_varint(const uint8_t *buf, const uint8_t *end, uint32_t *value)
+{
+    ssize_t n = 0;
+    *value = 0;
+    do {
+        if (buf + n >= end || n == 4) {
+            return MQTT_ERROR_MALFORMED_RESPONSE;
+        }
+        *value |= (uint32_t) (buf[n] & 0x7F) << (7 * n);
+    } while (buf[n++] & 0x80);
+    return n;
+}
+
+static size_t __mqtt_pack_uint32(uint8_t *buf, uint32_t integer)
+{
+    buf[0] = (uint8_t) (integer >> 24);
+    buf[1] = (uint8_t) (integer >> 16);
+    buf[2] = (uint8_t) (integer >> 8);
+    buf[3] = (uint8_t) integer;
+    return 4;
+}
+
+static uint32_t __mqtt_unpack_uint32(const uint8_t *buf)
+{
+    return ((uint32_t) buf[0] << 24) | ((uint32_t) buf[1] << 16) | ((uint32_t) buf[2] << 8) | buf[3];
+}
+
+/**
+ * Unpacks the length of the property block at buf (before end), pointing *props and 
+ * *props_end at the properties. Returns the size of the whole block, or 
+ * MQTT_ERROR_MALFORMED_RESPONSE.
+ */
+static ssize_t __mqtt_unpack_properties(const uint8_t *buf, const uint8_t *end, 
+                                        const uint8_t **props, const uint8_t **props_end)
+{
+    uint32_t length;
+    ssize_t rv = __mqtt_unpack_varint(buf, end, &length);
+    if (rv < 0) {
+        return rv;
+    }
+    if ((size_t) (end - buf - rv) < length) {
+        return MQTT_ERROR_MALFORMED_RESPONSE;
+    }
+    *props = buf + rv;
+    *props_end = *props + length;
+    return rv + (ssize_t) length;
+}
+
+/**
+ * Unpacks the property at *buf (before end) and moves *buf past it. The value of integer
+ * properties is put in *value. Returns 1, or MQTT_ERROR_MALFORMED_RESPONSE.
+ */
+static ssize_t __mqtt_unpack_property(const uint8_t **buf, const uint8_t *end, uint8_t *id, uint32_t *value)
+{
+    const uint8_t *p = *buf;
+    size_t size;
+    ssize_t rv;
+
+    *value = 0;
+    if (p >= end) {
+        return MQTT_ERROR_MALFORMED_RESPONSE;
+    }
+    *id = *p++;
+    switch (*id) {
+    case 0x01: case 0x17: case 0x19: case 0x24: case 0x25: case 0x28: case 0x29: case 0x2A:
+        /* byte */
+        size = 1;
+        if (end - p >= 1) {
+            *value = *p;
+        }
+        break;
+    case 0x13: case 0x21: case 0x22: case 0x23:
+        /* two byte integer */
+        size = 2;
+        if (end - p >= 2) {
+            *value = __mqtt_unpack_uint16(p);
+        }
+        break;
+    case 0x02: case 0x11: case 0x18: case 0x27:
+        /* four byte integer */
+        size = 4;
+        if (end - p >= 4) {
+            *value = __mqtt_unpack_uint32(p);
+        }
+        break;
+    case 0x0B:
+        /* variable byte integer */
+        rv = __mqtt_unpack_varint(p, end, value);
+        if (rv < 0) {
+            return rv;
+        }
+        size = (size_t) rv;
+        break;
+    case 0x03: case 0x08: case 0x09: case 0x12: case 0x15: case 0x16: case 0x1A: case 0x1C: case 0x1F:
+        /* string or binary data */
+        if (end - p < 2) {
+            return MQTT_ERROR_MALFORMED_RESPONSE;
+        }
+        size = 2u + __mqtt_unpack_uint16(p);
+        break;
+    case 0x26:
+        /* string pair */
+        if (end - p < 2) {
+            return MQTT_ERROR_MALFORMED_RESPONSE;
+        }
+        size = 2u + __mqtt_unpack_uint16(p);
+        if ((size_t) (end - p) < size + 2) {
+            return MQTT_ERROR_MALFORMED_RESPONSE;
+        }
+        size += 2u + __mqtt_unpack_uint16(p + size);
+        break;
+    default:
+        return MQTT_ERROR_MALFORMED_RESPONSE;
+    }
+    if ((size_t) (end - p) < size) {
+        return MQTT_ERROR_MALFORMED_RESPONSE;
+    }
+    *buf = p + size;
+    return 1;
 }
 
 /* CONNECT */
@@ -1110,9 +2449,27 @@ ssize_t mqtt_pack_connection_request(uint8_t* buf, size_t bufsz,
                                      const char* password,
                                      uint8_t connect_flags,
                                      uint16_t keep_alive)
+{
+    return __mqtt_pack_connection_request(buf, bufsz, client_id, will_topic, will_message, will_message_size,
+                                          user_name, password, connect_flags, keep_alive,
+                                          MQTT_PROTOCOL_LEVEL, NULL);
+}
+
+static ssize_t __mqtt_pack_connection_request(uint8_t* buf, size_t bufsz,
+                                              const char* client_id,
+                                              const char* will_topic,
+                                              const void* will_message,
+                                              size_t will_message_size,
+                                              const char* user_name,
+                                              const char* password,
+                                              uint8_t connect_flags,
+                                              uint16_t keep_alive,
+                                              uint8_t protocol_level,
+                                              const struct mqtt_connect_properties *properties)
 { 
     struct mqtt_fixed_header fixed_header;
     size_t remaining_length;
+    size_t properties_length = 0;
     const uint8_t *const start = buf;
     ssize_t rv;
 
@@ -1134,6 +2491,19 @@ ssize_t mqtt_pack_connection_request(uint8_t* buf, size_t bufsz,
     /* mqtt_string length is strlen + 2 */
     remaining_length += __mqtt_packed_cstrlen(client_id);
 
+    if (protocol_level >= MQTT_PROTOCOL_LEVEL_5) {
+        if (properties != NULL) {
+            properties_length += properties->session_expiry_interval ? 5 : 0;
+            properties_length += properties->receive_maximum ? 3 : 0;
+            properties_length += properties->maximum_packet_size ? 5 : 0;
+        }
+        remaining_length += __mqtt_varint_size((uint32_t) properties_length) + properties_length;
+        if (will_topic != NULL) {
+            /* empty will properties */
+            remaining_length += 1;
+        }
+    }
+
     if (will_topic != NULL) {
         uint8_t temp;
         /* there is a will */
@@ -1199,13 +2569,31 @@ ssize_t mqtt_pack_connection_request(uint8_t* buf, size_t bufsz,
     *buf++ = (uint8_t) 'Q';
     *buf++ = (uint8_t) 'T';
     *buf++ = (uint8_t) 'T';
-    *buf++ = MQTT_PROTOCOL_LEVEL;
+    *buf++ = protocol_level;
     *buf++ = connect_flags;
     buf += __mqtt_pack_uint16(buf, keep_alive);
+    if (protocol_level >= MQTT_PROTOCOL_LEVEL_5) {
+        buf += __mqtt_pack_varint(buf, (uint32_t) properties_length);
+        if (properties != NULL && properties->session_expiry_interval) {
+            *buf++ = MQTT_PROPERTY_SESSION_EXPIRY_INTERVAL;
+            buf += __mqtt_pack_uint32(buf, properties->session_expiry_interval);
+        }
+        if (properties != NULL && properties->receive_maximum) {
+            *buf++ = MQTT_PROPERTY_RECEIVE_MAXIMUM;
+            buf += __mqtt_pack_uint16(buf, properties->receive_maximum);
+        }
+        if (properties != NULL && properties->maximum_packet_size) {
+            *buf++ = MQTT_PROPERTY_MAXIMUM_PACKET_SIZE;
+            buf += __mqtt_pack_uint32(buf, properties->maximum_packet_size);
+        }
+    }
 
     /* pack the payload */
     buf += __mqtt_pack_str(buf, client_id);
     if (connect_flags & MQTT_CONNECT_WILL_FLAG) {
+        if (protocol_level >= MQTT_PROTOCOL_LEVEL_5) {
+            *buf++ = 0x00;
+        }
         buf += __mqtt_pack_str(buf, will_topic);
         buf += __mqtt_pack_uint16(buf, (uint16_t)will_message_size);
         memcpy(buf, will_message, will_message_size);
@@ -1233,6 +2621,13 @@ ssize_t mqtt_unpack_connack_response(struct mqtt_response *mqtt_response, const
     }
     
     response = &(mqtt_response->decoded.connack);
+    response->reason_code = 0;
+    response->receive_maximum = 0;
+    response->topic_alias_maximum = 0;
+    response->maximum_qos = 2;
+    response->maximum_packet_size = 0;
+    response->server_keep_alive = -1;
+
     /* unpack */
     if (*buf & 0xFE) {
         /* only bit 1 can be set */
@@ -1247,7 +2642,90 @@ ssize_t mqtt_unpack_connack_response(struct mqtt_response *mqtt_response, const
     } else {
         response->return_code = (enum MQTTConnackReturnCode) *buf++;
     }
-    return buf - start;
+    return buf - start;
+}
+
+static ssize_t __mqtt_unpack_connack5(struct mqtt_response *mqtt_response, const uint8_t *buf) {
+    const uint8_t *const start = buf;
+    const uint8_t *const end = buf + mqtt_response->fixed_header.remaining_length;
+    struct mqtt_response_connack *response = &(mqtt_response->decoded.connack);
+    const uint8_t *props, *props_end;
+    uint8_t id;
+    uint32_t value;
+    ssize_t rv;
+
+    /* a broker that doesn't speak MQTT 5 refuses with a 3.1.1 CONNACK */
+    if (mqtt_response->fixed_header.remaining_length == 2) {
+        return mqtt_unpack_connack_response(mqtt_response, buf);
+    }
+    if (mqtt_response->fixed_header.remaining_length < 3) {
+        return MQTT_ERROR_MALFORMED_RESPONSE;
+    }
+
+    if (*buf & 0xFE) {
+        /* only bit 1 can be set */
+        return MQTT_ERROR_CONNACK_FORBIDDEN_FLAGS;
+    }
+    response->session_present_flag = *buf++;
+
+    /* map the reason code onto the 3.1.1 return codes */
+    response->reason_code = *buf++;
+    switch (response->reason_code) {
+    case 0x00: response->return_code = MQTT_CONNACK_ACCEPTED; break;
+    case 0x84: response->return_code = MQTT_CONNACK_REFUSED_PROTOCOL_VERSION; break;
+    case 0x85: response->return_code = MQTT_CONNACK_REFUSED_IDENTIFIER_REJECTED; break;
+    case 0x86: response->return_code = MQTT_CONNACK_REFUSED_BAD_USER_NAME_OR_PASSWORD; break;
+    case 0x87: response->return_code = MQTT_CONNACK_REFUSED_NOT_AUTHORIZED; break;
+    default:
+        if (response->reason_code < 0x80) {
+            return MQTT_ERROR_CONNACK_FORBIDDEN_CODE;
+        }
+        response->return_code = MQTT_CONNACK_REFUSED_SERVER_UNAVAILABLE;
+        break;
+    }
+
+    /* properties, with the defaults for those that are left out */
+    response->receive_maximum = 65535;
+    response->topic_alias_maximum = 0;
+    response->maximum_qos = 2;
+    response->maximum_packet_size = 0;
+    response->server_keep_alive = -1;
+    rv = __mqtt_unpack_properties(buf, end, &props, &props_end);
+    if (rv < 0) {
+        return rv;
+    }
+    while (props < props_end) {
+        rv = __mqtt_unpack_property(&props, props_end, &id, &value);
+        if (rv < 0) {
+            return rv;
+        }
+        switch (id) {
+        case MQTT_PROPERTY_RECEIVE_MAXIMUM:
+            if (value == 0) {
+                return MQTT_ERROR_MALFORMED_RESPONSE;
+            }
+            response->receive_maximum = (uint16_t) value;
+            break;
+        case MQTT_PROPERTY_TOPIC_ALIAS_MAXIMUM:
+            response->topic_alias_maximum = (uint16_t) value;
+            break;
+        case MQTT_PROPERTY_MAXIMUM_QOS:
+            if (value > 1) {
+                return MQTT_ERROR_MALFORMED_RESPONSE;
+            }
+            response->maximum_qos = (uint8_t) value;
+            break;
+        case MQTT_PROPERTY_MAXIMUM_PACKET_SIZE:
+            response->maximum_packet_size = value;
+            break;
+        case MQTT_PROPERTY_SERVER_KEEP_ALIVE:
+            response->server_keep_alive = (int32_t) value;
+            break;
+        default:
+            break;
+        }
+    }
+    return end - start;
 }
 
 /* DISCONNECT */
@@ -1259,6 +2737,25 @@ ssize_t mqtt_pack_disconnect(uint8_t *buf, size_t bufsz) {
     return mqtt_pack_fixed_header(buf, bufsz, &fixed_header);
 }
 
+static ssize_t __mqtt_unpack_disconnect5(struct mqtt_response *mqtt_response, const uint8_t *buf) {
+    const uint8_t *const end = buf + mqtt_response->fixed_header.remaining_length;
+    const uint8_t *props, *props_end;
+    ssize_t rv;
+
+    /* no reason code means a normal disconnection */
+    mqtt_response->decoded.disconnect.reason_code = 0;
+    if (mqtt_response->fixed_header.remaining_length > 0) {
+        mqtt_response->decoded.disconnect.reason_code = buf[0];
+    }
+    if (mqtt_response->fixed_header.remaining_length > 1) {
+        rv = __mqtt_unpack_properties(buf + 1, end, &props, &props_end);
+        if (rv < 0) {
+            return rv;
+        }
+    }
+    return (ssize_t) mqtt_response->fixed_header.remaining_length;
+}
+
 /* PING */
 ssize_t mqtt_pack_ping_request(uint8_t *buf, size_t bufsz) {
     struct mqtt_fixed_header fixed_header;
@@ -1275,11 +2772,70 @@ ssize_t mqtt_pack_publish_request(uint8_t *buf, size_t bufsz,
                                   const void* application_message,
                                   size_t application_message_size,
                                   uint8_t publish_flags)
+{
+    return __mqtt_pack_publish(buf, bufsz, topic_name, packet_id, application_message, application_message_size,
+                               publish_flags, MQTT_PROTOCOL_LEVEL, 0, 0);
+}
+
+/**
+ * Packs a PUBLISH. For MQTT 5 it carries topic_alias (unless that is 0), and if alias_known
+ * the broker already has the alias so the topic is left out.
+ */
+static ssize_t __mqtt_pack_publish(uint8_t *buf, size_t bufsz,
+                                   const char* topic_name,
+                                   uint16_t packet_id,
+                                   const void* application_message,
+                                   size_t application_message_size,
+                                   uint8_t publish_flags,
+                                   uint8_t protocol_level,
+                                   uint16_t topic_alias,
+                                   int alias_known)
+{
+    ssize_t rv;
+
+    /* pack fixed and variable header */
+    rv = __mqtt_pack_publish_header(buf, bufsz, topic_name, packet_id, application_message_size, publish_flags,
+                                    protocol_level, topic_alias, alias_known);
+    if (rv <= 0) {
+        /* something went wrong */
+        return rv;
+    }
+
+    /* check that buffer is big enough */
+    if (bufsz - (size_t)rv < application_message_size) {
+        return 0;
+    }
+
+    /* pack payload */
+    memcpy(buf + rv, application_message, application_message_size);
+
+    return rv + (ssize_t)application_message_size;
+}
+
+ssize_t mqtt_pack_publish_header(uint8_t *buf, size_t bufsz,
+                                 const char* topic_name,
+                                 uint16_t packet_id,
+                                 size_t application_message_size,
+                                 uint8_t publish_flags)
+{
+    return __mqtt_pack_publish_header(buf, bufsz, topic_name, packet_id, application_message_size, publish_flags,
+                                      MQTT_PROTOCOL_LEVEL, 0, 0);
+}
+
+static ssize_t __mqtt_pack_publish_header(uint8_t *buf, size_t bufsz,
+                                          const char* topic_name,
+                                          uint16_t packet_id,
+                                          size_t application_message_size,
+                                          uint8_t publish_flags,
+                                          uint8_t protocol_level,
+                                          uint16_t topic_alias,
+                                          int alias_known)
 {
     const uint8_t *const start = buf;
     ssize_t rv;
     struct mqtt_fixed_header fixed_header;
     uint32_t remaining_length;
+    uint32_t header_length;
     uint8_t inspected_qos;
 
     /* check for null pointers */
@@ -1294,11 +2850,14 @@ ssize_t mqtt_pack_publish_request(uint8_t *buf, size_t bufsz,
     fixed_header.control_type = MQTT_CONTROL_PUBLISH;
 
     /* calculate remaining length */
-    remaining_length = (uint32_t)__mqtt_packed_cstrlen(topic_name);
+    header_length = alias_known ? 2u : (uint32_t)__mqtt_packed_cstrlen(topic_name);
     if (inspected_qos > 0) {
-        remaining_length += 2;
+        header_length += 2;
     }
-    remaining_length += (uint32_t)application_message_size;
+    if (protocol_level >= MQTT_PROTOCOL_LEVEL_5) {
+        header_length += (topic_alias != 0) ? 4 : 1;
+    }
+    remaining_length = header_length + (uint32_t)application_message_size;
     fixed_header.remaining_length = remaining_length;
 
     /* force dup to 0 if qos is 0 [Spec MQTT-3.3.1-2] */
@@ -1312,8 +2871,8 @@ ssize_t mqtt_pack_publish_request(uint8_t *buf, size_t bufsz,
     }
     fixed_header.control_flags = publish_flags & 0x7;
 
-    /* pack fixed header */
-    rv = mqtt_pack_fixed_header(buf, bufsz, &fixed_header);
+    /* pack fixed header, the payload isn't going into buf */
+    rv = __mqtt_pack_fixed_header_only(buf, bufsz, &fixed_header);
     if (rv <= 0) {
         /* something went wrong */
         return rv;
@@ -1322,19 +2881,24 @@ ssize_t mqtt_pack_publish_request(uint8_t *buf, size_t bufsz,
     bufsz -= (size_t)rv;
 
     /* check that buffer is big enough */
-    if (bufsz < remaining_length) {
+    if (bufsz < header_length) {
         return 0;
     }
 
     /* pack variable header */
-    buf += __mqtt_pack_str(buf, topic_name);
+    buf += __mqtt_pack_str(buf, alias_known ? "" : topic_name);
     if (inspected_qos > 0) {
         buf += __mqtt_pack_uint16(buf, packet_id);
     }
-
-    /* pack payload */
-    memcpy(buf, application_message, application_message_size);
-    buf += application_message_size;
+    if (protocol_level >= MQTT_PROTOCOL_LEVEL_5) {
+        if (topic_alias != 0) {
+            *buf++ = 3;
+            *buf++ = MQTT_PROPERTY_TOPIC_ALIAS;
+            buf += __mqtt_pack_uint16(buf, topic_alias);
+        } else {
+            *buf++ = 0;
+        }
+    }
 
     return buf - start;
 }
@@ -1352,6 +2916,9 @@ ssize_t mqtt_unpack_publish_response(struct mqtt_response *mqtt_response, const
     response->dup_flag = (fixed_header->control_flags & MQTT_PUBLISH_DUP) >> 3;
     response->qos_level = (fixed_header->control_flags & MQTT_PUBLISH_QOS_MASK) >> 1;
     response->retain_flag = fixed_header->control_flags & MQTT_PUBLISH_RETAIN;
+    response->topic_alias = 0;
+    response->properties = NULL;
+    response->properties_size = 0;
 
     /* make sure that remaining length is valid */
     if (mqtt_response->fixed_header.remaining_length < 4) {
@@ -1382,6 +2949,63 @@ ssize_t mqtt_unpack_publish_response(struct mqtt_response *mqtt_response, const
     return buf - start;
 }
 
+static ssize_t __mqtt_unpack_publish5(struct mqtt_response *mqtt_response, const uint8_t *buf)
+{
+    const uint8_t *const start = buf;
+    const uint8_t *const end = buf + mqtt_response->fixed_header.remaining_length;
+    struct mqtt_fixed_header *fixed_header = &(mqtt_response->fixed_header);
+    struct mqtt_response_publish *response = &(mqtt_response->decoded.publish);
+    const uint8_t *props, *props_end;
+    uint8_t id;
+    uint32_t value;
+    ssize_t rv;
+
+    /* get flags */
+    response->dup_flag = (fixed_header->control_flags & MQTT_PUBLISH_DUP) >> 3;
+    response->qos_level = (fixed_header->control_flags & MQTT_PUBLISH_QOS_MASK) >> 1;
+    response->retain_flag = fixed_header->control_flags & MQTT_PUBLISH_RETAIN;
+    response->topic_alias = 0;
+
+    /* parse variable header */
+    if (end - buf < 2) {
+        return MQTT_ERROR_MALFORMED_RESPONSE;
+    }
+    response->topic_name_size = __mqtt_unpack_uint16(buf);
+    buf += 2;
+    if (end - buf < (ssize_t) response->topic_name_size + (response->qos_level > 0 ? 2 : 0)) {
+        return MQTT_ERROR_MALFORMED_RESPONSE;
+    }
+    response->topic_name = buf;
+    buf += response->topic_name_size;
+    if (response->qos_level > 0) {
+        response->packet_id = __mqtt_unpack_uint16(buf);
+        buf += 2;
+    }
+
+    /* properties */
+    rv = __mqtt_unpack_properties(buf, end, &props, &props_end);
+    if (rv < 0) {
+        return rv;
+    }
+    buf += rv;
+    response->properties = props;
+    response->properties_size = (size_t) (props_end - props);
+    while (props < props_end) {
+        rv = __mqtt_unpack_property(&props, props_end, &id, &value);
+        if (rv < 0) {
+            return rv;
+        }
+        if (id == MQTT_PROPERTY_TOPIC_ALIAS) {
+            response->topic_alias = (uint16_t) value;
+        }
+    }
+
+    /* get payload */
+    response->application_message = buf;
+    response->application_message_size = (size_t) (end - buf);
+    return end - start;
+}
+
 /* PUBXXX */
 ssize_t mqtt_pack_pubxxx_request(uint8_t *buf, size_t bufsz, 
                                  enum MQTTControlPacketType control_type,
@@ -1418,6 +3042,23 @@ ssize_t mqtt_pack_pubxxx_request(uint8_t *buf, size_t bufsz,
     return buf - start;
 }
 
+static void __mqtt_set_pubxxx(struct mqtt_response *mqtt_response, uint16_t packet_id, uint8_t reason_code)
+{
+    if (mqtt_response->fixed_header.control_type == MQTT_CONTROL_PUBACK) {
+        mqtt_response->decoded.puback.packet_id = packet_id;
+        mqtt_response->decoded.puback.reason_code = reason_code;
+    } else if (mqtt_response->fixed_header.control_type == MQTT_CONTROL_PUBREC) {
+        mqtt_response->decoded.pubrec.packet_id = packet_id;
+        mqtt_response->decoded.pubrec.reason_code = reason_code;
+    } else if (mqtt_response->fixed_header.control_type == MQTT_CONTROL_PUBREL) {
+        mqtt_response->decoded.pubrel.packet_id = packet_id;
+        mqtt_response->decoded.pubrel.reason_code = reason_code;
+    } else {
+        mqtt_response->decoded.pubcomp.packet_id = packet_id;
+        mqtt_response->decoded.pubcomp.reason_code = reason_code;
+    }
+}
+
 ssize_t mqtt_unpack_pubxxx_response(struct mqtt_response *mqtt_response, const uint8_t *buf) 
 {
     const uint8_t *const start = buf;
@@ -1432,19 +3073,32 @@ ssize_t mqtt_unpack_pubxxx_response(struct mqtt_response *mqtt_response, const u
     packet_id = __mqtt_unpack_uint16(buf);
     buf += 2;
 
-    if (mqtt_response->fixed_header.control_type == MQTT_CONTROL_PUBACK) {
-        mqtt_response->decoded.puback.packet_id = packet_id;
-    } else if (mqtt_response->fixed_header.control_type == MQTT_CONTROL_PUBREC) {
-        mqtt_response->decoded.pubrec.packet_id = packet_id;
-    } else if (mqtt_response->fixed_header.control_type == MQTT_CONTROL_PUBREL) {
-        mqtt_response->decoded.pubrel.packet_id = packet_id;
-    } else {
-        mqtt_response->decoded.pubcomp.packet_id = packet_id;
-    }
+    __mqtt_set_pubxxx(mqtt_response, packet_id, 0);
 
     return buf - start;
 }
 
+static ssize_t __mqtt_unpack_pubxxx5(struct mqtt_response *mqtt_response, const uint8_t *buf) 
+{
+    const uint8_t *const end = buf + mqtt_response->fixed_header.remaining_length;
+    const uint8_t *props, *props_end;
+    ssize_t rv;
+
+    /* the reason code and properties can be left out */
+    if (mqtt_response->fixed_header.remaining_length <= 2) {
+        return mqtt_unpack_pubxxx_response(mqtt_response, buf);
+    }
+    if (mqtt_response->fixed_header.remaining_length > 3) {
+        rv = __mqtt_unpack_properties(buf + 3, end, &props, &props_end);
+        if (rv < 0) {
+            return rv;
+        }
+    }
+    __mqtt_set_pubxxx(mqtt_response, __mqtt_unpack_uint16(buf), buf[2]);
+
+    return (ssize_t) mqtt_response->fixed_header.remaining_length;
+}
+
 /* SUBACK */
 ssize_t mqtt_unpack_suback_response (struct mqtt_response *mqtt_response, const uint8_t *buf) {
     const uint8_t *const start = buf;
@@ -1468,14 +3122,34 @@ ssize_t mqtt_unpack_suback_response (struct mqtt_response *mqtt_response, const
     return buf - start;
 }
 
+static ssize_t __mqtt_unpack_suback5(struct mqtt_response *mqtt_response, const uint8_t *buf) {
+    const uint8_t *const end = buf + mqtt_response->fixed_header.remaining_length;
+    const uint8_t *props, *props_end;
+    ssize_t rv;
+
+    if (mqtt_response->fixed_header.remaining_length < 3) {
+        return MQTT_ERROR_MALFORMED_RESPONSE;
+    }
+    mqtt_response->decoded.suback.packet_id = __mqtt_unpack_uint16(buf);
+
+    /* skip the properties, a reason code per topic follows */
+    rv = __mqtt_unpack_properties(buf + 2, end, &props, &props_end);
+    if (rv < 0) {
+        return rv;
+    }
+    if (props_end >= end) {
+        return MQTT_ERROR_MALFORMED_RESPONSE;
+    }
+    mqtt_response->decoded.suback.return_codes = props_end;
+    mqtt_response->decoded.suback.num_return_codes = (size_t) (end - props_end);
+
+    return (ssize_t) mqtt_response->fixed_header.remaining_length;
+}
+
 /* SUBSCRIBE */
 ssize_t mqtt_pack_subscribe_request(uint8_t *buf, size_t bufsz, unsigned int packet_id, ...) {
     va_list args;
-    const uint8_t *const start = buf;
-    ssize_t rv;
-    struct mqtt_fixed_header fixed_header;
     unsigned int num_subs = 0;
-    unsigned int i;
     const char *topic[MQTT_SUBSCRIBE_REQUEST_MAX_NUM_TOPICS];
     uint8_t max_qos[MQTT_SUBSCRIBE_REQUEST_MAX_NUM_TOPICS];
 
@@ -1498,10 +3172,25 @@ ssize_t mqtt_pack_subscribe_request(uint8_t *buf, size_t bufsz, unsigned int pac
     }
     va_end(args);
 
+    return __mqtt_pack_subscribe(buf, bufsz, packet_id, topic, max_qos, num_subs, MQTT_PROTOCOL_LEVEL);
+}
+
+static ssize_t __mqtt_pack_subscribe(uint8_t *buf, size_t bufsz, unsigned int packet_id,
+                                     const char **topic, const uint8_t *max_qos, unsigned int num_subs,
+                                     uint8_t protocol_level)
+{
+    const uint8_t *const start = buf;
+    ssize_t rv;
+    struct mqtt_fixed_header fixed_header;
+    unsigned int i;
+
     /* build the fixed header */
     fixed_header.control_type = MQTT_CONTROL_SUBSCRIBE;
     fixed_header.control_flags = 2u;
     fixed_header.remaining_length = 2u; /* size of variable header */
+    if (protocol_level >= MQTT_PROTOCOL_LEVEL_5) {
+        fixed_header.remaining_length += 1; /* empty properties */
+    }
     for(i = 0; i < num_subs; ++i) {
         /* payload is topic name + max qos (1 byte) */
         fixed_header.remaining_length += __mqtt_packed_cstrlen(topic[i]) + 1;
@@ -1523,6 +3212,9 @@ ssize_t mqtt_pack_subscribe_request(uint8_t *buf, size_t bufsz, unsigned int pac
     
     /* pack variable header */
     buf += __mqtt_pack_uint16(buf, (uint16_t)packet_id);
+    if (protocol_level >= MQTT_PROTOCOL_LEVEL_5) {
+        *buf++ = 0;
+    }
 
 
     /* pack payload */
@@ -1545,19 +3237,39 @@ ssize_t mqtt_unpack_unsuback_response(struct mqtt_response *mqtt_response, const
 
     /* parse packet_id */
     mqtt_response->decoded.unsuback.packet_id = __mqtt_unpack_uint16(buf);
+    mqtt_response->decoded.unsuback.reason_codes = NULL;
+    mqtt_response->decoded.unsuback.num_reason_codes = 0;
     buf += 2;
 
     return buf - start;
 }
 
+static ssize_t __mqtt_unpack_unsuback5(struct mqtt_response *mqtt_response, const uint8_t *buf) 
+{
+    const uint8_t *const end = buf + mqtt_response->fixed_header.remaining_length;
+    const uint8_t *props, *props_end;
+    ssize_t rv;
+
+    if (mqtt_response->fixed_header.remaining_length < 3) {
+        return MQTT_ERROR_MALFORMED_RESPONSE;
+    }
+    mqtt_response->decoded.unsuback.packet_id = __mqtt_unpack_uint16(buf);
+
+    /* skip the properties, a reason code per topic follows */
+    rv = __mqtt_unpack_properties(buf + 2, end, &props, &props_end);
+    if (rv < 0) {
+        return rv;
+    }
+    mqtt_response->decoded.unsuback.reason_codes = props_end;
+    mqtt_response->decoded.unsuback.num_reason_codes = (size_t) (end - props_end);
+
+    return (ssize_t) mqtt_response->fixed_header.remaining_length;
+}
+
 /* UNSUBSCRIBE */
 ssize_t mqtt_pack_unsubscribe_request(uint8_t *buf, size_t bufsz, unsigned int packet_id, ...) {
     va_list args;
-    const uint8_t *const start = buf;
-    ssize_t rv;
-    struct mqtt_fixed_header fixed_header;
     unsigned int num_subs = 0;
-    unsigned int i;
     const char *topic[MQTT_UNSUBSCRIBE_REQUEST_MAX_NUM_TOPICS];
 
     /* parse all subscriptions */
@@ -1577,10 +3289,25 @@ ssize_t mqtt_pack_unsubscribe_request(uint8_t *buf, size_t bufsz, unsigned int p
     }
     va_end(args);
 
+    return __mqtt_pack_unsubscribe(buf, bufsz, packet_id, topic, num_subs, MQTT_PROTOCOL_LEVEL);
+}
+
+static ssize_t __mqtt_pack_unsubscribe(uint8_t *buf, size_t bufsz, unsigned int packet_id,
+                                       const char **topic, unsigned int num_subs,
+                                       uint8_t protocol_level)
+{
+    const uint8_t *const start = buf;
+    ssize_t rv;
+    struct mqtt_fixed_header fixed_header;
+    unsigned int i;
+
     /* build the fixed header */
     fixed_header.control_type = MQTT_CONTROL_UNSUBSCRIBE;
     fixed_header.control_flags = 2u;
     fixed_header.remaining_length = 2u; /* size of variable header */
+    if (protocol_level >= MQTT_PROTOCOL_LEVEL_5) {
+        fixed_header.remaining_length += 1; /* empty properties */
+    }
     for(i = 0; i < num_subs; ++i) {
         /* payload is topic name */
         fixed_header.remaining_length += __mqtt_packed_cstrlen(topic[i]);
@@ -1601,6 +3328,9 @@ ssize_t mqtt_pack_unsubscribe_request(uint8_t *buf, size_t bufsz, unsigned int p
 
     /* pack variable header */
     buf += __mqtt_pack_uint16(buf, (uint16_t)packet_id);
+    if (protocol_level >= MQTT_PROTOCOL_LEVEL_5) {
+        *buf++ = 0;
+    }
 
 
     /* pack payload */
@@ -1612,127 +3342,341 @@ ssize_t mqtt_pack_unsubscribe_request(uint8_t *buf, size_t bufsz, unsigned int p
 }
 
 /* MESSAGE QUEUE */
+
+/* alignment of the slot ring at the start of the queue's memory block */
+#define MQTT_MQ_ALIGNMENT 8u
+
+/* the packet-id index holds slot + 1 in a uint16_t and is at most 2^16 entries */
+#define MQTT_MQ_MAX_CAPACITY 32768u
+
+/* per-slot memory budget: the slot itself, up to 4 index entries and the packet data */
+#define MQTT_MQ_BYTES_PER_SLOT (sizeof(struct mqtt_queued_message) + 4 * sizeof(uint16_t) + MQTT_MQ_SLOT_BYTES)
+
+#define __mqtt_mq_hash(mq, pid) ((((uint32_t)(pid) * 0x9E3779B1u) >> 16) & ((mq)->index_size - 1))
+
+/**
+ * Splits usable bytes of queue memory between the slot ring, the packet-id index (the 
+ * power of two >= 2 x capacity entries) and the data ring. Returns the number of slots, 
+ * a power of two so the ring wraps with a mask; the memory of the slots rounded off goes 
+ * to the data ring.
+ */
+static size_t __mqtt_mq_layout(size_t usable, size_t *index_size)
+{
+    size_t slots = usable / MQTT_MQ_BYTES_PER_SLOT;
+    size_t capacity = 0;
+    if (slots == 0 && usable > sizeof(struct mqtt_queued_message) + 2 * sizeof(uint16_t)) {
+        slots = 1;
+    }
+    if (slots > 0) {
+        capacity = 1;
+        while (capacity <= slots / 2 && capacity < MQTT_MQ_MAX_CAPACITY) {
+            capacity <<= 1;
+        }
+    }
+    *index_size = 1;
+    while (*index_size < 2 * capacity) {
+        *index_size <<= 1;
+    }
+    if (capacity == 0) {
+        *index_size = 0;
+    }
+    return capacity;
+}
+
+size_t mqtt_mq_max_packet_size(size_t bufsz)
+{
+    size_t index_size;
+    size_t capacity = __mqtt_mq_layout(bufsz, &index_size);
+    size_t overhead = capacity * sizeof(struct mqtt_queued_message) + index_size * sizeof(uint16_t);
+    return bufsz > overhead ? bufsz - overhead : 0;
+}
+
 void mqtt_mq_init(struct mqtt_message_queue *mq, void *buf, size_t bufsz) 
 {  
     if(buf != NULL)
     {
+        uint8_t *start = (uint8_t *)buf;
+        size_t pad = (MQTT_MQ_ALIGNMENT - ((size_t)start % MQTT_MQ_ALIGNMENT)) % MQTT_MQ_ALIGNMENT;
+        size_t usable = bufsz > pad ? bufsz - pad : 0;
+
         mq->mem_start = buf;
         mq->mem_end = (uint8_t *)buf + bufsz;
-        mq->curr = (uint8_t *)buf;
-        mq->queue_tail = (struct mqtt_queued_message *)mq->mem_end;
-        mq->curr_sz = (size_t) (mqtt_mq_currsz(mq));
+
+        /* split the block between the slot ring, the packet-id index and the data ring */
+        mq->queue = (struct mqtt_queued_message *)(start + pad);
+        mq->queue_capacity = __mqtt_mq_layout(usable, &mq->index_size);
+        mq->queue_head = 0;
+        mq->queue_length = 0;
+        mq->bytes_queued = 0;
+        mq->pinned = NULL;
+
+        mq->index = (uint16_t *)(mq->queue + mq->queue_capacity);
+        memset(mq->index, 0, mq->index_size * sizeof(uint16_t));
+
+        mq->data_start = (uint8_t *)(mq->index + mq->index_size);
+        mq->data_end = (uint8_t *)mq->mem_end;
+        if (mq->data_start > mq->data_end) {
+            mq->data_start = mq->data_end;
+        }
+        mq->curr = mq->data_start;
+        mq->curr_sz = mqtt_mq_currsz(mq);
+    } else {
+        memset(mq, 0, sizeof(*mq));
+    }
+}
+
+size_t mqtt_mq_currsz(struct mqtt_message_queue *mq)
+{
+    uint8_t *oldest;
+    if (mq->queue_length == mq->queue_capacity) {
+        /* no free slots */
+        return 0;
     }
+    if (mq->queue_length == 0) {
+        return (size_t) (mq->data_end - mq->curr);
+    }
+
+    oldest = mqtt_mq_get(mq, 0)->start;
+    if (mq->curr > oldest) {
+        /* not wrapped: free space runs to the end of the data ring */
+        return (size_t) (mq->data_end - mq->curr);
+    }
+    /* wrapped: free space runs up to the oldest message */
+    return (size_t) (oldest - mq->curr);
 }
 
 struct mqtt_queued_message* mqtt_mq_register(struct mqtt_message_queue *mq, size_t nbytes)
 {
     /* make queued message header */
-    --(mq->queue_tail);
-    mq->queue_tail->start = mq->curr;
-    mq->queue_tail->size = nbytes;
-    mq->queue_tail->state = MQTT_QUEUED_UNSENT;
+    struct mqtt_queued_message *msg = mqtt_mq_get(mq, mq->queue_length);
+    ++(mq->queue_length);
+    msg->start = mq->curr;
+    msg->size = nbytes;
+    msg->state = MQTT_QUEUED_UNSENT;
+    msg->payload = NULL;
+    msg->payload_size = 0;
+    msg->payload_ref = NULL;
+    msg->resend_count = 0;
+    msg->topic_alias = 0;
+    mq->bytes_queued += nbytes;
 
     /* move curr and recalculate curr_sz */
     mq->curr += nbytes;
-    mq->curr_sz = (size_t) (mqtt_mq_currsz(mq));
+    mq->curr_sz = mqtt_mq_currsz(mq);
 
-    return mq->queue_tail;
+    return msg;
 }
 
-void mqtt_mq_clean(struct mqtt_message_queue *mq) {
-    struct mqtt_queued_message *new_head;
-
-    for(new_head = mqtt_mq_get(mq, 0); new_head >= mq->queue_tail; --new_head) {
-        if (new_head->state != MQTT_QUEUED_COMPLETE) break;
+/* only messages that can be acknowledged by packet id are indexed */
+static int __mqtt_mq_is_indexed(const struct mqtt_queued_message *msg) {
+    switch (msg->control_type) {
+        case MQTT_CONTROL_PUBLISH:
+            return (msg->start[0] & MQTT_PUBLISH_QOS_MASK) != 0;
+        case MQTT_CONTROL_PUBACK:
+        case MQTT_CONTROL_PUBREC:
+        case MQTT_CONTROL_PUBREL:
+        case MQTT_CONTROL_PUBCOMP:
+        case MQTT_CONTROL_SUBSCRIBE:
+        case MQTT_CONTROL_UNSUBSCRIBE:
+            return 1;
+        default:
+            return 0;
     }
-    
-    /* check if everything can be removed */
-    if (new_head < mq->queue_tail) {
-        mq->curr = (uint8_t *)mq->mem_start;
-        mq->queue_tail = (struct mqtt_queued_message *)mq->mem_end;
-        mq->curr_sz = (size_t) (mqtt_mq_currsz(mq));
+}
+
+void mqtt_mq_index(struct mqtt_message_queue *mq, struct mqtt_queued_message *msg)
+{
+    size_t pos;
+    if (!__mqtt_mq_is_indexed(msg)) {
         return;
-    } else if (new_head == mqtt_mq_get(mq, 0)) {
-        /* do nothing */
+    }
+
+    /* linear probing; the table is at least twice the slot count so there's always a gap */
+    pos = __mqtt_mq_hash(mq, msg->packet_id);
+    while (mq->index[pos] != 0) {
+        pos = (pos + 1) & (mq->index_size - 1);
+    }
+    mq->index[pos] = (uint16_t)(msg - mq->queue + 1);
+}
+
+static void __mqtt_mq_unindex(struct mqtt_message_queue *mq, struct mqtt_queued_message *msg)
+{
+    size_t mask = mq->index_size - 1;
+    uint16_t entry = (uint16_t)(msg - mq->queue + 1);
+    size_t pos = __mqtt_mq_hash(mq, msg->packet_id);
+    size_t next;
+
+    if (!__mqtt_mq_is_indexed(msg)) {
         return;
     }
 
-    /* move buffered data */
+    while (mq->index[pos] != entry) {
+        if (mq->index[pos] == 0) {
+            /* not found */
+            return;
+        }
+        pos = (pos + 1) & mask;
+    }
+
+    /* backward-shift deletion: pull later entries of the probe run into the gap */
+    next = pos;
+    for (;;) {
+        size_t home;
+        next = (next + 1) & mask;
+        if (mq->index[next] == 0) {
+            break;
+        }
+        home = __mqtt_mq_hash(mq, mq->queue[mq->index[next] - 1].packet_id);
+        /* move the entry unless its home lies cyclically in (pos, next] */
+        if (((next - home) & mask) >= ((next - pos) & mask)) {
+            mq->index[pos] = mq->index[next];
+            pos = next;
+        }
+    }
+    mq->index[pos] = 0;
+}
+
+int __mqtt_mq_pid_in_use(struct mqtt_message_queue *mq, uint16_t packet_id)
+{
+    size_t pos;
+    if (mq->index_size == 0) {
+        return 0;
+    }
+    pos = __mqtt_mq_hash(mq, packet_id);
+    while (mq->index[pos] != 0) {
+        if (mq->queue[mq->index[pos] - 1].packet_id == packet_id) {
+            return 1;
+        }
+        pos = (pos + 1) & (mq->index_size - 1);
+    }
+    return 0;
+}
+
+void mqtt_mq_clean(struct mqtt_message_queue *mq) {
+    /* release completed messages from the front of the queue */
+    while (mq->queue_length > 0 
+           && mqtt_mq_get(mq, 0)->state == MQTT_QUEUED_COMPLETE
+           && mqtt_mq_get(mq, 0) != mq->pinned) 
     {
-        size_t n = (size_t) (mq->curr - new_head->start);
-        size_t removing = (size_t) (new_head->start - (uint8_t*) mq->mem_start);
-        memmove(mq->mem_start, new_head->start, n);
-        mq->curr = (unsigned char*)mq->mem_start + n;
-      
+        struct mqtt_queued_message *msg = mqtt_mq_get(mq, 0);
+        __mqtt_mq_unindex(mq, msg);
+        if (msg->payload_ref != NULL) {
+            mqtt_payload_ref_release(msg->payload_ref);
+        }
+        mq->bytes_queued -= msg->size;
+        mq->queue_head = (mq->queue_head + 1) & (mq->queue_capacity - 1);
+        --(mq->queue_length);
+    }
 
-        /* move queue */
-        {
-            ssize_t new_tail_idx = new_head - mq->queue_tail;
-            memmove(mqtt_mq_get(mq, new_tail_idx), mq->queue_tail, sizeof(struct mqtt_queued_message) * (size_t) ((new_tail_idx + 1)));
-            mq->queue_tail = mqtt_mq_get(mq, new_tail_idx);
-          
-            {
-                /* bump back start's */
-                ssize_t i = 0;
-                for(; i < new_tail_idx + 1; ++i) {
-                    mqtt_mq_get(mq, i)->start -= removing;
-                }
-            }
+    if (mq->queue_length == 0) {
+        /* everything was removed */
+        mq->queue_head = 0;
+        mq->curr = mq->data_start;
+    } else {
+        /* 
+        If we're not wrapped, but there's more room before the oldest message than there
+        is after curr, start packing at the front of the data ring instead. Queued packets
+        never straddle the wrap, so partially sent messages stay contiguous.
+        */
+        uint8_t *oldest = mqtt_mq_get(mq, 0)->start;
+        if (mq->curr > oldest && (oldest - mq->data_start) > (mq->data_end - mq->curr)) {
+            mq->curr = mq->data_start;
         }
     }
 
     /* get curr_sz */
-    mq->curr_sz = (size_t) (mqtt_mq_currsz(mq));
+    mq->curr_sz = mqtt_mq_currsz(mq);
+}
+
+void mqtt_mq_release_payloads(struct mqtt_message_queue *mq)
+{
+    size_t i;
+    for(i = 0; i < mq->queue_length; ++i) {
+        struct mqtt_queued_message *msg = mqtt_mq_get(mq, i);
+        if (msg->payload_ref != NULL) {
+            mqtt_payload_ref_release(msg->payload_ref);
+            msg->payload_ref = NULL;
+        }
+    }
 }
 
 struct mqtt_queued_message* mqtt_mq_find(struct mqtt_message_queue *mq, enum MQTTControlPacketType control_type, uint16_t *packet_id)
 {
-    struct mqtt_queued_message *curr;
-    for(curr = mqtt_mq_get(mq, 0); curr >= mq->queue_tail; --curr) {
-        if (curr->control_type == control_type) {
-            if ((packet_id == NULL && curr->state != MQTT_QUEUED_COMPLETE) ||
-                (packet_id != NULL && *packet_id == curr->packet_id)) {
+    size_t i;
+    if (packet_id == NULL) {
+        /* CONNECT and PINGREQ aren't indexed: find the oldest one still outstanding */
+        for(i = 0; i < mq->queue_length; ++i) {
+            struct mqtt_queued_message *curr = mqtt_mq_get(mq, i);
+            if (curr->control_type == control_type && curr->state != MQTT_QUEUED_COMPLETE) {
                 return curr;
             }
         }
+        return NULL;
+    } else {
+        /* walk the probe run for this packet id, keeping the oldest match */
+        struct mqtt_queued_message *found = NULL;
+        size_t found_age = 0;
+        size_t pos;
+        if (mq->index_size == 0) {
+            return NULL;
+        }
+        pos = __mqtt_mq_hash(mq, *packet_id);
+        while (mq->index[pos] != 0) {
+            struct mqtt_queued_message *curr = &mq->queue[mq->index[pos] - 1];
+            if (curr->control_type == control_type && curr->packet_id == *packet_id) {
+                size_t slot = (size_t)(curr - mq->queue);
+                size_t age = (slot - mq->queue_head) & (mq->queue_capacity - 1);
+                if (found == NULL || age < found_age) {
+                    found = curr;
+                    found_age = age;
+                }
+            }
+            pos = (pos + 1) & (mq->index_size - 1);
+        }
+        return found;
     }
-    return NULL;
 }
 
 
 /* RESPONSE UNPACKING */
 ssize_t mqtt_unpack_response(struct mqtt_response* response, const uint8_t *buf, size_t bufsz) {
+    return mqtt_unpack_response_version(response, buf, bufsz, MQTT_PROTOCOL_LEVEL);
+}
+
+ssize_t mqtt_unpack_response_version(struct mqtt_response* response, const uint8_t *buf, size_t bufsz,
+                                     uint8_t protocol_level) {
     const uint8_t *const start = buf;
+    int v5 = (protocol_level >= MQTT_PROTOCOL_LEVEL_5);
     ssize_t rv = mqtt_unpack_fixed_header(response, buf, bufsz);
     if (rv <= 0) return rv;
     else buf += rv;
     switch(response->fixed_header.control_type) {
         case MQTT_CONTROL_CONNACK:
-            rv = mqtt_unpack_connack_response(response, buf);
+            rv = v5 ? __mqtt_unpack_connack5(response, buf) : mqtt_unpack_connack_response(response, buf);
             break;
         case MQTT_CONTROL_PUBLISH:
-            rv = mqtt_unpack_publish_response(response, buf);
+            rv = v5 ? __mqtt_unpack_publish5(response, buf) : mqtt_unpack_publish_response(response, buf);
             break;
         case MQTT_CONTROL_PUBACK:
-            rv = mqtt_unpack_pubxxx_response(response, buf);
-            break;
         case MQTT_CONTROL_PUBREC:
-            rv = mqtt_unpack_pubxxx_response(response, buf);
-            break;
         case MQTT_CONTROL_PUBREL:
-            rv = mqtt_unpack_pubxxx_response(response, buf);
-            break;
         case MQTT_CONTROL_PUBCOMP:
-            rv = mqtt_unpack_pubxxx_response(response, buf);
+            rv = v5 ? __mqtt_unpack_pubxxx5(response, buf) : mqtt_unpack_pubxxx_response(response, buf);
             break;
         case MQTT_CONTROL_SUBACK:
-            rv = mqtt_unpack_suback_response(response, buf);
+            rv = v5 ? __mqtt_unpack_suback5(response, buf) : mqtt_unpack_suback_response(response, buf);
             break;
         case MQTT_CONTROL_UNSUBACK:
-            rv = mqtt_unpack_unsuback_response(response, buf);
+            rv = v5 ? __mqtt_unpack_unsuback5(response, buf) : mqtt_unpack_unsuback_response(response, buf);
             break;
         case MQTT_CONTROL_PINGRESP:
             return rv;
+        case MQTT_CONTROL_DISCONNECT:
+            if (!v5) {
+                return MQTT_ERROR_RESPONSE_INVALID_CONTROL_TYPE;
+            }
+            rv = __mqtt_unpack_disconnect5(response, buf);
+            break;
         default:
             return MQTT_ERROR_RESPONSE_INVALID_CONTROL_TYPE;
     }
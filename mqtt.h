@@ -174,6 +174,17 @@ struct mqtt_fixed_header {
  */
 #define MQTT_PROTOCOL_LEVEL 0x04
 
+/**
+ * @brief The protocol identifier for MQTT v5.
+ * @ingroup packers
+ * 
+ * @see mqtt_set_protocol_version
+ * @see <a href="https://docs.oasis-open.org/mqtt/mqtt/v5.0/os/mqtt-v5.0-os.html#_Toc3901036">
+ * MQTT v5.0: Protocol Version.
+ * </a>  
+ */
+#define MQTT_PROTOCOL_LEVEL_5 0x05
+
 /** 
  * @brief A macro used to declare the enum MQTTErrors and associated 
  *        error messages (the members of the num) at the same time.
@@ -207,7 +218,9 @@ struct mqtt_fixed_header {
     MQTT_ERROR(MQTT_ERROR_INVALID_REMAINING_LENGTH)      \
     MQTT_ERROR(MQTT_ERROR_CLEAN_SESSION_IS_REQUIRED)     \
     MQTT_ERROR(MQTT_ERROR_RECONNECT_FAILED)              \
-    MQTT_ERROR(MQTT_ERROR_RECONNECTING)
+    MQTT_ERROR(MQTT_ERROR_RECONNECTING)                  \
+    MQTT_ERROR(MQTT_ERROR_SERVER_DISCONNECTED)           \
+    MQTT_ERROR(MQTT_ERROR_SEND_BUFFER_TOO_SMALL)
 
 /* todo: add more connection refused errors */
 
@@ -326,6 +339,24 @@ struct mqtt_response_connack {
      * @see MQTTConnackReturnCode
      */
     enum MQTTConnackReturnCode return_code;
+
+    /** @brief The MQTT 5 reason code (\c return_code holds the nearest 3.1.1 code). 0 for 3.1.1. */
+    uint8_t reason_code;
+
+    /** @brief The most unacknowledged QoS 1 and 2 PUBLISH packets the broker accepts (MQTT 5), or 0 for no limit. */
+    uint16_t receive_maximum;
+
+    /** @brief The highest topic alias the broker accepts from the client (MQTT 5). 0 means none. */
+    uint16_t topic_alias_maximum;
+
+    /** @brief The highest QoS the broker supports (MQTT 5). */
+    uint8_t maximum_qos;
+
+    /** @brief The largest packet the broker accepts (MQTT 5), or 0 for no limit. */
+    uint32_t maximum_packet_size;
+
+    /** @brief The keep-alive the client must use instead of its own, in seconds (MQTT 5), or -1. */
+    int32_t server_keep_alive;
 };
 
  /**
@@ -376,6 +407,15 @@ struct mqtt_response_publish {
 
     /** @brief The size of the application message in bytes. */
     size_t application_message_size;
+
+    /** @brief The topic alias property (MQTT 5), or 0. */
+    uint16_t topic_alias;
+
+    /** @brief The raw PUBLISH properties (MQTT 5), or NULL. */
+    const void* properties;
+
+    /** @brief The size of \c properties in bytes. */
+    size_t properties_size;
 };
 
 /**
@@ -390,6 +430,9 @@ struct mqtt_response_publish {
 struct mqtt_response_puback {
     /** @brief The published messages packet ID. */
     uint16_t packet_id;
+
+    /** @brief The reason code (MQTT 5). 0 for 3.1.1, 0x80 and above if the publish failed. */
+    uint8_t reason_code;
 };
 
 /**
@@ -404,6 +447,9 @@ struct mqtt_response_puback {
 struct mqtt_response_pubrec {
     /** @brief The published messages packet ID. */
     uint16_t packet_id;
+
+    /** @brief The reason code (MQTT 5). 0 for 3.1.1, 0x80 and above if the publish failed. */
+    uint8_t reason_code;
 };
 
 /**
@@ -418,6 +464,9 @@ struct mqtt_response_pubrec {
 struct mqtt_response_pubrel {
     /** @brief The published messages packet ID. */
     uint16_t packet_id;
+
+    /** @brief The reason code (MQTT 5). 0 for 3.1.1. */
+    uint8_t reason_code;
 };
 
 /**
@@ -432,6 +481,9 @@ struct mqtt_response_pubrel {
 struct mqtt_response_pubcomp {
     /** T@brief he published messages packet ID. */
     uint16_t packet_id;
+
+    /** @brief The reason code (MQTT 5). 0 for 3.1.1. */
+    uint8_t reason_code;
 };
 
 /**
@@ -483,6 +535,12 @@ struct mqtt_response_suback {
 struct mqtt_response_unsuback {
     /** @brief The published messages packet ID. */
     uint16_t packet_id;
+
+    /** @brief A reason code for each topic (MQTT 5), or NULL for 3.1.1. */
+    const uint8_t *reason_codes;
+
+    /** @brief The number of reason codes. */
+    size_t num_reason_codes;
 };
 
 /**
@@ -499,6 +557,19 @@ struct mqtt_response_pingresp {
   int dummy;
 };
 
+/**
+ * @brief A DISCONNECT sent by the broker (MQTT 5 only).
+ * @ingroup unpackers
+ * 
+ * @see <a href="https://docs.oasis-open.org/mqtt/mqtt/v5.0/os/mqtt-v5.0-os.html#_Toc3901205">
+ * MQTT v5.0: DISCONNECT - Disconnect notification.
+ * </a> 
+ */
+struct mqtt_response_disconnect {
+    /** @brief Why the broker is closing the connection. */
+    uint8_t reason_code;
+};
+
 /**
  * @brief A struct used to deserialize/interpret an incoming packet from the broker.
  * @ingroup unpackers
@@ -525,6 +596,7 @@ struct mqtt_response {
         struct mqtt_response_suback   suback;
         struct mqtt_response_unsuback unsuback;
         struct mqtt_response_pingresp pingresp;
+        struct mqtt_response_disconnect disconnect;
     } decoded;
 };
 
@@ -646,6 +718,27 @@ ssize_t mqtt_unpack_unsuback_response(struct mqtt_response *mqtt_response, const
  */
 ssize_t mqtt_unpack_response(struct mqtt_response* response, const uint8_t *buf, size_t bufsz);
 
+/**
+ * @brief Deserialize a packet from the broker for a given protocol version.
+ * @ingroup unpackers
+ * 
+ * \ref mqtt_unpack_response is this with \c MQTT_PROTOCOL_LEVEL. With 
+ * \c MQTT_PROTOCOL_LEVEL_5 the packets' properties and reason codes are parsed as well,
+ * and DISCONNECT packets from the broker are accepted.
+ * 
+ * @param[out] response the mqtt_response that will be initialize from \p buf.
+ * @param[in] buf the incoming data buffer.
+ * @param[in] bufsz the number of bytes available in the buffer.
+ * @param[in] protocol_level \c MQTT_PROTOCOL_LEVEL or \c MQTT_PROTOCOL_LEVEL_5.
+ * 
+ * @relates mqtt_response
+ * 
+ * @returns The number of bytes consumed on success, zero \p buf does not contain enough bytes
+ *          to deserialize the packet, a negative value if a protocol violation was encountered.  
+ */
+ssize_t mqtt_unpack_response_version(struct mqtt_response* response, const uint8_t *buf, size_t bufsz, 
+                                     uint8_t protocol_level);
+
 /* REQUESTS */
 
  /**
@@ -732,6 +825,28 @@ ssize_t mqtt_pack_connection_request(uint8_t* buf, size_t bufsz,
                                      uint8_t connect_flags,
                                      uint16_t keep_alive);
 
+/**
+ * @brief The MQTT 5 properties a client sends in its CONNECT packet.
+ * @ingroup api
+ * 
+ * Zero leaves a property out, so the broker uses its default.
+ * 
+ * @see mqtt_set_protocol_version
+ * @see <a href="https://docs.oasis-open.org/mqtt/mqtt/v5.0/os/mqtt-v5.0-os.html#_Toc3901046">
+ * MQTT v5.0: CONNECT Properties.
+ * </a>
+ */
+struct mqtt_connect_properties {
+    /** @brief How long the broker keeps the session after the connection closes, in seconds. */
+    uint32_t session_expiry_interval;
+
+    /** @brief The most QoS 1 and 2 PUBLISH packets the client will handle at once. */
+    uint16_t receive_maximum;
+
+    /** @brief The largest packet the client will accept, in bytes. */
+    uint32_t maximum_packet_size;
+};
+
 /**
  * @brief An enumeration of the PUBLISH flags.
  * @ingroup packers
@@ -779,6 +894,29 @@ ssize_t mqtt_pack_publish_request(uint8_t *buf, size_t bufsz,
                                   size_t application_message_size,
                                   uint8_t publish_flags);
 
+/**
+ * @brief Serialize everything in a PUBLISH request except the application message.
+ * @ingroup packers
+ * 
+ * The remaining length in the fixed header accounts for \p application_message_size 
+ * bytes of payload, which the caller must send immediately after the packed bytes.
+ * 
+ * @param[out] buf the buffer to put the PUBLISH header in.
+ * @param[in] bufsz the maximum number of bytes that can be put into \p buf.
+ * @param[in] topic_name the topic to publish under.
+ * @param[in] packet_id this packets packet ID.
+ * @param[in] application_message_size the size of the application message in bytes.
+ * @param[in] publish_flags The flags to publish with (see \ref mqtt_pack_publish_request).
+ * 
+ * @returns The number of bytes put into \p buf, 0 if \p buf is too small to fit the 
+ *          header, a negative value if there was a protocol violation.
+ */
+ssize_t mqtt_pack_publish_header(uint8_t *buf, size_t bufsz,
+                                 const char* topic_name,
+                                 uint16_t packet_id,
+                                 size_t application_message_size,
+                                 uint8_t publish_flags);
+
 /**
  * @brief Serialize a PUBACK, PUBREC, PUBREL, or PUBCOMP packet and put it in \p buf.
  * @ingroup packers
@@ -923,6 +1061,48 @@ enum MQTTQueuedMessageState {
     MQTT_QUEUED_COMPLETE
 };
 
+/**
+ * @brief A reference-counted, caller-owned buffer that queued messages can point into.
+ * @ingroup api
+ * 
+ * \ref mqtt_publish_ref takes a reference for each message it queues and drops it once 
+ * the message has been sent (QoS 0) or acknowledged (QoS 1 and 2), any partial write of it
+ * has finished, and it has been cleaned out of the queue. Embed this in your own buffer type
+ * and free the buffer from \c release.
+ */
+struct mqtt_payload_ref {
+    /** @brief The number of references. Starts at 1 (the caller's) in \ref mqtt_payload_ref_init. */
+    mqtt_pal_refcount_t refcount;
+
+    /** 
+     * @brief Called when the last reference is dropped. 
+     * 
+     * @note This may be called from \ref mqtt_sync, with the client's mutex held.
+     */
+    void (*release)(struct mqtt_payload_ref *ref);
+};
+
+/**
+ * @brief Initialize a payload reference with a count of 1.
+ * @ingroup api
+ * 
+ * @param[out] ref The reference to initialize.
+ * @param[in] release Called when the count drops to zero. May be NULL.
+ */
+void mqtt_payload_ref_init(struct mqtt_payload_ref *ref, void (*release)(struct mqtt_payload_ref *ref));
+
+/**
+ * @brief Take another reference on \p ref.
+ * @ingroup api
+ */
+void mqtt_payload_ref_retain(struct mqtt_payload_ref *ref);
+
+/**
+ * @brief Drop a reference on \p ref, calling its \c release callback if it was the last one.
+ * @ingroup api
+ */
+void mqtt_payload_ref_release(struct mqtt_payload_ref *ref);
+
 /**
  * @brief A message in a mqtt_message_queue.
  * @ingroup details
@@ -958,12 +1138,91 @@ struct mqtt_queued_message {
      *       \c packet_id field.
      */
     uint16_t packet_id;
+
+    /**
+     * @brief The number of times the message has been retransmitted after a timeout.
+     * 
+     * Each retransmission doubles the message's timeout (see \ref mqtt_client.rto).
+     */
+    uint8_t resend_count;
+
+    /**
+     * @brief The topic alias the packed PUBLISH carries (MQTT 5), or 0.
+     * 
+     * Aliases only mean something on the connection they were set up on, so \ref mqtt_reinit
+     * repacks these messages with their full topic.
+     */
+    uint16_t topic_alias;
+
+    /**
+     * @brief Caller-owned bytes that are sent straight after the packet at \c start, or NULL.
+     * 
+     * Used by \ref mqtt_publish_ref so the application message isn't copied into the queue.
+     */
+    const uint8_t *payload;
+
+    /** @brief The number of bytes at \c payload. */
+    size_t payload_size;
+
+    /** @brief The reference that keeps \c payload alive, released when the message is cleaned. */
+    struct mqtt_payload_ref *payload_ref;
 };
 
+/**
+ * @brief The number of bytes of packet data to budget for each message slot.
+ * @ingroup details
+ *
+ * The message queue splits its buffer between a ring of mqtt_queued_message slots and a
+ * ring of packet data. This sets the ratio: each slot is paired with at least this many 
+ * bytes of packet data (the slot count is rounded down to a power of two, and the slots 
+ * that rounds off go to packet data). Define it before including mqtt.h to tune the 
+ * split for your traffic.
+ */
+#if !defined(MQTT_MQ_SLOT_BYTES)
+#define MQTT_MQ_SLOT_BYTES 64
+#endif
+
+/**
+ * @brief The maximum number of queued messages gathered into one socket write.
+ * @ingroup details
+ *
+ * \ref __mqtt_send hands every message that is due to be sent to \ref mqtt_pal_sendallv
+ * in batches of up to this many messages (one iovec entry each, two for messages queued
+ * by \ref mqtt_publish_ref).
+ */
+#if !defined(MQTT_SEND_BATCH_MAX)
+#define MQTT_SEND_BATCH_MAX 64
+#endif
+
+/**
+ * @brief The most topic aliases an MQTT 5 client sets up on a connection.
+ * @ingroup details
+ *
+ * The first PUBLISH to a topic sends the topic and an alias for it; later ones send only
+ * the alias. The broker's topic alias maximum can lower this.
+ */
+#if !defined(MQTT_TOPIC_ALIAS_MAX)
+#define MQTT_TOPIC_ALIAS_MAX 16
+#endif
+
+/**
+ * @brief The longest topic (in bytes, plus one) that gets a topic alias.
+ * @ingroup details
+ */
+#if !defined(MQTT_TOPIC_ALIAS_TOPIC_MAX)
+#define MQTT_TOPIC_ALIAS_TOPIC_MAX 64
+#endif
+
 /**
  * @brief A message queue.
  * @ingroup details
  * 
+ * The queue is a pair of rings sharing one memory block: a ring of mqtt_queued_message
+ * slots at the start of the block, followed by a ring of packet data. Packets are always
+ * stored contiguously (a packet that doesn't fit before the end of the data ring is packed
+ * at its start instead), so registering and releasing a message is O(1) and queued packets
+ * never move while they are waiting to be (re)sent.
+ * 
  * @note This struct is used internally to manage sending messages.
  * @note The only members the user should use are \c curr and \c curr_sz. 
  */
@@ -989,19 +1248,55 @@ struct mqtt_message_queue {
     /**
      * @brief The number of bytes that can be written to \c curr.
      * 
-     * @note curr_sz will decrease by more than the number of bytes you write to 
-     *       \c curr. This is because the mqtt_queued_message structs share the 
-     *       same memory (and thus, a mqtt_queued_message must be allocated in 
-     *       the message queue's memory whenever a new message is registered).  
+     * @note curr_sz is 0 when every message slot is in use, even if there is space left
+     *       for packet data.
      */
     size_t curr_sz;
-    
+
     /**
-     * @brief The tail of the array of mqtt_queued_messages's.
+     * @brief The ring of mqtt_queued_message slots.
      * 
-     * @note This member should not be used manually.
+     * @note This member should not be used manually, use \ref mqtt_mq_get.
+     */
+    struct mqtt_queued_message *queue;
+
+    /** @brief The number of slots in \c queue (a power of two, or 0). */
+    size_t queue_capacity;
+
+    /** @brief The index in \c queue of the oldest message. */
+    size_t queue_head;
+
+    /** @brief The number of messages in the queue. */
+    size_t queue_length;
+
+    /** @brief The total size of the packets in the queue, in bytes. */
+    size_t bytes_queued;
+
+    /**
+     * @brief A message that is partially written to the socket, or NULL.
+     *
+     * Its bytes (and payload) have to stay put until the rest is written, even if it is
+     * acknowledged in the meantime, so \ref mqtt_mq_clean never releases it, or anything
+     * queued after it. Kept equal to mqtt_client::send_partial by the client.
      */
-    struct mqtt_queued_message *queue_tail;
+    struct mqtt_queued_message *pinned;
+
+    /**
+     * @brief An open-addressing (linear probing) index from packet ID to slot.
+     *
+     * Each entry holds the slot's index in \c queue plus one, or 0 if the entry is empty.
+     * Only messages that can be acknowledged by packet ID are indexed (see \ref mqtt_mq_index).
+     */
+    uint16_t *index;
+
+    /** @brief The number of entries in \c index (a power of two, at least twice \c queue_capacity). */
+    size_t index_size;
+
+    /** @brief The start of the packet data ring. */
+    uint8_t *data_start;
+
+    /** @brief The end of the packet data ring. */
+    uint8_t *data_end;
 };
 
 /**
@@ -1016,10 +1311,30 @@ struct mqtt_message_queue {
  */
 void mqtt_mq_init(struct mqtt_message_queue *mq, void *buf, size_t bufsz);
 
+/**
+ * @brief The largest packet a message queue can hold.
+ * @ingroup details
+ * 
+ * This is the size of the data ring, what is left of the buffer after the message slots
+ * and the packet-id index: at least MQTT_MQ_SLOT_BYTES / (MQTT_MQ_SLOT_BYTES + 
+ * sizeof(struct mqtt_queued_message) + 8) of it, more when the slot count is rounded 
+ * down to a power of two.
+ * 
+ * @param[in] bufsz The size of the queue's buffer, which is assumed to be 8-byte aligned.
+ * 
+ * @relates mqtt_message_queue
+ */
+size_t mqtt_mq_max_packet_size(size_t bufsz);
+
 /**
  * @brief Clear as many messages from the front of the queue as possible.
  * @ingroup details
  * 
+ * Releases completed messages from the front of the queue, stopping at the \c pinned one.
+ * If the space left before the
+ * end of the data ring is smaller than the space freed at its start, packing continues
+ * from the start of the ring.
+ * 
  * @note Calls to this function are the \em only way to remove messages from the queue.
  * 
  * @param mq The message queue.
@@ -1028,6 +1343,16 @@ void mqtt_mq_init(struct mqtt_message_queue *mq, void *buf, size_t bufsz);
  */
 void mqtt_mq_clean(struct mqtt_message_queue *mq);
 
+/**
+ * @brief Drop the payload references held by every message in the queue.
+ * @ingroup details
+ * 
+ * Called by \ref mqtt_reinit before the queue is reset, since the messages are discarded.
+ * 
+ * @relates mqtt_message_queue
+ */
+void mqtt_mq_release_payloads(struct mqtt_message_queue *mq);
+
 /**
  * @brief Register a message that was just added to the buffer.
  * @ingroup details
@@ -1046,10 +1371,33 @@ void mqtt_mq_clean(struct mqtt_message_queue *mq);
  */
 struct mqtt_queued_message* mqtt_mq_register(struct mqtt_message_queue *mq, size_t nbytes);
 
+/**
+ * @brief Add a registered message to the queue's packet-id index.
+ * @ingroup details
+ * 
+ * Call this once the message's \c control_type and \c packet_id have been set. QoS 0
+ * PUBLISH messages, and messages without a packet ID, are not indexed.
+ * 
+ * @param mq The message queue.
+ * @param msg The message returned by \ref mqtt_mq_register.
+ * 
+ * @relates mqtt_message_queue
+ */
+void mqtt_mq_index(struct mqtt_message_queue *mq, struct mqtt_queued_message *msg);
+
+/**
+ * @brief Returns 1 if an indexed message in the queue uses \p packet_id, 0 otherwise.
+ * @ingroup details
+ */
+int __mqtt_mq_pid_in_use(struct mqtt_message_queue *mq, uint16_t packet_id);
+
 /**
  * @brief Find a message in the message queue.
  * @ingroup details
  * 
+ * Lookups by packet ID go through the queue's packet-id index and are O(1). Lookups
+ * without a packet ID scan the queue for the oldest outstanding message of that type.
+ * 
  * @param mq The message queue.
  * @param[in] control_type The control type of the message you want to find.
  * @param[in] packet_id The packet ID of the message you want to find. Set to \c NULL if you 
@@ -1060,31 +1408,78 @@ struct mqtt_queued_message* mqtt_mq_register(struct mqtt_message_queue *mq, size
  */
 struct mqtt_queued_message* mqtt_mq_find(struct mqtt_message_queue *mq, enum MQTTControlPacketType control_type, uint16_t *packet_id);
 
+/**
+ * @brief Returns the index into mqtt_message_queue::queue of the message at \p index.
+ * @ingroup details
+ */
+#define __mqtt_mq_slot(mq_ptr, index) \
+    (((mq_ptr)->queue_head + (index)) & ((mq_ptr)->queue_capacity - 1))
+
 /**
  * @brief Returns the mqtt_queued_message at \p index.
  * @ingroup details
  * 
  * @param mq_ptr A pointer to the message queue.
- * @param index The index of the message. 
+ * @param index The index of the message, 0 is the oldest message in the queue. 
  *
  * @returns The mqtt_queued_message at \p index.
  */
-#define mqtt_mq_get(mq_ptr, index) (((struct mqtt_queued_message*) ((mq_ptr)->mem_end)) - 1 - index)
+#define mqtt_mq_get(mq_ptr, index) (&(mq_ptr)->queue[__mqtt_mq_slot(mq_ptr, index)])
 
 /**
  * @brief Returns the number of messages in the message queue, \p mq_ptr.
  * @ingroup details
  */
-#define mqtt_mq_length(mq_ptr) (((struct mqtt_queued_message*) ((mq_ptr)->mem_end)) - (mq_ptr)->queue_tail)
+#define mqtt_mq_length(mq_ptr) ((ssize_t)(mq_ptr)->queue_length)
 
 /**
  * @brief Used internally to recalculate the \c curr_sz.
  * @ingroup details
  */
-#define mqtt_mq_currsz(mq_ptr) (mq_ptr->curr >= (uint8_t*) ((mq_ptr)->queue_tail - 1)) ? 0 : ((uint8_t*) ((mq_ptr)->queue_tail - 1)) - (mq_ptr)->curr
+size_t mqtt_mq_currsz(struct mqtt_message_queue *mq);
 
 /* CLIENT */
 
+/**
+ * @brief How a client allocates, grows and shrinks its send and receive buffers.
+ * @ingroup api
+ * 
+ * Once a policy is set with \ref mqtt_set_buffer_policy the client allocates its own 
+ * buffers. The send buffer starts at \c send_initial_size and doubles (moving the queued 
+ * messages across) whenever a message doesn't fit, up to \c send_max_size. When the queue
+ * has been empty and the buffer hasn't grown for \c shrink_after, it is given back and 
+ * replaced with one of \c send_initial_size. The receive buffer doubles up to 
+ * \c recv_max_size when an incoming packet doesn't fit.
+ * 
+ * \c alloc and \c free can hand out memory from an arena or chunk allocator; if they are 
+ * NULL, \c MQTT_PAL_MALLOC and \c MQTT_PAL_FREE are used.
+ */
+struct mqtt_buffer_policy {
+    /** @brief Allocates \p size bytes, or returns NULL. */
+    void* (*alloc)(void* state, size_t size);
+
+    /** @brief Frees a buffer returned by \c alloc. */
+    void (*free)(void* state, void* buf, size_t size);
+
+    /** @brief Passed to \c alloc and \c free. */
+    void* state;
+
+    /** @brief The size of the send buffer when the queue is idle, in bytes. */
+    size_t send_initial_size;
+
+    /** @brief The most the send buffer may grow to, in bytes. */
+    size_t send_max_size;
+
+    /** @brief The initial size of the receive buffer, in bytes. */
+    size_t recv_initial_size;
+
+    /** @brief The most the receive buffer may grow to, in bytes. */
+    size_t recv_max_size;
+
+    /** @brief How long (in milliseconds) the send buffer must go without growing before it can shrink. */
+    mqtt_pal_time_t shrink_after;
+};
+
 /**
  * @brief An MQTT client. 
  * @ingroup details
@@ -1114,6 +1509,14 @@ struct mqtt_client {
      */
     size_t send_offset;
 
+    /**
+     * @brief The message that has been partially sent, or NULL.
+     *
+     * The rest of this message (from \c send_offset) must be sent before any other bytes
+     * are written to the socket.
+     */
+    struct mqtt_queued_message *send_partial;
+
     /** 
      * @brief The timestamp of the last message sent to the buffer.
      * 
@@ -1134,21 +1537,75 @@ struct mqtt_client {
     enum MQTTErrors error;
 
     /** 
-     * @brief The timeout period in seconds.
+     * @brief The longest retransmission timeout, in milliseconds.
      * 
-     * If the broker doesn't return an ACK within response_timeout seconds a timeout
-     * will occur and the message will be retransmitted. 
+     * If the broker doesn't return an ACK within the retransmission timeout a timeout will
+     * occur and the message will be retransmitted. Until the first round-trip time has been
+     * measured the timeout is response_timeout; after that it is \ref rto, doubled for 
+     * each time the message has already been retransmitted, and capped at response_timeout.
+     * With MQTT 5, PUBLISH and PUBREL messages are never retransmitted on the same 
+     * connection [MQTT-4.4.0-1], only after a reconnect (see \ref mqtt_reinit).
      * 
-     * @note The default value is 30 [seconds] but you can change it at any time.
+     * @note The default value is 30000 [milliseconds] but you can change it at any time.
      */
     int response_timeout;
 
-    /** @brief A counter counting the number of timeouts that have occurred. */
+    /** 
+     * @brief The shortest retransmission timeout, in milliseconds.
+     * 
+     * @note The default value is 1000 [milliseconds], the minimum RTO of RFC 6298, but you
+     *       can change it at any time.
+     */
+    int min_response_timeout;
+
+    /** 
+     * @brief A counter counting the number of timeouts that have occurred. 
+     * 
+     * Every timeout retransmits a message, so this is also the number of retransmissions.
+     */
     int number_of_timeouts;
 
+    /**
+     * @brief The smoothed round-trip time to the broker in milliseconds, or -1 before the 
+     *        first measurement.
+     * 
+     * Measured from the ACKs of messages that weren't retransmitted, as in TCP (RFC 6298).
+     */
+    float srtt;
+
+    /** @brief The round-trip time variation in milliseconds. @see srtt */
+    float rttvar;
+
+    /** @brief The retransmission timeout, srtt + 4 rttvar, in milliseconds. @see response_timeout */
+    mqtt_pal_time_t rto;
+
+    /**
+     * @brief The most QoS 1 PUBLISH messages that may be awaiting their PUBACK at once, or 0
+     *        for no limit.
+     * 
+     * Further QoS 1 messages wait in the send buffer (in order) until PUBACKs open the window 
+     * again, and so do the PUBLISHes of any QoS queued behind them. Retransmissions of 
+     * messages already in flight aren't held back.
+     * 
+     * @note The default value is 0 but you can change it at any time.
+     */
+    int max_inflight_qos1;
+
+    /**
+     * @brief The most QoS 2 exchanges that may be in flight at once, or 0 for no limit.
+     * 
+     * An exchange is in flight from its PUBLISH being sent until its PUBCOMP arrives. Each 
+     * has its own PUBREC/PUBREL/PUBCOMP state, found by packet id. Further QoS 2 messages 
+     * wait in the send buffer (in order) until an exchange completes, and so do the 
+     * PUBLISHes of any QoS queued behind them.
+     * 
+     * @note The default value is 1 (one exchange at a time) but you can change it at any time.
+     */
+    int max_inflight_qos2;
+
     /**
      * @brief Approximately much time it has typically taken to receive responses from the 
-     *        broker.
+     *        broker, in milliseconds.
      * 
      * @note This is tracked using a exponential-averaging.
      */
@@ -1234,6 +1691,68 @@ struct mqtt_client {
 
     /** @brief The sending message queue. */
     struct mqtt_message_queue mq;
+
+    /**
+     * @brief A CONNECT that has to be sent before the (older) messages ahead of it in the queue, or NULL.
+     * 
+     * Set when \ref mqtt_connect is called with messages kept from a previous connection.
+     */
+    struct mqtt_queued_message *send_first;
+
+    /** @brief Nonzero if \c buffer_policy is in use. */
+    int has_buffer_policy;
+
+    /** @brief The buffer policy set with \ref mqtt_set_buffer_policy. */
+    struct mqtt_buffer_policy buffer_policy;
+
+    /** @brief The send buffer, if it was allocated through \c buffer_policy (otherwise NULL). */
+    void *owned_send_buffer;
+
+    /** @brief The receive buffer, if it was allocated through \c buffer_policy (otherwise NULL). */
+    void *owned_recv_buffer;
+
+    /** @brief The time the send buffer last grew. */
+    mqtt_pal_time_t time_of_last_grow;
+
+    /** @brief The most bytes that have been queued in the send buffer at once. */
+    size_t send_high_water;
+
+    /** @brief \c MQTT_PROTOCOL_LEVEL (3.1.1, the default) or \c MQTT_PROTOCOL_LEVEL_5. */
+    uint8_t protocol_level;
+
+    /** @brief The properties sent in the CONNECT packet (MQTT 5). */
+    struct mqtt_connect_properties connect_properties;
+
+    /**
+     * @brief The broker's receive maximum (MQTT 5), or 0 for no limit.
+     * 
+     * No more than this many QoS 1 and 2 PUBLISH messages are sent without their PUBACK or
+     * PUBCOMP, on top of \c max_inflight_qos1 and \c max_inflight_qos2. Set from the CONNACK.
+     */
+    uint16_t server_receive_maximum;
+
+    /** @brief The highest topic alias the broker accepts (MQTT 5). Set from the CONNACK, 0 until then. */
+    uint16_t server_topic_alias_maximum;
+
+    /** @brief The highest QoS the broker supports. PUBLISH messages are downgraded to it. */
+    uint8_t server_maximum_qos;
+
+    /** @brief The largest packet the broker accepts (MQTT 5), or 0 for no limit. */
+    uint32_t server_maximum_packet_size;
+
+    /**
+     * @brief The last failure reason code (0x80 and above) the broker sent (MQTT 5).
+     * 
+     * A PUBACK or PUBREC with a failure reason ends that message's exchange, and a DISCONNECT
+     * from the broker puts the client in the \c MQTT_ERROR_SERVER_DISCONNECTED state.
+     */
+    uint8_t last_reason_code;
+
+    /** @brief The topics of the aliases set up on this connection; alias \c i+1 is at \c i. */
+    char topic_aliases[MQTT_TOPIC_ALIAS_MAX][MQTT_TOPIC_ALIAS_TOPIC_MAX];
+
+    /** @brief The number of aliases in \c topic_aliases. */
+    uint16_t num_topic_aliases;
 };
 
 /**
@@ -1292,10 +1811,94 @@ ssize_t __mqtt_recv(struct mqtt_client *client);
  *            inside your main thread. See @ref simple_publisher.c and @ref simple_subscriber.c
  *            for examples (specifically the \c client_refresher functions).
  * 
+ * @see mqtt_get_readiness for driving the client from an event loop instead.
+ * 
  * @returns MQTT_OK upon success, an \ref MQTTErrors otherwise. 
  */
 enum MQTTErrors mqtt_sync(struct mqtt_client *client);
 
+/**
+ * @brief Like \ref mqtt_sync, but only receives.
+ * @ingroup api
+ * 
+ * For event loops: call this when the socket reported by \ref mqtt_get_readiness is 
+ * readable (or has hung up). Errors are recovered from exactly as in \ref mqtt_sync.
+ * 
+ * @param[in,out] client The MQTT client.
+ * 
+ * @returns MQTT_OK upon success, an \ref MQTTErrors otherwise. 
+ */
+enum MQTTErrors mqtt_sync_read(struct mqtt_client *client);
+
+/**
+ * @brief Like \ref mqtt_sync, but only sends.
+ * @ingroup api
+ * 
+ * For event loops: call this when the socket reported by \ref mqtt_get_readiness is 
+ * writable, or once its \c next_deadline has passed. Retransmissions, keep-alive 
+ * pings and giving back an idle send buffer all happen here.
+ * 
+ * @param[in,out] client The MQTT client.
+ * 
+ * @returns MQTT_OK upon success, an \ref MQTTErrors otherwise. 
+ */
+enum MQTTErrors mqtt_sync_write(struct mqtt_client *client);
+
+/**
+ * @brief The \c next_deadline of a client with no timers pending.
+ * @ingroup api
+ */
+#define MQTT_DEADLINE_NONE ((mqtt_pal_time_t) -1)
+
+/**
+ * @brief What a client is waiting for, as reported by \ref mqtt_get_readiness.
+ * @ingroup api
+ */
+struct mqtt_readiness {
+    /** @brief The socket to wait on. */
+    mqtt_pal_socket_handle socketfd;
+
+    /** @brief Nonzero if \ref mqtt_sync_read should be called when the socket is readable. */
+    int want_read;
+
+    /** 
+     * @brief Nonzero if the client has something it can send right now, i.e. 
+     *        \ref mqtt_sync_write should be called when the socket is writable.
+     * 
+     * Messages held back by an in-flight window or the broker's receive maximum don't 
+     * count, so this stays zero until an ack makes room for them.
+     */
+    int want_write;
+
+    /**
+     * @brief The \c MQTT_PAL_TIME() by which \ref mqtt_sync_write should be called 
+     *        even if the socket isn't writable: the next retransmission, keep-alive ping
+     *        or send buffer shrink. \ref MQTT_DEADLINE_NONE if there is none.
+     */
+    mqtt_pal_time_t next_deadline;
+};
+
+/**
+ * @brief Reports what \p client is waiting for, so it can be driven from an event loop
+ *        (poll, epoll, io_uring, ...) instead of calling \ref mqtt_sync periodically.
+ * @ingroup api
+ * 
+ * Wait until the socket is readable (if \c want_read), writable (if \c want_write) or
+ * \c next_deadline has passed, then call \ref mqtt_sync_read and/or 
+ * \ref mqtt_sync_write. Ask again afterwards, and after queueing new messages.
+ * 
+ * @pre mqtt_init must have been called.
+ * 
+ * @param[in] client The MQTT client.
+ * @param[out] readiness What the client is waiting for.
+ * 
+ * @returns MQTT_OK upon success. If the client is in an error state (including a 
+ *          reconnect requested with \ref mqtt_reconnect) that error is returned, with 
+ *          \c want_read and \c want_write zero and \c next_deadline now: call 
+ *          \ref mqtt_sync to recover, when the application next wants to try.
+ */
+enum MQTTErrors mqtt_get_readiness(struct mqtt_client *client, struct mqtt_readiness *readiness);
+
 /**
  * @brief Initializes an MQTT client.
  * @ingroup api
@@ -1320,6 +1923,12 @@ enum MQTTErrors mqtt_sync(struct mqtt_client *client);
  * @note If \p sendbuf fills up completely during runtime a \c MQTT_ERROR_SEND_BUFFER_IS_FULL
  *       error will be set. Similarly if \p recvbuf is ever to small to receive a message from
  *       the broker an MQTT_ERROR_RECV_BUFFER_TOO_SMALL error will be set.
+ * @note Part of \p sendbuf holds the message queue's slots and packet-id index, so the 
+ *       largest packet that can be published is \ref mqtt_mq_max_packet_size (\p sendbufsz),
+ *       between 45% and 70% of \p sendbuf on 64-bit targets with the default 
+ *       MQTT_MQ_SLOT_BYTES, depending on how the slot count rounds to a power of two (or,
+ *       with a buffer policy, that of its \c send_max_size). Publishing anything larger returns 
+ *       \c MQTT_ERROR_SEND_BUFFER_TOO_SMALL, without putting the client in an error state.
  * @note A pointer to \ref mqtt_client.publish_response_callback_state is always passed as the 
  *       \c state argument to \p publish_response_callback. Note that the second argument is 
  *       the mqtt_response_publish that was received from the broker.
@@ -1400,6 +2009,53 @@ void mqtt_init_reconnect(struct mqtt_client *client,
                          void *reconnect_state,
                          void (*publish_response_callback)(void** state, struct mqtt_response_publish *publish));
 
+/**
+ * @brief Let the client allocate, grow and shrink its own buffers.
+ * @ingroup api
+ * 
+ * The policy is copied. Buffers already given to the client stay in use until they 
+ * need to grow; after that the client only uses buffers from \p policy. With a policy 
+ * set, \ref mqtt_publish_batch keeps queueing while the client is reconnecting.
+ * 
+ * @note This doesn't lock the client's mutex; call it right after \ref mqtt_init or 
+ *       \ref mqtt_init_reconnect.
+ * 
+ * @param[in,out] client The MQTT client.
+ * @param[in] policy The buffer policy. 
+ * 
+ * @see mqtt_buffer_policy
+ */
+void mqtt_set_buffer_policy(struct mqtt_client *client, const struct mqtt_buffer_policy *policy);
+
+/**
+ * @brief Choose the MQTT protocol version the client connects with.
+ * @ingroup api
+ * 
+ * The default is 3.1.1 (\c MQTT_PROTOCOL_LEVEL). With \c MQTT_PROTOCOL_LEVEL_5 the client
+ * sends \p properties in its CONNECT, follows the broker's receive maximum, topic alias 
+ * maximum, maximum QoS and server keep-alive from the CONNACK, and replaces the topic of 
+ * repeated PUBLISH messages with a topic alias. Inbound topic aliases aren't enabled.
+ * 
+ * @note This doesn't lock the client's mutex; call it before \ref mqtt_connect.
+ * 
+ * @param[in,out] client The MQTT client.
+ * @param[in] protocol_level \c MQTT_PROTOCOL_LEVEL or \c MQTT_PROTOCOL_LEVEL_5.
+ * @param[in] properties The CONNECT properties, copied. May be NULL.
+ * 
+ * @returns \c MQTT_OK upon success, \c MQTT_ERROR_NOT_IMPLEMENTED for other versions.
+ */
+enum MQTTErrors mqtt_set_protocol_version(struct mqtt_client *client, uint8_t protocol_level,
+                                          const struct mqtt_connect_properties *properties);
+
+/**
+ * @brief Give back the buffers the client allocated through its buffer policy.
+ * @ingroup api
+ * 
+ * Queued messages are discarded (releasing their payload references). The client must 
+ * be reinitialized before it is used again.
+ */
+void mqtt_free_buffers(struct mqtt_client *client);
+
 /**
  * @brief Safely assign/reassign a socket and buffers to an new/existing client.
  * @ingroup api
@@ -1408,13 +2064,23 @@ void mqtt_init_reconnect(struct mqtt_client *client,
  * \c client->error will be \c MQTT_ERROR_CONNECT_NOT_CALLED (which will be cleared)
  * as soon as \ref mqtt_connect is called.
  * 
+ * Messages still in the old send buffer are discarded, and any payload references they
+ * held (see \ref mqtt_publish_ref) are released, so the old send buffer must still be valid.
+ * 
+ * If a buffer policy has been set (see \ref mqtt_set_buffer_policy), pass NULL buffers to 
+ * keep the client's own. The queued PUBLISH, PUBREL, SUBSCRIBE and UNSUBSCRIBE messages are 
+ * then kept and sent again on the new connection, right after the CONNECT. PUBLISH messages
+ * that used an MQTT 5 topic alias are repacked with their topic.
+ * 
  * @pre This function must be called BEFORE \ref mqtt_connect. 
  * 
  * @param[in,out] client The MQTT client.
  * @param[in] socketfd The new socket connected to the broker. 
- * @param[in] sendbuf The buffer that will be used to buffer egress traffic to the broker.
+ * @param[in] sendbuf The buffer that will be used to buffer egress traffic to the broker, 
+ *            or NULL to use the buffer policy.
  * @param[in] sendbufsz The size of \p sendbuf in bytes.
- * @param[in] recvbuf The buffer that will be used to buffer ingress traffic from the broker.
+ * @param[in] recvbuf The buffer that will be used to buffer ingress traffic from the broker,
+ *            or NULL to use the buffer policy.
  * @param[in] recvbufsz The size of \p recvbuf in bytes.
  * 
  * @post Call \ref mqtt_connect.
@@ -1483,7 +2149,9 @@ enum MQTTErrors mqtt_connect(struct mqtt_client *client,
  *            publish at (MQTT_PUBLISH_QOS_[0,1,2]) or whether or not the broker should 
  *            retain the publish (MQTT_PUBLISH_RETAIN).
  * 
- * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise.
+ * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise. 
+ *          \c MQTT_ERROR_SEND_BUFFER_TOO_SMALL if the packet is larger than the send buffer
+ *          can ever hold (see \ref mqtt_init); the client's state is left as it was.
  */
 enum MQTTErrors mqtt_publish(struct mqtt_client *client,
                              const char* topic_name,
@@ -1491,6 +2159,88 @@ enum MQTTErrors mqtt_publish(struct mqtt_client *client,
                              size_t application_message_size,
                              uint8_t publish_flags);
 
+/**
+ * @brief Publish an application message without copying it into the send buffer.
+ * @ingroup api
+ * 
+ * Only the PUBLISH header (fixed header, topic and packet ID) is packed into the client's 
+ * send buffer. The application message is written to the socket directly from 
+ * \p application_message, which must stay valid and unchanged until the message is done 
+ * with: sent for QoS 0, acknowledged for QoS 1 and 2, and in either case not part way 
+ * through being written to the socket (a retransmission can be acknowledged before it is 
+ * all written). \p payload_ref tracks that; a reference is taken here and dropped when 
+ * the message is cleaned out of the queue.
+ * 
+ * @pre mqtt_connect must have been called.
+ * 
+ * @param[in,out] client The MQTT client.
+ * @param[in] topic_name The name of the topic.
+ * @param[in] application_message The data to be published.
+ * @param[in] application_message_size The size of \p application_message in bytes.
+ * @param[in] publish_flags \ref MQTTPublishFlags to be used (see \ref mqtt_publish).
+ * @param[in] payload_ref The reference owning \p application_message. May be NULL if the 
+ *            data outlives the client (e.g. static data).
+ * 
+ * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise (see \ref mqtt_publish; 
+ *          only the header has to fit in the send buffer). No reference is taken on failure.
+ */
+enum MQTTErrors mqtt_publish_ref(struct mqtt_client *client,
+                                 const char* topic_name,
+                                 const void* application_message,
+                                 size_t application_message_size,
+                                 uint8_t publish_flags,
+                                 struct mqtt_payload_ref *payload_ref);
+
+/**
+ * @brief One message in a call to \ref mqtt_publish_batch.
+ * @ingroup api
+ */
+struct mqtt_publish_entry {
+    /** @brief The name of the topic, or NULL to use the batch's topic. */
+    const char* topic_name;
+
+    /** @brief The data to be published. */
+    const void* application_message;
+
+    /** @brief The size of \c application_message in bytes. */
+    size_t application_message_size;
+
+    /** @brief \ref MQTTPublishFlags to be used (see \ref mqtt_publish). */
+    uint8_t publish_flags;
+
+    /** @brief Set by \ref mqtt_publish_batch: \c MQTT_OK if the message was queued, an \ref MQTTErrors otherwise. */
+    enum MQTTErrors status;
+};
+
+/**
+ * @brief Publish several application messages at once.
+ * @ingroup api
+ * 
+ * Equivalent to calling \ref mqtt_publish for each entry in order, but the client's mutex
+ * is taken once, the free space in the send buffer is checked (and cleaned if necessary)
+ * once for the whole batch, and the packets are packed back to back.
+ * 
+ * If the send buffer can't hold the whole batch (and, with a buffer policy, can't grow to),
+ * the leading entries that fit are queued and the rest get \c MQTT_ERROR_SEND_BUFFER_IS_FULL.
+ * A full buffer is only reported through the entries; it doesn't put the client in an 
+ * error state. Neither does an entry too large to ever fit, which gets
+ * \c MQTT_ERROR_SEND_BUFFER_TOO_SMALL and is skipped.
+ * 
+ * @pre mqtt_connect must have been called.
+ * 
+ * @param[in,out] client The MQTT client.
+ * @param[in] topic_name The topic for entries whose \c topic_name is NULL. May be NULL if 
+ *            every entry has its own topic.
+ * @param[in,out] entries The messages to publish. Each entry's \c status is set.
+ * @param[in] count The number of entries.
+ * 
+ * @returns \c MQTT_OK if every message was queued, the first failing entry's status otherwise.
+ */
+enum MQTTErrors mqtt_publish_batch(struct mqtt_client *client,
+                                   const char* topic_name,
+                                   struct mqtt_publish_entry *entries,
+                                   size_t count);
+
 /**
  * @brief Acknowledge an ingree publish with QOS==1.
  * @ingroup details
@@ -22,6 +22,15 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 
+/* clock_gettime and CLOCK_MONOTONIC aren't declared by a strict -std=c99 otherwise */
+#if !defined(WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+/* nor are syscall, MAP_POPULATE and MAP_ANONYMOUS, which the io_uring backend uses */
+#if defined(MQTT_USE_IO_URING) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
 #include "mqtt.h"
 
 /** 
@@ -31,6 +40,20 @@ SOFTWARE.
  * @cond Doxygen_Suppress
  */
 
+#if defined(__unix__) || defined(__APPLE__) || defined(__NuttX__)
+
+/* 
+ * Timeouts and keep-alive only ever look at differences between two times, so use a
+ * clock that doesn't step when the wall clock is adjusted (e.g. by NTP).
+ */
+mqtt_pal_time_t mqtt_pal_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (mqtt_pal_time_t)ts.tv_sec * 1000 + (mqtt_pal_time_t)(ts.tv_nsec / 1000000);
+}
+
+#endif
+
 #if defined(MQTT_USE_CUSTOM_SOCKET_HANDLE)
 
 /*
@@ -333,7 +356,11 @@ ssize_t mqtt_pal_recvall(mqtt_pal_socket_handle fd, void* buf, size_t bufsz, int
 
 #include <errno.h>
 
-ssize_t mqtt_pal_sendall(mqtt_pal_socket_handle fd, const void* buf, size_t len, int flags) {
+/*
+ * The plain socket calls. The io_uring backend (below) uses them too, on kernels 
+ * without io_uring.
+ */
+static ssize_t __mqtt_pal_sendall(int fd, const void* buf, size_t len, int flags) {
     enum MQTTErrors error = 0;
     size_t sent = 0;
     while(sent < len) {
@@ -359,7 +386,62 @@ ssize_t mqtt_pal_sendall(mqtt_pal_socket_handle fd, const void* buf, size_t len,
     return (ssize_t)sent;
 }
 
-ssize_t mqtt_pal_recvall(mqtt_pal_socket_handle fd, void* buf, size_t bufsz, int flags) {
+#if defined(IOV_MAX)
+#define MQTT_PAL_IOV_MAX IOV_MAX
+#else
+#define MQTT_PAL_IOV_MAX 16
+#endif
+
+static ssize_t __mqtt_pal_sendallv(int fd, mqtt_pal_iovec *iov, int iovcnt, int flags) {
+    enum MQTTErrors error = 0;
+    size_t sent = 0;
+    while(iovcnt > 0) {
+        struct msghdr hdr;
+        int chunk = iovcnt < MQTT_PAL_IOV_MAX ? iovcnt : MQTT_PAL_IOV_MAX;
+        int chunk_flags = flags;
+        ssize_t rv;
+#if defined(MSG_MORE)
+        /* cork the segment if the kernel can't take the whole list in one call */
+        if (chunk < iovcnt) {
+            chunk_flags |= MSG_MORE;
+        }
+#endif
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_iov = iov;
+        hdr.msg_iovlen = chunk;
+        rv = sendmsg(fd, &hdr, chunk_flags);
+        if (rv < 0) {
+            if (errno == EAGAIN) {
+                /* should call sendmsg later again */
+                break;
+            }
+            error = MQTT_ERROR_SOCKET_ERROR;
+            break;
+        }
+        if (rv == 0) {
+            /* is this possible? maybe OS bug. */
+            error = MQTT_ERROR_SOCKET_ERROR;
+            break;
+        }
+        sent += (size_t) rv;
+        /* skip the buffers that were sent, and trim the one that was partially sent */
+        while (iovcnt > 0 && (size_t) rv >= iov->iov_len) {
+            rv -= (ssize_t) iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + rv;
+            iov->iov_len -= (size_t) rv;
+        }
+    }
+    if (sent == 0) {
+        return error;
+    }
+    return (ssize_t)sent;
+}
+
+static ssize_t __mqtt_pal_recvall(int fd, void* buf, size_t bufsz, int flags) {
     const void *const start = buf;
     enum MQTTErrors error = 0;
     ssize_t rv;
@@ -392,6 +474,438 @@ ssize_t mqtt_pal_recvall(mqtt_pal_socket_handle fd, void* buf, size_t bufsz, int
     return (char*)buf - (const char*)start;
 }
 
+#if !defined(MQTT_USE_IO_URING)
+
+ssize_t mqtt_pal_sendall(mqtt_pal_socket_handle fd, const void* buf, size_t len, int flags) {
+    return __mqtt_pal_sendall(fd, buf, len, flags);
+}
+
+ssize_t mqtt_pal_sendallv(mqtt_pal_socket_handle fd, mqtt_pal_iovec *iov, int iovcnt, int flags) {
+    return __mqtt_pal_sendallv(fd, iov, iovcnt, flags);
+}
+
+ssize_t mqtt_pal_recvall(mqtt_pal_socket_handle fd, void* buf, size_t bufsz, int flags) {
+    return __mqtt_pal_recvall(fd, buf, bufsz, flags);
+}
+
+#else /* !defined(MQTT_USE_IO_URING) */
+
+#if !defined(__linux__)
+#error MQTT_USE_IO_URING is only available on Linux
+#endif
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * io_uring backend.
+ *
+ * Each connection gets a small ring with its socket registered as fixed file 0, and a
+ * multishot receive armed on it that fills a registered ring of provided buffers. 
+ * Received bytes just show up in the completion queue, so mqtt_pal_recvall makes no
+ * syscalls unless the receive has to be armed again. A send is submitted (along with
+ * anything else queued) and its completion reaped with a single io_uring_enter.
+ *
+ * Kernels without io_uring (or with it disabled), or too old for provided buffer rings
+ * and multishot receive (Linux 6.0), get the plain socket calls on the bare fd.
+ */
+
+#if !defined(MQTT_PAL_URING_BUFFERS)
+/* number of provided receive buffers, a power of 2 */
+#define MQTT_PAL_URING_BUFFERS 16
+#endif
+#if !defined(MQTT_PAL_URING_BUFFER_SIZE)
+#define MQTT_PAL_URING_BUFFER_SIZE 4096
+#endif
+
+#define MQTT_PAL_URING_SEND 1
+#define MQTT_PAL_URING_RECV 2
+
+struct mqtt_pal_uring {
+    int fd;
+    int ring_fd; /* -1 when using the plain socket calls */
+
+    /* the submission and completion queues, mapped with IORING_FEAT_SINGLE_MMAP */
+    void *ring_mem;
+    size_t ring_mem_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit;
+
+    /* the provided receive buffers, and the one being copied out of */
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    uint8_t *bufs;
+    uint16_t buf_tail;
+    uint16_t pending_bid;
+    uint32_t pending_offset;
+    uint32_t pending_len;
+
+    int recv_armed;
+    int recv_seen;
+    enum MQTTErrors error; /* reported once the bytes received before it are read */
+    struct msghdr msg;
+};
+
+static int __mqtt_pal_uring_enter(struct mqtt_pal_uring *h, unsigned min_complete) {
+    int rv;
+    do {
+        rv = (int) syscall(__NR_io_uring_enter, h->ring_fd, h->to_submit, min_complete,
+                           min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (rv < 0 && errno == EINTR);
+    if (rv < 0) {
+        return -1;
+    }
+    h->to_submit -= (unsigned) rv;
+    return 0;
+}
+
+static struct io_uring_sqe *__mqtt_pal_uring_get_sqe(struct mqtt_pal_uring *h) {
+    unsigned tail = *h->sq_tail;
+    unsigned index;
+    struct io_uring_sqe *sqe;
+    if (tail - __atomic_load_n(h->sq_head, __ATOMIC_ACQUIRE) >= h->sq_entries) {
+        return NULL;
+    }
+    index = tail & *h->sq_mask;
+    sqe = &h->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    h->sq_array[index] = index;
+    return sqe;
+}
+
+static void __mqtt_pal_uring_commit_sqe(struct mqtt_pal_uring *h) {
+    __atomic_store_n(h->sq_tail, *h->sq_tail + 1, __ATOMIC_RELEASE);
+    h->to_submit += 1;
+}
+
+/* gives a receive buffer back to the kernel */
+static void __mqtt_pal_uring_recycle(struct mqtt_pal_uring *h, uint16_t bid) {
+    /* the ring's tail overlays bufs[0].resv, so only the other fields are written */
+    struct io_uring_buf *buf = &h->buf_ring->bufs[h->buf_tail & (MQTT_PAL_URING_BUFFERS - 1)];
+    buf->addr = (uint64_t) (uintptr_t) (h->bufs + (size_t) bid * MQTT_PAL_URING_BUFFER_SIZE);
+    buf->len = MQTT_PAL_URING_BUFFER_SIZE;
+    buf->bid = bid;
+    h->buf_tail += 1;
+    __atomic_store_n(&h->buf_ring->tail, h->buf_tail, __ATOMIC_RELEASE);
+}
+
+static int __mqtt_pal_uring_arm_recv(struct mqtt_pal_uring *h) {
+    struct io_uring_sqe *sqe = __mqtt_pal_uring_get_sqe(h);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = 0;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->buf_group = 0;
+    sqe->user_data = MQTT_PAL_URING_RECV;
+    __mqtt_pal_uring_commit_sqe(h);
+    h->recv_armed = 1;
+    return __mqtt_pal_uring_enter(h, 0);
+}
+
+static void __mqtt_pal_uring_teardown(struct mqtt_pal_uring *h) {
+    if (h->ring_fd >= 0) {
+        close(h->ring_fd);
+        h->ring_fd = -1;
+    }
+    if (h->ring_mem != NULL) {
+        munmap(h->ring_mem, h->ring_mem_size);
+        h->ring_mem = NULL;
+    }
+    if (h->sqes != NULL) {
+        munmap(h->sqes, h->sqes_size);
+        h->sqes = NULL;
+    }
+    if (h->buf_ring != NULL) {
+        munmap(h->buf_ring, h->buf_ring_size);
+        h->buf_ring = NULL;
+    }
+    MQTT_PAL_FREE(h->bufs);
+    h->bufs = NULL;
+    h->pending_len = 0;
+}
+
+static int __mqtt_pal_uring_setup(struct mqtt_pal_uring *h) {
+    struct io_uring_params params;
+    struct io_uring_buf_reg reg;
+    uint8_t *ring;
+    size_t cq_size;
+    uint16_t i;
+    void *mem;
+
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = 4 * MQTT_PAL_URING_BUFFERS;
+    h->ring_fd = (int) syscall(__NR_io_uring_setup, 4, &params);
+    if (h->ring_fd < 0) {
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+        return -1;
+    }
+
+    h->ring_mem_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_size > h->ring_mem_size) {
+        h->ring_mem_size = cq_size;
+    }
+    mem = mmap(NULL, h->ring_mem_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+               h->ring_fd, IORING_OFF_SQ_RING);
+    if (mem == MAP_FAILED) {
+        return -1;
+    }
+    h->ring_mem = mem;
+    ring = (uint8_t *) mem;
+    h->sq_head = (unsigned *) (ring + params.sq_off.head);
+    h->sq_tail = (unsigned *) (ring + params.sq_off.tail);
+    h->sq_mask = (unsigned *) (ring + params.sq_off.ring_mask);
+    h->sq_array = (unsigned *) (ring + params.sq_off.array);
+    h->sq_entries = params.sq_entries;
+    h->cq_head = (unsigned *) (ring + params.cq_off.head);
+    h->cq_tail = (unsigned *) (ring + params.cq_off.tail);
+    h->cq_mask = (unsigned *) (ring + params.cq_off.ring_mask);
+    h->cqes = (struct io_uring_cqe *) (ring + params.cq_off.cqes);
+
+    h->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    mem = mmap(NULL, h->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+               h->ring_fd, IORING_OFF_SQES);
+    if (mem == MAP_FAILED) {
+        return -1;
+    }
+    h->sqes = (struct io_uring_sqe *) mem;
+
+    /* fixed file 0 saves looking up the socket on every operation */
+    if (syscall(__NR_io_uring_register, h->ring_fd, IORING_REGISTER_FILES, &h->fd, 1) < 0) {
+        return -1;
+    }
+
+    /* the provided buffer ring has to be page aligned */
+    h->buf_ring_size = MQTT_PAL_URING_BUFFERS * sizeof(struct io_uring_buf);
+    mem = mmap(NULL, h->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        return -1;
+    }
+    h->buf_ring = (struct io_uring_buf_ring *) mem;
+    h->bufs = (uint8_t *) MQTT_PAL_MALLOC((size_t) MQTT_PAL_URING_BUFFERS * MQTT_PAL_URING_BUFFER_SIZE);
+    if (h->bufs == NULL) {
+        return -1;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) h->buf_ring;
+    reg.ring_entries = MQTT_PAL_URING_BUFFERS;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, h->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return -1;
+    }
+    for(i = 0; i < MQTT_PAL_URING_BUFFERS; ++i) {
+        __mqtt_pal_uring_recycle(h, i);
+    }
+
+    return __mqtt_pal_uring_arm_recv(h);
+}
+
+struct mqtt_pal_uring *mqtt_pal_uring_open(int fd) {
+    struct mqtt_pal_uring *h = (struct mqtt_pal_uring *) MQTT_PAL_MALLOC(sizeof(struct mqtt_pal_uring));
+    if (h == NULL) {
+        return NULL;
+    }
+    memset(h, 0, sizeof(*h));
+    h->fd = fd;
+    h->ring_fd = -1;
+    if (__mqtt_pal_uring_setup(h) != 0) {
+        __mqtt_pal_uring_teardown(h);
+    }
+    return h;
+}
+
+void mqtt_pal_uring_close(struct mqtt_pal_uring *h) {
+    if (h == NULL) {
+        return;
+    }
+    __mqtt_pal_uring_teardown(h);
+    MQTT_PAL_FREE(h);
+}
+
+int mqtt_pal_uring_fd(const struct mqtt_pal_uring *h) {
+    return h->fd;
+}
+
+int mqtt_pal_uring_pollfd(const struct mqtt_pal_uring *h) {
+    return (h->ring_fd >= 0) ? h->ring_fd : h->fd;
+}
+
+int mqtt_pal_uring_active(const struct mqtt_pal_uring *h) {
+    return h->ring_fd >= 0;
+}
+
+/*
+ * Takes the completion of the send out of the completion queue. Receive completions
+ * ahead of it are shifted along and left in place, so the ring fd stays readable for
+ * them. Returns the send's result, or 1 if there is no send completion yet.
+ */
+static int __mqtt_pal_uring_take_send(struct mqtt_pal_uring *h, int32_t *res) {
+    unsigned head = *h->cq_head;
+    unsigned tail = __atomic_load_n(h->cq_tail, __ATOMIC_ACQUIRE);
+    unsigned mask = *h->cq_mask;
+    unsigned i;
+    for(i = head; i != tail; ++i) {
+        if (h->cqes[i & mask].user_data == MQTT_PAL_URING_SEND) {
+            *res = h->cqes[i & mask].res;
+            for(; i != head; --i) {
+                h->cqes[i & mask] = h->cqes[(i - 1) & mask];
+            }
+            __atomic_store_n(h->cq_head, head + 1, __ATOMIC_RELEASE);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+ssize_t mqtt_pal_sendallv(mqtt_pal_socket_handle h, mqtt_pal_iovec *iov, int iovcnt, int flags) {
+    size_t sent = 0;
+    if (h->ring_fd < 0) {
+        return __mqtt_pal_sendallv(h->fd, iov, iovcnt, flags);
+    }
+    while(iovcnt > 0) {
+        int chunk = iovcnt < MQTT_PAL_IOV_MAX ? iovcnt : MQTT_PAL_IOV_MAX;
+        struct io_uring_sqe *sqe = __mqtt_pal_uring_get_sqe(h);
+        size_t requested = 0;
+        int32_t res;
+        int i;
+        if (sqe == NULL) {
+            break;
+        }
+        for(i = 0; i < chunk; ++i) {
+            requested += iov[i].iov_len;
+        }
+        memset(&h->msg, 0, sizeof(h->msg));
+        h->msg.msg_iov = iov;
+        h->msg.msg_iovlen = chunk;
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = 0;
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->addr = (uint64_t) (uintptr_t) &h->msg;
+        sqe->len = 1;
+        /* like the plain path, a full socket buffer ends the send rather than waiting */
+        sqe->msg_flags = (uint32_t) (flags | MSG_DONTWAIT);
+        sqe->user_data = MQTT_PAL_URING_SEND;
+        __mqtt_pal_uring_commit_sqe(h);
+
+        /* submit and wait in one call; receive completions may arrive first */
+        if (__mqtt_pal_uring_enter(h, 1) < 0) {
+            return sent > 0 ? (ssize_t) sent : MQTT_ERROR_SOCKET_ERROR;
+        }
+        while (__mqtt_pal_uring_take_send(h, &res) != 0) {
+            unsigned waiting = __atomic_load_n(h->cq_tail, __ATOMIC_ACQUIRE) - *h->cq_head;
+            if (__mqtt_pal_uring_enter(h, waiting + 1) < 0) {
+                return sent > 0 ? (ssize_t) sent : MQTT_ERROR_SOCKET_ERROR;
+            }
+        }
+
+        if (res == -EAGAIN) {
+            /* should call send later again */
+            break;
+        }
+        if (res <= 0) {
+            return sent > 0 ? (ssize_t) sent : MQTT_ERROR_SOCKET_ERROR;
+        }
+        sent += (size_t) res;
+        if ((size_t) res < requested) {
+            break;
+        }
+        iov += chunk;
+        iovcnt -= chunk;
+    }
+    return (ssize_t) sent;
+}
+
+ssize_t mqtt_pal_sendall(mqtt_pal_socket_handle h, const void* buf, size_t len, int flags) {
+    mqtt_pal_iovec iov;
+    if (h->ring_fd < 0) {
+        return __mqtt_pal_sendall(h->fd, buf, len, flags);
+    }
+    iov.iov_base = (void *) buf;
+    iov.iov_len = len;
+    return mqtt_pal_sendallv(h, &iov, 1, flags);
+}
+
+ssize_t mqtt_pal_recvall(mqtt_pal_socket_handle h, void* buf, size_t bufsz, int flags) {
+    uint8_t *out = (uint8_t *) buf;
+    size_t received = 0;
+    if (h->ring_fd < 0) {
+        return __mqtt_pal_recvall(h->fd, buf, bufsz, flags);
+    }
+    while (received < bufsz) {
+        struct io_uring_cqe *cqe;
+        unsigned head;
+        if (h->pending_len > 0) {
+            /* copy out of the buffer the last completion filled */
+            size_t n = bufsz - received < h->pending_len ? bufsz - received : h->pending_len;
+            memcpy(out + received, h->bufs + (size_t) h->pending_bid * MQTT_PAL_URING_BUFFER_SIZE + h->pending_offset, n);
+            received += n;
+            h->pending_offset += (uint32_t) n;
+            h->pending_len -= (uint32_t) n;
+            if (h->pending_len == 0) {
+                __mqtt_pal_uring_recycle(h, h->pending_bid);
+            }
+            continue;
+        }
+
+        head = *h->cq_head;
+        if (h->error != 0 || head == __atomic_load_n(h->cq_tail, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        cqe = &h->cqes[head & *h->cq_mask];
+        if (cqe->res > 0) {
+            h->pending_bid = (uint16_t) (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            h->pending_offset = 0;
+            h->pending_len = (uint32_t) cqe->res;
+            h->recv_seen = 1;
+        } else if (cqe->res == 0) {
+            /* the peer closed the connection. Raise an error to trigger a reconnect */
+            h->error = MQTT_ERROR_SOCKET_ERROR;
+        } else if (cqe->res == -EINVAL && !h->recv_seen) {
+            /* multishot receive isn't supported: carry on with the plain socket calls */
+            ssize_t rv;
+            __mqtt_pal_uring_teardown(h);
+            rv = __mqtt_pal_recvall(h->fd, out + received, bufsz - received, flags);
+            if (rv < 0) {
+                return received > 0 ? (ssize_t) received : rv;
+            }
+            return (ssize_t) received + rv;
+        } else if (cqe->res != -ENOBUFS) {
+            h->error = MQTT_ERROR_SOCKET_ERROR;
+        }
+        /* -ENOBUFS: every buffer was waiting to be read. It's armed again below */
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            h->recv_armed = 0;
+        }
+        __atomic_store_n(h->cq_head, head + 1, __ATOMIC_RELEASE);
+    }
+
+    /* the kernel ends a multishot receive when it runs out of buffers (and may for
+       other reasons), so arm it again */
+    if (!h->recv_armed && h->error == 0 && __mqtt_pal_uring_arm_recv(h) != 0) {
+        h->error = MQTT_ERROR_SOCKET_ERROR;
+    }
+
+    if (received == 0 && h->error != 0) {
+        return h->error;
+    }
+    return (ssize_t) received;
+}
+
+#endif /* !defined(MQTT_USE_IO_URING) */
+
 #elif defined(_MSC_VER) || defined(WIN32)
 
 #include <errno.h>
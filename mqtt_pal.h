@@ -49,8 +49,11 @@ extern "C" {
  *      - \c mqtt_pal_time_t : return type of \c MQTT_PAL_TIME() 
  *      - \c mqtt_pal_mutex_t : type of the argument that is passed to \c MQTT_PAL_MUTEX_LOCK and 
  *        \c MQTT_PAL_MUTEX_RELEASE
+ *      - \c mqtt_pal_refcount_t : type of the counter passed to \c MQTT_PAL_REFCOUNT_INC and
+ *        \c MQTT_PAL_REFCOUNT_DEC
  *  - Functions:
  *      - \c memcpy, \c strlen
+ *      - \c MQTT_PAL_MALLOC, \c MQTT_PAL_FREE : used by the default \ref mqtt_buffer_policy
  *      - \c va_start, \c va_arg, \c va_end
  *  - Constants:
  *      - \c INT_MIN
@@ -58,21 +61,29 @@ extern "C" {
  * Additionally, three macro's are required:
  *  - \c MQTT_PAL_HTONS(s) : host-to-network endian conversion for uint16_t.
  *  - \c MQTT_PAL_NTOHS(s) : network-to-host endian conversion for uint16_t.
- *  - \c MQTT_PAL_TIME()   : returns [type: \c mqtt_pal_time_t] current time in seconds. 
+ *  - \c MQTT_PAL_TIME()   : returns [type: \c mqtt_pal_time_t] current time in milliseconds. 
+ *    This should come from a monotonic clock; only differences between two times are used.
  *  - \c MQTT_PAL_MUTEX_LOCK(mtx_pointer) : macro that locks the mutex pointed to by \c mtx_pointer.
  *  - \c MQTT_PAL_MUTEX_RELEASE(mtx_pointer) : macro that unlocks the mutex pointed to by 
  *    \c mtx_pointer.
+ *  - \c MQTT_PAL_REFCOUNT_INC(cnt_pointer) : atomically increments the counter pointed to by
+ *    \c cnt_pointer.
+ *  - \c MQTT_PAL_REFCOUNT_DEC(cnt_pointer) : atomically decrements the counter pointed to by
+ *    \c cnt_pointer and returns the new value.
  * 
  * Lastly, \ref mqtt_pal_sendall and \ref mqtt_pal_recvall, must be implemented in mqtt_pal.c 
- * for sending and receiving data using the platforms socket calls.
+ * for sending and receiving data using the platforms socket calls. Platforms with a 
+ * gathering send may also implement \ref mqtt_pal_sendallv (see \c MQTT_PAL_HAVE_SENDALLV).
  */
 
 
 /* UNIX-like platform support */
 #if defined(__unix__) || defined(__APPLE__) || defined(__NuttX__)
     #include <limits.h>
+    #include <stdlib.h>
     #include <string.h>
     #include <stdarg.h>
+    #include <stdint.h>
     #include <time.h>
     #include <arpa/inet.h>
     #include <pthread.h>
@@ -80,15 +91,26 @@ extern "C" {
     #define MQTT_PAL_HTONS(s) htons(s)
     #define MQTT_PAL_NTOHS(s) ntohs(s)
 
-    #define MQTT_PAL_TIME() time(NULL)
+    typedef int64_t mqtt_pal_time_t;
+
+    /* milliseconds on CLOCK_MONOTONIC, see mqtt_pal.c */
+    mqtt_pal_time_t mqtt_pal_time(void);
+    #define MQTT_PAL_TIME() mqtt_pal_time()
 
-    typedef time_t mqtt_pal_time_t;
     typedef pthread_mutex_t mqtt_pal_mutex_t;
 
     #define MQTT_PAL_MUTEX_INIT(mtx_ptr) pthread_mutex_init(mtx_ptr, NULL)
     #define MQTT_PAL_MUTEX_LOCK(mtx_ptr) pthread_mutex_lock(mtx_ptr)
     #define MQTT_PAL_MUTEX_UNLOCK(mtx_ptr) pthread_mutex_unlock(mtx_ptr)
 
+    typedef int mqtt_pal_refcount_t;
+
+    #define MQTT_PAL_REFCOUNT_INC(cnt_ptr) __atomic_add_fetch(cnt_ptr, 1, __ATOMIC_RELAXED)
+    #define MQTT_PAL_REFCOUNT_DEC(cnt_ptr) __atomic_sub_fetch(cnt_ptr, 1, __ATOMIC_ACQ_REL)
+
+    #define MQTT_PAL_MALLOC(size) malloc(size)
+    #define MQTT_PAL_FREE(ptr) free(ptr)
+
     #if !defined(MQTT_USE_CUSTOM_SOCKET_HANDLE)
         #if defined(MQTT_USE_MBEDTLS)
             struct mbedtls_ssl_context;
@@ -114,12 +136,24 @@ extern "C" {
             } bearssl_context;
 
             typedef bearssl_context* mqtt_pal_socket_handle;
+        #elif defined(MQTT_USE_IO_URING)
+            #include <sys/uio.h>
+            struct mqtt_pal_uring;
+            typedef struct mqtt_pal_uring *mqtt_pal_socket_handle;
+
+            typedef struct iovec mqtt_pal_iovec;
+            #define MQTT_PAL_HAVE_SENDALLV
         #else
+            #include <sys/uio.h>
             typedef int mqtt_pal_socket_handle;
+
+            typedef struct iovec mqtt_pal_iovec;
+            #define MQTT_PAL_HAVE_SENDALLV
         #endif
     #endif
 #elif defined(_MSC_VER) || defined(WIN32)
     #include <limits.h>
+    #include <stdlib.h>
     #include <winsock2.h>
     #include <windows.h>
     #include <time.h>
@@ -129,15 +163,24 @@ extern "C" {
     #define MQTT_PAL_HTONS(s) htons(s)
     #define MQTT_PAL_NTOHS(s) ntohs(s)
 
-    #define MQTT_PAL_TIME() time(NULL)
+    /* milliseconds since boot, unaffected by changes to the system time */
+    #define MQTT_PAL_TIME() ((mqtt_pal_time_t) GetTickCount64())
 
-    typedef time_t mqtt_pal_time_t;
+    typedef int64_t mqtt_pal_time_t;
     typedef CRITICAL_SECTION mqtt_pal_mutex_t;
 
     #define MQTT_PAL_MUTEX_INIT(mtx_ptr) InitializeCriticalSection(mtx_ptr)
     #define MQTT_PAL_MUTEX_LOCK(mtx_ptr) EnterCriticalSection(mtx_ptr)
     #define MQTT_PAL_MUTEX_UNLOCK(mtx_ptr) LeaveCriticalSection(mtx_ptr)
 
+    typedef LONG mqtt_pal_refcount_t;
+
+    #define MQTT_PAL_REFCOUNT_INC(cnt_ptr) InterlockedIncrement(cnt_ptr)
+    #define MQTT_PAL_REFCOUNT_DEC(cnt_ptr) InterlockedDecrement(cnt_ptr)
+
+    #define MQTT_PAL_MALLOC(size) malloc(size)
+    #define MQTT_PAL_FREE(ptr) free(ptr)
+
 
     #if !defined(MQTT_USE_CUSTOM_SOCKET_HANDLE)
         #if defined(MQTT_USE_BIO)
@@ -150,6 +193,26 @@ extern "C" {
 
 #endif
 
+/* 
+ * Single-threaded mode: when the client is only ever used from one thread, define
+ * MQTT_SINGLE_THREADED (for mqtt.c and everything including mqtt.h) to compile the 
+ * locking and atomic reference counting away. mqtt_pal_mutex_t is kept so the 
+ * layout of struct mqtt_client doesn't change.
+ */
+#if defined(MQTT_SINGLE_THREADED)
+    #undef MQTT_PAL_MUTEX_INIT
+    #undef MQTT_PAL_MUTEX_LOCK
+    #undef MQTT_PAL_MUTEX_UNLOCK
+    #undef MQTT_PAL_REFCOUNT_INC
+    #undef MQTT_PAL_REFCOUNT_DEC
+
+    #define MQTT_PAL_MUTEX_INIT(mtx_ptr) ((void)(mtx_ptr))
+    #define MQTT_PAL_MUTEX_LOCK(mtx_ptr) ((void)(mtx_ptr))
+    #define MQTT_PAL_MUTEX_UNLOCK(mtx_ptr) ((void)(mtx_ptr))
+    #define MQTT_PAL_REFCOUNT_INC(cnt_ptr) (++*(cnt_ptr))
+    #define MQTT_PAL_REFCOUNT_DEC(cnt_ptr) (--*(cnt_ptr))
+#endif
+
 /**
  * @brief Sends all the bytes in a buffer.
  * @ingroup pal
@@ -170,6 +233,32 @@ extern "C" {
  */
 ssize_t mqtt_pal_sendall(mqtt_pal_socket_handle fd, const void* buf, size_t len, int flags);
 
+#if defined(MQTT_PAL_HAVE_SENDALLV)
+/**
+ * @brief Sends all the bytes in a list of buffers with as few socket calls as possible.
+ * @ingroup pal
+ * 
+ * @param[in] fd The file-descriptor (or handle) of the socket.
+ * @param[in,out] iov The buffers to send, in order. Entries are advanced past the bytes 
+ *                    that were sent, so their contents are unspecified on return.
+ * @param[in] iovcnt The number of entries in \p iov.
+ * @param[in] flags Flags which are passed to the underlying socket.
+ * 
+ * @returns The total number of bytes sent if successful, an \ref MQTTErrors otherwise. 
+ *          Error handling follows \ref mqtt_pal_sendall.
+ *
+ * @note This is optional. A platform that defines \c MQTT_PAL_HAVE_SENDALLV must also 
+ *       provide the \c mqtt_pal_iovec type (with \c iov_base and \c iov_len members); 
+ *       otherwise mqtt.c sends each buffer with \ref mqtt_pal_sendall.
+ */
+ssize_t mqtt_pal_sendallv(mqtt_pal_socket_handle fd, mqtt_pal_iovec *iov, int iovcnt, int flags);
+#else
+typedef struct {
+    void *iov_base;
+    size_t iov_len;
+} mqtt_pal_iovec;
+#endif
+
 /**
  * @brief Non-blocking receive all the byte available.
  * @ingroup pal
@@ -190,6 +279,54 @@ ssize_t mqtt_pal_sendall(mqtt_pal_socket_handle fd, const void* buf, size_t len,
  */
 ssize_t mqtt_pal_recvall(mqtt_pal_socket_handle fd, void* buf, size_t bufsz, int flags);
 
+#if defined(MQTT_USE_IO_URING) && !defined(MQTT_USE_CUSTOM_SOCKET_HANDLE)
+/**
+ * @brief Wraps a connected, non-blocking socket in an io_uring socket handle.
+ * @ingroup pal
+ * 
+ * With \c MQTT_USE_IO_URING (Linux only) the socket handle passed to \ref mqtt_init or 
+ * \ref mqtt_reinit is one of these. Each gets its own small io_uring: received data 
+ * lands in registered buffers through a multishot receive, so \ref mqtt_pal_recvall 
+ * needs no syscalls, and each send is submitted and completed with a single 
+ * \c io_uring_enter. If the kernel doesn't support io_uring (or the parts of it used,
+ * which need Linux 6.0) the handle falls back to the plain socket calls.
+ * 
+ * @param[in] fd The socket. It is not closed by \ref mqtt_pal_uring_close.
+ * 
+ * @returns The handle, or NULL if it couldn't be allocated.
+ */
+struct mqtt_pal_uring *mqtt_pal_uring_open(int fd);
+
+/**
+ * @brief Releases an io_uring socket handle (but doesn't close its socket).
+ * @ingroup pal
+ */
+void mqtt_pal_uring_close(struct mqtt_pal_uring *handle);
+
+/**
+ * @brief The socket of an io_uring socket handle. Poll it to know when it's writable.
+ * @ingroup pal
+ */
+int mqtt_pal_uring_fd(const struct mqtt_pal_uring *handle);
+
+/**
+ * @brief The fd to poll to know when an io_uring socket handle has data to read.
+ * @ingroup pal
+ * 
+ * The multishot receive takes data off the socket as soon as it arrives, so the socket
+ * itself doesn't become readable: this is the ring's fd, or the socket after falling 
+ * back to the plain socket calls.
+ */
+int mqtt_pal_uring_pollfd(const struct mqtt_pal_uring *handle);
+
+/**
+ * @brief Nonzero if \p handle is using io_uring, zero if it fell back to the plain 
+ *        socket calls.
+ * @ingroup pal
+ */
+int mqtt_pal_uring_active(const struct mqtt_pal_uring *handle);
+#endif
+
 #if defined(__cplusplus)
 }
 #endif
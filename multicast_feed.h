@@ -0,0 +1,41 @@
+#pragma once
+#include <stdint.h>
+
+// NOTE(cmo): Live feed of calibrated samples over UDP multicast, for
+// instruments on the LAN that want them with as little latency as possible
+// and without going through the broker. Each block from the logger goes out
+// as one datagram:
+//   MulticastBlockHeader
+//   num_samples x MulticastSample
+// Everything is native endian (as for the MQTT payload), the header is 40
+// bytes and each sample the same 40 bytes as an MQTT message.
+//
+// `sequence` counts datagrams from 0 since the sender started, and `session`
+// is when it started, so a receiver can tell lost datagrams (a jump in
+// sequence) from a restarted sender (a new session). `sent` is when the
+// datagram was handed to the kernel, for measuring latency on hosts with
+// synchronised clocks.
+
+#define MULTICAST_MAGIC "MAGB"
+#define MULTICAST_VERSION 1
+#define MULTICAST_NUM_CHANNELS 4
+// NOTE(cmo): Defaults for both ends, an administratively scoped group.
+#define MULTICAST_DEFAULT_GROUP "239.255.77.1"
+#define MULTICAST_DEFAULT_PORT "5277"
+
+typedef struct MulticastBlockHeader
+{
+    char magic[4];
+    uint16_t version;
+    uint16_t num_samples;
+    uint64_t sequence;
+    int64_t session;   // ms since unix epoch
+    int64_t timestamp; // ms since unix epoch, start of the block
+    int64_t sent;      // us since unix epoch
+} __attribute__((packed)) MulticastBlockHeader;
+
+typedef struct MulticastSample
+{
+    int64_t timestamp;
+    double data[MULTICAST_NUM_CHANNELS];
+} __attribute__((packed)) MulticastSample;
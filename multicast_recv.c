@@ -0,0 +1,227 @@
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "multicast_feed.h"
+
+// NOTE(cmo): Receiver for the daemon's multicast feed (see multicast_feed.h).
+// Reports datagrams lost (gaps in the sequence), ones arriving late or
+// duplicated, sender restarts, and the latency from `sent` to arrival.
+//
+//   mag_mcast_recv [-g group] [-p port] [-i interface address] [-n count] [-v]
+//
+// -n stops after that many datagrams, -v prints every sample. Otherwise runs
+// until interrupted, then prints a summary.
+
+typedef struct FeedStats
+{
+    bool have_session;
+    int64_t session;
+    uint64_t expected;
+    int64_t received;
+    int64_t lost;
+    int64_t late;
+    int64_t restarts;
+    int64_t malformed;
+    int64_t latency_min;
+    int64_t latency_max;
+    int64_t latency_sum;
+} FeedStats;
+
+static volatile sig_atomic_t g_stop = 0;
+
+void handle_sigint(int signum)
+{
+    g_stop = 1;
+}
+
+int64_t current_epoch_micros()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+int open_multicast_receiver(const char* group, const char* port, const char* interface)
+{
+    struct ip_mreq mreq = {0};
+    if (inet_pton(AF_INET, group, &mreq.imr_multiaddr) != 1)
+    {
+        fprintf(stderr, "Not an IPv4 multicast group: %s\n", group);
+        return -1;
+    }
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (interface && inet_pton(AF_INET, interface, &mreq.imr_interface) != 1)
+    {
+        fprintf(stderr, "Not an IPv4 interface address: %s\n", interface);
+        return -1;
+    }
+
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(port));
+    // NOTE(cmo): Bound to the group, so we only see this feed even if something
+    // else on the machine uses the same port.
+    addr.sin_addr = mreq.imr_multiaddr;
+
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    int one = 1;
+    if (sockfd == -1
+        || setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1
+        || bind(sockfd, (struct sockaddr*)&addr, sizeof(addr)) == -1
+        || setsockopt(sockfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) == -1)
+    {
+        perror("multicast receiver");
+        if (sockfd != -1)
+            close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+void record_datagram(FeedStats* stats, const MulticastBlockHeader* header, int64_t arrived)
+{
+    if (!stats->have_session || header->session != stats->session)
+    {
+        // NOTE(cmo): Whatever was sent before we joined (or before the sender
+        // restarted) doesn't count as lost.
+        if (stats->have_session)
+        {
+            stats->restarts += 1;
+            printf("Sender restarted (session %lld)\n", (long long)header->session);
+        }
+        stats->have_session = true;
+        stats->session = header->session;
+        stats->expected = header->sequence;
+    }
+
+    if (header->sequence >= stats->expected)
+    {
+        uint64_t gap = header->sequence - stats->expected;
+        if (gap > 0)
+        {
+            stats->lost += gap;
+            printf("Lost %llu datagram(s) before sequence %llu\n",
+                   (unsigned long long)gap, (unsigned long long)header->sequence);
+        }
+        stats->expected = header->sequence + 1;
+    }
+    else
+    {
+        // NOTE(cmo): Reordered or duplicated. If we'd already counted it as lost,
+        // it wasn't.
+        stats->late += 1;
+        if (stats->lost > 0)
+            stats->lost -= 1;
+    }
+
+    int64_t latency = arrived - header->sent;
+    if (stats->received == 0 || latency < stats->latency_min)
+        stats->latency_min = latency;
+    if (stats->received == 0 || latency > stats->latency_max)
+        stats->latency_max = latency;
+    stats->latency_sum += latency;
+    stats->received += 1;
+}
+
+void print_summary(const FeedStats* stats)
+{
+    printf("Received %lld, lost %lld, late/duplicate %lld, restarts %lld, malformed %lld\n",
+           (long long)stats->received, (long long)stats->lost, (long long)stats->late,
+           (long long)stats->restarts, (long long)stats->malformed);
+    if (stats->received > 0)
+    {
+        printf("Latency (us): min %lld, mean %.1f, max %lld\n",
+               (long long)stats->latency_min,
+               (double)stats->latency_sum / stats->received,
+               (long long)stats->latency_max);
+    }
+}
+
+int main(int argc, const char* argv[])
+{
+    const char* group = MULTICAST_DEFAULT_GROUP;
+    const char* port = MULTICAST_DEFAULT_PORT;
+    const char* interface = NULL;
+    int64_t count = 0;
+    bool verbose = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-v") == 0)
+            verbose = true;
+        else if (i + 1 < argc && strcmp(argv[i], "-g") == 0)
+            group = argv[++i];
+        else if (i + 1 < argc && strcmp(argv[i], "-p") == 0)
+            port = argv[++i];
+        else if (i + 1 < argc && strcmp(argv[i], "-i") == 0)
+            interface = argv[++i];
+        else if (i + 1 < argc && strcmp(argv[i], "-n") == 0)
+            count = atoll(argv[++i]);
+        else
+        {
+            fprintf(stderr, "Usage: %s [-g group] [-p port] [-i interface address] [-n count] [-v]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    int sockfd = open_multicast_receiver(group, port, interface);
+    if (sockfd == -1)
+        return 1;
+
+    // NOTE(cmo): No SA_RESTART, so a blocked recv returns on Ctrl-C.
+    struct sigaction sa = {0};
+    sa.sa_handler = handle_sigint;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    FeedStats stats = {0};
+    uint8_t buf[65536];
+    while (!g_stop && (count == 0 || stats.received < count))
+    {
+        ssize_t len = recv(sockfd, buf, sizeof(buf), 0);
+        int64_t arrived = current_epoch_micros();
+        if (len == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("recv");
+            break;
+        }
+
+        const MulticastBlockHeader* header = (const MulticastBlockHeader*)buf;
+        if (len < (ssize_t)sizeof(MulticastBlockHeader)
+            || memcmp(header->magic, MULTICAST_MAGIC, sizeof(header->magic)) != 0
+            || header->version != MULTICAST_VERSION
+            || len != (ssize_t)(sizeof(MulticastBlockHeader) + header->num_samples * sizeof(MulticastSample)))
+        {
+            stats.malformed += 1;
+            continue;
+        }
+        record_datagram(&stats, header, arrived);
+
+        if (verbose)
+        {
+            const MulticastSample* samples = (const MulticastSample*)(buf + sizeof(MulticastBlockHeader));
+            for (int i = 0; i < header->num_samples; ++i)
+            {
+                printf("%llu %lld %f %f %f %f\n",
+                       (unsigned long long)header->sequence, (long long)samples[i].timestamp,
+                       samples[i].data[0], samples[i].data[1], samples[i].data[2], samples[i].data[3]);
+            }
+        }
+        fflush(stdout);
+    }
+
+    print_summary(&stats);
+    close(sockfd);
+    return 0;
+}
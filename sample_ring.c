@@ -0,0 +1,210 @@
+#define _POSIX_C_SOURCE 200809L
+#include "sample_ring.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// NOTE(cmo): Records start on their own page.
+static const uint32_t SampleRingHeaderSize = 4096;
+
+static size_t sample_ring_size(int64_t capacity)
+{
+    return SampleRingHeaderSize + (size_t)capacity * sizeof(SampleRingRecord);
+}
+
+static bool sample_ring_compatible(const SampleRingHeader* h, size_t size)
+{
+    return memcmp(h->magic, SAMPLE_RING_MAGIC, sizeof(SAMPLE_RING_MAGIC)) == 0
+        && h->version == SAMPLE_RING_VERSION
+        && h->header_size >= sizeof(SampleRingHeader)
+        && h->record_size == sizeof(SampleRingRecord)
+        && h->num_channels == SAMPLE_RING_NUM_CHANNELS
+        && h->capacity > 0
+        && size >= h->header_size + (size_t)h->capacity * h->record_size;
+}
+
+static bool sample_ring_map(SampleRing* ring, size_t size, bool writable)
+{
+    void* mem = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, ring->fd, 0);
+    if (mem == MAP_FAILED)
+        return false;
+
+    ring->header = (SampleRingHeader*)mem;
+    ring->map_size = size;
+    ring->writable = writable;
+    return true;
+}
+
+bool sample_ring_create(SampleRing* ring, const char* name, int64_t capacity, int64_t sample_interval)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+    if (ring->fd == -1)
+    {
+        perror("shm_open");
+        return false;
+    }
+
+    size_t size = sample_ring_size(capacity);
+    struct stat st;
+    bool keep = fstat(ring->fd, &st) == 0 && (size_t)st.st_size == size;
+    if (!keep && ftruncate(ring->fd, (off_t)size) == -1)
+    {
+        perror("ftruncate");
+        sample_ring_close(ring);
+        return false;
+    }
+    if (!sample_ring_map(ring, size, true))
+    {
+        perror("mmap");
+        sample_ring_close(ring);
+        return false;
+    }
+
+    SampleRingHeader* h = ring->header;
+    keep = keep && sample_ring_compatible(h, size) && h->capacity == capacity
+           && h->header_size == SampleRingHeaderSize;
+    if (keep)
+    {
+        // NOTE(cmo): A block we were part way through writing when we last
+        // stopped was never committed, forget it.
+        __atomic_store_n(&h->reserved, h->committed, __ATOMIC_RELEASE);
+        h->sample_interval = sample_interval;
+    }
+    else
+    {
+        // NOTE(cmo): Anyone still reading the old layout sees `created` change.
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        memset(h, 0, SampleRingHeaderSize);
+        memcpy(h->magic, SAMPLE_RING_MAGIC, sizeof(SAMPLE_RING_MAGIC));
+        h->version = SAMPLE_RING_VERSION;
+        h->header_size = SampleRingHeaderSize;
+        h->record_size = sizeof(SampleRingRecord);
+        h->num_channels = SAMPLE_RING_NUM_CHANNELS;
+        h->capacity = capacity;
+        h->sample_interval = sample_interval;
+        __atomic_store_n(&h->created, (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000, __ATOMIC_RELEASE);
+    }
+    ring->records = (SampleRingRecord*)((uint8_t*)h + h->header_size);
+    return true;
+}
+
+void sample_ring_write(SampleRing* ring, const SampleRingRecord* records, int64_t n)
+{
+    SampleRingHeader* h = ring->header;
+    int64_t capacity = h->capacity;
+    if (n > capacity)
+    {
+        records += n - capacity;
+        n = capacity;
+    }
+
+    // NOTE(cmo): Claim the slots first, so a reader looking at them now can
+    // tell they're being overwritten.
+    int64_t head = h->committed;
+    __atomic_store_n(&h->reserved, head + n, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    int64_t slot = head % capacity;
+    int64_t first = (capacity - slot < n) ? capacity - slot : n;
+    memcpy(ring->records + slot, records, first * sizeof(SampleRingRecord));
+    memcpy(ring->records, records + first, (n - first) * sizeof(SampleRingRecord));
+
+    __atomic_store_n(&h->committed, head + n, __ATOMIC_RELEASE);
+}
+
+bool sample_ring_open(SampleRing* ring, const char* name)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = shm_open(name, O_RDONLY, 0);
+    if (ring->fd == -1)
+        return false;
+
+    struct stat st;
+    if (fstat(ring->fd, &st) == -1 || (size_t)st.st_size < sizeof(SampleRingHeader)
+        || !sample_ring_map(ring, (size_t)st.st_size, false)
+        || !sample_ring_compatible(ring->header, (size_t)st.st_size))
+    {
+        sample_ring_close(ring);
+        return false;
+    }
+    ring->records = (SampleRingRecord*)((uint8_t*)ring->header + ring->header->header_size);
+    return true;
+}
+
+int64_t sample_ring_head(const SampleRing* ring)
+{
+    return __atomic_load_n(&ring->header->committed, __ATOMIC_ACQUIRE);
+}
+
+int64_t sample_ring_oldest(const SampleRing* ring)
+{
+    int64_t oldest = __atomic_load_n(&ring->header->reserved, __ATOMIC_ACQUIRE) - ring->header->capacity;
+    return oldest > 0 ? oldest : 0;
+}
+
+const SampleRingRecord* sample_ring_at(const SampleRing* ring, int64_t index)
+{
+    return ring->records + index % ring->header->capacity;
+}
+
+bool sample_ring_still_valid(const SampleRing* ring, int64_t first)
+{
+    // NOTE(cmo): Orders the reads of the records before the read of `reserved`.
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return first >= __atomic_load_n(&ring->header->reserved, __ATOMIC_RELAXED) - ring->header->capacity;
+}
+
+int64_t sample_ring_read(const SampleRing* ring, int64_t* cursor, SampleRingRecord* out, int64_t max)
+{
+    int64_t capacity = ring->header->capacity;
+    while (true)
+    {
+        int64_t head = sample_ring_head(ring);
+        int64_t start = *cursor;
+        if (start < head - capacity)
+            start = head - capacity;
+        if (start < 0)
+            start = 0;
+        int64_t n = head - start;
+        if (n > max)
+            n = max;
+        if (n <= 0)
+            return 0;
+
+        int64_t slot = start % capacity;
+        int64_t first = (capacity - slot < n) ? capacity - slot : n;
+        memcpy(out, ring->records + slot, first * sizeof(SampleRingRecord));
+        memcpy(out + first, ring->records, (n - first) * sizeof(SampleRingRecord));
+
+        // NOTE(cmo): If the writer lapped us part way through, go again from
+        // wherever the oldest record is now.
+        if (sample_ring_still_valid(ring, start))
+        {
+            *cursor = start + n;
+            return n;
+        }
+    }
+}
+
+int64_t sample_ring_latest(const SampleRing* ring, SampleRingRecord* out, int64_t n)
+{
+    int64_t cursor = sample_ring_head(ring) - n;
+    return sample_ring_read(ring, &cursor, out, n);
+}
+
+void sample_ring_close(SampleRing* ring)
+{
+    if (ring->header)
+        munmap(ring->header, ring->map_size);
+    if (ring->fd != -1)
+        close(ring->fd);
+    ring->header = NULL;
+    ring->records = NULL;
+    ring->fd = -1;
+}
@@ -0,0 +1,96 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// NOTE(cmo): A ring of the most recent calibrated samples in POSIX shared
+// memory (/dev/shm/<name>), written by the daemon and readable by any number
+// of local processes without locks or any help from the writer.
+//
+// Layout (native endian, all offsets in bytes):
+//   0                    SampleRingHeader
+//   header_size          capacity x SampleRingRecord
+//
+// Record i (counting every record ever written to the ring) lives in slot
+// i % capacity. A record is the same 40 bytes as an MQTT sample: 8 bytes of
+// milliseconds since the unix epoch then 4 doubles, i.e. the numpy dtype
+//   [("timestamp", "<i8"), ("data", "<f8", (4,))]
+// so the records can be viewed in place with
+//   np.ndarray((capacity,), dtype, buffer=mmap, offset=header_size)
+// (see SampleRing.py).
+//
+// The writer is a seqlock over the ring: it bumps `reserved` before writing
+// a block and `committed` after. A reader copies (or looks at) records, then
+// checks they were older than `reserved - capacity` throughout, i.e. that the
+// writer hadn't lapped them; if it had, it tries again.
+
+#define SAMPLE_RING_MAGIC "MAGRING"
+#define SAMPLE_RING_VERSION 1
+#define SAMPLE_RING_NUM_CHANNELS 4
+
+typedef struct SampleRingRecord
+{
+    int64_t timestamp;
+    double data[SAMPLE_RING_NUM_CHANNELS];
+} __attribute__((packed)) SampleRingRecord;
+
+typedef struct SampleRingHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t record_size;
+    uint32_t num_channels;
+    int64_t capacity;
+    // NOTE(cmo): ms between samples, and when the ring was set up (ms since
+    // epoch). A reader that finds `created` changed should reopen the ring.
+    int64_t sample_interval;
+    int64_t created;
+    uint8_t pad[16];
+    // NOTE(cmo): On their own cache line. Counts of records ever written:
+    // `reserved` includes the block being written, `committed` doesn't.
+    int64_t reserved;
+    int64_t committed;
+} SampleRingHeader;
+
+typedef struct SampleRing
+{
+    int fd;
+    SampleRingHeader* header;
+    SampleRingRecord* records;
+    size_t map_size;
+    bool writable;
+} SampleRing;
+
+// NOTE(cmo): Writer. Opens the ring called `name` (e.g. "/magnetometer-samples"),
+// keeping the samples already in it if its layout matches, otherwise
+// (re)creating it. Returns false on failure.
+bool sample_ring_create(SampleRing* ring, const char* name, int64_t capacity, int64_t sample_interval);
+void sample_ring_write(SampleRing* ring, const SampleRingRecord* records, int64_t n);
+
+// NOTE(cmo): Reader. Maps the ring read-only, returns false if it doesn't
+// exist or isn't a ring this library understands.
+bool sample_ring_open(SampleRing* ring, const char* name);
+
+// NOTE(cmo): Index of the next record to be written (i.e. the number written
+// so far), and of the oldest record that is still in the ring.
+int64_t sample_ring_head(const SampleRing* ring);
+int64_t sample_ring_oldest(const SampleRing* ring);
+
+// NOTE(cmo): Copies up to max records from *cursor onwards into out, and
+// advances *cursor past them. If the records at *cursor have already been
+// overwritten, reading starts from the oldest one still in the ring instead
+// (so the records skipped are the difference between *cursor before the call
+// and *cursor minus the return value after). Returns the number copied.
+int64_t sample_ring_read(const SampleRing* ring, int64_t* cursor, SampleRingRecord* out, int64_t max);
+// NOTE(cmo): Copies the most recent n (or fewer) records into out, oldest
+// first. Returns the number copied.
+int64_t sample_ring_latest(const SampleRing* ring, SampleRingRecord* out, int64_t n);
+
+// NOTE(cmo): Zero-copy access. The record pointed to may be overwritten at any
+// time: after using records [first, ...) check sample_ring_still_valid(ring,
+// first) and discard what was read if it returns false.
+const SampleRingRecord* sample_ring_at(const SampleRing* ring, int64_t index);
+bool sample_ring_still_valid(const SampleRing* ring, int64_t first);
+
+void sample_ring_close(SampleRing* ring);
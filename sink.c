@@ -0,0 +1,183 @@
+#define _POSIX_C_SOURCE 200809L
+#include "sink.h"
+#include <assert.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+SinkBlock* sink_block_alloc(int32_t n_samples)
+{
+    SinkBlock* block = malloc(sizeof(SinkBlock) + n_samples * (sizeof(MagnetometerMessage) + 4 * sizeof(int32_t)));
+    if (!block)
+        return NULL;
+    block->refs = 1;
+    block->n_samples = n_samples;
+    block->start_time = 0;
+    block->counts = (int32_t*)(block->samples + n_samples);
+    return block;
+}
+
+void sink_block_release(SinkBlock* block)
+{
+    if (__atomic_sub_fetch(&block->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(block);
+}
+
+static void sink_wake(Sink* sink)
+{
+    uint64_t one = 1;
+    ssize_t unused = write(sink->wake_fd, &one, sizeof(one));
+    (void)unused;
+}
+
+static SinkBlock* sink_pop(Sink* sink)
+{
+    int64_t tail = sink->tail;
+    if (tail == __atomic_load_n(&sink->head, __ATOMIC_ACQUIRE))
+        return NULL;
+    SinkBlock* block = sink->queue[tail % sink->capacity];
+    __atomic_store_n(&sink->tail, tail + 1, __ATOMIC_RELEASE);
+    return block;
+}
+
+static void sink_default_wait(void* state, int wake_fd)
+{
+    struct pollfd pfd = { .fd = wake_fd, .events = POLLIN };
+    poll(&pfd, 1, -1);
+}
+
+static void* sink_worker(void* arg)
+{
+    Sink* sink = (Sink*)arg;
+    void (*wait)(void*, int) = sink->ops.wait ? sink->ops.wait : sink_default_wait;
+    while (true)
+    {
+        // NOTE(cmo): Clear the wakeup before looking at the queue, so a block
+        // pushed after we last look still wakes the next wait.
+        uint64_t count;
+        ssize_t unused = read(sink->wake_fd, &count, sizeof(count));
+        (void)unused;
+
+        SinkBlock* block;
+        while ((block = sink_pop(sink)))
+        {
+            int32_t failed = sink->ops.write_block(sink->state, block);
+            sink_block_release(block);
+            __atomic_add_fetch(&sink->stats.blocks_written, 1, __ATOMIC_RELAXED);
+            if (failed)
+                __atomic_add_fetch(&sink->stats.samples_failed, failed, __ATOMIC_RELAXED);
+        }
+        if (sink->ops.stats)
+        {
+            SinkStats backlog = {0};
+            sink->ops.stats(sink->state, &backlog);
+            __atomic_store_n(&sink->stats.backlog, backlog.backlog, __ATOMIC_RELAXED);
+            __atomic_store_n(&sink->stats.backlog_high_water, backlog.backlog_high_water, __ATOMIC_RELAXED);
+        }
+
+        // NOTE(cmo): Everything queued before sink_fanout_close has been
+        // written by the time we see it.
+        if (__atomic_load_n(&sink->stopping, __ATOMIC_ACQUIRE)
+            && sink->tail == __atomic_load_n(&sink->head, __ATOMIC_ACQUIRE))
+            break;
+        wait(sink->state, sink->wake_fd);
+    }
+
+    sink->ops.flush(sink->state);
+    return NULL;
+}
+
+bool sink_fanout_add(SinkFanout* fanout, const SinkOps* ops, void* state, int64_t queue_blocks)
+{
+    assert(fanout->num_sinks < SINK_FANOUT_MAX && "Too many sinks");
+    Sink* sink = &fanout->sinks[fanout->num_sinks];
+    memset(sink, 0, sizeof(*sink));
+    sink->ops = *ops;
+    sink->state = state;
+    sink->capacity = queue_blocks;
+
+    if (!sink->ops.init(state))
+    {
+        fprintf(stderr, "Unable to start %s output, carrying on without it.\n", ops->name);
+        return false;
+    }
+
+    sink->queue = calloc(queue_blocks, sizeof(SinkBlock*));
+    sink->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (!sink->queue || sink->wake_fd == -1
+        || pthread_create(&sink->thread, NULL, sink_worker, sink) != 0)
+    {
+        fprintf(stderr, "Unable to start thread for %s output, carrying on without it.\n", ops->name);
+        free(sink->queue);
+        if (sink->wake_fd != -1)
+            close(sink->wake_fd);
+        if (sink->ops.close)
+            sink->ops.close(state);
+        return false;
+    }
+
+    fanout->num_sinks += 1;
+    return true;
+}
+
+void sink_fanout_submit(SinkFanout* fanout, SinkBlock* block)
+{
+    for (int i = 0; i < fanout->num_sinks; ++i)
+    {
+        Sink* sink = &fanout->sinks[i];
+        int64_t head = sink->head;
+        int64_t depth = head - __atomic_load_n(&sink->tail, __ATOMIC_ACQUIRE);
+        while (depth >= sink->capacity && fanout->wait_when_full)
+        {
+            poll(NULL, 0, 1);
+            depth = head - __atomic_load_n(&sink->tail, __ATOMIC_ACQUIRE);
+        }
+        if (depth >= sink->capacity)
+        {
+            __atomic_add_fetch(&sink->stats.blocks_dropped, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (depth + 1 > sink->stats.queue_high_water)
+            __atomic_store_n(&sink->stats.queue_high_water, depth + 1, __ATOMIC_RELAXED);
+
+        __atomic_add_fetch(&block->refs, 1, __ATOMIC_RELAXED);
+        sink->queue[head % sink->capacity] = block;
+        __atomic_store_n(&sink->head, head + 1, __ATOMIC_RELEASE);
+        sink_wake(sink);
+    }
+    sink_block_release(block);
+}
+
+void sink_fanout_stats(SinkFanout* fanout, int index, SinkStats* stats)
+{
+    SinkStats* s = &fanout->sinks[index].stats;
+    stats->blocks_written = __atomic_load_n(&s->blocks_written, __ATOMIC_RELAXED);
+    stats->blocks_dropped = __atomic_load_n(&s->blocks_dropped, __ATOMIC_RELAXED);
+    stats->samples_failed = __atomic_load_n(&s->samples_failed, __ATOMIC_RELAXED);
+    stats->queue_high_water = __atomic_load_n(&s->queue_high_water, __ATOMIC_RELAXED);
+    stats->backlog = __atomic_load_n(&s->backlog, __ATOMIC_RELAXED);
+    stats->backlog_high_water = __atomic_load_n(&s->backlog_high_water, __ATOMIC_RELAXED);
+}
+
+void sink_fanout_close(SinkFanout* fanout)
+{
+    for (int i = 0; i < fanout->num_sinks; ++i)
+    {
+        Sink* sink = &fanout->sinks[i];
+        __atomic_store_n(&sink->stopping, true, __ATOMIC_RELEASE);
+        sink_wake(sink);
+    }
+    for (int i = 0; i < fanout->num_sinks; ++i)
+    {
+        Sink* sink = &fanout->sinks[i];
+        pthread_join(sink->thread, NULL);
+        close(sink->wake_fd);
+        free(sink->queue);
+        if (sink->ops.close)
+            sink->ops.close(sink->state);
+    }
+    fanout->num_sinks = 0;
+}
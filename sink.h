@@ -0,0 +1,111 @@
+#pragma once
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// NOTE(cmo): The output stage. Each calibrated block is encoded once into a
+// SinkBlock and handed to every sink (MQTT, shared memory, multicast, files,
+// ...). Each sink has its own bounded queue and thread, so a slow or stuck
+// sink drops its own blocks (counted in its SinkStats) without holding up
+// the others or the acquisition loop.
+
+// NOTE(cmo): The 40 byte sample every output uses: 8 bytes of milliseconds
+// since unix epoch, 4 x 8 bytes of doubles of calibrated data.
+typedef struct MagnetometerMessage
+{
+    int64_t timestamp;
+    double data[4];
+} __attribute__((packed)) MagnetometerMessage;
+
+typedef struct SinkBlock
+{
+    int32_t refs;
+    int32_t n_samples;
+    int64_t start_time;
+    // NOTE(cmo): The raw ADC counts the samples were calibrated from,
+    // n_samples x 4, in the same allocation.
+    int32_t* counts;
+    MagnetometerMessage samples[];
+} SinkBlock;
+
+typedef struct SinkStats
+{
+    int64_t blocks_written;
+    // NOTE(cmo): Blocks that never reached the sink because its queue was full.
+    int64_t blocks_dropped;
+    // NOTE(cmo): Samples the sink itself failed to deliver.
+    int64_t samples_failed;
+    int64_t queue_high_water; // blocks
+    // NOTE(cmo): Filled in by the sink's stats op, if it has one, e.g. bytes
+    // waiting in its own buffers.
+    int64_t backlog;
+    int64_t backlog_high_water;
+} SinkStats;
+
+typedef struct SinkOps
+{
+    const char* name;
+    // NOTE(cmo): Called from sink_fanout_add, on the caller's thread. A sink
+    // that fails to init isn't added.
+    bool (*init)(void* state);
+    // NOTE(cmo): The rest run on the sink's own thread. write_block returns
+    // the number of samples from the block it couldn't deliver.
+    int32_t (*write_block)(void* state, const SinkBlock* block);
+    // NOTE(cmo): Get everything written so far out (bounded in time), at
+    // shutdown.
+    void (*flush)(void* state);
+    // NOTE(cmo): Optional. Undoes init (closing files, sockets, mappings):
+    // from sink_fanout_close once the sink has been flushed and its thread
+    // stopped, or from sink_fanout_add if the thread can't be started. A sink
+    // whose init fails cleans up after itself.
+    void (*close)(void* state);
+    // NOTE(cmo): Optional. Fills in the backlog fields.
+    void (*stats)(void* state, SinkStats* stats);
+    // NOTE(cmo): Optional, for sinks with work of their own between blocks.
+    // Sleep until that work is due or wake_fd is readable (a block has been
+    // queued, or we're stopping), do it, and return. The default just waits
+    // on wake_fd.
+    void (*wait)(void* state, int wake_fd);
+} SinkOps;
+
+typedef struct Sink
+{
+    SinkOps ops;
+    void* state;
+    pthread_t thread;
+    int wake_fd;
+    bool stopping;
+    // NOTE(cmo): Single producer (sink_fanout_submit), single consumer (the
+    // sink's thread). head and tail count blocks ever pushed and popped.
+    SinkBlock** queue;
+    int64_t capacity;
+    int64_t head;
+    int64_t tail;
+    SinkStats stats;
+} Sink;
+
+#define SINK_FANOUT_MAX 8
+
+typedef struct SinkFanout
+{
+    Sink sinks[SINK_FANOUT_MAX];
+    int num_sinks;
+    // NOTE(cmo): Wait for space instead of dropping when a queue is full. Only
+    // for the benchmarks, where the simulated device produces blocks as fast
+    // as we can take them.
+    bool wait_when_full;
+} SinkFanout;
+
+SinkBlock* sink_block_alloc(int32_t n_samples);
+void sink_block_release(SinkBlock* block);
+
+// NOTE(cmo): Inits the sink and starts its thread, with room for queue_blocks
+// blocks in its queue. Returns false (and the sink isn't used) on failure.
+bool sink_fanout_add(SinkFanout* fanout, const SinkOps* ops, void* state, int64_t queue_blocks);
+// NOTE(cmo): Queues the block on every sink, and releases the caller's
+// reference to it.
+void sink_fanout_submit(SinkFanout* fanout, SinkBlock* block);
+void sink_fanout_stats(SinkFanout* fanout, int index, SinkStats* stats);
+// NOTE(cmo): Lets every sink finish what's queued, flushes them, stops their
+// threads and closes them.
+void sink_fanout_close(SinkFanout* fanout);
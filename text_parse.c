@@ -0,0 +1,235 @@
+#include "text_parse.h"
+#include <float.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if FLT_EVAL_METHOD == 0
+static const double Pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+#endif
+
+#if LDBL_MANT_DIG == 64
+static const long double Pow10Long[] = {
+    1e0L, 1e1L, 1e2L, 1e3L, 1e4L, 1e5L, 1e6L, 1e7L, 1e8L, 1e9L, 1e10L,
+    1e11L, 1e12L, 1e13L, 1e14L, 1e15L, 1e16L, 1e17L, 1e18L, 1e19L, 1e20L,
+    1e21L, 1e22L, 1e23L, 1e24L, 1e25L, 1e26L, 1e27L,
+};
+#endif
+
+static inline bool is_digit(char c)
+{
+    return (unsigned char)(c - '0') < 10;
+}
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define TEXT_PARSE_SWAR 1
+
+static inline uint64_t load8(const char* p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline bool is_eight_digits(uint64_t v)
+{
+    // NOTE(cmo): Every byte is 0x30-0x39: the high nibble is 3, and adding 6
+    // doesn't carry out of the low one.
+    return ((v & 0xf0f0f0f0f0f0f0f0ull)
+            | (((v + 0x0606060606060606ull) & 0xf0f0f0f0f0f0f0f0ull) >> 4))
+        == 0x3333333333333333ull;
+}
+
+static inline uint64_t eight_digits_value(uint64_t v)
+{
+    // NOTE(cmo): Pairs, then quads, then all 8, with the first character
+    // (lowest byte) most significant.
+    v -= 0x3030303030303030ull;
+    v = (v * 10) + (v >> 8);
+    v = (((v & 0x000000ff000000ffull) * (100 + (1000000ull << 32)))
+         + (((v >> 16) & 0x000000ff000000ffull) * (1 + (10000ull << 32))))
+        >> 32;
+    return v & 0xffffffffull;
+}
+#endif
+
+// NOTE(cmo): Accumulates a run of digits into *mantissa, returning the end of
+// the run. *n_digits counts all of them, overflow of the mantissa is caught
+// by the caller from that.
+static inline const char* take_digits(const char* p, const char* end, uint64_t* mantissa, int* n_digits)
+{
+    uint64_t m = *mantissa;
+    const char* start = p;
+#ifdef TEXT_PARSE_SWAR
+    while (end - p >= 8)
+    {
+        uint64_t v = load8(p);
+        if (!is_eight_digits(v))
+            break;
+        m = m * 100000000ull + eight_digits_value(v);
+        p += 8;
+    }
+#endif
+    while (p < end && is_digit(*p))
+    {
+        m = m * 10 + (uint64_t)(*p - '0');
+        p++;
+    }
+    *mantissa = m;
+    *n_digits += (int)(p - start);
+    return p;
+}
+
+static const char* parse_slow(const char* start, const char* end, double* out)
+{
+    // NOTE(cmo): strtod needs a terminator, and the buffer may not have one.
+    char small[64];
+    size_t len = 0;
+    while (start + len < end
+           && start[len] != ' ' && start[len] != '\t' && start[len] != '\n' && start[len] != '\r')
+        len++;
+    char* token = len < sizeof(small) ? small : malloc(len + 1);
+    if (!token)
+        return NULL;
+    memcpy(token, start, len);
+    token[len] = '\0';
+    char* stop;
+    *out = strtod(token, &stop);
+    const char* result = stop == token ? NULL : start + (stop - token);
+    if (token != small)
+        free(token);
+    return result;
+}
+
+const char* text_parse_double(const char* p, const char* end, double* out)
+{
+    const char* start = p;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+    {
+        negative = *p == '-';
+        p++;
+    }
+    if (p == end || (!is_digit(*p) && *p != '.'))
+        return parse_slow(start, end, out);
+
+    uint64_t mantissa = 0;
+    int n_digits = 0;
+    const char* digits = p;
+    p = take_digits(p, end, &mantissa, &n_digits);
+    int exponent = 0;
+    if (p < end && *p == '.')
+    {
+        p++;
+        int n_int = n_digits;
+        p = take_digits(p, end, &mantissa, &n_digits);
+        exponent = -(n_digits - n_int);
+    }
+    if (n_digits == 0)
+        return NULL;
+
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+        const char* e = p + 1;
+        bool exp_negative = false;
+        if (e < end && (*e == '-' || *e == '+'))
+        {
+            exp_negative = *e == '-';
+            e++;
+        }
+        if (e < end && is_digit(*e))
+        {
+            int value = 0;
+            while (e < end && is_digit(*e))
+            {
+                if (value < 100000)
+                    value = value * 10 + (*e - '0');
+                e++;
+            }
+            exponent += exp_negative ? -value : value;
+            p = e;
+        }
+    }
+
+    if (n_digits > 19)
+    {
+        // NOTE(cmo): Leading zeros aren't significant, so e.g. 0.00001234 is
+        // fine, but more than 19 real digits may have overflowed.
+        int leading = 0;
+        for (const char* c = digits; c < p && (*c == '0' || *c == '.'); ++c)
+            leading += *c == '0';
+        if (n_digits - leading > 19)
+            return parse_slow(start, end, out);
+    }
+
+    if (mantissa == 0)
+    {
+        *out = negative ? -0.0 : 0.0;
+        return p;
+    }
+
+#if FLT_EVAL_METHOD == 0
+    if (mantissa <= (1ull << 53) && exponent >= -22 && exponent <= 22)
+    {
+        double value = (double)mantissa;
+        value = exponent < 0 ? value / Pow10[-exponent] : value * Pow10[exponent];
+        *out = negative ? -value : value;
+        return p;
+    }
+#endif
+
+#if LDBL_MANT_DIG == 64
+    if (exponent >= -27 && exponent <= 27)
+    {
+        long double value = (long double)mantissa;
+        value = exponent < 0 ? value / Pow10Long[-exponent] : value * Pow10Long[exponent];
+        // NOTE(cmo): The x87 format stores the 64 bit significand first. The
+        // 11 bits below the double's 53 say how close we are to halfway.
+        uint64_t significand;
+        memcpy(&significand, &value, sizeof(significand));
+        uint64_t low = significand & 0x7ff;
+        if (low < 0x3ff || low > 0x401)
+        {
+            double rounded = (double)value;
+            *out = negative ? -rounded : rounded;
+            return p;
+        }
+    }
+#endif
+
+    return parse_slow(start, end, out);
+}
+
+const char* text_parse_line(const char* p, const char* end, double values[5], bool* ok)
+{
+    *ok = true;
+    for (int i = 0; i < 5; ++i)
+    {
+        while (p < end && (*p == ' ' || *p == '\t'))
+            p++;
+        const char* next = (p < end && *p != '\n') ? text_parse_double(p, end, &values[i]) : NULL;
+        if (!next)
+        {
+            *ok = false;
+            break;
+        }
+        p = next;
+    }
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+        p++;
+    if (p < end && *p != '\n')
+        *ok = false;
+
+    const char* newline = memchr(p, '\n', end - p);
+    if (!newline)
+    {
+        // NOTE(cmo): Every line we write ends in a newline, so this one was
+        // cut short and its last number can't be trusted.
+        *ok = false;
+        return end;
+    }
+    return newline + 1;
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+
+// NOTE(cmo): Parsing for the daily text archive (see daily_archive.h), much
+// faster than strtod/genfromtxt for the numbers we actually write, and exact:
+// the result is always the correctly rounded double, same as strtod.
+//
+// Digits are taken 8 at a time with SWAR arithmetic (all 8 bytes checked and
+// converted in a handful of 64 bit operations) into a 19 digit integer
+// mantissa and a power of ten, which is then scaled:
+//   - mantissa <= 2^53 and |power| <= 22: both are exact doubles, so a single
+//     multiply or divide is correctly rounded (Clinger's fast path)
+//   - otherwise, on x86, scaled in 80 bit long double (both still exact for
+//     |power| <= 27) and rounded to double, unless the long double result
+//     sits within an ulp of a halfway point, where rounding twice could
+//     differ from rounding once
+// Anything left (more than 19 significant digits, huge exponents, nan, inf)
+// goes to strtod.
+
+// NOTE(cmo): Parses one number at p (no leading whitespace) into *out. Never
+// reads at or beyond end. Returns the first character after the number, or
+// NULL if there isn't a number at p.
+const char* text_parse_double(const char* p, const char* end, double* out);
+
+// NOTE(cmo): Parses the line starting at p: 5 numbers (time, east-west,
+// north-south, up-down, temperature) separated by spaces or tabs. Sets *ok to
+// whether the line was exactly that, and returns the start of the next line
+// (end if there isn't one).
+const char* text_parse_line(const char* p, const char* end, double values[5], bool* ok);